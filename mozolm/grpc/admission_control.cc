@@ -0,0 +1,53 @@
+// Copyright 2026 MozoLM Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "mozolm/grpc/admission_control.h"
+
+#include "absl/strings/str_cat.h"
+
+namespace mozolm {
+namespace grpc {
+
+using ::grpc::Status;
+
+AdmissionControl::AdmissionControl(absl::string_view rpc_name) {
+  metrics::MetricsRegistry &registry = metrics::MetricsRegistry::Global();
+  rejected_ = registry.GetCounter(absl::StrCat("rpc/", rpc_name, "/rejected"));
+  shed_ = registry.GetCounter(absl::StrCat("rpc/", rpc_name, "/shed"));
+}
+
+Status AdmissionControl::Admit(absl::Time deadline, absl::Time now) {
+  if (shed_expired_ && deadline < now) {
+    shed_->Increment();
+    return Status(::grpc::StatusCode::RESOURCE_EXHAUSTED,
+                  "Request deadline expired before handling");
+  }
+  if (max_in_flight_ <= 0) {
+    in_flight_.fetch_add(1, std::memory_order_acq_rel);
+    return Status::OK;
+  }
+  int in_flight = in_flight_.load(std::memory_order_acquire);
+  do {
+    if (in_flight >= max_in_flight_) {
+      rejected_->Increment();
+      return Status(::grpc::StatusCode::RESOURCE_EXHAUSTED,
+                    absl::StrCat("Too many requests in flight: ", in_flight));
+    }
+  } while (!in_flight_.compare_exchange_weak(in_flight, in_flight + 1,
+                                             std::memory_order_acq_rel));
+  return Status::OK;
+}
+
+}  // namespace grpc
+}  // namespace mozolm
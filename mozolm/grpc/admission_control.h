@@ -0,0 +1,79 @@
+// Copyright 2026 MozoLM Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Admission control for the server requests of a single RPC type.
+
+#ifndef MOZOLM_MOZOLM_GRPC_ADMISSION_CONTROL_H_
+#define MOZOLM_MOZOLM_GRPC_ADMISSION_CONTROL_H_
+
+#include <atomic>
+
+#include "absl/strings/string_view.h"
+#include "absl/time/time.h"
+#include "include/grpcpp/support/status.h"
+#include "mozolm/utils/metrics.h"
+
+namespace mozolm {
+namespace grpc {
+
+// Decides whether a request should be handled or rejected, so that the server
+// fails fast rather than letting the latency grow without bound when it is
+// overloaded. A request is rejected if:
+//   - the number of requests in flight, i.e., admitted and not yet released,
+//     has reached the limit, or
+//   - its deadline has already expired, when the shedding of the expired
+//     requests is enabled. Such requests would be wasted work since the
+//     client has already given up on them.
+// The rejections are counted in the global metrics registry under
+// `rpc/<rpc_name>/rejected` and `rpc/<rpc_name>/shed`, respectively.
+//
+// The limits are expected to be configured before the server starts, the
+// admission itself is thread-safe.
+class AdmissionControl {
+ public:
+  explicit AdmissionControl(absl::string_view rpc_name);
+  AdmissionControl(const AdmissionControl &) = delete;
+  AdmissionControl &operator=(const AdmissionControl &) = delete;
+
+  // Sets the maximum number of requests in flight, zero or negative values
+  // disable the limit.
+  void set_max_in_flight(int max_in_flight) { max_in_flight_ = max_in_flight; }
+
+  // Enables or disables the shedding of the requests whose deadline has
+  // expired.
+  void set_shed_expired(bool shed_expired) { shed_expired_ = shed_expired; }
+
+  // Admits the request with the given deadline at time `now`, in which case
+  // the request has to be released once finished. Returns
+  // `RESOURCE_EXHAUSTED` if the request is rejected.
+  ::grpc::Status Admit(absl::Time deadline, absl::Time now);
+
+  // Releases the admitted request.
+  void Release() { in_flight_.fetch_sub(1, std::memory_order_acq_rel); }
+
+  // Number of requests currently in flight.
+  int in_flight() const { return in_flight_.load(std::memory_order_acquire); }
+
+ private:
+  int max_in_flight_ = 0;
+  bool shed_expired_ = false;
+  std::atomic<int> in_flight_ = 0;
+  metrics::Counter *rejected_;  // Requests over the limit.
+  metrics::Counter *shed_;      // Requests past their deadline.
+};
+
+}  // namespace grpc
+}  // namespace mozolm
+
+#endif  // MOZOLM_MOZOLM_GRPC_ADMISSION_CONTROL_H_
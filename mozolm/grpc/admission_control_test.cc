@@ -0,0 +1,70 @@
+// Copyright 2026 MozoLM Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "mozolm/grpc/admission_control.h"
+
+#include "gtest/gtest.h"
+#include "absl/time/time.h"
+#include "mozolm/utils/metrics.h"
+
+namespace mozolm {
+namespace grpc {
+namespace {
+
+int64_t CounterValue(absl::string_view name) {
+  return metrics::MetricsRegistry::Global().GetCounter(name)->value();
+}
+
+TEST(AdmissionControlTest, UnlimitedByDefault) {
+  AdmissionControl admission("UnlimitedTest");
+  const absl::Time now = absl::Now();
+  for (int i = 0; i < 100; ++i) {
+    EXPECT_TRUE(admission.Admit(absl::InfiniteFuture(), now).ok());
+  }
+  EXPECT_EQ(100, admission.in_flight());
+  // Shedding is disabled, hence expired requests are still admitted.
+  EXPECT_TRUE(admission.Admit(now - absl::Seconds(1), now).ok());
+}
+
+TEST(AdmissionControlTest, RejectsOverLimit) {
+  AdmissionControl admission("LimitTest");
+  admission.set_max_in_flight(2);
+  const absl::Time now = absl::Now();
+  EXPECT_TRUE(admission.Admit(absl::InfiniteFuture(), now).ok());
+  EXPECT_TRUE(admission.Admit(absl::InfiniteFuture(), now).ok());
+  const ::grpc::Status status = admission.Admit(absl::InfiniteFuture(), now);
+  EXPECT_EQ(::grpc::StatusCode::RESOURCE_EXHAUSTED, status.error_code());
+  EXPECT_EQ(1, CounterValue("rpc/LimitTest/rejected"));
+  EXPECT_EQ(2, admission.in_flight());
+
+  // Releasing a request makes room for another one.
+  admission.Release();
+  EXPECT_TRUE(admission.Admit(absl::InfiniteFuture(), now).ok());
+  EXPECT_EQ(2, admission.in_flight());
+}
+
+TEST(AdmissionControlTest, ShedsExpiredRequests) {
+  AdmissionControl admission("ShedTest");
+  admission.set_shed_expired(true);
+  const absl::Time now = absl::Now();
+  EXPECT_TRUE(admission.Admit(now + absl::Seconds(1), now).ok());
+  const ::grpc::Status status = admission.Admit(now - absl::Seconds(1), now);
+  EXPECT_EQ(::grpc::StatusCode::RESOURCE_EXHAUSTED, status.error_code());
+  EXPECT_EQ(1, CounterValue("rpc/ShedTest/shed"));
+  EXPECT_EQ(1, admission.in_flight());
+}
+
+}  // namespace
+}  // namespace grpc
+}  // namespace mozolm
@@ -17,7 +17,6 @@
 #include <memory>
 
 #include "absl/memory/memory.h"
-#include "absl/strings/str_format.h"
 #include "include/grpcpp/client_context.h"
 #include "include/grpcpp/completion_queue.h"
 #include "include/grpcpp/grpcpp.h"  // IWYU pragma: keep
@@ -30,66 +29,212 @@ namespace mozolm {
 namespace grpc {
 namespace {
 
-// Extracts the next tag from a gRPC completion queue and verify that it matches
-// the given expected tag. Returns OK upon a successful fetch and match.
-absl::Status WaitAndCheck(::grpc::CompletionQueue *cq, int expected_tag) {
-  // Wait until next result arrives.
-  void *got_tag;
-  bool ok = false;
-  if (!cq->Next(&got_tag, &ok)) {
-    return absl::InternalError("Completion queue next error");
-  }
-  if (!ok) return absl::InternalError("RPC call failed");
-
-  // Match the tag with the expected tag.
-  if (expected_tag != *static_cast<int *>(got_tag)) {
-    return absl::InternalError(absl::StrFormat(
-        "Completion queue tag mismatch. Expected %d, got %d",
-        expected_tag, *static_cast<int *>(got_tag)));
-  }
-  return absl::OkStatus();
-}
+// State of a single outstanding call, shared between the issuing thread and
+// the completion queue thread.
+template <class Response>
+struct AsyncCall {
+  ::grpc::ClientContext context;
+  std::unique_ptr<::grpc::ClientAsyncResponseReaderInterface<Response>> rpc;
+  ::grpc::Status status;
+  Response response;
+};
 
-std::unique_ptr<::grpc::ClientContext> MakeClientContext(double timeout_sec) {
-  std::unique_ptr<::grpc::ClientContext> context =
-      std::make_unique<::grpc::ClientContext>();
+void SetDeadline(double timeout_sec, ::grpc::ClientContext *context) {
   context->set_deadline(gpr_time_add(
       gpr_now(GPR_CLOCK_REALTIME),
       gpr_time_from_millis(static_cast<int64_t>(1000.0 * timeout_sec),
                            GPR_TIMESPAN)));
-  return context;
+}
+
+// Returns a callback which fulfills the promise shared with the returned
+// future.
+template <class Response>
+std::pair<ClientAsyncImpl::ResponseCallback<Response>,
+          std::future<absl::StatusOr<Response>>>
+MakePromiseCallback() {
+  auto promise = std::make_shared<std::promise<absl::StatusOr<Response>>>();
+  auto future = promise->get_future();
+  return {[promise](absl::StatusOr<Response> response) {
+            promise->set_value(std::move(response));
+          },
+          std::move(future)};
+}
+
+GetContextRequest MakeContextRequest(const std::string &context_str,
+                                     int64_t initial_state,
+                                     const std::string &fallback_context) {
+  GetContextRequest request;
+  request.set_state(initial_state);
+  request.set_context(context_str);
+  request.set_fallback_context(fallback_context);
+  return request;
 }
 
 }  // namespace
 
 ClientAsyncImpl::ClientAsyncImpl(
     std::unique_ptr<MozoLMService::StubInterface> stub) : stub_(
-        std::move(stub)) {}
+        std::move(stub)) {
+  cq_thread_ = std::make_unique<std::thread>(&ClientAsyncImpl::DriveCQ, this);
+}
+
+ClientAsyncImpl::~ClientAsyncImpl() {
+  cq_.Shutdown();
+  if (cq_thread_->joinable()) cq_thread_->join();
+}
+
+void ClientAsyncImpl::DriveCQ() {
+  void *tag;  // Matches the async operation started against this cq_.
+  bool ok;
+  // Waits for the completion of the next call in the queue, casts the tag
+  // to the std::function finishing the call and runs it inline.
+  while (cq_.Next(&tag, &ok)) {
+    auto func_ptr = static_cast<std::function<void(bool)> *>(tag);
+    (*func_ptr)(ok);
+    delete func_ptr;
+  }
+}
+
+template <class Response>
+void ClientAsyncImpl::StartCall(
+    double timeout_sec,
+    const std::function<std::unique_ptr<
+        ::grpc::ClientAsyncResponseReaderInterface<Response>>(
+        ::grpc::ClientContext *, ::grpc::CompletionQueue *)> &start_call,
+    ResponseCallback<Response> callback) {
+  auto call = std::make_shared<AsyncCall<Response>>();
+  SetDeadline(timeout_sec, &call->context);
+  call->rpc = start_call(&call->context, &cq_);  // Performs RPC call.
+  if (!call->rpc) {  // This will fail if the test mocks are not set up right.
+    callback(absl::InternalError("Got invalid response reader"));
+    return;
+  }
+  ++num_in_flight_;
+  auto finish_callback = new std::function<void(bool)>(
+      [this, call, callback = std::move(callback)](bool ok) {
+        --num_in_flight_;
+        if (!ok) {
+          callback(absl::InternalError("RPC call failed"));
+        } else if (!call->status.ok()) {
+          // The canonical gRPC and absl status codes are the same, keeping
+          // the code lets the callers tell, e.g., shed requests from errors.
+          callback(absl::Status(
+              static_cast<absl::StatusCode>(call->status.error_code()),
+              call->status.error_message()));
+        } else {
+          callback(std::move(call->response));
+        }
+      });
+  call->rpc->Finish(&call->response, &call->status, finish_callback);
+}
+
+void ClientAsyncImpl::AsyncGetLMScores(const GetContextRequest &request,
+                                       double timeout_sec,
+                                       ResponseCallback<LMScores> callback) {
+  StartCall<LMScores>(
+      timeout_sec,
+      [this, &request](::grpc::ClientContext *context,
+                       ::grpc::CompletionQueue *cq) {
+        return stub_->AsyncGetLMScores(context, request, cq);
+      },
+      std::move(callback));
+}
+
+void ClientAsyncImpl::AsyncGetNextState(const GetContextRequest &request,
+                                        double timeout_sec,
+                                        ResponseCallback<NextState> callback) {
+  StartCall<NextState>(
+      timeout_sec,
+      [this, &request](::grpc::ClientContext *context,
+                       ::grpc::CompletionQueue *cq) {
+        return stub_->AsyncGetNextState(context, request, cq);
+      },
+      std::move(callback));
+}
+
+void ClientAsyncImpl::AsyncUpdateLMScores(const UpdateLMScoresRequest &request,
+                                          double timeout_sec,
+                                          ResponseCallback<LMScores> callback) {
+  StartCall<LMScores>(
+      timeout_sec,
+      [this, &request](::grpc::ClientContext *context,
+                       ::grpc::CompletionQueue *cq) {
+        return stub_->AsyncUpdateLMScores(context, request, cq);
+      },
+      std::move(callback));
+}
+
+void ClientAsyncImpl::AsyncScoreText(
+    const ScoreTextRequest &request, double timeout_sec,
+    ResponseCallback<ScoreTextResponse> callback) {
+  StartCall<ScoreTextResponse>(
+      timeout_sec,
+      [this, &request](::grpc::ClientContext *context,
+                       ::grpc::CompletionQueue *cq) {
+        return stub_->AsyncScoreText(context, request, cq);
+      },
+      std::move(callback));
+}
+
+void ClientAsyncImpl::AsyncAdaptToText(
+    const AdaptToTextRequest &request, double timeout_sec,
+    ResponseCallback<AdaptToTextResponse> callback) {
+  StartCall<AdaptToTextResponse>(
+      timeout_sec,
+      [this, &request](::grpc::ClientContext *context,
+                       ::grpc::CompletionQueue *cq) {
+        return stub_->AsyncAdaptToText(context, request, cq);
+      },
+      std::move(callback));
+}
+
+std::future<absl::StatusOr<LMScores>> ClientAsyncImpl::GetLMScoresFuture(
+    const GetContextRequest &request, double timeout_sec) {
+  auto [callback, future] = MakePromiseCallback<LMScores>();
+  AsyncGetLMScores(request, timeout_sec, std::move(callback));
+  return std::move(future);
+}
+
+std::future<absl::StatusOr<NextState>> ClientAsyncImpl::GetNextStateFuture(
+    const GetContextRequest &request, double timeout_sec) {
+  auto [callback, future] = MakePromiseCallback<NextState>();
+  AsyncGetNextState(request, timeout_sec, std::move(callback));
+  return std::move(future);
+}
+
+std::future<absl::StatusOr<LMScores>> ClientAsyncImpl::UpdateLMScoresFuture(
+    const UpdateLMScoresRequest &request, double timeout_sec) {
+  auto [callback, future] = MakePromiseCallback<LMScores>();
+  AsyncUpdateLMScores(request, timeout_sec, std::move(callback));
+  return std::move(future);
+}
+
+std::future<absl::StatusOr<ScoreTextResponse>>
+ClientAsyncImpl::ScoreTextFuture(const ScoreTextRequest &request,
+                                 double timeout_sec) {
+  auto [callback, future] = MakePromiseCallback<ScoreTextResponse>();
+  AsyncScoreText(request, timeout_sec, std::move(callback));
+  return std::move(future);
+}
+
+std::future<absl::StatusOr<AdaptToTextResponse>>
+ClientAsyncImpl::AdaptToTextFuture(const AdaptToTextRequest &request,
+                                   double timeout_sec) {
+  auto [callback, future] = MakePromiseCallback<AdaptToTextResponse>();
+  AsyncAdaptToText(request, timeout_sec, std::move(callback));
+  return std::move(future);
+}
 
 absl::Status ClientAsyncImpl::GetLMScore(
-    const std::string& context_str, int initial_state, double timeout_sec,
+    const std::string& context_str, int64_t initial_state,
+    const std::string& fallback_context, double timeout_sec,
     double* normalization,
     std::vector<std::pair<double, std::string>>* prob_idx_pair_vector) {
-  // Sets up client context and the request.
-  std::unique_ptr<::grpc::ClientContext> context = MakeClientContext(
-      timeout_sec);
-  GetContextRequest request;
-  request.set_state(initial_state);
-  request.set_context(context_str);
-
-  // Fetches the response.
-  ::grpc::CompletionQueue cq;
-  std::unique_ptr<::grpc::ClientAsyncResponseReaderInterface<LMScores>> rpc(
-      stub_->AsyncGetLMScores(
-          context.get(), request, &cq));  // Performs RPC call.
-  ::grpc::Status status;
-  LMScores response;
-  int finish_tag = 1;
-  rpc->Finish(&response, &status, &finish_tag);
-  RETURN_IF_ERROR(WaitAndCheck(&cq, finish_tag));
-  if (!status.ok()) {
-    return absl::InternalError(status.error_message());
-  }
+  ASSIGN_OR_RETURN(const LMScores response,
+                   GetLMScoresFuture(MakeContextRequest(context_str,
+                                                        initial_state,
+                                                        fallback_context),
+                                     timeout_sec).get());
 
   // Retrieves information from response if RPC call was successful.
   ASSIGN_OR_RETURN(*prob_idx_pair_vector, models::GetTopHypotheses(response));
@@ -98,30 +243,14 @@ absl::Status ClientAsyncImpl::GetLMScore(
 }
 
 absl::Status ClientAsyncImpl::GetNextState(
-    const std::string& context_str, int initial_state, double timeout_sec,
+    const std::string& context_str, int64_t initial_state,
+    const std::string& fallback_context, double timeout_sec,
     int64_t* next_state) {
-  // Sets up client context and the request.
-  std::unique_ptr<::grpc::ClientContext> context = MakeClientContext(
-      timeout_sec);
-  GetContextRequest request;
-  request.set_state(initial_state);
-  request.set_context(context_str);
-
-  ::grpc::CompletionQueue cq;
-  std::unique_ptr<::grpc::ClientAsyncResponseReaderInterface<NextState>> rpc(
-      stub_->AsyncGetNextState(
-          context.get(), request, &cq));  // Performs RPC call.
-  if (!rpc) {  // This will fail if the test mocks are not set up correctly.
-    return absl::InternalError("Got invalid response reader");
-  }
-  ::grpc::Status status;
-  NextState response;
-  int finish_tag = 1;
-  rpc->Finish(&response, &status, &finish_tag);
-  RETURN_IF_ERROR(WaitAndCheck(&cq, finish_tag));
-  if (!status.ok()) {
-    return absl::InternalError(status.error_message());
-  }
+  ASSIGN_OR_RETURN(const NextState response,
+                   GetNextStateFuture(MakeContextRequest(context_str,
+                                                         initial_state,
+                                                         fallback_context),
+                                      timeout_sec).get());
 
   // Sets next_state if RPC call was successful.
   *next_state = response.next_state();
@@ -129,49 +258,38 @@ absl::Status ClientAsyncImpl::GetNextState(
 }
 
 absl::Status ClientAsyncImpl::UpdateCountGetDestStateScore(
-    const std::string& context_str, int initial_state, double timeout_sec,
-    int count, int64_t* next_state, double* normalization,
+    const std::string& context_str, int64_t initial_state,
+    const std::string& fallback_context, double timeout_sec, int count,
+    int64_t* next_state, double* normalization,
     std::vector<std::pair<double, std::string>>* prob_idx_pair_vector) {
   RETURN_IF_ERROR(UpdateCountGetDestStateScore(
       nisaba::utf8::StrSplitByCharToUnicode(context_str), initial_state,
-      timeout_sec, count, normalization, prob_idx_pair_vector));
-  return GetNextState(context_str, initial_state, timeout_sec, next_state);
+      fallback_context, timeout_sec, count, normalization,
+      prob_idx_pair_vector));
+  return GetNextState(context_str, initial_state, fallback_context,
+                      timeout_sec, next_state);
 }
 
 absl::Status ClientAsyncImpl::UpdateCountGetDestStateScore(
-    const std::vector<int>& context_str, int initial_state, double timeout_sec,
-    int count, double* normalization,
+    const std::vector<int>& context_str, int64_t initial_state,
+    const std::string& fallback_context, double timeout_sec, int count,
+    double* normalization,
     std::vector<std::pair<double, std::string>>* prob_idx_pair_vector) {
-  // Sets up client context and the request.
-  std::unique_ptr<::grpc::ClientContext> context = MakeClientContext(
-      timeout_sec);
   UpdateLMScoresRequest request;
   request.set_state(initial_state);
+  request.set_fallback_context(fallback_context);
   request.mutable_utf8_sym()->Reserve(context_str.size());
   for (auto utf8_sym : context_str) {
     request.add_utf8_sym(utf8_sym);
   }
   request.set_count(count);
-
-  // Fetches the response.
-  ::grpc::CompletionQueue cq;
-  std::unique_ptr<::grpc::ClientAsyncResponseReaderInterface<LMScores>> rpc(
-      stub_->AsyncUpdateLMScores(context.get(), request,
-                                 &cq));  // Performs RPC call.
-  ::grpc::Status status;
-  LMScores response;
-  int finish_tag = 1;
-  rpc->Finish(&response, &status, &finish_tag);
-  RETURN_IF_ERROR(WaitAndCheck(&cq, finish_tag));
-  if (!status.ok()) return absl::InternalError(status.error_message());
+  ASSIGN_OR_RETURN(const LMScores response,
+                   UpdateLMScoresFuture(request, timeout_sec).get());
 
   // Retrieves information from response if RPC call was successful.
-  const auto probs_status = models::GetTopHypotheses(response);
-  if (probs_status.ok()) {
-    *prob_idx_pair_vector = std::move(probs_status.value());
-    *normalization = response.normalization();
-  }
-  return probs_status.status();
+  ASSIGN_OR_RETURN(*prob_idx_pair_vector, models::GetTopHypotheses(response));
+  *normalization = response.normalization();
+  return absl::OkStatus();
 }
 
 }  // namespace grpc
@@ -15,50 +15,137 @@
 #ifndef MOZOLM_MOZOLM_GRPC_CLIENT_ASYNC_IMPL_H_
 #define MOZOLM_MOZOLM_GRPC_CLIENT_ASYNC_IMPL_H_
 
+#include <atomic>
+#include <functional>
+#include <future>
 #include <memory>
 #include <string>
+#include <thread>
 #include <utility>
 #include <vector>
 
 #include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "include/grpcpp/completion_queue.h"
+#include "include/grpcpp/support/async_unary_call.h"
 #include "mozolm/grpc/service.grpc.pb.h"
 
 namespace mozolm {
 namespace grpc {
 
 // A completion-queue asynchronous client for the LM server.
+//
+// All the calls share a single completion queue which is drained by a
+// dedicated thread owned by the client, so any number of requests may be in
+// flight on the same channel at any given time. The requests can be issued
+// using either the callback or the future interfaces below. The blocking
+// methods are provided for convenience and are implemented on top of the
+// futures. The client is thread-safe.
 class ClientAsyncImpl {
  public:
-  // Constructs a client to use the given LM server.
+  // Callback receiving the response (or an error) for a single request. The
+  // callbacks are run by the completion queue thread, hence should be quick
+  // and must not block on other requests issued by the same client.
+  template <class Response>
+  using ResponseCallback = std::function<void(absl::StatusOr<Response>)>;
+
+  // Constructs a client to use the given LM server and starts the completion
+  // queue thread.
   explicit ClientAsyncImpl(std::unique_ptr<MozoLMService::StubInterface> stub);
 
+  // Shuts down the completion queue and waits for the completion queue thread
+  // to finish. The requests still in flight are not cancelled: this waits
+  // until each of them completes or reaches its deadline, and runs its
+  // callback, before returning.
+  ~ClientAsyncImpl();
+
+  // Asynchronous interface: Issues the request and immediately returns. The
+  // callback is invoked once the request completes or fails.
+  void AsyncGetLMScores(const GetContextRequest& request, double timeout_sec,
+                        ResponseCallback<LMScores> callback);
+  void AsyncGetNextState(const GetContextRequest& request, double timeout_sec,
+                         ResponseCallback<NextState> callback);
+  void AsyncUpdateLMScores(const UpdateLMScoresRequest& request,
+                           double timeout_sec,
+                           ResponseCallback<LMScores> callback);
+  void AsyncScoreText(const ScoreTextRequest& request, double timeout_sec,
+                      ResponseCallback<ScoreTextResponse> callback);
+  void AsyncAdaptToText(const AdaptToTextRequest& request, double timeout_sec,
+                        ResponseCallback<AdaptToTextResponse> callback);
+
+  // Future interface: Same as above, but the response is delivered via the
+  // returned future.
+  std::future<absl::StatusOr<LMScores>> GetLMScoresFuture(
+      const GetContextRequest& request, double timeout_sec);
+  std::future<absl::StatusOr<NextState>> GetNextStateFuture(
+      const GetContextRequest& request, double timeout_sec);
+  std::future<absl::StatusOr<LMScores>> UpdateLMScoresFuture(
+      const UpdateLMScoresRequest& request, double timeout_sec);
+  std::future<absl::StatusOr<ScoreTextResponse>> ScoreTextFuture(
+      const ScoreTextRequest& request, double timeout_sec);
+  std::future<absl::StatusOr<AdaptToTextResponse>> AdaptToTextFuture(
+      const AdaptToTextRequest& request, double timeout_sec);
+
   // Seeks the language models scores given the initial state and context
-  // string.
+  // string. The initial state is an opaque handle previously returned by the
+  // server, the fallback context is the full context string leading to it,
+  // which the server uses to rebuild the state if the handle has expired.
   absl::Status GetLMScore(
-      const std::string& context_str, int initial_state, double timeout_sec,
+      const std::string& context_str, int64_t initial_state,
+      const std::string& fallback_context, double timeout_sec,
       double* normalization,
       std::vector<std::pair<double, std::string>>* prob_idx_pair_vector);
 
   // Seeks the next model state given the initial state and context string.
-  absl::Status GetNextState(const std::string& context_str, int initial_state,
+  absl::Status GetNextState(const std::string& context_str,
+                            int64_t initial_state,
+                            const std::string& fallback_context,
                             double timeout_sec, int64_t* next_state);
 
   // Updates counts and retrieves probabilities from destination state.
   absl::Status UpdateCountGetDestStateScore(
-      const std::string& context_str, int initial_state, double timeout_sec,
-      int count, int64_t* next_state, double* normalization,
+      const std::string& context_str, int64_t initial_state,
+      const std::string& fallback_context, double timeout_sec, int count,
+      int64_t* next_state, double* normalization,
       std::vector<std::pair<double, std::string>>* prob_idx_pair_vector);
 
+  // Number of requests that have been issued but have not completed yet.
+  int num_in_flight() const { return num_in_flight_; }
+
  private:
   ClientAsyncImpl() = delete;
 
   // Updates counts and retrieves probabilities from destination state.
   absl::Status UpdateCountGetDestStateScore(
-      const std::vector<int>& context_str, int initial_state,
-      double timeout_sec, int count, double* normalization,
+      const std::vector<int>& context_str, int64_t initial_state,
+      const std::string& fallback_context, double timeout_sec, int count,
+      double* normalization,
       std::vector<std::pair<double, std::string>>* prob_idx_pair_vector);
 
+  // Issues the call using the supplied function which starts the RPC on the
+  // given client context and completion queue. Once the RPC finishes, the
+  // callback is run by the completion queue thread.
+  template <class Response>
+  void StartCall(
+      double timeout_sec,
+      const std::function<std::unique_ptr<
+          ::grpc::ClientAsyncResponseReaderInterface<Response>>(
+          ::grpc::ClientContext*, ::grpc::CompletionQueue*)>& start_call,
+      ResponseCallback<Response> callback);
+
+  // Processes the completed requests until the completion queue is shut down.
+  void DriveCQ();
+
   std::unique_ptr<MozoLMService::StubInterface> stub_;  // Owned elsewhere.
+
+  // Completion queue shared by all the requests.
+  ::grpc::CompletionQueue cq_;
+
+  // Thread draining the completion queue.
+  std::unique_ptr<std::thread> cq_thread_;
+
+  // Number of requests in flight.
+  std::atomic<int> num_in_flight_ = 0;
 };
 
 }  // namespace grpc
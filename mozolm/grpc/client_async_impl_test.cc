@@ -17,6 +17,8 @@
 #include "mozolm/grpc/client_async_impl.h"
 
 #include <memory>
+#include <set>
+#include <vector>
 
 #include "gmock/gmock.h"
 #include "nisaba/port/status-matchers.h"
@@ -24,6 +26,7 @@
 #include "gtest/gtest.h"
 #include "absl/memory/memory.h"
 #include "include/grpcpp/alarm.h"
+#include "absl/synchronization/blocking_counter.h"
 #include "include/grpcpp/grpcpp.h"  // IWYU pragma: keep
 #include "mozolm/grpc/service.grpc.pb.h"
 #include "mozolm/grpc/service_mock.grpc.pb.h"
@@ -82,40 +85,124 @@ TEST_F(ClientAsyncImplTest, CheckGetNextStateUnaryAsync) {
   request.set_context("");
 
   // Set up call expectations.
-  int tag = 1;
+  ::grpc::CompletionQueue *client_cq = nullptr;
   std::unique_ptr<::grpc::Alarm> alarm;
   auto reader =
       std::make_unique<LocalMockClientAsyncResponseReader<NextState>>();
   EXPECT_CALL(*stub_, AsyncGetNextStateRaw(_, EqualsProto(request), _))
       .WillOnce(DoAll(
-          [&tag, &alarm](Unused, Unused, ::grpc::CompletionQueue* cq) {
-            // This is a work-around to make caller's completion queue
-            // `Next()` call succeed.
-            alarm = std::make_unique<::grpc::Alarm>(
-                cq, gpr_now(GPR_CLOCK_MONOTONIC),
-                reinterpret_cast<void*>(&tag));
+          [&client_cq](Unused, Unused, ::grpc::CompletionQueue* cq) {
+            client_cq = cq;
           },
           Return(reader.get())));
 
   NextState response;
   EXPECT_CALL(*reader, Finish)
       .WillOnce(DoAll(
-          [response, tag](NextState* result, ::grpc::Status* status,
-                          void* tag_ptr) {
+          [response, &client_cq, &alarm](NextState* result,
+                                         ::grpc::Status* status,
+                                         void* tag) {
             // This injects the actual response.
             *result = response;
             *status = ::grpc::Status::OK;
-            *static_cast<int*>(tag_ptr) = tag;
+            // This is a work-around to deliver the client's tag to its
+            // completion queue.
+            alarm = std::make_unique<::grpc::Alarm>(
+                client_cq, gpr_now(GPR_CLOCK_MONOTONIC), tag);
           },
           Return()));
 
   // Verify the response.
   int64_t next_state;
   EXPECT_OK(client_->GetNextState(request.context(), request.state(),
+                                  request.fallback_context(),
                                   kDefaultTimeoutSec, &next_state));
   EXPECT_EQ(0, next_state);
 }
 
+// Checks that the status code of a failed request is passed on to the caller.
+TEST_F(ClientAsyncImplTest, CheckErrorStatusCodeIsKept) {
+  ::grpc::CompletionQueue *client_cq = nullptr;
+  std::unique_ptr<::grpc::Alarm> alarm;
+  auto reader =
+      std::make_unique<LocalMockClientAsyncResponseReader<NextState>>();
+  EXPECT_CALL(*stub_, AsyncGetNextStateRaw(_, _, _))
+      .WillOnce(DoAll(
+          [&client_cq](Unused, Unused, ::grpc::CompletionQueue* cq) {
+            client_cq = cq;
+          },
+          Return(reader.get())));
+  EXPECT_CALL(*reader, Finish)
+      .WillOnce([&client_cq, &alarm](NextState* result,
+                                     ::grpc::Status* status, void* tag) {
+        *status = ::grpc::Status(::grpc::StatusCode::RESOURCE_EXHAUSTED,
+                                 "Too many requests in flight");
+        alarm = std::make_unique<::grpc::Alarm>(
+            client_cq, gpr_now(GPR_CLOCK_MONOTONIC), tag);
+      });
+
+  int64_t next_state;
+  const absl::Status status = client_->GetNextState(
+      "", -1, "", kDefaultTimeoutSec, &next_state);
+  EXPECT_EQ(absl::StatusCode::kResourceExhausted, status.code());
+  EXPECT_EQ("Too many requests in flight", status.message());
+}
+
+// Checks that multiple requests can be in flight at the same time, all sharing
+// the client's completion queue.
+TEST_F(ClientAsyncImplTest, CheckPipelinedGetNextStateAsync) {
+  constexpr int kNumRequests = 8;
+
+  // Set up call expectations. The completions are delivered only once all the
+  // requests have been issued.
+  ::grpc::CompletionQueue *client_cq = nullptr;
+  std::vector<void *> tags;
+  auto reader =
+      std::make_unique<LocalMockClientAsyncResponseReader<NextState>>();
+  EXPECT_CALL(*stub_, AsyncGetNextStateRaw(_, _, _))
+      .Times(kNumRequests)
+      .WillRepeatedly(DoAll(
+          [&client_cq](Unused, Unused, ::grpc::CompletionQueue* cq) {
+            client_cq = cq;
+          },
+          Return(reader.get())));
+  EXPECT_CALL(*reader, Finish)
+      .Times(kNumRequests)
+      .WillRepeatedly([&tags](NextState* result, ::grpc::Status* status,
+                              void* tag) {
+        tags.push_back(tag);
+        result->set_next_state(tags.size());
+        *status = ::grpc::Status::OK;
+      });
+
+  absl::BlockingCounter pending(kNumRequests);
+  std::set<int64_t> next_states;
+  for (int i = 0; i < kNumRequests; ++i) {
+    GetContextRequest request;
+    request.set_state(i);
+    client_->AsyncGetNextState(
+        request, kDefaultTimeoutSec,
+        [&next_states, &pending](absl::StatusOr<NextState> response) {
+          EXPECT_OK(response.status());
+          if (response.ok()) next_states.insert(response->next_state());
+          pending.DecrementCount();
+        });
+  }
+  EXPECT_EQ(kNumRequests, client_->num_in_flight());
+
+  // Complete all the requests.
+  std::vector<std::unique_ptr<::grpc::Alarm>> alarms;
+  for (void *tag : tags) {
+    alarms.push_back(std::make_unique<::grpc::Alarm>(
+        client_cq, gpr_now(GPR_CLOCK_MONOTONIC), tag));
+  }
+  pending.Wait();
+  EXPECT_EQ(0, client_->num_in_flight());
+  EXPECT_EQ(kNumRequests, next_states.size());
+  EXPECT_EQ(1, *next_states.begin());
+  EXPECT_EQ(kNumRequests, *next_states.rbegin());
+}
+
 }  // namespace
 }  // namespace grpc
 }  // namespace mozolm
@@ -32,6 +32,11 @@
 //   bazel-bin/mozolm/grpc/client_async \
 //     --client_config="server { address_uri:\"localhost:50051\" } \
 //     request_type:BITS_PER_CHAR_CALCULATION test_corpus:\"${TESTFILE}\""
+//
+// - To prime the dynamic models with the past documents of the user:
+//   bazel-bin/mozolm/grpc/client_async \
+//     --client_config="server { address_uri:\"localhost:50051\" } \
+//     request_type:ADAPT_TO_TEXT adaptation_text:\"${USER_TEXT_FILE}\""
 
 #include <string>
 
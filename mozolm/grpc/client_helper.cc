@@ -14,8 +14,10 @@
 
 #include "mozolm/grpc/client_helper.h"
 
-#include <cmath>
+#include <algorithm>
+#include <deque>
 #include <fstream>
+#include <future>
 #include <memory>
 #include <string>
 #include <utility>
@@ -35,6 +37,7 @@
 #include "mozolm/grpc/client_async_impl.h"
 #include "mozolm/grpc/server_config.pb.h"
 #include "mozolm/grpc/server_helper.h"
+#include "nisaba/port/file_util.h"
 #include "nisaba/port/utf8_util.h"
 #include "nisaba/port/status_macros.h"
 
@@ -42,9 +45,6 @@ namespace mozolm {
 namespace grpc {
 namespace {
 
-constexpr int kNumCodepoints = 143859;   // Total possible Unicode codepoints.
-constexpr float kMixEpsilon = 0.00000001;  // Amount to weight uniform prob.
-
 // Returns random probability threshold between 0 and 1.
 double GetUniformThreshold(absl::BitGenRef bit_gen) {
   return absl::Uniform(bit_gen, 0.0, 1.0);
@@ -66,38 +66,6 @@ int GetRandomPosition(
   return pos;
 }
 
-// Returns the index for the utf8_sym in the given vector, -1 if not found.
-// Since the vector is in descending probability order, will use linear scan to
-// find match, since this will on average be efficient.
-int FindStringIndex(
-    const std::vector<std::pair<double, std::string>>& prob_idx_pair_vector,
-    const std::string& utf8_sym) {
-  for (int idx = 0; idx < prob_idx_pair_vector.size(); ++idx) {
-    if (utf8_sym == prob_idx_pair_vector[idx].second) {
-      return idx;
-    }
-  }
-  return -1;
-}
-
-// Returns a uniform codepoint probability weighted by epsilon mix parameter.
-double UniformMixValue() {
-  return static_cast<double>(kMixEpsilon) / static_cast<double>(kNumCodepoints);
-}
-
-// Finds value in vector and returns bits.  Mixes with a uniform to ensure full
-// coverage, i.e., probability = (1-\epsilon) P + \epsilon U, where P is the
-// model probability and U is a uniform distribution over unicode codepoints.
-double CalculateBits(
-    int idx,
-    const std::vector<std::pair<double, std::string>>& prob_idx_pair_vector) {
-  double prob = UniformMixValue();
-  if (idx >= 0) {
-    prob += prob_idx_pair_vector[idx].first * (1.0 - kMixEpsilon);
-  }
-  return -std::log2(prob);
-}
-
 // Client credentials factory: Configures SSL, if requested, otherwise uses an
 // insecure channel.
 std::shared_ptr<::grpc::ChannelCredentials>
@@ -131,15 +99,34 @@ BuildChannelCredentials(const ClientConfig &config,
 
 }  // namespace
 
-absl::Status ClientHelper::GetLMScores(
-    const std::string& context_string, int initial_state, double* normalization,
-    std::vector<std::pair<double, std::string>>* prob_idx_pair_vector) {
-  if (completion_client_ == nullptr) {
+absl::StatusOr<ClientAsyncImpl*> ClientHelper::NextClient() {
+  if (clients_.empty()) {
     return absl::InternalError("Completion client not initialized");
   }
-  RETURN_IF_ERROR(completion_client_->GetLMScore(context_string, initial_state,
-                                                 timeout_sec_, normalization,
-                                                 prob_idx_pair_vector));
+  if (load_balancing_policy_ == ClientConfig::LEAST_OUTSTANDING_REQUESTS) {
+    // Ties are broken in round-robin fashion so that idle clients are evenly
+    // used.
+    const int start = next_client_++ % clients_.size();
+    int best = start;
+    for (int i = 1; i < clients_.size(); ++i) {
+      const int idx = (start + i) % clients_.size();
+      if (clients_[idx]->num_in_flight() < clients_[best]->num_in_flight()) {
+        best = idx;
+      }
+    }
+    return clients_[best].get();
+  }
+  return clients_[next_client_++ % clients_.size()].get();
+}
+
+absl::Status ClientHelper::GetLMScores(
+    ClientAsyncImpl* client, const std::string& context_string,
+    int64_t initial_state, const std::string& fallback_string,
+    double* normalization,
+    std::vector<std::pair<double, std::string>>* prob_idx_pair_vector) {
+  RETURN_IF_ERROR(client->GetLMScore(
+      context_string, initial_state, fallback_string, timeout_sec_,
+      normalization, prob_idx_pair_vector));
   if (*normalization <= 0) {
     return absl::InternalError(absl::StrCat(
         "Invalid normalization factor: ", *normalization));
@@ -149,12 +136,12 @@ absl::Status ClientHelper::GetLMScores(
 }
 
 absl::StatusOr<int64_t> ClientHelper::GetNextState(
-    const std::string& context_string,
-    int initial_state) {
+    ClientAsyncImpl* client, const std::string& context_string,
+    int64_t initial_state, const std::string& fallback_string) {
   int64_t next_state;
-  GOOGLE_CHECK_NE(completion_client_, nullptr);
-  const absl::Status status = completion_client_->GetNextState(
-      context_string, initial_state, timeout_sec_, &next_state);
+  const absl::Status status = client->GetNextState(
+      context_string, initial_state, fallback_string, timeout_sec_,
+      &next_state);
   if (!status.ok()) {
     return absl::InternalError(absl::StrCat(
         "Getting next state failed for initial state ", initial_state,
@@ -164,15 +151,13 @@ absl::StatusOr<int64_t> ClientHelper::GetNextState(
 }
 
 absl::Status ClientHelper::UpdateCountGetDestStateScore(
-    const std::string& context_string, int initial_state, int count,
+    ClientAsyncImpl* client, const std::string& context_string,
+    int64_t initial_state, const std::string& fallback_string, int count,
     int64_t* next_state, double* normalization,
     std::vector<std::pair<double, std::string>>* prob_idx_pair_vector) {
-  if (completion_client_ == nullptr) {
-    return absl::InternalError("Completion client not initialized");
-  }
-  return completion_client_->UpdateCountGetDestStateScore(
-      context_string, initial_state, timeout_sec_, count, next_state,
-      normalization, prob_idx_pair_vector);
+  return client->UpdateCountGetDestStateScore(
+      context_string, initial_state, fallback_string, timeout_sec_, count,
+      next_state, normalization, prob_idx_pair_vector);
 }
 
 absl::Status ClientHelper::RandGen(const std::string& context_string,
@@ -181,15 +166,22 @@ absl::Status ClientHelper::RandGen(const std::string& context_string,
   *result = context_string;
   const int max_length = kMaxRandGenLen + result->length();
 
+  // The state handles and model updates are specific to the server, hence all
+  // the requests are sent to the same one.
+  ASSIGN_OR_RETURN(ClientAsyncImpl *client, NextClient());
+
   // Advance state to configured initial state.
-  const auto state_status = GetNextState(context_string, /*initial_state=*/-1);
+  const auto state_status = GetNextState(client, context_string,
+                                         /*initial_state=*/-1,
+                                         /*fallback_string=*/"");
   if (!state_status.ok()) return state_status.status();
   int64_t state = state_status.value();
   std::string chosen;
   std::vector<std::pair<double, std::string>> prob_idx_pair_vector;
   double normalization;
-  RETURN_IF_ERROR(GetLMScores(/*context_string=*/"", state, &normalization,
-                              &prob_idx_pair_vector));
+  RETURN_IF_ERROR(GetLMScores(client, /*context_string=*/"", state,
+                              /*fallback_string=*/context_string,
+                              &normalization, &prob_idx_pair_vector));
   bool success = true;
   absl::BitGen bit_gen;
   do {
@@ -201,12 +193,14 @@ absl::Status ClientHelper::RandGen(const std::string& context_string,
       chosen = prob_idx_pair_vector[pos].second;
       if (!chosen.empty()) {
         // Only updates if not end-of-string (by convention, empty string).
+        const std::string fallback_string = *result;
         *result += chosen;
         prob_idx_pair_vector.clear();
-        success =
-            UpdateCountGetDestStateScore(chosen, state, /*count=*/1, &state,
-                                         &normalization,
-                                         &prob_idx_pair_vector).ok();
+        success = UpdateCountGetDestStateScore(client, chosen, state,
+                                               fallback_string, /*count=*/1,
+                                               &state, &normalization,
+                                               &prob_idx_pair_vector)
+                      .ok();
       }
     } else {
       *result += "(subsequent generation failed)";
@@ -228,8 +222,10 @@ absl::Status ClientHelper::OneKbestSample(int k_best,
                                           std::string* result) {
   std::vector<std::pair<double, std::string>> prob_idx_pair_vector;
   double normalization;
-  RETURN_IF_ERROR(GetLMScores(context_string, /*initial_state=*/-1,
-                              &normalization, &prob_idx_pair_vector));
+  ASSIGN_OR_RETURN(ClientAsyncImpl *client, NextClient());
+  RETURN_IF_ERROR(GetLMScores(client, context_string, /*initial_state=*/-1,
+                              /*fallback_string=*/"", &normalization,
+                              &prob_idx_pair_vector));
   *result = std::to_string(k_best) + "-best prob continuations:";
   for (int i = 0; i < k_best; i++) {
     *result = absl::StrFormat("%s %s(%5.3f)", *result,
@@ -245,38 +241,45 @@ absl::Status ClientHelper::CalcBitsPerCharacter(const std::string& test_file,
   if (!infile.is_open()) {
     return absl::NotFoundError("Test file could not be accessed");
   }
-  absl::Status status = absl::OkStatus();
-  std::string input_line;
+  // Each line is scored by the server in a single request. Dynamic models are
+  // updated as the lines are scored, hence the lines are sent one at a time
+  // to the same server. If the models are static, which is found out from the
+  // first response, the order does not matter and multiple lines are kept in
+  // flight, balanced across all the servers.
+  ASSIGN_OR_RETURN(ClientAsyncImpl *client, NextClient());
+  int max_lines_in_flight = 1;
+  bool models_are_static = false;
+  std::deque<std::future<absl::StatusOr<ScoreTextResponse>>> in_flight;
   int tot_chars = 0;
   int tot_oov_chars = 0;
   double tot_bits = 0.0;
-  double unused_normalization;
-  while (status.ok() && std::getline(infile, input_line)) {
-    std::vector<std::string> input_chars = nisaba::utf8::StrSplitByChar(
-        input_line);
-    input_chars.push_back("");  // End-of-string character.
-    int64_t state = 0;  // Will start at initial state of the model.
-    std::vector<std::pair<double, std::string>> prob_idx_pair_vector;
-    RETURN_IF_ERROR(GetLMScores(/*context_string=*/"", state,
-                                &unused_normalization, &prob_idx_pair_vector));
-    for (const auto& utf8_sym : input_chars) {
-      const int idx = FindStringIndex(prob_idx_pair_vector, utf8_sym);
-      tot_bits += CalculateBits(idx, prob_idx_pair_vector);
-      if (idx < 0) {
-         ++tot_oov_chars;
-      }
-      ++tot_chars;
-      prob_idx_pair_vector.clear();
-      status = UpdateCountGetDestStateScore(utf8_sym, state, /*count=*/1,
-                                            &state, &unused_normalization,
-                                            &prob_idx_pair_vector);
-      if (!status.ok()) break;
+  const auto collect_oldest = [&]() -> absl::Status {
+    ASSIGN_OR_RETURN(const ScoreTextResponse response,
+                     in_flight.front().get());
+    in_flight.pop_front();
+    tot_bits += response.bits();
+    tot_chars += response.num_chars();
+    tot_oov_chars += response.num_oov_chars();
+    if (response.model_is_static()) {
+      max_lines_in_flight = kMaxLinesInFlight * clients_.size();
+      models_are_static = true;
+    }
+    return absl::OkStatus();
+  };
+  ScoreTextRequest request;
+  request.set_update_counts(true);
+  while (std::getline(infile, *request.mutable_text())) {
+    if (models_are_static) {
+      ASSIGN_OR_RETURN(client, NextClient());
+    }
+    in_flight.push_back(client->ScoreTextFuture(request, timeout_sec_));
+    while (static_cast<int>(in_flight.size()) >= max_lines_in_flight) {
+      RETURN_IF_ERROR(collect_oldest());
     }
   }
-  if (infile.is_open()) {
-    infile.close();
+  while (!in_flight.empty()) {
+    RETURN_IF_ERROR(collect_oldest());
   }
-  if (!status.ok()) return status;
   *result = absl::StrJoin(
       std::make_tuple("Total characters: ", tot_chars, " (", tot_oov_chars,
                       " OOV); bits per character: ",
@@ -284,17 +287,58 @@ absl::Status ClientHelper::CalcBitsPerCharacter(const std::string& test_file,
   return absl::OkStatus();
 }
 
+absl::Status ClientHelper::AdaptToText(const std::string& text_file,
+                                       std::string* result) {
+  AdaptToTextRequest request;
+  ASSIGN_OR_RETURN(*request.mutable_text(),
+                   nisaba::file::ReadBinaryFile(text_file));
+  if (clients_.empty()) {
+    return absl::InternalError("Completion client not initialized");
+  }
+  // Adapts all the servers concurrently, over the first channel to each.
+  std::vector<std::future<absl::StatusOr<AdaptToTextResponse>>> responses;
+  for (int idx = 0; idx < clients_.size(); idx += channels_per_server_) {
+    responses.push_back(clients_[idx]->AdaptToTextFuture(request,
+                                                         timeout_sec_));
+  }
+  absl::Status status = absl::OkStatus();
+  for (auto &response : responses) {
+    const absl::Status server_status = response.get().status();
+    if (status.ok()) status = server_status;
+  }
+  RETURN_IF_ERROR(status);
+  *result = absl::StrCat("Adapted ", responses.size(), " server(s) to ",
+                         request.text().size(), " bytes of ", text_file);
+  return absl::OkStatus();
+}
+
 absl::Status ClientHelper::Init(const ClientConfig& config) {
-  ::grpc::ChannelArguments channel_args;
-  std::shared_ptr<::grpc::ChannelCredentials> creds = BuildChannelCredentials(
-      config, &channel_args);
-  if (creds == nullptr) {
-    return absl::InternalError("Failed to build channel credentials");
+  std::vector<std::string> address_uris = {config.server().address_uri()};
+  address_uris.insert(address_uris.end(),
+                      config.replica_address_uris().begin(),
+                      config.replica_address_uris().end());
+  channels_per_server_ = std::max(config.channels_per_server(), 1);
+  clients_.clear();
+  for (const auto& address_uri : address_uris) {
+    for (int i = 0; i < channels_per_server_; ++i) {
+      ::grpc::ChannelArguments channel_args;
+      std::shared_ptr<::grpc::ChannelCredentials> creds =
+          BuildChannelCredentials(config, &channel_args);
+      if (creds == nullptr) {
+        return absl::InternalError("Failed to build channel credentials");
+      }
+      // Prevents the channels to the same server from sharing the
+      // connections.
+      channel_args.SetInt(GRPC_ARG_USE_LOCAL_SUBCHANNEL_POOL, 1);
+      std::shared_ptr<::grpc::Channel> channel = ::grpc::CreateCustomChannel(
+          address_uri, creds, channel_args);
+      clients_.push_back(
+          std::make_unique<ClientAsyncImpl>(MozoLMService::NewStub(channel)));
+    }
   }
-  channel_ = ::grpc::CreateCustomChannel(config.server().address_uri(), creds,
-                                         channel_args);
-  completion_client_ =
-      std::make_unique<ClientAsyncImpl>(MozoLMService::NewStub(channel_));
+  GOOGLE_LOG(INFO) << "Created " << clients_.size() << " channels to "
+                   << address_uris.size() << " server(s)";
+  load_balancing_policy_ = config.load_balancing_policy();
   timeout_sec_ = config.timeout_sec();
   return absl::OkStatus();
 }
@@ -304,6 +348,9 @@ void InitConfigDefaults(ClientConfig* config) {
   if (config->timeout_sec() <= 0.0) {
     config->set_timeout_sec(kDefaultClientTimeoutSec);
   }
+  if (config->channels_per_server() <= 0) {
+    config->set_channels_per_server(1);
+  }
 }
 
 absl::Status RunClient(const ClientConfig& config) {
@@ -323,6 +370,9 @@ absl::Status RunClient(const ClientConfig& config) {
     case ClientConfig::BITS_PER_CHAR_CALCULATION:
       status = client.CalcBitsPerCharacter(config.test_corpus(), &result);
       break;
+    case ClientConfig::ADAPT_TO_TEXT:
+      status = client.AdaptToText(config.adaptation_text(), &result);
+      break;
     default:
       return absl::InvalidArgumentError("Unknown client request type");
   }
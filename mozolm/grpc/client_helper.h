@@ -15,6 +15,7 @@
 #ifndef MOZOLM_MOZOLM_GRPC_CLIENT_HELPER_H_
 #define MOZOLM_MOZOLM_GRPC_CLIENT_HELPER_H_
 
+#include <atomic>
 #include <memory>
 #include <string>
 #include <vector>
@@ -30,7 +31,13 @@ namespace grpc {
 
 constexpr int kMaxRandGenLen = 128;
 constexpr double kDefaultClientTimeoutSec = 5.0;
+constexpr int kMaxLinesInFlight = 64;  // Pipelined lines for static models.
 
+// Client for one or more servers. Every operation (a session) is assigned to
+// one of the channels according to the load balancing policy and, since the
+// state handles are specific to the server, all the requests that depend on
+// the state are sent through that channel. The independent requests, such as
+// the lines scored by the static models, are balanced individually.
 class ClientHelper {
  public:
   ClientHelper() = default;
@@ -47,35 +54,60 @@ class ClientHelper {
   absl::Status RandGen(const std::string& context_string, std::string* result);
 
   // Calculates bits per character in test file.  To cover all unicode
-  // codepoints, even those assigned zero probability by the model, we
-  // interpolate with a uniform model over all codepoints, using a very small
-  // interpolation factor for this mixing.
+  // codepoints, even those assigned zero probability by the model, the server
+  // interpolates with a uniform model over all codepoints, using a very small
+  // interpolation factor for this mixing. The lines are scored by the server
+  // as a whole and, for static models, pipelined.
   absl::Status CalcBitsPerCharacter(const std::string& test_file,
                                     std::string* result);
 
+  // Adapts the dynamic models to the contents of the text file, which are
+  // sent in a single request to every server, since the later sessions may be
+  // balanced to any of them. Fails if adapting any of the servers fails.
+  absl::Status AdaptToText(const std::string& text_file, std::string* result);
+
  private:
+  // Picks the client for the next session according to the load balancing
+  // policy.
+  absl::StatusOr<ClientAsyncImpl*> NextClient();
+
   // Requests LMScores from model, populates vector of prob/index pairs and
-  // updates normalization count, returning true if successful.
+  // updates normalization count, returning true if successful. The
+  // fallback_string is the full context leading to initial_state, used by the
+  // server if the state handle has expired.
   absl::Status GetLMScores(
-      const std::string& context_string, int initial_state,
+      ClientAsyncImpl* client, const std::string& context_string,
+      int64_t initial_state, const std::string& fallback_string,
       double* normalization,
       std::vector<std::pair<double, std::string>>* prob_idx_pair_vector);
 
   // Requests next state from model and returns result.
-  absl::StatusOr<int64_t> GetNextState(const std::string& context_string,
-                                       int initial_state);
+  absl::StatusOr<int64_t> GetNextState(ClientAsyncImpl* client,
+                                       const std::string& context_string,
+                                       int64_t initial_state,
+                                       const std::string& fallback_string);
 
   // Updates counts in model and returns destination state and prob/index pairs.
   absl::Status UpdateCountGetDestStateScore(
-      const std::string& context_string, int initial_state, int count,
+      ClientAsyncImpl* client, const std::string& context_string,
+      int64_t initial_state, const std::string& fallback_string, int count,
       int64_t* next_state, double* normalization,
       std::vector<std::pair<double, std::string>>* prob_idx_pair_vector);
 
   // Timeout when waiting for server (specified in seconds).
   double timeout_sec_;
 
-  std::shared_ptr<::grpc::Channel> channel_;
-  std::unique_ptr<ClientAsyncImpl> completion_client_;
+  // Clients, one per channel, for all the servers. The channels to each
+  // server are consecutive.
+  std::vector<std::unique_ptr<ClientAsyncImpl>> clients_;
+  int channels_per_server_ = 1;
+
+  // Policy for picking the client for the next session.
+  ClientConfig::LoadBalancingPolicy load_balancing_policy_ =
+      ClientConfig::ROUND_ROBIN;
+
+  // Position of the next client for the round-robin selection.
+  std::atomic<unsigned int> next_client_ = 0;
 };
 
 // Sets default parameters for the client if they have not already been set.
@@ -177,6 +177,45 @@ TEST_P(ClientHelperTest, CheckCalcBitsPerCharacter) {
   EXPECT_TRUE(std::filesystem::remove(test_file));
 }
 
+TEST_P(ClientHelperTest, CheckMultipleServers) {
+  // Start the replicas of the main server.
+  constexpr int kNumReplicas = 2;
+  std::vector<std::unique_ptr<ServerHelper>> replicas;
+  for (int i = 0; i < kNumReplicas; ++i) {
+    auto replica = std::make_unique<ServerHelper>();
+    ASSERT_OK(replica->Init(server_config_));
+    ASSERT_OK(replica->Run(/* wait_till_terminated= */false));
+    client_config_.add_replica_address_uris(absl::StrCat(
+        "localhost:", replica->server().selected_port()));
+    replicas.push_back(std::move(replica));
+  }
+  client_config_.set_channels_per_server(2);
+
+  const auto temp_text_status = nisaba::file::WriteTempTextFile(
+      "test.txt", "Hello world!\nHello again!\nGoodbye world!\n");
+  ASSERT_OK(temp_text_status.status());
+  const std::string test_file = temp_text_status.value();
+
+  for (const auto policy : {ClientConfig::ROUND_ROBIN,
+                            ClientConfig::LEAST_OUTSTANDING_REQUESTS}) {
+    client_config_.set_load_balancing_policy(policy);
+    ClientHelper client;
+    ASSERT_OK(client.Init(client_config_));
+    std::string result;
+    for (int i = 0; i < 2 * (kNumReplicas + 1); ++i) {
+      EXPECT_OK(client.OneKbestSample(/* k_best= */5,
+                                      /* context_string= */"", &result));
+      EXPECT_OK(client.RandGen(/* context_string= */"He", &result));
+    }
+    EXPECT_OK(client.CalcBitsPerCharacter(test_file, &result));
+    EXPECT_FALSE(result.empty());
+  }
+
+  // Cleanup.
+  EXPECT_TRUE(std::filesystem::remove(test_file));
+  for (auto &replica : replicas) replica->Shutdown();
+}
+
 INSTANTIATE_TEST_SUITE_P(
     ClientServerMiniEnd2End, ClientHelperTest, ::testing::Values(
         // Static character bigram.
@@ -0,0 +1,77 @@
+// Copyright 2026 MozoLM Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "mozolm/grpc/response_cache.h"
+
+#include "absl/strings/str_cat.h"
+
+namespace mozolm {
+namespace grpc {
+
+ResponseCache::ResponseCache(absl::string_view name, int max_size)
+    : max_size_(max_size) {
+  metrics::MetricsRegistry &registry = metrics::MetricsRegistry::Global();
+  hits_ = registry.GetCounter(absl::StrCat(name, "/hits"));
+  misses_ = registry.GetCounter(absl::StrCat(name, "/misses"));
+  evictions_ = registry.GetCounter(absl::StrCat(name, "/evictions"));
+  invalidations_ = registry.GetCounter(absl::StrCat(name, "/invalidations"));
+}
+
+bool ResponseCache::Lookup(int64_t state_handle, ::grpc::Slice *response) {
+  absl::MutexLock lock(lock_);
+  const auto pos = index_.find(state_handle);
+  if (pos == index_.end()) {
+    misses_->Increment();
+    return false;
+  }
+  entries_.splice(entries_.begin(), entries_, pos->second);
+  *response = pos->second->response;
+  hits_->Increment();
+  return true;
+}
+
+void ResponseCache::Insert(int64_t state_handle,
+                           const ::grpc::Slice &response) {
+  if (max_size_ <= 0) return;
+  absl::MutexLock lock(lock_);
+  const auto pos = index_.find(state_handle);
+  if (pos != index_.end()) {
+    pos->second->response = response;
+    entries_.splice(entries_.begin(), entries_, pos->second);
+    return;
+  }
+  if (entries_.size() >= max_size_) {
+    index_.erase(entries_.back().state_handle);
+    entries_.pop_back();
+    evictions_->Increment();
+  }
+  entries_.push_front({state_handle, response});
+  index_[state_handle] = entries_.begin();
+}
+
+void ResponseCache::Clear() {
+  absl::MutexLock lock(lock_);
+  if (entries_.empty()) return;
+  entries_.clear();
+  index_.clear();
+  invalidations_->Increment();
+}
+
+int ResponseCache::size() const {
+  absl::MutexLock lock(lock_);
+  return entries_.size();
+}
+
+}  // namespace grpc
+}  // namespace mozolm
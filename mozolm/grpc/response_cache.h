@@ -0,0 +1,88 @@
+// Copyright 2026 MozoLM Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Cache of the serialized server responses.
+
+#ifndef MOZOLM_MOZOLM_GRPC_RESPONSE_CACHE_H_
+#define MOZOLM_MOZOLM_GRPC_RESPONSE_CACHE_H_
+
+#include <list>
+
+#include "mozolm/stubs/integral_types.h"
+#include "absl/base/thread_annotations.h"
+#include "absl/container/flat_hash_map.h"
+#include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
+#include "include/grpcpp/support/slice.h"
+#include "mozolm/utils/metrics.h"
+
+namespace mozolm {
+namespace grpc {
+
+// Bounded cache of serialized responses, keyed by the hub state handle the
+// response was computed for. The least recently used responses are evicted
+// once the cache is full. The responses are kept as reference-counted gRPC
+// slices, hence serving a cached response copies neither the bytes nor
+// requires serializing the message again.
+//
+// The cached responses are only valid for as long as the model hub does not
+// change, the cache has to be cleared whenever the model counts are updated.
+// The hits, misses, evictions and invalidations are counted in the global
+// metrics registry under `<name>/`.
+class ResponseCache {
+ public:
+  ResponseCache(absl::string_view name, int max_size);
+  ResponseCache(const ResponseCache &) = delete;
+  ResponseCache &operator=(const ResponseCache &) = delete;
+
+  // Looks up the response for the given state handle. Returns false if the
+  // response is not cached.
+  bool Lookup(int64_t state_handle, ::grpc::Slice *response)
+      ABSL_LOCKS_EXCLUDED(lock_);
+
+  // Caches the response for the given state handle.
+  void Insert(int64_t state_handle, const ::grpc::Slice &response)
+      ABSL_LOCKS_EXCLUDED(lock_);
+
+  // Drops all the cached responses.
+  void Clear() ABSL_LOCKS_EXCLUDED(lock_);
+
+  // Number of cached responses.
+  int size() const ABSL_LOCKS_EXCLUDED(lock_);
+
+ private:
+  struct Entry {
+    int64_t state_handle;
+    ::grpc::Slice response;
+  };
+  using EntryList = std::list<Entry>;
+
+  const int max_size_;
+  mutable absl::Mutex lock_;
+
+  // Cached entries, most recently used first, and their index.
+  EntryList entries_ ABSL_GUARDED_BY(lock_);
+  absl::flat_hash_map<int64_t, EntryList::iterator> index_
+      ABSL_GUARDED_BY(lock_);
+
+  metrics::Counter *hits_;
+  metrics::Counter *misses_;
+  metrics::Counter *evictions_;
+  metrics::Counter *invalidations_;
+};
+
+}  // namespace grpc
+}  // namespace mozolm
+
+#endif  // MOZOLM_MOZOLM_GRPC_RESPONSE_CACHE_H_
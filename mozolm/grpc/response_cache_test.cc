@@ -0,0 +1,62 @@
+// Copyright 2026 MozoLM Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "mozolm/grpc/response_cache.h"
+
+#include <string>
+
+#include "gtest/gtest.h"
+
+namespace mozolm {
+namespace grpc {
+namespace {
+
+std::string SliceToString(const ::grpc::Slice &slice) {
+  return std::string(reinterpret_cast<const char *>(slice.begin()),
+                     slice.size());
+}
+
+TEST(ResponseCacheTest, EvictsLeastRecentlyUsed) {
+  ResponseCache cache("test_cache", /*max_size=*/2);
+  cache.Insert(1, ::grpc::Slice(std::string("one")));
+  cache.Insert(2, ::grpc::Slice(std::string("two")));
+  ::grpc::Slice response;
+  ASSERT_TRUE(cache.Lookup(1, &response));  // Makes 2 least recently used.
+  EXPECT_EQ("one", SliceToString(response));
+
+  cache.Insert(3, ::grpc::Slice(std::string("three")));
+  EXPECT_EQ(2, cache.size());
+  EXPECT_FALSE(cache.Lookup(2, &response));
+  ASSERT_TRUE(cache.Lookup(1, &response));
+  EXPECT_EQ("one", SliceToString(response));
+  ASSERT_TRUE(cache.Lookup(3, &response));
+  EXPECT_EQ("three", SliceToString(response));
+}
+
+TEST(ResponseCacheTest, ClearDropsAllResponses) {
+  ResponseCache cache("test_cache", /*max_size=*/10);
+  cache.Insert(1, ::grpc::Slice(std::string("one")));
+  cache.Insert(1, ::grpc::Slice(std::string("uno")));
+  EXPECT_EQ(1, cache.size());
+  ::grpc::Slice response;
+  ASSERT_TRUE(cache.Lookup(1, &response));
+  EXPECT_EQ("uno", SliceToString(response));
+  cache.Clear();
+  EXPECT_EQ(0, cache.size());
+  EXPECT_FALSE(cache.Lookup(1, &response));
+}
+
+}  // namespace
+}  // namespace grpc
+}  // namespace mozolm
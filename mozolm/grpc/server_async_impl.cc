@@ -14,15 +14,25 @@
 
 #include "mozolm/grpc/server_async_impl.h"
 
+#include <filesystem>
 #include <memory>
+#include <string>
+#include <system_error>
 #include <utility>
 #include <vector>
 
 #include "google/protobuf/stubs/logging.h"
 #include "absl/functional/bind_front.h"
 #include "absl/memory/memory.h"
+#include "absl/status/statusor.h"
 #include "absl/strings/match.h"
+#include "absl/strings/str_cat.h"
 #include "include/grpcpp/server_builder.h"
+#include "mozolm/models/corpus_scorer.h"
+#include "mozolm/models/language_model.h"
+#include "mozolm/models/model_factory.h"
+#include "mozolm/models/model_storage.pb.h"
+#include "nisaba/port/status_macros.h"
 
 namespace mozolm {
 namespace grpc {
@@ -30,36 +40,292 @@ namespace grpc {
 using ::grpc::Status;
 using ::grpc::ServerContext;
 
+namespace {
+
+// Number of completed and failed reloads of the model hub.
+metrics::Counter* ModelHubReloads() {
+  static metrics::Counter* const counter =
+      metrics::MetricsRegistry::Global().GetCounter("model_hub/reloads");
+  return counter;
+}
+
+metrics::Counter* ModelHubReloadFailures() {
+  static metrics::Counter* const counter =
+      metrics::MetricsRegistry::Global().GetCounter(
+          "model_hub/reload_failures");
+  return counter;
+}
+
+// Time to build, warm up and swap in the new hub.
+metrics::Histogram* ModelHubReloadLatency() {
+  static metrics::Histogram* const histogram =
+      metrics::MetricsRegistry::Global().GetHistogram(
+          "model_hub/reload_usec");
+  return histogram;
+}
+
+// Number of completed and failed checkpoints of the dynamic models.
+metrics::Counter* CheckpointWrites() {
+  static metrics::Counter* const counter =
+      metrics::MetricsRegistry::Global().GetCounter("checkpoint/writes");
+  return counter;
+}
+
+metrics::Counter* CheckpointFailures() {
+  static metrics::Counter* const counter =
+      metrics::MetricsRegistry::Global().GetCounter("checkpoint/failures");
+  return counter;
+}
+
+// Time for which the model updates are paused while the models are
+// snapshotted, and the time to write out all the snapshots.
+metrics::Histogram* CheckpointSnapshotLatency() {
+  static metrics::Histogram* const histogram =
+      metrics::MetricsRegistry::Global().GetHistogram(
+          "checkpoint/snapshot_usec");
+  return histogram;
+}
+
+metrics::Histogram* CheckpointWriteLatency() {
+  static metrics::Histogram* const histogram =
+      metrics::MetricsRegistry::Global().GetHistogram("checkpoint/write_usec");
+  return histogram;
+}
+
+// Writes the snapshot to a temporary file and renames it to the given path,
+// so that the readers never see a partially written checkpoint.
+absl::Status WriteSnapshot(const models::ModelSnapshot& snapshot,
+                           const std::string& path) {
+  const std::string temp_path = absl::StrCat(path, ".tmp");
+  RETURN_IF_ERROR(snapshot.Write(temp_path));
+  std::error_code error;
+  std::filesystem::rename(temp_path, path, error);
+  if (error) {
+    return absl::InternalError(absl::StrCat("Failed to rename ", temp_path,
+                                            " to ", path, ": ",
+                                            error.message()));
+  }
+  return absl::OkStatus();
+}
+
+// Resolves the state handle of a request into a hub state, -1 standing for the
+// start state when the request carries no handle. Fails if the handle has
+// expired and cannot be rebuilt from the fallback context of the request.
+Status ResolveRequestState(models::LanguageModelHub* model_hub, int64_t handle,
+                           const std::string& fallback_context, int* state) {
+  *state = model_hub->ResolveStateHandle(handle, fallback_context);
+  if (handle >= 0 && *state < 0) {
+    return Status(::grpc::StatusCode::NOT_FOUND,
+                  "state handle has expired and no fallback context is given");
+  }
+  return Status::OK;
+}
+
+}  // namespace
+
+std::string ModelCheckpointPath(absl::string_view directory, int model_idx) {
+  return (std::filesystem::path(std::string(directory)) /
+          absl::StrCat("model_", model_idx, ".fst"))
+      .string();
+}
+
+void RestoreFromCheckpoints(absl::string_view directory,
+                            ModelHubConfig* model_hub_config) {
+  for (int idx = 0; idx < model_hub_config->model_config_size(); ++idx) {
+    ModelConfig* model_config = model_hub_config->mutable_model_config(idx);
+    // Only the dynamic PPM models support the checkpoints for now.
+    if (model_config->type() != ModelConfig::PPM_AS_FST ||
+        model_config->storage().ppm_options().static_model()) {
+      continue;
+    }
+    const std::string path = ModelCheckpointPath(directory, idx);
+    if (!std::filesystem::exists(path)) continue;
+    GOOGLE_LOG(INFO) << "Restoring model " << idx << " from " << path;
+    ModelStorage* storage = model_config->mutable_storage();
+    storage->set_model_file(path);
+    storage->mutable_ppm_options()->set_model_is_fst(true);
+  }
+}
+
+ServerAsyncImpl::RpcMetrics::RpcMetrics(absl::string_view rpc_name) {
+  metrics::MetricsRegistry& registry = metrics::MetricsRegistry::Global();
+  const std::string prefix = absl::StrCat("rpc/", rpc_name, "/");
+  requests = registry.GetCounter(absl::StrCat(prefix, "requests"));
+  errors = registry.GetCounter(absl::StrCat(prefix, "errors"));
+  handle_usec = registry.GetHistogram(absl::StrCat(prefix, "handle_usec"));
+  total_usec = registry.GetHistogram(absl::StrCat(prefix, "total_usec"));
+}
+
+void ServerAsyncImpl::RpcMetrics::RecordHandled(absl::Time start_time,
+                                                const Status& status) {
+  handle_usec->RecordMicros(absl::Now() - start_time);
+  requests->Increment();
+  if (!status.ok()) errors->Increment();
+}
+
+void ServerAsyncImpl::RpcMetrics::RecordFinished(absl::Time start_time) {
+  total_usec->RecordMicros(absl::Now() - start_time);
+}
+
 ServerAsyncImpl::ServerAsyncImpl(
-    std::unique_ptr<models::LanguageModelHub> model_hub) {
-  model_hub_ = std::move(model_hub);
+    std::unique_ptr<models::LanguageModelHub> model_hub)
+    : model_hub_(std::move(model_hub)) {}
+
+ServerAsyncImpl::~ServerAsyncImpl() {
+  std::unique_ptr<std::thread> reload_thread;
+  {
+    absl::MutexLock lock(reload_lock_);
+    reload_thread = std::move(reload_thread_);
+  }
+  if (reload_thread != nullptr) reload_thread->join();
+}
+
+std::shared_ptr<models::LanguageModelHub> ServerAsyncImpl::model_hub() const {
+  absl::MutexLock lock(model_hub_lock_);
+  return model_hub_;
 }
 
 Status ServerAsyncImpl::HandleRequest(ServerContext* context,
                                       const GetContextRequest* request,
                                       LMScores* response) {
-  if (!model_hub_->ExtractLMScores(
-          model_hub_->ContextState(request->context(), request->state()),
-          response)) {
+  const std::shared_ptr<models::LanguageModelHub> model_hub = this->model_hub();
+  int state;
+  const Status status = ResolveRequestState(
+      model_hub.get(), request->state(), request->fallback_context(), &state);
+  if (!status.ok()) return status;
+  if (!model_hub->ExtractLMScores(
+          model_hub->ContextState(request->context(), state), response)) {
     // Only fails if given state is invalid.
     return Status(::grpc::StatusCode::INVALID_ARGUMENT, "invalid state");
   }
   return Status::OK;
 }
 
+Status ServerAsyncImpl::HandleSerializedRequest(
+    ServerContext* context, ::grpc::ByteBuffer* request,
+    ::grpc::ByteBuffer* response) {
+  GetContextRequest context_request;
+  const Status status =
+      ::grpc::SerializationTraits<GetContextRequest>::Deserialize(
+          request, &context_request);
+  if (!status.ok()) return status;
+  const std::shared_ptr<models::LanguageModelHub> model_hub = this->model_hub();
+  int init_state;
+  const Status resolve_status = ResolveRequestState(
+      model_hub.get(), context_request.state(),
+      context_request.fallback_context(), &init_state);
+  if (!resolve_status.ok()) return resolve_status;
+  const int state =
+      model_hub->ContextState(context_request.context(), init_state);
+  const int64_t state_handle = model_hub->StateHandle(state);
+  ::grpc::Slice serialized_scores;
+  if (lm_scores_cache_ == nullptr ||
+      !lm_scores_cache_->Lookup(state_handle, &serialized_scores)) {
+    LMScores lm_scores;
+    if (!model_hub->ExtractLMScores(state, &lm_scores)) {
+      // Only fails if given state is invalid.
+      return Status(::grpc::StatusCode::INVALID_ARGUMENT, "invalid state");
+    }
+    serialized_scores = ::grpc::Slice(lm_scores.SerializeAsString());
+    if (lm_scores_cache_ != nullptr) {
+      lm_scores_cache_->Insert(state_handle, serialized_scores);
+    }
+  }
+  *response = ::grpc::ByteBuffer(&serialized_scores, 1);
+  return Status::OK;
+}
+
 Status ServerAsyncImpl::HandleRequest(ServerContext* context,
                                       const GetContextRequest* request,
                                       NextState* response) {
-  const int64_t state = model_hub_->ContextState(request->context(),
-                                                 request->state());
-  response->set_next_state(state);
+  const std::shared_ptr<models::LanguageModelHub> model_hub = this->model_hub();
+  int state;
+  const Status status = ResolveRequestState(
+      model_hub.get(), request->state(), request->fallback_context(), &state);
+  if (!status.ok()) return status;
+  response->set_next_state(model_hub->StateHandle(
+      model_hub->ContextState(request->context(), state)));
   return Status::OK;
 }
 
 Status ServerAsyncImpl::HandleRequest(
     ServerContext* context, const UpdateLMScoresRequest* request,
     LMScores* response) {
-  return ManageUpdateLMScores(request, response);
+  absl::ReaderMutexLock lock(model_update_lock_);
+  const Status status = ManageUpdateLMScores(request, response);
+  InvalidateResponseCache();
+  return status;
+}
+
+Status ServerAsyncImpl::HandleRequest(ServerContext* context,
+                                      const ScoreTextRequest* request,
+                                      ScoreTextResponse* response) {
+  absl::ReaderMutexLock lock(model_update_lock_);
+  const std::shared_ptr<models::LanguageModelHub> model_hub = this->model_hub();
+  const auto scores = models::ScoreText(
+      request->text(), request->update_counts(), model_hub.get());
+  if (request->update_counts()) InvalidateResponseCache();
+  if (!scores.ok()) {
+    // The canonical absl and gRPC status codes are the same.
+    return Status(static_cast<::grpc::StatusCode>(scores.status().code()),
+                  std::string(scores.status().message()));
+  }
+  response->set_bits(scores->bits);
+  response->set_num_chars(scores->num_chars);
+  response->set_num_oov_chars(scores->num_oov_chars);
+  response->set_model_is_static(model_hub->IsStatic());
+  return Status::OK;
+}
+
+Status ServerAsyncImpl::HandleRequest(ServerContext* context,
+                                      const AdaptToTextRequest* request,
+                                      AdaptToTextResponse* response) {
+  absl::ReaderMutexLock lock(model_update_lock_);
+  const absl::Status status = model_hub()->AdaptToText(request->text());
+  InvalidateResponseCache();
+  if (!status.ok()) {
+    // The canonical absl and gRPC status codes are the same.
+    return Status(static_cast<::grpc::StatusCode>(status.code()),
+                  std::string(status.message()));
+  }
+  return Status::OK;
+}
+
+Status ServerAsyncImpl::HandleRequest(ServerContext* context,
+                                      const GetStatsRequest* request,
+                                      ServerStats* response) {
+  const metrics::MetricsSnapshot snapshot =
+      metrics::MetricsRegistry::Global().Snapshot();
+  for (const auto& [name, value] : snapshot.counters) {
+    ServerStats::Counter* counter = response->add_counters();
+    counter->set_name(name);
+    counter->set_value(value);
+  }
+  for (const auto& [name, values] : snapshot.histograms) {
+    ServerStats::Histogram* histogram = response->add_histograms();
+    histogram->set_name(name);
+    histogram->set_count(values.count);
+    histogram->set_mean(values.Mean());
+    histogram->set_p50(values.Quantile(0.5));
+    histogram->set_p90(values.Quantile(0.9));
+    histogram->set_p99(values.Quantile(0.99));
+    for (const int64_t bucket_count : values.bucket_counts) {
+      histogram->add_bucket_counts(bucket_count);
+    }
+  }
+  return Status::OK;
+}
+
+Status ServerAsyncImpl::HandleRequest(ServerContext* context,
+                                      const ReloadModelRequest* request,
+                                      ReloadModelResponse* response) {
+  const absl::Status status = StartModelHubReload();
+  if (!status.ok()) {
+    // The canonical absl and gRPC status codes are the same.
+    return Status(static_cast<::grpc::StatusCode>(status.code()),
+                  std::string(status.message()));
+  }
+  return Status::OK;
 }
 
 void ServerAsyncImpl::DriveCQ() {
@@ -68,12 +334,11 @@ void ServerAsyncImpl::DriveCQ() {
   // Waits for the completion of the next operation in the queue. Then, if not
   // shutting down, it casts the tag (a pointer to the std::function
   // implementing the next step in the execution of the RPC) to a
-  // std::function and runs it inline.
+  // std::function and runs it inline. The tags are owned by the call data.
   while (cq_->Next(&tag, &ok)) {
     // Casts the tag to a std::function and runs it inline.
     auto func_ptr = static_cast<std::function<void(bool)>*>(tag);
     (*func_ptr)(ok);
-    delete func_ptr;
   }
   // The completion queue is shutting down.
   GOOGLE_LOG(INFO) << "Completion queue shutdown.";
@@ -103,41 +368,45 @@ void ServerAsyncImpl::RequestNextGetNextState() {
     GOOGLE_LOG(INFO) << "Server shutdown, so not requesting GetNextState";
     return;
   }
-  ServerContext* ctx = new ServerContext();
-  GetContextRequest* request = new GetContextRequest();
-  ::grpc::ServerAsyncResponseWriter<NextState>* responder =
-        new ::grpc::ServerAsyncResponseWriter<NextState>(ctx);
-  auto process_get_nextstate_callback = new std::function<void(bool)>(
-      absl::bind_front(&ServerAsyncImpl::ProcessGetNextState, this, ctx,
-                       request, responder));
-  service_.RequestGetNextState(ctx, request, responder, cq_.get(), cq_.get(),
-                               process_get_nextstate_callback);
+  GetNextStateCall* call = get_next_state_calls_.Acquire();
+  if (!call->process_tag) {
+    // Newly created call, its tags are bound once for its lifetime.
+    call->process_tag = absl::bind_front(
+        &ServerAsyncImpl::ProcessGetNextState, this, call);
+    call->finish_tag = absl::bind_front(
+        &ServerAsyncImpl::CleanupAfterGetNextState, this, call);
+  }
+  service_.RequestGetNextState(call->context(), call->request(),
+                               call->responder(), cq_.get(), cq_.get(),
+                               &call->process_tag);
 }
 
-void ServerAsyncImpl::ProcessGetNextState(
-    ServerContext* ctx, GetContextRequest* request,
-    ::grpc::ServerAsyncResponseWriter<NextState>* responder, bool ok) {
+void ServerAsyncImpl::ProcessGetNextState(GetNextStateCall* call, bool ok) {
   if (!ok) {
     // Request for new RPC has failed, cleaning up and returning.
     GOOGLE_LOG(INFO) << "GetNextState not ok.";
-    CleanupAfterGetNextState(ctx, request, responder, ok);
+    CleanupAfterGetNextState(call, ok);
     return;
   }
   RequestNextGetNextState();  // Starts waiting for any new requests.
-  NextState response;
-  ::grpc::Status status = HandleRequest(ctx, request, &response);
-  auto finish_get_nextstate_callback = new std::function<void(bool)>(
-      absl::bind_front(&ServerAsyncImpl::CleanupAfterGetNextState, this,
-                       ctx, request, responder));
-  responder->Finish(response, status, finish_get_nextstate_callback);
-}
-
-void ServerAsyncImpl::CleanupAfterGetNextState(
-    ServerContext* ctx, GetContextRequest* request,
-    ::grpc::ServerAsyncResponseWriter<NextState>* responder, bool ignored_ok) {
-  delete ctx;
-  delete request;
-  delete responder;
+  const absl::Time start_time = absl::Now();
+  ::grpc::Status status = get_next_state_admission_.Admit(
+      absl::FromChrono(call->context()->deadline()), start_time);
+  if (status.ok()) {
+    call->start_time = start_time;
+    status = HandleRequest(call->context(), call->request(), call->response());
+    get_next_state_metrics_.RecordHandled(start_time, status);
+  }
+  call->responder()->Finish(*call->response(), status, &call->finish_tag);
+}
+
+void ServerAsyncImpl::CleanupAfterGetNextState(GetNextStateCall* call,
+                                               bool ignored_ok) {
+  if (call->start_time != absl::InfinitePast()) {
+    get_next_state_admission_.Release();
+    get_next_state_metrics_.RecordFinished(call->start_time);
+  }
+  get_next_state_calls_.Release(call);
   DecrementRpcPending();
 }
 
@@ -146,84 +415,273 @@ void ServerAsyncImpl::RequestNextGetLMScore() {
     GOOGLE_LOG(INFO) << "Server shutdown, so not requesting GetLMScore";
     return;
   }
-  ServerContext* ctx = new ServerContext();
-  GetContextRequest* request = new GetContextRequest();
-  ::grpc::ServerAsyncResponseWriter<LMScores>* responder =
-        new ::grpc::ServerAsyncResponseWriter<LMScores>(ctx);
-  auto process_get_lmscore_callback = new std::function<void(bool)>(
-      absl::bind_front(&ServerAsyncImpl::ProcessGetLMScore, this, ctx,
-                       request, responder));
-  service_.RequestGetLMScores(ctx, request, responder, cq_.get(), cq_.get(),
-                             process_get_lmscore_callback);
+  GetLMScoresCall* call = get_lm_scores_calls_.Acquire();
+  if (!call->process_tag) {
+    // Newly created call, its tags are bound once for its lifetime.
+    call->process_tag = absl::bind_front(
+        &ServerAsyncImpl::ProcessGetLMScore, this, call);
+    call->finish_tag = absl::bind_front(
+        &ServerAsyncImpl::CleanupAfterGetLMScore, this, call);
+  }
+  service_.RequestGetLMScores(call->context(), call->request(),
+                              call->responder(), cq_.get(), cq_.get(),
+                              &call->process_tag);
 }
 
-void ServerAsyncImpl::ProcessGetLMScore(
-    ServerContext* ctx, GetContextRequest* request,
-    ::grpc::ServerAsyncResponseWriter<LMScores>* responder, bool ok) {
+void ServerAsyncImpl::ProcessGetLMScore(GetLMScoresCall* call, bool ok) {
   if (!ok) {
     // Request for new RPC has failed, cleaning up and returning.
     GOOGLE_LOG(INFO) << "GetLMScore not ok.";
-    CleanupAfterGetLMScore(ctx, request, responder, ok);
+    CleanupAfterGetLMScore(call, ok);
     return;
   }
   RequestNextGetLMScore();  // Starts waiting for any new requests.
-  LMScores response;
-  ::grpc::Status status = HandleRequest(ctx, request, &response);
-  auto finish_get_lmscore_callback = new std::function<void(bool)>(
-      absl::bind_front(&ServerAsyncImpl::CleanupAfterGetLMScore, this,
-                       ctx, request, responder));
-  responder->Finish(response, status, finish_get_lmscore_callback);
-}
-
-void ServerAsyncImpl::CleanupAfterGetLMScore(
-    ServerContext* ctx, GetContextRequest* request,
-    ::grpc::ServerAsyncResponseWriter<LMScores>* responder, bool ignored_ok) {
-  delete ctx;
-  delete request;
-  delete responder;
+  const absl::Time start_time = absl::Now();
+  ::grpc::Status status = get_lm_scores_admission_.Admit(
+      absl::FromChrono(call->context()->deadline()), start_time);
+  if (status.ok()) {
+    call->start_time = start_time;
+    status = HandleSerializedRequest(call->context(), call->request(),
+                                     call->response());
+    get_lm_scores_metrics_.RecordHandled(start_time, status);
+  }
+  call->responder()->Finish(*call->response(), status, &call->finish_tag);
+}
+
+void ServerAsyncImpl::CleanupAfterGetLMScore(GetLMScoresCall* call,
+                                             bool ignored_ok) {
+  if (call->start_time != absl::InfinitePast()) {
+    get_lm_scores_admission_.Release();
+    get_lm_scores_metrics_.RecordFinished(call->start_time);
+  }
+  get_lm_scores_calls_.Release(call);
   DecrementRpcPending();
 }
 
 void ServerAsyncImpl::RequestNextUpdateLMScores() {
   if (!IncrementRpcPending()) {
-    GOOGLE_LOG(INFO) << "Server shutdown, so not requesting GetLMScore";
+    GOOGLE_LOG(INFO) << "Server shutdown, so not requesting UpdateLMScores";
     return;
   }
-  ServerContext* ctx = new ServerContext();
-  UpdateLMScoresRequest* request = new UpdateLMScoresRequest();
-  ::grpc::ServerAsyncResponseWriter<LMScores>* responder =
-        new ::grpc::ServerAsyncResponseWriter<LMScores>(ctx);
-  auto process_update_lmscores_callback = new std::function<void(bool)>(
-      absl::bind_front(&ServerAsyncImpl::ProcessUpdateLMScores, this,
-                       ctx, request, responder));
-  service_.RequestUpdateLMScores(ctx, request, responder, cq_.get(), cq_.get(),
-                                 process_update_lmscores_callback);
+  UpdateLMScoresCall* call = update_lm_scores_calls_.Acquire();
+  if (!call->process_tag) {
+    // Newly created call, its tags are bound once for its lifetime.
+    call->process_tag = absl::bind_front(
+        &ServerAsyncImpl::ProcessUpdateLMScores, this, call);
+    call->finish_tag = absl::bind_front(
+        &ServerAsyncImpl::CleanupAfterUpdateLMScores, this, call);
+  }
+  service_.RequestUpdateLMScores(call->context(), call->request(),
+                                 call->responder(), cq_.get(), cq_.get(),
+                                 &call->process_tag);
 }
 
-void ServerAsyncImpl::ProcessUpdateLMScores(
-    ServerContext* ctx, UpdateLMScoresRequest* request,
-    ::grpc::ServerAsyncResponseWriter<LMScores>* responder, bool ok) {
+void ServerAsyncImpl::ProcessUpdateLMScores(UpdateLMScoresCall* call, bool ok) {
   if (!ok) {
     // Request for new RPC has failed, cleaning up and returning.
     GOOGLE_LOG(INFO) << "UpdateLMScores not ok.";
-    CleanupAfterUpdateLMScores(ctx, request, responder, ok);
+    CleanupAfterUpdateLMScores(call, ok);
     return;
   }
   RequestNextUpdateLMScores();  // Starts waiting for any new requests.
-  LMScores response;
-  ::grpc::Status status = HandleRequest(ctx, request, &response);
-  auto finish_update_lmscores_callback = new std::function<void(bool)>(
-      absl::bind_front(&ServerAsyncImpl::CleanupAfterUpdateLMScores,
-                       this, ctx, request, responder));
-  responder->Finish(response, status, finish_update_lmscores_callback);
-}
-
-void ServerAsyncImpl::CleanupAfterUpdateLMScores(
-    ServerContext* ctx, UpdateLMScoresRequest* request,
-    ::grpc::ServerAsyncResponseWriter<LMScores>* responder, bool ignored_ok) {
-  delete ctx;
-  delete request;
-  delete responder;
+  const absl::Time start_time = absl::Now();
+  ::grpc::Status status = update_lm_scores_admission_.Admit(
+      absl::FromChrono(call->context()->deadline()), start_time);
+  if (status.ok()) {
+    call->start_time = start_time;
+    status = HandleRequest(call->context(), call->request(), call->response());
+    update_lm_scores_metrics_.RecordHandled(start_time, status);
+  }
+  call->responder()->Finish(*call->response(), status, &call->finish_tag);
+}
+
+void ServerAsyncImpl::CleanupAfterUpdateLMScores(UpdateLMScoresCall* call,
+                                                 bool ignored_ok) {
+  if (call->start_time != absl::InfinitePast()) {
+    update_lm_scores_admission_.Release();
+    update_lm_scores_metrics_.RecordFinished(call->start_time);
+  }
+  update_lm_scores_calls_.Release(call);
+  DecrementRpcPending();
+}
+
+void ServerAsyncImpl::RequestNextScoreText() {
+  if (!IncrementRpcPending()) {
+    GOOGLE_LOG(INFO) << "Server shutdown, so not requesting ScoreText";
+    return;
+  }
+  ScoreTextCall* call = score_text_calls_.Acquire();
+  if (!call->process_tag) {
+    // Newly created call, its tags are bound once for its lifetime.
+    call->process_tag = absl::bind_front(
+        &ServerAsyncImpl::ProcessScoreText, this, call);
+    call->finish_tag = absl::bind_front(
+        &ServerAsyncImpl::CleanupAfterScoreText, this, call);
+  }
+  service_.RequestScoreText(call->context(), call->request(),
+                            call->responder(), cq_.get(), cq_.get(),
+                            &call->process_tag);
+}
+
+void ServerAsyncImpl::ProcessScoreText(ScoreTextCall* call, bool ok) {
+  if (!ok) {
+    // Request for new RPC has failed, cleaning up and returning.
+    GOOGLE_LOG(INFO) << "ScoreText not ok.";
+    CleanupAfterScoreText(call, ok);
+    return;
+  }
+  RequestNextScoreText();  // Starts waiting for any new requests.
+  const absl::Time start_time = absl::Now();
+  ::grpc::Status status = score_text_admission_.Admit(
+      absl::FromChrono(call->context()->deadline()), start_time);
+  if (status.ok()) {
+    call->start_time = start_time;
+    status = HandleRequest(call->context(), call->request(), call->response());
+    score_text_metrics_.RecordHandled(start_time, status);
+  }
+  call->responder()->Finish(*call->response(), status, &call->finish_tag);
+}
+
+void ServerAsyncImpl::CleanupAfterScoreText(ScoreTextCall* call,
+                                            bool ignored_ok) {
+  if (call->start_time != absl::InfinitePast()) {
+    score_text_admission_.Release();
+    score_text_metrics_.RecordFinished(call->start_time);
+  }
+  score_text_calls_.Release(call);
+  DecrementRpcPending();
+}
+
+void ServerAsyncImpl::RequestNextAdaptToText() {
+  if (!IncrementRpcPending()) {
+    GOOGLE_LOG(INFO) << "Server shutdown, so not requesting AdaptToText";
+    return;
+  }
+  AdaptToTextCall* call = adapt_to_text_calls_.Acquire();
+  if (!call->process_tag) {
+    // Newly created call, its tags are bound once for its lifetime.
+    call->process_tag = absl::bind_front(
+        &ServerAsyncImpl::ProcessAdaptToText, this, call);
+    call->finish_tag = absl::bind_front(
+        &ServerAsyncImpl::CleanupAfterAdaptToText, this, call);
+  }
+  service_.RequestAdaptToText(call->context(), call->request(),
+                              call->responder(), cq_.get(), cq_.get(),
+                              &call->process_tag);
+}
+
+void ServerAsyncImpl::ProcessAdaptToText(AdaptToTextCall* call, bool ok) {
+  if (!ok) {
+    // Request for new RPC has failed, cleaning up and returning.
+    GOOGLE_LOG(INFO) << "AdaptToText not ok.";
+    CleanupAfterAdaptToText(call, ok);
+    return;
+  }
+  RequestNextAdaptToText();  // Starts waiting for any new requests.
+  const absl::Time start_time = absl::Now();
+  ::grpc::Status status = adapt_to_text_admission_.Admit(
+      absl::FromChrono(call->context()->deadline()), start_time);
+  if (status.ok()) {
+    call->start_time = start_time;
+    status = HandleRequest(call->context(), call->request(), call->response());
+    adapt_to_text_metrics_.RecordHandled(start_time, status);
+  }
+  call->responder()->Finish(*call->response(), status, &call->finish_tag);
+}
+
+void ServerAsyncImpl::CleanupAfterAdaptToText(AdaptToTextCall* call,
+                                              bool ignored_ok) {
+  if (call->start_time != absl::InfinitePast()) {
+    adapt_to_text_admission_.Release();
+    adapt_to_text_metrics_.RecordFinished(call->start_time);
+  }
+  adapt_to_text_calls_.Release(call);
+  DecrementRpcPending();
+}
+
+void ServerAsyncImpl::RequestNextGetStats() {
+  if (!IncrementRpcPending()) {
+    GOOGLE_LOG(INFO) << "Server shutdown, so not requesting GetStats";
+    return;
+  }
+  GetStatsCall* call = get_stats_calls_.Acquire();
+  if (!call->process_tag) {
+    // Newly created call, its tags are bound once for its lifetime.
+    call->process_tag = absl::bind_front(
+        &ServerAsyncImpl::ProcessGetStats, this, call);
+    call->finish_tag = absl::bind_front(
+        &ServerAsyncImpl::CleanupAfterGetStats, this, call);
+  }
+  service_.RequestGetStats(call->context(), call->request(),
+                           call->responder(), cq_.get(), cq_.get(),
+                           &call->process_tag);
+}
+
+void ServerAsyncImpl::ProcessGetStats(GetStatsCall* call, bool ok) {
+  if (!ok) {
+    // Request for new RPC has failed, cleaning up and returning.
+    GOOGLE_LOG(INFO) << "GetStats not ok.";
+    CleanupAfterGetStats(call, ok);
+    return;
+  }
+  RequestNextGetStats();  // Starts waiting for any new requests.
+  const absl::Time start_time = absl::Now();
+  call->start_time = start_time;
+  ::grpc::Status status =
+      HandleRequest(call->context(), call->request(), call->response());
+  get_stats_metrics_.RecordHandled(start_time, status);
+  call->responder()->Finish(*call->response(), status, &call->finish_tag);
+}
+
+void ServerAsyncImpl::CleanupAfterGetStats(GetStatsCall* call,
+                                           bool ignored_ok) {
+  if (call->start_time != absl::InfinitePast()) {
+    get_stats_metrics_.RecordFinished(call->start_time);
+  }
+  get_stats_calls_.Release(call);
+  DecrementRpcPending();
+}
+
+void ServerAsyncImpl::RequestNextReloadModel() {
+  if (!IncrementRpcPending()) {
+    GOOGLE_LOG(INFO) << "Server shutdown, so not requesting ReloadModel";
+    return;
+  }
+  ReloadModelCall* call = reload_model_calls_.Acquire();
+  if (!call->process_tag) {
+    // Newly created call, its tags are bound once for its lifetime.
+    call->process_tag = absl::bind_front(
+        &ServerAsyncImpl::ProcessReloadModel, this, call);
+    call->finish_tag = absl::bind_front(
+        &ServerAsyncImpl::CleanupAfterReloadModel, this, call);
+  }
+  service_.RequestReloadModel(call->context(), call->request(),
+                              call->responder(), cq_.get(), cq_.get(),
+                              &call->process_tag);
+}
+
+void ServerAsyncImpl::ProcessReloadModel(ReloadModelCall* call, bool ok) {
+  if (!ok) {
+    // Request for new RPC has failed, cleaning up and returning.
+    GOOGLE_LOG(INFO) << "ReloadModel not ok.";
+    CleanupAfterReloadModel(call, ok);
+    return;
+  }
+  RequestNextReloadModel();  // Starts waiting for any new requests.
+  const absl::Time start_time = absl::Now();
+  call->start_time = start_time;
+  ::grpc::Status status =
+      HandleRequest(call->context(), call->request(), call->response());
+  reload_model_metrics_.RecordHandled(start_time, status);
+  call->responder()->Finish(*call->response(), status, &call->finish_tag);
+}
+
+void ServerAsyncImpl::CleanupAfterReloadModel(ReloadModelCall* call,
+                                              bool ignored_ok) {
+  if (call->start_time != absl::InfinitePast()) {
+    reload_model_metrics_.RecordFinished(call->start_time);
+  }
+  reload_model_calls_.Release(call);
   DecrementRpcPending();
 }
 
@@ -265,11 +723,153 @@ absl::Status ServerAsyncImpl::BuildAndStart(
   return absl::OkStatus();
 }
 
+void ServerAsyncImpl::ConfigureAdmissionControl(
+    const AdmissionControlConfig& config) {
+  get_next_state_admission_.set_max_in_flight(
+      config.max_get_next_state_in_flight());
+  get_lm_scores_admission_.set_max_in_flight(
+      config.max_get_lm_scores_in_flight());
+  update_lm_scores_admission_.set_max_in_flight(
+      config.max_update_lm_scores_in_flight());
+  score_text_admission_.set_max_in_flight(config.max_score_text_in_flight());
+  adapt_to_text_admission_.set_max_in_flight(
+      config.max_adapt_to_text_in_flight());
+  for (AdmissionControl* admission :
+       {&get_next_state_admission_, &get_lm_scores_admission_,
+        &update_lm_scores_admission_, &score_text_admission_,
+        &adapt_to_text_admission_}) {
+    admission->set_shed_expired(config.shed_expired_requests());
+  }
+}
+
+void ServerAsyncImpl::ConfigureResponseCache(int max_size) {
+  if (max_size > 0) {
+    lm_scores_cache_ =
+        std::make_unique<ResponseCache>("lm_scores_cache", max_size);
+  } else {
+    lm_scores_cache_ = nullptr;
+  }
+}
+
+void ServerAsyncImpl::ConfigureModelReload(
+    const ModelHubConfig& model_hub_config, const ModelReloadConfig& config) {
+  model_hub_config_ = model_hub_config;
+  model_reload_config_ = config;
+}
+
+absl::Status ServerAsyncImpl::ReloadModelHub() {
+  const absl::Time start_time = absl::Now();
+  GOOGLE_LOG(INFO) << "Reloading the model hub ...";
+  ModelHubConfig model_hub_config = model_hub_config_;
+  if (checkpoint_config_.restore() && !checkpoint_config_.directory().empty()) {
+    // Carries the adaptation of the dynamic models over to the new hub by
+    // restoring them from up to date checkpoints.
+    const absl::Status status = WriteCheckpoints();
+    if (!status.ok()) {
+      ModelHubReloadFailures()->Increment();
+      return status;
+    }
+    RestoreFromCheckpoints(checkpoint_config_.directory(), &model_hub_config);
+  }
+  auto model_hub_status = models::MakeModelHub(model_hub_config);
+  if (!model_hub_status.ok()) {
+    ModelHubReloadFailures()->Increment();
+    return model_hub_status.status();
+  }
+  std::shared_ptr<models::LanguageModelHub> model_hub =
+      std::move(model_hub_status.value());
+
+  // Builds the states for the warmup contexts, which also brings the relevant
+  // parts of the models into their caches.
+  LMScores lm_scores;
+  for (const std::string& context : model_reload_config_.warmup_context()) {
+    model_hub->ExtractLMScores(model_hub->ContextState(context), &lm_scores);
+  }
+
+  // Swaps in the new hub. The old one is released here, unless it is still
+  // used by the requests in flight, in which case it is released by the last
+  // of them.
+  {
+    absl::MutexLock lock(model_hub_lock_);
+    model_hub->set_state_handle_epoch(++model_hub_epoch_);
+    model_hub_.swap(model_hub);
+  }
+  // The cached responses have been computed by the old hub.
+  if (lm_scores_cache_ != nullptr) lm_scores_cache_->Clear();
+  const absl::Duration reload_time = absl::Now() - start_time;
+  ModelHubReloads()->Increment();
+  ModelHubReloadLatency()->RecordMicros(reload_time);
+  GOOGLE_LOG(INFO) << "Reloaded the model hub in "
+                   << absl::FormatDuration(reload_time);
+  return absl::OkStatus();
+}
+
+absl::Status ServerAsyncImpl::StartModelHubReload() {
+  if (!model_reload_config_.enabled()) {
+    return absl::FailedPreconditionError("Model reload is not enabled");
+  }
+  absl::MutexLock lock(reload_lock_);
+  if (reload_in_progress_) {
+    return absl::AlreadyExistsError("Model reload is already in progress");
+  }
+  if (reload_thread_ != nullptr) {
+    reload_thread_->join();  // Previous reload has already completed.
+  }
+  reload_in_progress_ = true;
+  reload_thread_ = std::make_unique<std::thread>([this] {
+    const absl::Status status = ReloadModelHub();
+    if (!status.ok()) {
+      GOOGLE_LOG(ERROR) << "Failed to reload the model hub: "
+                        << status.ToString();
+    }
+    absl::MutexLock lock(reload_lock_);
+    reload_in_progress_ = false;
+  });
+  return absl::OkStatus();
+}
+
+void ServerAsyncImpl::ConfigureCheckpoints(const CheckpointConfig& config) {
+  checkpoint_config_ = config;
+}
+
+absl::Status ServerAsyncImpl::WriteCheckpoints() {
+  if (checkpoint_config_.directory().empty()) return absl::OkStatus();
+  absl::MutexLock checkpoint_lock(checkpoint_lock_);
+  const absl::Time start_time = absl::Now();
+  absl::StatusOr<std::vector<std::unique_ptr<models::ModelSnapshot>>>
+      snapshots;
+  {
+    absl::WriterMutexLock lock(model_update_lock_);
+    snapshots = model_hub()->SnapshotModels();
+  }
+  const absl::Time snapshot_time = absl::Now();
+  CheckpointSnapshotLatency()->RecordMicros(snapshot_time - start_time);
+  absl::Status status = snapshots.status();
+  for (int idx = 0; status.ok() && idx < snapshots->size(); ++idx) {
+    const std::unique_ptr<models::ModelSnapshot>& snapshot =
+        (*snapshots)[idx];
+    if (snapshot == nullptr) continue;
+    status = WriteSnapshot(
+        *snapshot, ModelCheckpointPath(checkpoint_config_.directory(), idx));
+  }
+  if (!status.ok()) {
+    CheckpointFailures()->Increment();
+    return status;
+  }
+  CheckpointWrites()->Increment();
+  CheckpointWriteLatency()->RecordMicros(absl::Now() - snapshot_time);
+  return absl::OkStatus();
+}
+
 absl::Status ServerAsyncImpl::ProcessRequests() {
   // Requests one RPC of each type to start the queue going.
   RequestNextGetNextState();
   RequestNextGetLMScore();
   RequestNextUpdateLMScores();
+  RequestNextScoreText();
+  RequestNextAdaptToText();
+  RequestNextGetStats();
+  RequestNextReloadModel();
 
   // Proceed to the server's main loop.
   DriveCQ();
@@ -312,22 +912,33 @@ void ServerAsyncImpl::Shutdown() {
   DriveCQ();
 }
 
+void ServerAsyncImpl::InvalidateResponseCache() {
+  // Static models never change, hence their responses remain valid.
+  if (lm_scores_cache_ != nullptr && !model_hub()->IsStatic()) {
+    lm_scores_cache_->Clear();
+  }
+}
+
 Status ServerAsyncImpl::ManageUpdateLMScores(
     const UpdateLMScoresRequest* request, LMScores* response) {
   const int utf8_sym_size = request->utf8_sym_size();
   std::vector<int> utf8_syms(utf8_sym_size);
-  int curr_state = request->state();
+  const std::shared_ptr<models::LanguageModelHub> model_hub = this->model_hub();
+  int state;
+  const Status status = ResolveRequestState(
+      model_hub.get(), request->state(), request->fallback_context(), &state);
+  if (!status.ok()) return status;
+  int curr_state = state;
   for (int i = 0; i < utf8_sym_size; ++i) {
     // Adds each symbol to vector and finds next state.
     utf8_syms[i] = request->utf8_sym(i);
-    curr_state = model_hub_->NextState(curr_state, utf8_syms[i]);
+    curr_state = model_hub->NextState(curr_state, utf8_syms[i]);
   }
-  if (!model_hub_->UpdateLMCounts(request->state(), utf8_syms,
-                                  request->count())) {
+  if (!model_hub->UpdateLMCounts(state, utf8_syms, request->count())) {
     return Status(::grpc::StatusCode::INVALID_ARGUMENT,
                   "Failed to update language model counts.");
   }
-  if (model_hub_->ExtractLMScores(curr_state, response)) {
+  if (model_hub->ExtractLMScores(curr_state, response)) {
     return Status::OK;
   } else {
     return Status(::grpc::StatusCode::INVALID_ARGUMENT,
@@ -17,18 +17,28 @@
 
 #include <memory>
 #include <string>
+#include <thread>  // NOLINT
 
 #include "absl/status/status.h"
+#include "absl/strings/string_view.h"
 #include "absl/synchronization/mutex.h"
 #include "absl/synchronization/notification.h"
+#include "absl/time/time.h"
 #include "include/grpcpp/grpcpp.h"
 #include "include/grpcpp/security/server_credentials.h"
 #include "include/grpcpp/server.h"
 #include "include/grpcpp/server_context.h"
 #include "include/grpcpp/support/async_stream.h"
+#include "include/grpcpp/support/byte_buffer.h"
+#include "mozolm/grpc/admission_control.h"
+#include "mozolm/grpc/response_cache.h"
+#include "mozolm/grpc/server_call_data.h"
+#include "mozolm/grpc/server_config.pb.h"
 #include "mozolm/grpc/service.grpc.pb.h"
 #include "mozolm/grpc/service.pb.h"
 #include "mozolm/models/language_model_hub.h"
+#include "mozolm/models/model_config.pb.h"
+#include "mozolm/utils/metrics.h"
 #include "nisaba/port/thread_pool.h"
 
 namespace mozolm {
@@ -44,7 +54,7 @@ class ServerAsyncImpl : public MozoLMService::AsyncService {
   // hub is required.
   ServerAsyncImpl(std::unique_ptr<models::LanguageModelHub> model);
   ServerAsyncImpl() = delete;
-  ~ServerAsyncImpl() override = default;
+  ~ServerAsyncImpl() override;
 
   // Initializes the server binding to the supplied port, registers the
   // service, launches the completion queue and starts the server.
@@ -52,6 +62,44 @@ class ServerAsyncImpl : public MozoLMService::AsyncService {
                              std::shared_ptr<::grpc::ServerCredentials> creds,
                              int async_pool_size);
 
+  // Configures the limits on the requests handled concurrently and the
+  // shedding of the expired requests. Should be called before the server is
+  // started.
+  void ConfigureAdmissionControl(const AdmissionControlConfig& config);
+
+  // Enables caching of up to `max_size` serialized GetLMScores responses.
+  // Should be called before the server is started.
+  void ConfigureResponseCache(int max_size);
+
+  // Enables reloading the model hub, which is then rebuilt from the given
+  // hub configuration. Should be called before the server is started.
+  void ConfigureModelReload(const ModelHubConfig& model_hub_config,
+                            const ModelReloadConfig& config);
+
+  // Builds a new model hub, warms it up and swaps it in place of the current
+  // one. The requests in flight finish on the old hub, which is released once
+  // they have all completed. Blocks until the new hub is serving requests. If
+  // restoring from the checkpoints is enabled, the dynamic models are first
+  // checkpointed and then restored from these, so that they keep their
+  // adaptation (except for the updates made while the new hub is built).
+  // Otherwise all the models are built anew from the hub configuration.
+  absl::Status ReloadModelHub();
+
+  // Runs `ReloadModelHub` on a background thread. Fails if the reload is not
+  // enabled or if another reload is still in progress.
+  absl::Status StartModelHubReload();
+
+  // Enables checkpointing the dynamic models to the configured directory.
+  // Should be called before the server is started.
+  void ConfigureCheckpoints(const CheckpointConfig& config);
+
+  // Writes the checkpoints of the dynamic models, if enabled. The model
+  // updates are only paused while the models are snapshotted, which is cheap,
+  // rather than while the snapshots are written out. Each checkpoint is
+  // written to a temporary file first, which then atomically replaces the
+  // previous checkpoint.
+  absl::Status WriteCheckpoints() ABSL_LOCKS_EXCLUDED(checkpoint_lock_);
+
   // Runs request processing loop until the server shutdown is requested.
   absl::Status ProcessRequests();
 
@@ -63,6 +111,13 @@ class ServerAsyncImpl : public MozoLMService::AsyncService {
                                const GetContextRequest* request,
                                LMScores* response);
 
+  // Returns the serialized lm_scores given the serialized GetContextRequest.
+  // This is the handler actually used by the server, which serves the
+  // responses from the cache (if enabled) whenever possible.
+  ::grpc::Status HandleSerializedRequest(::grpc::ServerContext* context,
+                                         ::grpc::ByteBuffer* request,
+                                         ::grpc::ByteBuffer* response);
+
   // Returns the next state given the context.
   ::grpc::Status HandleRequest(::grpc::ServerContext* context,
                                const GetContextRequest* request,
@@ -74,66 +129,187 @@ class ServerAsyncImpl : public MozoLMService::AsyncService {
                                const UpdateLMScoresRequest* request,
                                LMScores* response);
 
+  // Scores the text from the start state, optionally updating the counts,
+  // and returns the total bits.
+  ::grpc::Status HandleRequest(::grpc::ServerContext* context,
+                               const ScoreTextRequest* request,
+                               ScoreTextResponse* response);
+
+  // Adapts the dynamic models to the text.
+  ::grpc::Status HandleRequest(::grpc::ServerContext* context,
+                               const AdaptToTextRequest* request,
+                               AdaptToTextResponse* response);
+
+  // Returns the snapshot of the server latency histograms and counters.
+  ::grpc::Status HandleRequest(::grpc::ServerContext* context,
+                               const GetStatsRequest* request,
+                               ServerStats* response);
+
+  // Starts reloading the model hub in the background.
+  ::grpc::Status HandleRequest(::grpc::ServerContext* context,
+                               const ReloadModelRequest* request,
+                               ReloadModelResponse* response);
+
   // Returns the model symbol index associated with a state.
   int ModelStateSym(int state) {
-    return model_hub_->StateSym(state);
+    return model_hub()->StateSym(state);
   }
 
   int selected_port() const { return selected_port_; }
 
  private:
+  // Latency histograms and counters for one RPC type, registered in the
+  // global metrics registry under `rpc/<rpc_name>/`.
+  struct RpcMetrics {
+    explicit RpcMetrics(absl::string_view rpc_name);
+
+    // Records the outcome of the request whose handling started at
+    // `start_time`.
+    void RecordHandled(absl::Time start_time, const ::grpc::Status& status);
+
+    // Records the total latency once the response has been sent.
+    void RecordFinished(absl::Time start_time);
+
+    metrics::Counter* requests;        // Number of handled requests.
+    metrics::Counter* errors;          // Number of failed requests.
+    metrics::Histogram* handle_usec;   // Time spent in HandleRequest.
+    metrics::Histogram* total_usec;    // Time until the response is sent.
+  };
+
+  // Returns the current model hub. The ownership of the hub is shared with the
+  // caller, so that the hub outlives the request even if it is concurrently
+  // replaced by a reload.
+  std::shared_ptr<models::LanguageModelHub> model_hub() const
+      ABSL_LOCKS_EXCLUDED(model_hub_lock_);
+
   void DriveCQ();              // Manages a step in the operation of cq_.
   bool IncrementRpcPending();  // Locks, increments & releases counter.
   bool DecrementRpcPending();  // Locks, decrements & releases counter.
 
+  // Drops the cached responses once the model counts have been updated.
+  void InvalidateResponseCache();
+
   // Manages the UpdateLMScores steps.
   ::grpc::Status ManageUpdateLMScores(const UpdateLMScoresRequest* request,
                                       LMScores* response);
 
-  // Steps for handling a GetNextState request: 1) initializes request and
+  // Recyclable call data for each RPC type.
+  using GetNextStateCall = CallData<GetContextRequest, NextState>;
+  using GetLMScoresCall = CallData<::grpc::ByteBuffer, ::grpc::ByteBuffer>;
+  using UpdateLMScoresCall = CallData<UpdateLMScoresRequest, LMScores>;
+  using ScoreTextCall = CallData<ScoreTextRequest, ScoreTextResponse>;
+  using AdaptToTextCall = CallData<AdaptToTextRequest, AdaptToTextResponse>;
+  using GetStatsCall = CallData<GetStatsRequest, ServerStats>;
+  using ReloadModelCall = CallData<ReloadModelRequest, ReloadModelResponse>;
+
+  // Steps for handling a GetNextState request: 1) acquires the call data and
   // starts waiting for new requests; 2) processes and finishes received
-  // requests; and 3) cleans up allocated data.
+  // requests; and 3) returns the call data to the pool.
   void RequestNextGetNextState() ABSL_LOCKS_EXCLUDED(shutdown_lock_);
-  void ProcessGetNextState(
-      ::grpc::ServerContext* ctx, GetContextRequest* request,
-      ::grpc::ServerAsyncResponseWriter<NextState>* responder, bool ok)
+  void ProcessGetNextState(GetNextStateCall* call, bool ok)
       ABSL_LOCKS_EXCLUDED(shutdown_lock_);
-  void CleanupAfterGetNextState(
-      ::grpc::ServerContext* ctx, GetContextRequest* request,
-      ::grpc::ServerAsyncResponseWriter<NextState>* responder, bool ignored_ok)
+  void CleanupAfterGetNextState(GetNextStateCall* call, bool ignored_ok)
       ABSL_LOCKS_EXCLUDED(shutdown_lock_);
 
-  // Steps for handling a GetLMScore request: 1) initializes request and
+  // Steps for handling a GetLMScore request: 1) acquires the call data and
   // starts waiting for new requests; 2) processes and finishes received
-  // requests; and 3) cleans up allocated data.
+  // requests; and 3) returns the call data to the pool.
   void RequestNextGetLMScore() ABSL_LOCKS_EXCLUDED(shutdown_lock_);
-  void ProcessGetLMScore(
-      ::grpc::ServerContext* ctx, GetContextRequest* request,
-      ::grpc::ServerAsyncResponseWriter<LMScores>* responder, bool ok)
+  void ProcessGetLMScore(GetLMScoresCall* call, bool ok)
       ABSL_LOCKS_EXCLUDED(shutdown_lock_);
-  void CleanupAfterGetLMScore(
-      ::grpc::ServerContext* ctx, GetContextRequest* request,
-      ::grpc::ServerAsyncResponseWriter<LMScores>* responder, bool ignored_ok)
+  void CleanupAfterGetLMScore(GetLMScoresCall* call, bool ignored_ok)
       ABSL_LOCKS_EXCLUDED(shutdown_lock_);
 
-  // Steps for handling an UpdateLMScores request: 1) initializes request and
-  // starts waiting for new requests; 2) processes and finishes received
-  // requests; and 3) cleans up allocated data.
+  // Steps for handling an UpdateLMScores request: 1) acquires the call data
+  // and starts waiting for new requests; 2) processes and finishes received
+  // requests; and 3) returns the call data to the pool.
   void RequestNextUpdateLMScores() ABSL_LOCKS_EXCLUDED(shutdown_lock_);
-  void ProcessUpdateLMScores(
-      ::grpc::ServerContext* ctx, UpdateLMScoresRequest* request,
-      ::grpc::ServerAsyncResponseWriter<LMScores>* responder, bool ok)
+  void ProcessUpdateLMScores(UpdateLMScoresCall* call, bool ok)
       ABSL_LOCKS_EXCLUDED(shutdown_lock_);
-  void CleanupAfterUpdateLMScores(
-      ::grpc::ServerContext* ctx, UpdateLMScoresRequest* request,
-      ::grpc::ServerAsyncResponseWriter<LMScores>* responder, bool ignored_ok)
+  void CleanupAfterUpdateLMScores(UpdateLMScoresCall* call, bool ignored_ok)
       ABSL_LOCKS_EXCLUDED(shutdown_lock_);
 
-  // Model hub instance owned by the server.
-  std::unique_ptr<models::LanguageModelHub> model_hub_;
+  // Steps for handling a ScoreText request: 1) acquires the call data and
+  // starts waiting for new requests; 2) processes and finishes received
+  // requests; and 3) returns the call data to the pool.
+  void RequestNextScoreText() ABSL_LOCKS_EXCLUDED(shutdown_lock_);
+  void ProcessScoreText(ScoreTextCall* call, bool ok)
+      ABSL_LOCKS_EXCLUDED(shutdown_lock_);
+  void CleanupAfterScoreText(ScoreTextCall* call, bool ignored_ok)
+      ABSL_LOCKS_EXCLUDED(shutdown_lock_);
+
+  // Steps for handling an AdaptToText request: 1) acquires the call data and
+  // starts waiting for new requests; 2) processes and finishes received
+  // requests; and 3) returns the call data to the pool.
+  void RequestNextAdaptToText() ABSL_LOCKS_EXCLUDED(shutdown_lock_);
+  void ProcessAdaptToText(AdaptToTextCall* call, bool ok)
+      ABSL_LOCKS_EXCLUDED(shutdown_lock_);
+  void CleanupAfterAdaptToText(AdaptToTextCall* call, bool ignored_ok)
+      ABSL_LOCKS_EXCLUDED(shutdown_lock_);
+
+  // Steps for handling a GetStats request: 1) acquires the call data and
+  // starts waiting for new requests; 2) processes and finishes received
+  // requests; and 3) returns the call data to the pool.
+  void RequestNextGetStats() ABSL_LOCKS_EXCLUDED(shutdown_lock_);
+  void ProcessGetStats(GetStatsCall* call, bool ok)
+      ABSL_LOCKS_EXCLUDED(shutdown_lock_);
+  void CleanupAfterGetStats(GetStatsCall* call, bool ignored_ok)
+      ABSL_LOCKS_EXCLUDED(shutdown_lock_);
+
+  // Steps for handling a ReloadModel request: 1) acquires the call data and
+  // starts waiting for new requests; 2) processes and finishes received
+  // requests; and 3) returns the call data to the pool.
+  void RequestNextReloadModel() ABSL_LOCKS_EXCLUDED(shutdown_lock_);
+  void ProcessReloadModel(ReloadModelCall* call, bool ok)
+      ABSL_LOCKS_EXCLUDED(shutdown_lock_);
+  void CleanupAfterReloadModel(ReloadModelCall* call, bool ignored_ok)
+      ABSL_LOCKS_EXCLUDED(shutdown_lock_);
+
+  // Model hub instance, owned by the server and shared with the requests
+  // in flight. Replaced when the model is reloaded, in which case the hub
+  // gets a new epoch for its state handles.
+  mutable absl::Mutex model_hub_lock_;
+  std::shared_ptr<models::LanguageModelHub> model_hub_
+      ABSL_GUARDED_BY(model_hub_lock_);
+  int model_hub_epoch_ ABSL_GUARDED_BY(model_hub_lock_) = 0;
+
+  // Configuration for reloading the model hub.
+  ModelHubConfig model_hub_config_;
+  ModelReloadConfig model_reload_config_;
+
+  // Held shared by the requests that may update the models and exclusively
+  // while the models are snapshotted for checkpointing.
+  absl::Mutex model_update_lock_;
+
+  // Configuration for checkpointing the models. The lock serializes writing
+  // the checkpoints.
+  CheckpointConfig checkpoint_config_;
+  absl::Mutex checkpoint_lock_;
+
+  // Thread running the background reload, if any.
+  absl::Mutex reload_lock_;
+  std::unique_ptr<std::thread> reload_thread_ ABSL_GUARDED_BY(reload_lock_);
+  bool reload_in_progress_ ABSL_GUARDED_BY(reload_lock_) = false;
+
+  // Pools of the call data. These outlive the server and its completion
+  // queue, which may still refer to the calls in flight.
+  CallDataPool<GetContextRequest, NextState> get_next_state_calls_;
+  CallDataPool<::grpc::ByteBuffer, ::grpc::ByteBuffer> get_lm_scores_calls_;
+  CallDataPool<UpdateLMScoresRequest, LMScores> update_lm_scores_calls_;
+  CallDataPool<ScoreTextRequest, ScoreTextResponse> score_text_calls_;
+  CallDataPool<AdaptToTextRequest, AdaptToTextResponse> adapt_to_text_calls_;
+  CallDataPool<GetStatsRequest, ServerStats> get_stats_calls_;
+  CallDataPool<ReloadModelRequest, ReloadModelResponse> reload_model_calls_;
+
+  // Cache of the serialized GetLMScores responses, if enabled.
+  std::unique_ptr<ResponseCache> lm_scores_cache_;
 
   std::unique_ptr<::grpc::ServerCompletionQueue> cq_;
-  MozoLMService::AsyncService service_;
+
+  // The GetLMScores responses are sent as raw bytes, so that the cached
+  // responses do not need to be serialized again.
+  MozoLMService::WithRawMethod_GetLMScores<MozoLMService::AsyncService>
+      service_;
   absl::Mutex shutdown_lock_;
   std::unique_ptr<::grpc::Server> server_
       ABSL_GUARDED_BY(shutdown_lock_);
@@ -155,8 +331,36 @@ class ServerAsyncImpl : public MozoLMService::AsyncService {
 
   // Pool for asynchronous request handling.
   std::unique_ptr<nisaba::ThreadPool> async_pool_;
+
+  // Per-RPC metrics.
+  RpcMetrics get_next_state_metrics_{"GetNextState"};
+  RpcMetrics get_lm_scores_metrics_{"GetLMScores"};
+  RpcMetrics update_lm_scores_metrics_{"UpdateLMScores"};
+  RpcMetrics score_text_metrics_{"ScoreText"};
+  RpcMetrics adapt_to_text_metrics_{"AdaptToText"};
+  RpcMetrics get_stats_metrics_{"GetStats"};
+  RpcMetrics reload_model_metrics_{"ReloadModel"};
+
+  // Per-RPC admission control. The statistics requests are always admitted
+  // since they are cheap and most useful when the server is overloaded, as
+  // are the model reloads, which are handled in the background.
+  AdmissionControl get_next_state_admission_{"GetNextState"};
+  AdmissionControl get_lm_scores_admission_{"GetLMScores"};
+  AdmissionControl update_lm_scores_admission_{"UpdateLMScores"};
+  AdmissionControl score_text_admission_{"ScoreText"};
+  AdmissionControl adapt_to_text_admission_{"AdaptToText"};
 };
 
+// Returns the path of the checkpoint of the model with the given index in the
+// model hub configuration.
+std::string ModelCheckpointPath(absl::string_view directory, int model_idx);
+
+// Points the dynamic models in the hub configuration that have been
+// checkpointed to the given directory at their checkpoints, so that they are
+// restored from these rather than built anew.
+void RestoreFromCheckpoints(absl::string_view directory,
+                            ModelHubConfig* model_hub_config);
+
 }  // namespace grpc
 }  // namespace mozolm
 
@@ -14,6 +14,8 @@
 
 #include "mozolm/grpc/server_async_impl.h"
 
+#include <cmath>
+#include <filesystem>
 #include <string>
 #include <vector>
 
@@ -28,6 +30,7 @@
 #include "mozolm/models/model_config.pb.h"
 #include "mozolm/models/model_factory.h"
 #include "mozolm/models/model_storage.pb.h"
+#include "nisaba/port/file_util.h"
 #include "nisaba/port/utf8_util.h"
 
 namespace mozolm {
@@ -38,6 +41,7 @@ constexpr float kFloatDelta = 0.00001;  // Delta for float comparisons.
 
 using ::grpc::Status;
 using ::grpc::ServerContext;
+using ::protobuf_matchers::EqualsProto;
 
 class ServerAsyncImplMock : public ServerAsyncImpl {
  public:
@@ -162,5 +166,308 @@ TEST(ServerAsyncTest, UpdateLMScore_SetsLMScoreWitCountTen) {
   CheckUpdateLMScoresContent(0, 10);
 }
 
+TEST(ServerAsyncTest, GetLMScores_RebuildsExpiredStateFromFallback) {
+  ServerAsyncImplMock server;
+  ServerContext context;
+  GetContextRequest request;
+  request.set_context("abc");
+  NextState next_state;
+  ASSERT_TRUE(server.HandleRequest(&context, &request, &next_state).ok());
+
+  // A handle with a different generation of the same slot has expired.
+  request.set_state(next_state.next_state() + (int64_t{1} << 32));
+  request.set_context("");
+  request.set_fallback_context("abc");
+  LMScores response;
+  ASSERT_TRUE(server.HandleRequest(&context, &request, &response).ok());
+  EXPECT_EQ(response.probabilities_size(), 28);
+  NextState rebuilt_state;
+  ASSERT_TRUE(server.HandleRequest(&context, &request, &rebuilt_state).ok());
+  EXPECT_EQ(next_state.next_state(), rebuilt_state.next_state());
+  EXPECT_EQ('c', server.ModelStateSym(rebuilt_state.next_state()));
+}
+
+TEST(ServerAsyncTest, ScoreText_MatchesPerCharacterScores) {
+  ServerAsyncImplMock server;
+  ServerContext context;
+  ScoreTextRequest request;
+  request.set_text("abc");
+  ScoreTextResponse response;
+  ASSERT_TRUE(server.HandleRequest(&context, &request, &response).ok());
+  EXPECT_EQ(4, response.num_chars());  // Includes end-of-string.
+  EXPECT_EQ(0, response.num_oov_chars());
+  EXPECT_FALSE(response.model_is_static());
+  // Uniform model without updates: every character has probability 1/28.
+  EXPECT_NEAR(4 * std::log2(28.0), response.bits(), kFloatDelta);
+
+  // Updating the counts while scoring the same text makes it more likely.
+  request.set_update_counts(true);
+  ScoreTextResponse updated_response;
+  ASSERT_TRUE(server.HandleRequest(&context, &request, &updated_response).ok());
+  ASSERT_TRUE(server.HandleRequest(&context, &request, &updated_response).ok());
+  EXPECT_LT(updated_response.bits(), response.bits());
+}
+
+TEST(ServerAsyncTest, ScoreText_CountsOovCharacters) {
+  ServerAsyncImplMock server;
+  ServerContext context;
+  ScoreTextRequest request;
+  request.set_text("a\u05d0b");
+  ScoreTextResponse response;
+  ASSERT_TRUE(server.HandleRequest(&context, &request, &response).ok());
+  EXPECT_EQ(4, response.num_chars());
+  EXPECT_EQ(1, response.num_oov_chars());
+}
+
+TEST(ServerAsyncTest, AdaptToText_MakesTextMoreLikely) {
+  ServerAsyncImplMock server;
+  ServerContext context;
+  ScoreTextRequest score_request;
+  score_request.set_text("abc");
+  ScoreTextResponse response;
+  ASSERT_TRUE(server.HandleRequest(&context, &score_request, &response).ok());
+
+  AdaptToTextRequest request;
+  request.set_text("abc\nabc\n");
+  AdaptToTextResponse adapt_response;
+  ASSERT_TRUE(server.HandleRequest(&context, &request, &adapt_response).ok());
+  ScoreTextResponse adapted_response;
+  ASSERT_TRUE(
+      server.HandleRequest(&context, &score_request, &adapted_response).ok());
+  EXPECT_LT(adapted_response.bits(), response.bits());
+}
+
+// Returns the value of the named counter in the statistics. The counters are
+// only registered on their first use, hence the missing ones are zero.
+int64_t FindCounter(const ServerStats& stats, const std::string& name) {
+  for (const auto& counter : stats.counters()) {
+    if (counter.name() == name) return counter.value();
+  }
+  return 0;
+}
+
+TEST(ServerAsyncTest, GetStats_ReportsCountersAndHistograms) {
+  ServerAsyncImplMock server;
+  ServerContext context;
+  const GetStatsRequest stats_request;
+  ServerStats stats;
+  ASSERT_TRUE(server.HandleRequest(&context, &stats_request, &stats).ok());
+  const int64_t states_created = FindCounter(stats, "hub/states_created");
+
+  // Advancing through a new context creates a single hub state for it, since
+  // the component models are walked without intermediate hub states.
+  GetContextRequest request;
+  request.set_context("abc");
+  NextState next_state;
+  ASSERT_TRUE(server.HandleRequest(&context, &request, &next_state).ok());
+  ServerStats updated_stats;
+  ASSERT_TRUE(
+      server.HandleRequest(&context, &stats_request, &updated_stats).ok());
+  EXPECT_EQ(states_created + 1,
+            FindCounter(updated_stats, "hub/states_created"));
+
+  // The histograms are registered for all the RPCs on server creation.
+  std::vector<std::string> histogram_names;
+  for (const auto& histogram : updated_stats.histograms()) {
+    histogram_names.push_back(histogram.name());
+    EXPECT_EQ(metrics::Histogram::kNumBuckets, histogram.bucket_counts_size());
+  }
+  EXPECT_THAT(histogram_names,
+              ::testing::IsSupersetOf({"rpc/GetLMScores/handle_usec",
+                                       "rpc/GetNextState/total_usec",
+                                       "rpc/GetStats/handle_usec"}));
+}
+
+// Fetches the scores at the given state, optionally advanced by the context,
+// via the serialized request handler.
+LMScores GetSerializedLMScores(ServerAsyncImpl* server, int64_t state,
+                               const std::string& context_string = "") {
+  ServerContext context;
+  GetContextRequest request;
+  request.set_state(state);
+  request.set_context(context_string);
+  ::grpc::ByteBuffer request_bytes, response_bytes;
+  bool own_buffer;
+  EXPECT_TRUE(::grpc::SerializationTraits<GetContextRequest>::Serialize(
+      request, &request_bytes, &own_buffer).ok());
+  EXPECT_TRUE(server->HandleSerializedRequest(&context, &request_bytes,
+                                              &response_bytes).ok());
+  LMScores response;
+  EXPECT_TRUE(::grpc::SerializationTraits<LMScores>::Deserialize(
+      &response_bytes, &response).ok());
+  return response;
+}
+
+TEST(ServerAsyncTest, GetLMScores_CachedResponsesInvalidatedOnUpdate) {
+  ServerAsyncImplMock server;
+  server.ConfigureResponseCache(/*max_size=*/10);
+  ServerContext context;
+  GetContextRequest request;
+  LMScores expected;
+  ASSERT_TRUE(server.HandleRequest(&context, &request, &expected).ok());
+
+  // The second request is served from the cache.
+  const GetStatsRequest stats_request;
+  ServerStats stats;
+  ASSERT_TRUE(server.HandleRequest(&context, &stats_request, &stats).ok());
+  const int64_t hits = FindCounter(stats, "lm_scores_cache/hits");
+  EXPECT_THAT(GetSerializedLMScores(&server, 0), EqualsProto(expected));
+  EXPECT_THAT(GetSerializedLMScores(&server, 0), EqualsProto(expected));
+  stats.Clear();
+  ASSERT_TRUE(server.HandleRequest(&context, &stats_request, &stats).ok());
+  EXPECT_EQ(hits + 1, FindCounter(stats, "lm_scores_cache/hits"));
+
+  // Updating the counts of the dynamic model invalidates the cache.
+  UpdateLMScoresRequest update_request;
+  update_request.add_utf8_sym('a');
+  update_request.set_count(10);
+  LMScores updated;
+  ASSERT_TRUE(server.HandleRequest(&context, &update_request, &updated).ok());
+  ASSERT_TRUE(server.HandleRequest(&context, &request, &expected).ok());
+  EXPECT_THAT(GetSerializedLMScores(&server, 0), EqualsProto(expected));
+  EXPECT_NEAR(28.0 + 10, expected.normalization(), kFloatDelta);
+}
+
+TEST(ServerAsyncTest, GetLMScores_CachedResponsesForContext) {
+  ServerAsyncImplMock server;
+  server.ConfigureResponseCache(/*max_size=*/10);
+  ServerContext context;
+  GetContextRequest request;
+  request.set_context("abc");
+  LMScores expected;
+  ASSERT_TRUE(server.HandleRequest(&context, &request, &expected).ok());
+
+  // Repeating the request with a multi-symbol context reaches the same state,
+  // hence the second request is served from the cache.
+  const GetStatsRequest stats_request;
+  ServerStats stats;
+  ASSERT_TRUE(server.HandleRequest(&context, &stats_request, &stats).ok());
+  const int64_t hits = FindCounter(stats, "lm_scores_cache/hits");
+  EXPECT_THAT(GetSerializedLMScores(&server, 0, "abc"), EqualsProto(expected));
+  EXPECT_THAT(GetSerializedLMScores(&server, 0, "abc"), EqualsProto(expected));
+  stats.Clear();
+  ASSERT_TRUE(server.HandleRequest(&context, &stats_request, &stats).ok());
+  EXPECT_EQ(hits + 1, FindCounter(stats, "lm_scores_cache/hits"));
+}
+
+TEST(ServerAsyncTest, ReloadModel_ReplacesUpdatedModel) {
+  ServerAsyncImplMock server;
+  ServerContext context;
+  const ReloadModelRequest reload_request;
+  ReloadModelResponse reload_response;
+  EXPECT_EQ(::grpc::StatusCode::FAILED_PRECONDITION,
+            server.HandleRequest(&context, &reload_request, &reload_response)
+                .error_code());
+  ModelReloadConfig reload_config;
+  reload_config.set_enabled(true);
+  reload_config.add_warmup_context("ab");
+  server.ConfigureModelReload(ModelHubConfig(), reload_config);
+
+  // Updates the counts of the dynamic model.
+  GetContextRequest request;
+  request.set_context("a");
+  NextState next_state;
+  ASSERT_TRUE(server.HandleRequest(&context, &request, &next_state).ok());
+  UpdateLMScoresRequest update_request;
+  update_request.set_state(next_state.next_state());
+  update_request.add_utf8_sym('a');
+  update_request.set_count(10);
+  LMScores scores;
+  ASSERT_TRUE(server.HandleRequest(&context, &update_request, &scores).ok());
+  EXPECT_NEAR(28.0 + 10, scores.normalization(), kFloatDelta);
+
+  // The reloaded model starts afresh. The handles issued before the reload
+  // are rebuilt from their fallback context.
+  const GetStatsRequest stats_request;
+  ServerStats stats;
+  ASSERT_TRUE(server.HandleRequest(&context, &stats_request, &stats).ok());
+  const int64_t reloads = FindCounter(stats, "model_hub/reloads");
+  ASSERT_OK(server.ReloadModelHub());
+  request.Clear();
+  request.set_state(next_state.next_state());
+  // Without a fallback context the expired handle cannot be rebuilt.
+  EXPECT_EQ(::grpc::StatusCode::NOT_FOUND,
+            server.HandleRequest(&context, &request, &scores).error_code());
+  request.set_fallback_context("a");
+  ASSERT_TRUE(server.HandleRequest(&context, &request, &scores).ok());
+  EXPECT_NEAR(28.0, scores.normalization(), kFloatDelta);
+  stats.Clear();
+  ASSERT_TRUE(server.HandleRequest(&context, &stats_request, &stats).ok());
+  EXPECT_EQ(reloads + 1, FindCounter(stats, "model_hub/reloads"));
+
+  // Reloading via the RPC happens in the background.
+  EXPECT_TRUE(
+      server.HandleRequest(&context, &reload_request, &reload_response).ok());
+}
+
+// Returns the probability of the symbol in the scores, -1 if not found.
+double FindProb(const LMScores& scores, const std::string& symbol) {
+  for (int i = 0; i < scores.symbols_size(); ++i) {
+    if (scores.symbols(i) == symbol) return scores.probabilities(i);
+  }
+  return -1.0;
+}
+
+TEST(ServerAsyncTest, ReloadModel_RestoresAdaptedModelFromCheckpoint) {
+  const auto corpus_status =
+      nisaba::file::WriteTempTextFile("reload_corpus.txt", "abc");
+  ASSERT_OK(corpus_status.status());
+  ModelHubConfig hub_config;
+  ModelConfig* model_config = hub_config.add_model_config();
+  model_config->set_type(ModelConfig::PPM_AS_FST);
+  ModelStorage* storage = model_config->mutable_storage();
+  storage->set_model_file(corpus_status.value());
+  storage->mutable_ppm_options()->set_max_order(2);
+  storage->mutable_ppm_options()->set_static_model(false);
+  const std::filesystem::path checkpoint_dir =
+      std::filesystem::temp_directory_path() / "server_reload_checkpoints";
+  std::filesystem::create_directories(checkpoint_dir);
+
+  for (const bool restore : {false, true}) {
+    SCOPED_TRACE(restore);
+    ServerAsyncImpl server(models::MakeModelHub(hub_config).value());
+    ModelReloadConfig reload_config;
+    reload_config.set_enabled(true);
+    server.ConfigureModelReload(hub_config, reload_config);
+    CheckpointConfig checkpoint_config;
+    checkpoint_config.set_directory(checkpoint_dir.string());
+    checkpoint_config.set_restore(restore);
+    server.ConfigureCheckpoints(checkpoint_config);
+
+    // Adapts the model, so that "a" becomes more likely after "a".
+    ServerContext context;
+    GetContextRequest request;
+    request.set_context("a");
+    NextState next_state;
+    ASSERT_TRUE(server.HandleRequest(&context, &request, &next_state).ok());
+    request.Clear();
+    request.set_state(next_state.next_state());
+    LMScores initial_scores;
+    ASSERT_TRUE(
+        server.HandleRequest(&context, &request, &initial_scores).ok());
+    UpdateLMScoresRequest update_request;
+    update_request.set_state(next_state.next_state());
+    update_request.add_utf8_sym('a');
+    update_request.set_count(10);
+    LMScores adapted_scores;
+    ASSERT_TRUE(
+        server.HandleRequest(&context, &update_request, &adapted_scores).ok());
+    ASSERT_GT(FindProb(adapted_scores, "a"), FindProb(initial_scores, "a"));
+
+    // The adaptation is only kept across the reload if the model is restored
+    // from its checkpoint.
+    ASSERT_OK(server.ReloadModelHub());
+    request.set_fallback_context("a");
+    LMScores scores;
+    ASSERT_TRUE(server.HandleRequest(&context, &request, &scores).ok());
+    EXPECT_NEAR(FindProb(restore ? adapted_scores : initial_scores, "a"),
+                FindProb(scores, "a"), kFloatDelta);
+    EXPECT_EQ(restore, std::filesystem::exists(ModelCheckpointPath(
+                           checkpoint_dir.string(), /*model_idx=*/0)));
+  }
+  EXPECT_LT(0, std::filesystem::remove_all(checkpoint_dir));
+  EXPECT_TRUE(std::filesystem::remove(corpus_status.value()));
+}
+
 }  // namespace grpc
 }  // namespace mozolm
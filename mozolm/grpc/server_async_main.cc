@@ -94,6 +94,12 @@ ABSL_FLAG(std::string, server_config_file, "",
 ABSL_FLAG(int, async_pool_size, 0,
           "Number of threads for handling requests asynchronously.");
 
+ABSL_FLAG(int, stats_log_period_sec, 0,
+          "If positive, period in seconds for logging the server statistics.");
+
+ABSL_FLAG(int, lm_scores_cache_size, 0,
+          "If positive, maximum number of cached LM scores responses.");
+
 ABSL_FLAG(std::string, tls_server_key_file, "",
           "Private server key for SSL/TLS credentials.");
 
@@ -158,6 +164,13 @@ absl::Status InitConfigFromFlags(ServerConfig *config) {
   if (absl::GetFlag(FLAGS_async_pool_size) > 0) {
     config->set_async_pool_size(absl::GetFlag(FLAGS_async_pool_size));
   }
+  if (absl::GetFlag(FLAGS_stats_log_period_sec) > 0) {
+    config->set_stats_log_period_sec(
+        absl::GetFlag(FLAGS_stats_log_period_sec));
+  }
+  if (absl::GetFlag(FLAGS_lm_scores_cache_size) > 0) {
+    config->set_lm_scores_cache_size(absl::GetFlag(FLAGS_lm_scores_cache_size));
+  }
   InitConfigDefaults(config);
 
   // Initialize credentials.
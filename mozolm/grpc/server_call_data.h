@@ -0,0 +1,159 @@
+// Copyright 2026 MozoLM Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Recyclable state of the unary calls handled by the asynchronous server.
+
+#ifndef MOZOLM_MOZOLM_GRPC_SERVER_CALL_DATA_H_
+#define MOZOLM_MOZOLM_GRPC_SERVER_CALL_DATA_H_
+
+#include <functional>
+#include <memory>
+#include <optional>
+#include <vector>
+
+#include "google/protobuf/arena.h"
+#include "absl/base/thread_annotations.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/time/time.h"
+#include "include/grpcpp/server_context.h"
+#include "include/grpcpp/support/async_unary_call.h"
+
+namespace mozolm {
+namespace grpc {
+
+// State of a single unary RPC: the server context, the request and response
+// messages (or raw byte buffers) and the responder, together with the
+// completion queue tags that drive the call. The call data is meant to be
+// recycled across the requests by `CallDataPool`: the context and the
+// responder are constructed in place, the messages are allocated on an arena
+// that is reset rather than freed between the requests, and the tags are only
+// bound once.
+template <typename Request, typename Response>
+class CallData {
+ public:
+  // Completion queue tag, run with the status of the completed operation.
+  using Tag = std::function<void(bool)>;
+
+  CallData()
+      : arena_(MakeArenaOptions(initial_block_, sizeof(initial_block_))) {}
+  CallData(const CallData &) = delete;
+  CallData &operator=(const CallData &) = delete;
+
+  // Prepares the call for receiving a new request.
+  void Start() {
+    context_.emplace();
+    responder_.emplace(&context_.value());
+    request_ = google::protobuf::Arena::Create<Request>(&arena_);
+    response_ = google::protobuf::Arena::Create<Response>(&arena_);
+    start_time = absl::InfinitePast();
+  }
+
+  // Releases the state of the finished request, keeping the memory of the
+  // arena's initial block for the next one.
+  void Finish() {
+    responder_.reset();
+    context_.reset();
+    request_ = nullptr;
+    response_ = nullptr;
+    arena_.Reset();
+  }
+
+  ::grpc::ServerContext *context() { return &context_.value(); }
+  Request *request() { return request_; }
+  Response *response() { return response_; }
+  ::grpc::ServerAsyncResponseWriter<Response> *responder() {
+    return &responder_.value();
+  }
+
+  // Tags run when the request has been received and when the response has
+  // been sent, respectively. Empty until bound by the server.
+  Tag process_tag;
+  Tag finish_tag;
+
+  // Time when the handling of the request has started, infinite past if the
+  // request has not been handled.
+  absl::Time start_time = absl::InfinitePast();
+
+ private:
+  // Size of the arena block embedded in the call data, enough for the typical
+  // requests and responses. Larger messages spill over to the heap.
+  static constexpr int kInitialBlockSize = 4096;
+
+  static google::protobuf::ArenaOptions MakeArenaOptions(char *block,
+                                                        size_t size) {
+    google::protobuf::ArenaOptions options;
+    options.initial_block = block;
+    options.initial_block_size = size;
+    return options;
+  }
+
+  alignas(8) char initial_block_[kInitialBlockSize];
+  google::protobuf::Arena arena_;
+  std::optional<::grpc::ServerContext> context_;
+  std::optional<::grpc::ServerAsyncResponseWriter<Response>> responder_;
+  Request *request_ = nullptr;    // Owned by the arena.
+  Response *response_ = nullptr;  // Owned by the arena.
+};
+
+// Thread-safe pool of the call data for a single RPC type. The pool grows to
+// the maximum number of calls in flight and never shrinks.
+template <typename Request, typename Response>
+class CallDataPool {
+ public:
+  using Call = CallData<Request, Response>;
+
+  CallDataPool() = default;
+  CallDataPool(const CallDataPool &) = delete;
+  CallDataPool &operator=(const CallDataPool &) = delete;
+
+  // Returns a started call, either recycled or newly created.
+  Call *Acquire() ABSL_LOCKS_EXCLUDED(lock_) {
+    Call *call;
+    {
+      absl::MutexLock lock(lock_);
+      if (free_calls_.empty()) {
+        calls_.push_back(std::make_unique<Call>());
+        call = calls_.back().get();
+      } else {
+        call = free_calls_.back();
+        free_calls_.pop_back();
+      }
+    }
+    call->Start();
+    return call;
+  }
+
+  // Finishes the call and returns it to the pool.
+  void Release(Call *call) ABSL_LOCKS_EXCLUDED(lock_) {
+    call->Finish();
+    absl::MutexLock lock(lock_);
+    free_calls_.push_back(call);
+  }
+
+  // Total number of calls created by the pool.
+  int size() const ABSL_LOCKS_EXCLUDED(lock_) {
+    absl::MutexLock lock(lock_);
+    return calls_.size();
+  }
+
+ private:
+  mutable absl::Mutex lock_;
+  std::vector<std::unique_ptr<Call>> calls_ ABSL_GUARDED_BY(lock_);
+  std::vector<Call *> free_calls_ ABSL_GUARDED_BY(lock_);
+};
+
+}  // namespace grpc
+}  // namespace mozolm
+
+#endif  // MOZOLM_MOZOLM_GRPC_SERVER_CALL_DATA_H_
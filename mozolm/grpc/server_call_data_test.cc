@@ -0,0 +1,71 @@
+// Copyright 2026 MozoLM Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "mozolm/grpc/server_call_data.h"
+
+#include <string>
+
+#include "gtest/gtest.h"
+#include "absl/time/time.h"
+#include "mozolm/grpc/service.pb.h"
+
+namespace mozolm {
+namespace grpc {
+namespace {
+
+using TestCall = CallData<GetContextRequest, NextState>;
+
+TEST(ServerCallDataTest, CallsAreRecycled) {
+  CallDataPool<GetContextRequest, NextState> pool;
+  TestCall* call = pool.Acquire();
+  ASSERT_NE(nullptr, call->context());
+  ASSERT_NE(nullptr, call->responder());
+  EXPECT_EQ(absl::InfinitePast(), call->start_time);
+  call->request()->set_context("abc");
+  call->response()->set_next_state(3);
+  call->start_time = absl::Now();
+  pool.Release(call);
+
+  // The released call is reused, starting afresh.
+  TestCall* recycled_call = pool.Acquire();
+  EXPECT_EQ(call, recycled_call);
+  EXPECT_EQ(1, pool.size());
+  EXPECT_TRUE(recycled_call->request()->context().empty());
+  EXPECT_EQ(0, recycled_call->response()->next_state());
+  EXPECT_EQ(absl::InfinitePast(), recycled_call->start_time);
+
+  // The pool grows with the number of calls in flight.
+  TestCall* another_call = pool.Acquire();
+  EXPECT_NE(recycled_call, another_call);
+  EXPECT_EQ(2, pool.size());
+  pool.Release(recycled_call);
+  pool.Release(another_call);
+  EXPECT_EQ(2, pool.size());
+}
+
+TEST(ServerCallDataTest, LargeMessagesSpillFromInitialBlock) {
+  CallDataPool<GetContextRequest, NextState> pool;
+  TestCall* call = pool.Acquire();
+  const std::string long_context(100000, 'a');
+  call->request()->set_context(long_context);
+  EXPECT_EQ(long_context, call->request()->context());
+  pool.Release(call);
+  call = pool.Acquire();
+  EXPECT_TRUE(call->request()->context().empty());
+  pool.Release(call);
+}
+
+}  // namespace
+}  // namespace grpc
+}  // namespace mozolm
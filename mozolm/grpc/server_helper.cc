@@ -20,7 +20,9 @@
 #include "absl/memory/memory.h"
 #include "absl/synchronization/notification.h"
 #include "include/grpcpp/security/server_credentials.h"
+#include "mozolm/models/model_config.pb.h"
 #include "mozolm/models/model_factory.h"
+#include "mozolm/utils/metrics.h"
 #include "nisaba/port/status_macros.h"
 
 namespace mozolm {
@@ -78,13 +80,41 @@ void ProcessRequests(ServerAsyncImpl *server, absl::Notification *cq_ready) {
   }
 }
 
+// Worker thread for periodically logging the server statistics until stopped.
+void LogStats(absl::Duration period, absl::Notification *stop) {
+  while (!stop->WaitForNotificationWithTimeout(period)) {
+    const metrics::MetricsSnapshot stats =
+        metrics::MetricsRegistry::Global().Snapshot();
+    GOOGLE_LOG(INFO) << "Server statistics:\n" << stats.ToString();
+  }
+}
+
+// Worker thread for periodically checkpointing the models until stopped.
+void WriteCheckpoints(ServerAsyncImpl *server, absl::Duration period,
+                      absl::Notification *stop) {
+  while (!stop->WaitForNotificationWithTimeout(period)) {
+    const absl::Status status = server->WriteCheckpoints();
+    if (!status.ok()) {
+      GOOGLE_LOG(ERROR) << "Failed to checkpoint the models: "
+                        << status.ToString();
+    }
+  }
+}
+
 }  // namespace
 
 absl::Status ServerHelper::Init(const ServerConfig& config) {
   if (server_) return absl::InternalError("Server already active");
 
-  // Initialize the model hub.
-  auto model_status = models::MakeModelHub(config.model_hub_config());
+  // Initialize the model hub, restoring the dynamic models from their
+  // checkpoints if requested. Reading a checkpoint is much faster than
+  // training the model anew.
+  ModelHubConfig model_hub_config = config.model_hub_config();
+  const CheckpointConfig &checkpoint = config.checkpoint();
+  if (checkpoint.restore() && !checkpoint.directory().empty()) {
+    RestoreFromCheckpoints(checkpoint.directory(), &model_hub_config);
+  }
+  auto model_status = models::MakeModelHub(model_hub_config);
   if (!model_status.ok()) return model_status.status();
 
   // Configure the authentication.
@@ -92,7 +122,16 @@ absl::Status ServerHelper::Init(const ServerConfig& config) {
       config);
 
   // Initialize and start the server.
+  stats_log_period_ = absl::Seconds(config.stats_log_period_sec());
+  checkpoint_period_ = checkpoint.directory().empty()
+                           ? absl::ZeroDuration()
+                           : absl::Seconds(checkpoint.period_sec());
   server_ = std::make_unique<ServerAsyncImpl>(std::move(model_status.value()));
+  server_->ConfigureAdmissionControl(config.admission_control());
+  server_->ConfigureResponseCache(config.lm_scores_cache_size());
+  server_->ConfigureModelReload(config.model_hub_config(),
+                                config.model_reload());
+  server_->ConfigureCheckpoints(checkpoint);
   return server_->BuildAndStart(config.address_uri(), creds,
                                 config.async_pool_size());
 }
@@ -103,6 +142,17 @@ absl::Status ServerHelper::Run(bool wait_till_terminated) {
   server_thread_ =
       std::make_unique<std::thread>(&ProcessRequests, server_.get(), &cq_ready);
   cq_ready.WaitForNotification();
+  if (stats_log_period_ > absl::ZeroDuration()) {
+    stop_stats_logging_ = std::make_unique<absl::Notification>();
+    stats_thread_ = std::make_unique<std::thread>(
+        &LogStats, stats_log_period_, stop_stats_logging_.get());
+  }
+  if (checkpoint_period_ > absl::ZeroDuration()) {
+    stop_checkpoints_ = std::make_unique<absl::Notification>();
+    checkpoint_thread_ = std::make_unique<std::thread>(
+        &WriteCheckpoints, server_.get(), checkpoint_period_,
+        stop_checkpoints_.get());
+  }
   if (wait_till_terminated) {
     server_thread_->join();
   }
@@ -116,6 +166,25 @@ void ServerHelper::Shutdown() {
       if (server_thread_->joinable()) server_thread_->join();
       server_thread_.reset();
     }
+    if (stats_thread_) {
+      stop_stats_logging_->Notify();
+      if (stats_thread_->joinable()) stats_thread_->join();
+      stats_thread_.reset();
+      stop_stats_logging_.reset();
+    }
+    if (checkpoint_thread_) {
+      stop_checkpoints_->Notify();
+      if (checkpoint_thread_->joinable()) checkpoint_thread_->join();
+      checkpoint_thread_.reset();
+      stop_checkpoints_.reset();
+    }
+    // Checkpoints the final state of the models, all the updates to which
+    // have completed by now.
+    const absl::Status status = server_->WriteCheckpoints();
+    if (!status.ok()) {
+      GOOGLE_LOG(ERROR) << "Failed to checkpoint the models on shutdown: "
+                        << status.ToString();
+    }
     server_.reset();
   }
 }
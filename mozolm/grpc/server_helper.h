@@ -19,6 +19,8 @@
 #include <thread>
 
 #include "absl/status/status.h"
+#include "absl/synchronization/notification.h"
+#include "absl/time/time.h"
 #include "mozolm/grpc/server_async_impl.h"
 #include "mozolm/grpc/server_config.pb.h"
 
@@ -51,6 +53,23 @@ class ServerHelper {
 
   // Thread for running the main processing loop.
   std::unique_ptr<std::thread> server_thread_;
+
+  // Period for dumping the server statistics to the log, disabled if zero.
+  absl::Duration stats_log_period_ = absl::ZeroDuration();
+
+  // Thread for periodically logging the server statistics and the
+  // notification for stopping it.
+  std::unique_ptr<std::thread> stats_thread_;
+  std::unique_ptr<absl::Notification> stop_stats_logging_;
+
+  // Period for checkpointing the models, disabled if zero. The models are
+  // checkpointed on shutdown regardless, if the checkpoints are enabled.
+  absl::Duration checkpoint_period_ = absl::ZeroDuration();
+
+  // Thread for periodically checkpointing the models and the notification for
+  // stopping it.
+  std::unique_ptr<std::thread> checkpoint_thread_;
+  std::unique_ptr<absl::Notification> stop_checkpoints_;
 };
 
 // Sets default parameters for the server if they have not already been set.
@@ -145,6 +145,35 @@ TEST_F(ServerHelperTest, CheckStartWithValidTlsCreds) {
   server.Shutdown();
 }
 
+// Checkpoints the dynamic model on shutdown and restores it from the
+// checkpoint, rather than from the original model file, on restart.
+TEST_F(ServerHelperTest, CheckpointAndRestore) {
+  const std::filesystem::path checkpoint_dir =
+      std::filesystem::temp_directory_path() / "server_helper_checkpoints";
+  std::filesystem::create_directories(checkpoint_dir);
+  CheckpointConfig *checkpoint = config_.mutable_checkpoint();
+  checkpoint->set_directory(checkpoint_dir.string());
+  checkpoint->set_period_sec(1);
+  ServerHelper server;
+  ASSERT_OK(server.Init(config_));
+  EXPECT_OK(server.Run(/* wait_till_terminated= */false));
+  server.Shutdown();
+  const std::string checkpoint_path =
+      ModelCheckpointPath(checkpoint_dir.string(), /* model_idx= */0);
+  EXPECT_TRUE(std::filesystem::exists(checkpoint_path));
+  EXPECT_FALSE(std::filesystem::exists(checkpoint_path + ".tmp"));
+
+  // The original model file is not needed when restoring from the checkpoint.
+  config_.mutable_model_hub_config()->mutable_model_config(0)->
+      mutable_storage()->set_model_file("nonexistent.txt");
+  EXPECT_FALSE(server.Init(config_).ok());
+  server.Shutdown();
+  checkpoint->set_restore(true);
+  ASSERT_OK(server.Init(config_));
+  server.Shutdown();
+  EXPECT_LT(0, std::filesystem::remove_all(checkpoint_dir));
+}
+
 }  // namespace
 }  // namespace grpc
 }  // namespace mozolm
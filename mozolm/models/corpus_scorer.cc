@@ -0,0 +1,247 @@
+// Copyright 2026 MozoLM Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "mozolm/models/corpus_scorer.h"
+
+#include <cmath>
+#include <deque>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "google/protobuf/stubs/logging.h"
+#include "absl/status/status.h"
+#include "absl/strings/str_cat.h"
+#include "absl/base/thread_annotations.h"
+#include "absl/synchronization/blocking_counter.h"
+#include "absl/synchronization/mutex.h"
+#include "mozolm/models/model_factory.h"
+#include "nisaba/port/status_macros.h"
+#include "nisaba/port/thread_pool.h"
+#include "nisaba/port/timer.h"
+#include "nisaba/port/utf8_util.h"
+
+namespace mozolm {
+namespace models {
+namespace {
+
+constexpr int kNumCodepoints = 143859;   // Total possible Unicode codepoints.
+constexpr float kMixEpsilon = 0.00000001;  // Amount to weight uniform prob.
+
+// Number of corpus lines handed to a scoring thread at a time.
+constexpr int kLinesPerBatch = 256;
+
+// Maximum number of batches waiting to be scored, per scoring thread.
+constexpr int kMaxQueuedBatchesPerThread = 4;
+
+// Returns bits for the given model probability. Mixes with a uniform to
+// ensure full coverage, i.e., probability = (1-\epsilon) P + \epsilon U, where
+// P is the model probability and U is a uniform distribution over unicode
+// codepoints.
+double CalculateBits(double model_prob) {
+  double prob =
+      static_cast<double>(kMixEpsilon) / static_cast<double>(kNumCodepoints);
+  prob += model_prob * (1.0 - kMixEpsilon);
+  return -std::log2(prob);
+}
+
+// Scores the corpus one line at a time, as it is being read.
+absl::Status ScoreCorpusSequentially(const std::string &corpus_file,
+                                     LanguageModelHub *hub,
+                                     CorpusScores *corpus_scores) {
+  std::ifstream infile(corpus_file);
+  if (!infile.is_open()) {
+    return absl::NotFoundError(absl::StrCat("Failed to open ", corpus_file));
+  }
+  std::string line;
+  while (std::getline(infile, line)) {
+    ASSIGN_OR_RETURN(const TextScores scores,
+                     ScoreText(line, /*update_counts=*/true, hub));
+    corpus_scores->scores += scores;
+    ++corpus_scores->num_lines;
+  }
+  return absl::OkStatus();
+}
+
+// Bounded queue of the batches of corpus lines, filled by the thread reading
+// the corpus and drained by the scoring threads.
+class LineBatchQueue {
+ public:
+  explicit LineBatchQueue(int max_batches) : max_batches_(max_batches) {}
+
+  // Blocks until there is room in the queue, then adds the batch.
+  void Push(std::vector<std::string> batch) {
+    absl::MutexLock lock(mutex_);
+    mutex_.Await(absl::Condition(this, &LineBatchQueue::HasRoom));
+    batches_.push_back(std::move(batch));
+  }
+
+  // Blocks until a batch is available and moves it out. Returns false once
+  // the queue has been closed and all the batches taken.
+  bool Pop(std::vector<std::string> *batch) {
+    absl::MutexLock lock(mutex_);
+    mutex_.Await(absl::Condition(this, &LineBatchQueue::HasBatchOrClosed));
+    if (batches_.empty()) return false;
+    *batch = std::move(batches_.front());
+    batches_.pop_front();
+    return true;
+  }
+
+  // Signals that no more batches will be added.
+  void Close() {
+    absl::MutexLock lock(mutex_);
+    closed_ = true;
+  }
+
+ private:
+  bool HasRoom() const ABSL_EXCLUSIVE_LOCKS_REQUIRED(mutex_) {
+    return batches_.size() < max_batches_;
+  }
+  bool HasBatchOrClosed() const ABSL_EXCLUSIVE_LOCKS_REQUIRED(mutex_) {
+    return !batches_.empty() || closed_;
+  }
+
+  const int max_batches_;
+  absl::Mutex mutex_;
+  std::deque<std::vector<std::string>> batches_ ABSL_GUARDED_BY(mutex_);
+  bool closed_ ABSL_GUARDED_BY(mutex_) = false;
+};
+
+// Streams the corpus to the scoring threads, one per hub, in batches of lines
+// through a bounded queue, so that only a few batches per thread are held in
+// memory at any time. The corpus is read by the calling thread.
+absl::Status ScoreCorpusInParallel(
+    const std::string &corpus_file,
+    const std::vector<std::unique_ptr<LanguageModelHub>> &hubs,
+    CorpusScores *corpus_scores) {
+  std::ifstream infile(corpus_file);
+  if (!infile.is_open()) {
+    return absl::NotFoundError(absl::StrCat("Failed to open ", corpus_file));
+  }
+  const int num_shards = hubs.size();
+  LineBatchQueue queue(kMaxQueuedBatchesPerThread * num_shards);
+  std::vector<absl::Status> shard_status(num_shards);
+  std::vector<TextScores> shard_scores(num_shards);
+  nisaba::ThreadPool pool(num_shards);
+  absl::BlockingCounter shards_pending(num_shards);
+  for (int shard = 0; shard < num_shards; ++shard) {
+    pool.Schedule([&queue, &hubs, &shard_status, &shard_scores,
+                   &shards_pending, shard]() {
+      // Keeps draining the queue after an error, so that the reader is not
+      // blocked.
+      std::vector<std::string> batch;
+      while (queue.Pop(&batch)) {
+        for (const std::string &line : batch) {
+          if (!shard_status[shard].ok()) break;
+          const auto scores = ScoreText(line, /*update_counts=*/false,
+                                        hubs[shard].get());
+          if (scores.ok()) {
+            shard_scores[shard] += scores.value();
+          } else {
+            shard_status[shard] = scores.status();
+          }
+        }
+      }
+      shards_pending.DecrementCount();
+    });
+  }
+
+  std::vector<std::string> batch;
+  std::string line;
+  while (std::getline(infile, line)) {
+    batch.push_back(std::move(line));
+    ++corpus_scores->num_lines;
+    if (batch.size() == kLinesPerBatch) {
+      queue.Push(std::move(batch));
+      batch.clear();
+    }
+  }
+  if (!batch.empty()) queue.Push(std::move(batch));
+  queue.Close();
+  shards_pending.Wait();
+  for (int shard = 0; shard < num_shards; ++shard) {
+    RETURN_IF_ERROR(shard_status[shard]);
+    corpus_scores->scores += shard_scores[shard];
+  }
+  return absl::OkStatus();
+}
+
+}  // namespace
+
+absl::StatusOr<TextScores> ScoreText(const std::string &text,
+                                     bool update_counts,
+                                     LanguageModelHub *hub) {
+  const std::vector<std::string> utf8_chars =
+      nisaba::utf8::StrSplitByChar(text);
+  const std::vector<int> utf8_syms =
+      nisaba::utf8::StrSplitByCharToUnicode(text);
+  if (utf8_chars.size() != utf8_syms.size()) {
+    return absl::InvalidArgumentError("Invalid UTF-8 text");
+  }
+  TextScores scores;
+  int state = 0;  // Start state.
+  for (int i = 0; i <= utf8_syms.size(); ++i) {
+    // By convention, end-of-string is symbol zero.
+    const double prob = std::exp(
+        -hub->SymLMScore(state, i < utf8_syms.size() ? utf8_syms[i] : 0));
+    scores.bits += CalculateBits(prob);
+    if (prob <= 0.0) ++scores.num_oov_chars;
+    ++scores.num_chars;
+    if (i == utf8_syms.size()) break;
+    if (update_counts &&
+        !hub->UpdateLMCounts(state, {utf8_syms[i]}, /*count=*/1)) {
+      return absl::InvalidArgumentError(
+          "Failed to update language model counts");
+    }
+    state = hub->NextState(state, utf8_syms[i]);
+  }
+  return scores;
+}
+
+absl::StatusOr<CorpusScores> ScoreCorpus(const ModelHubConfig &config,
+                                         const std::string &corpus_file,
+                                         int num_threads) {
+  std::vector<std::unique_ptr<LanguageModelHub>> hubs;
+  ASSIGN_OR_RETURN(std::unique_ptr<LanguageModelHub> hub,
+                   MakeModelHub(config));
+  hubs.push_back(std::move(hub));
+  CorpusScores corpus_scores;
+  if (num_threads > 1 && hubs[0]->IsStatic()) {
+    // Each thread requires its own hub since the hub states are not shared.
+    GOOGLE_LOG(INFO) << "Initializing " << num_threads - 1
+                     << " more model hub instances ...";
+    for (int i = 1; i < num_threads; ++i) {
+      ASSIGN_OR_RETURN(hub, MakeModelHub(config));
+      hubs.push_back(std::move(hub));
+    }
+    corpus_scores.num_threads = num_threads;
+    nisaba::Timer timer;
+    RETURN_IF_ERROR(ScoreCorpusInParallel(corpus_file, hubs, &corpus_scores));
+    corpus_scores.elapsed_sec = timer.ElapsedMillis() / 1000.0;
+  } else {
+    if (num_threads > 1) {
+      GOOGLE_LOG(INFO) << "Dynamic models are scored sequentially";
+    }
+    nisaba::Timer timer;
+    RETURN_IF_ERROR(ScoreCorpusSequentially(corpus_file, hubs[0].get(),
+                                            &corpus_scores));
+    corpus_scores.elapsed_sec = timer.ElapsedMillis() / 1000.0;
+  }
+  return corpus_scores;
+}
+
+}  // namespace models
+}  // namespace mozolm
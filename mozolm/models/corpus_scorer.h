@@ -0,0 +1,92 @@
+// Copyright 2026 MozoLM Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Utilities for scoring texts and whole corpora with the language model hub.
+
+#ifndef MOZOLM_MOZOLM_MODELS_CORPUS_SCORER_H_
+#define MOZOLM_MOZOLM_MODELS_CORPUS_SCORER_H_
+
+#include <string>
+
+#include "mozolm/stubs/integral_types.h"
+#include "absl/status/statusor.h"
+#include "mozolm/models/language_model_hub.h"
+#include "mozolm/models/model_config.pb.h"
+
+namespace mozolm {
+namespace models {
+
+// Scores accumulated over one or more texts.
+struct TextScores {
+  double bits = 0.0;          // Total negative log base 2 probability.
+  int64_t num_chars = 0;      // Scored characters, including end-of-string.
+  int64_t num_oov_chars = 0;  // Characters with zero model probability.
+
+  TextScores &operator+=(const TextScores &other) {
+    bits += other.bits;
+    num_chars += other.num_chars;
+    num_oov_chars += other.num_oov_chars;
+    return *this;
+  }
+
+  double BitsPerChar() const {
+    return num_chars > 0 ? bits / num_chars : 0.0;
+  }
+  double OovRate() const {
+    return num_chars > 0 ? static_cast<double>(num_oov_chars) / num_chars : 0.0;
+  }
+};
+
+// Scores accumulated over the corpus together with the processing statistics.
+struct CorpusScores {
+  TextScores scores;
+  int64_t num_lines = 0;    // Number of scored lines.
+  int num_threads = 1;      // Number of threads used for scoring.
+  double elapsed_sec = 0.0; // Scoring time, not including the model loading.
+
+  double CharsPerSec() const {
+    return elapsed_sec > 0.0 ? scores.num_chars / elapsed_sec : 0.0;
+  }
+};
+
+// Scores the text character by character starting from the start state of
+// the hub, followed by the end-of-string. To cover all unicode codepoints,
+// even those assigned zero probability by the model, the probabilities are
+// interpolated with a uniform model over all codepoints, using a very small
+// interpolation factor for this mixing. If update_counts is enabled, the
+// counts of the dynamic models are updated with each character once it has
+// been scored.
+absl::StatusOr<TextScores> ScoreText(const std::string &text,
+                                     bool update_counts,
+                                     LanguageModelHub *hub);
+
+// Initializes the hub from the configuration and scores every line in the
+// corpus file, updating the dynamic models along the way. If all the models
+// are static and num_threads is greater than one, the lines are streamed in
+// batches through a bounded queue to num_threads scoring threads, each with
+// its own instance of the hub, so only a few batches per thread are held in
+// memory. Otherwise the corpus is streamed and scored line by line.
+//
+// Since the hub states are not shared, the models are not shared either: each
+// of the num_threads hubs loads the models from the configuration, so the
+// memory taken by the models and their loading time are multiplied by the
+// number of threads.
+absl::StatusOr<CorpusScores> ScoreCorpus(const ModelHubConfig &config,
+                                         const std::string &corpus_file,
+                                         int num_threads);
+
+}  // namespace models
+}  // namespace mozolm
+
+#endif  // MOZOLM_MOZOLM_MODELS_CORPUS_SCORER_H_
@@ -0,0 +1,142 @@
+// Copyright 2026 MozoLM Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "mozolm/models/corpus_scorer.h"
+
+#include <cmath>
+#include <filesystem>
+#include <memory>
+#include <string>
+
+#include "gmock/gmock.h"
+#include "nisaba/port/status-matchers.h"
+#include "gtest/gtest.h"
+#include "mozolm/models/model_config.pb.h"
+#include "mozolm/models/model_factory.h"
+#include "mozolm/models/model_storage.pb.h"
+#include "mozolm/models/ppm_as_fst_options.pb.h"
+#include "nisaba/port/file_util.h"
+
+using ::nisaba::file::WriteTempTextFile;
+
+namespace mozolm {
+namespace models {
+namespace {
+
+// Epsilon for floating point comparisons.
+constexpr double kEpsilon = 1E-6;
+
+// Corpus used both for training and scoring.
+constexpr char kCorpus[] =
+    "the quick brown fox\n"
+    "jumps over\n"
+    "the lazy dog\n"
+    "\n"
+    "and the fox jumps again\n";
+
+class CorpusScorerTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    const auto write_status = WriteTempTextFile("corpus.txt", kCorpus);
+    ASSERT_OK(write_status.status());
+    corpus_path_ = write_status.value();
+  }
+
+  void TearDown() override {
+    EXPECT_TRUE(std::filesystem::remove(corpus_path_));
+  }
+
+  // Returns configuration of a single PPM model hub trained on the corpus.
+  ModelHubConfig PpmHubConfig(bool static_model) const {
+    ModelHubConfig config;
+    ModelConfig *model_config = config.add_model_config();
+    model_config->set_type(ModelConfig::PPM_AS_FST);
+    ModelStorage *storage = model_config->mutable_storage();
+    storage->set_model_file(corpus_path_);
+    storage->mutable_ppm_options()->set_max_order(3);
+    storage->mutable_ppm_options()->set_static_model(static_model);
+    return config;
+  }
+
+  std::string corpus_path_;
+};
+
+TEST_F(CorpusScorerTest, ScoreTextCountsCharactersAndOovs) {
+  auto hub_status = MakeModelHub(PpmHubConfig(/*static_model=*/true));
+  ASSERT_OK(hub_status.status());
+  std::unique_ptr<LanguageModelHub> hub = std::move(hub_status.value());
+
+  auto scores = ScoreText("fox", /*update_counts=*/false, hub.get());
+  ASSERT_OK(scores.status());
+  EXPECT_EQ(4, scores->num_chars);  // Includes end-of-string.
+  EXPECT_EQ(0, scores->num_oov_chars);
+  EXPECT_LT(0.0, scores->bits);
+
+  // The uppercase characters are not in the training data.
+  scores = ScoreText("FOX", /*update_counts=*/false, hub.get());
+  ASSERT_OK(scores.status());
+  EXPECT_EQ(4, scores->num_chars);
+  EXPECT_EQ(3, scores->num_oov_chars);
+  EXPECT_NEAR(0.75, scores->OovRate(), kEpsilon);
+}
+
+TEST_F(CorpusScorerTest, ScoreTextUpdatesDynamicModels) {
+  auto hub_status = MakeModelHub(PpmHubConfig(/*static_model=*/false));
+  ASSERT_OK(hub_status.status());
+  std::unique_ptr<LanguageModelHub> hub = std::move(hub_status.value());
+
+  const auto first_scores = ScoreText("xylophone", /*update_counts=*/true,
+                                      hub.get());
+  ASSERT_OK(first_scores.status());
+  const auto second_scores = ScoreText("xylophone", /*update_counts=*/true,
+                                       hub.get());
+  ASSERT_OK(second_scores.status());
+  EXPECT_LT(second_scores->bits, first_scores->bits);
+}
+
+TEST_F(CorpusScorerTest, ParallelScoringMatchesSequential) {
+  const ModelHubConfig config = PpmHubConfig(/*static_model=*/true);
+  const auto sequential = ScoreCorpus(config, corpus_path_, /*num_threads=*/1);
+  ASSERT_OK(sequential.status());
+  EXPECT_EQ(1, sequential->num_threads);
+  EXPECT_EQ(5, sequential->num_lines);
+  EXPECT_EQ(std::string(kCorpus).size(), sequential->scores.num_chars);
+
+  const auto parallel = ScoreCorpus(config, corpus_path_, /*num_threads=*/3);
+  ASSERT_OK(parallel.status());
+  EXPECT_EQ(3, parallel->num_threads);
+  EXPECT_EQ(sequential->num_lines, parallel->num_lines);
+  EXPECT_EQ(sequential->scores.num_chars, parallel->scores.num_chars);
+  EXPECT_EQ(sequential->scores.num_oov_chars, parallel->scores.num_oov_chars);
+  EXPECT_NEAR(sequential->scores.bits, parallel->scores.bits, kEpsilon);
+}
+
+TEST_F(CorpusScorerTest, DynamicModelsAreScoredSequentially) {
+  const auto scores = ScoreCorpus(PpmHubConfig(/*static_model=*/false),
+                                  corpus_path_, /*num_threads=*/3);
+  ASSERT_OK(scores.status());
+  EXPECT_EQ(1, scores->num_threads);
+  EXPECT_EQ(5, scores->num_lines);
+}
+
+TEST_F(CorpusScorerTest, MissingCorpus) {
+  const auto scores = ScoreCorpus(PpmHubConfig(/*static_model=*/true),
+                                  "/nonexistent/corpus.txt",
+                                  /*num_threads=*/1);
+  EXPECT_FALSE(scores.ok());
+}
+
+}  // namespace
+}  // namespace models
+}  // namespace mozolm
@@ -17,6 +17,8 @@
 #include <algorithm>
 
 #include "absl/strings/str_cat.h"
+#include "absl/strings/str_split.h"
+#include "absl/strings/string_view.h"
 #include "nisaba/port/utf8_util.h"
 #include "third_party/opengrm/sfst/sfst.h"
 
@@ -40,6 +42,18 @@ int LanguageModel::ContextState(const std::string& context, int init_state) {
   return this_state;
 }
 
+absl::Status LanguageModel::AdaptToText(const std::string& text) {
+  if (IsStatic()) return absl::OkStatus();
+  for (absl::string_view line : absl::StrSplit(text, '\n', absl::SkipEmpty())) {
+    if (!UpdateLMCounts(start_state_,
+                        nisaba::utf8::StrSplitByCharToUnicode(line),
+                        /*count=*/1)) {
+      return absl::InternalError("Failed to update language model counts");
+    }
+  }
+  return absl::OkStatus();
+}
+
 absl::StatusOr<std::vector<std::pair<double, std::string>>>
 GetTopHypotheses(const LMScores &scores, int top_n) {
   const int num_entries = scores.probabilities().size();
@@ -15,6 +15,7 @@
 #ifndef MOZOLM_MOZOLM_MODELS_LANGUAGE_MODEL_H_
 #define MOZOLM_MOZOLM_MODELS_LANGUAGE_MODEL_H_
 
+#include <memory>
 #include <string>
 #include <utility>
 #include <vector>
@@ -27,6 +28,16 @@
 namespace mozolm {
 namespace models {
 
+// Frozen copy of the counts of a dynamic model, which can be written out while
+// the model itself keeps being updated.
+class ModelSnapshot {
+ public:
+  virtual ~ModelSnapshot() = default;
+
+  // Writes the snapshot in the format accepted when reading the model.
+  virtual absl::Status Write(const std::string &ofile) const = 0;
+};
+
 class LanguageModel {
  public:
   virtual ~LanguageModel() = default;
@@ -63,6 +74,13 @@ class LanguageModel {
         "No FST writing defined for this derived class");
   }
 
+  // Returns a snapshot of the model for checkpointing, or null if the derived
+  // class does not support the snapshots. Taking the snapshot should be cheap,
+  // since the model must not be updated meanwhile, unlike writing it out.
+  virtual absl::StatusOr<std::unique_ptr<ModelSnapshot>> Snapshot() const {
+    return nullptr;
+  }
+
   // Returns the negative log probability of the utf8_sym at the state.
   virtual double SymLMScore(int state, int utf8_sym) {
     return -log(0.0);  // Requires a derived class to complete.
@@ -74,9 +92,24 @@ class LanguageModel {
     return false;  // Requires a derived class to complete.
   }
 
+  // Adapts the counts of a dynamic model to the text, counting each of its
+  // lines from the start state as UpdateLMCounts would. Static models are left
+  // unchanged. Derived classes may batch the updates of the whole text.
+  virtual absl::Status AdaptToText(const std::string &text);
+
   // Returns true if model is static, false if model is dynamic.
   virtual bool IsStatic() const { return true; }
 
+  // Returns true if the state, once returned by the model, has since been
+  // discarded, e.g., evicted from a bounded set of states. Such a state no
+  // longer represents the context it was reached by.
+  virtual bool IsStaleState(int state) const { return false; }
+
+  // Returns the number of times the model has discarded all the states it had
+  // returned, after which their indices may refer to different states. Unlike
+  // the stale states above, these cannot be told apart from the current ones.
+  virtual int64_t StateResets() const { return 0; }
+
  protected:
   LanguageModel() : start_state_(0) {}
 
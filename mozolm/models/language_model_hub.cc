@@ -16,8 +16,11 @@
 
 #include <algorithm>
 #include <cmath>
+#include <numeric>
 
 #include "google/protobuf/stubs/logging.h"
+#include "absl/synchronization/blocking_counter.h"
+#include "mozolm/utils/metrics.h"
 #include "nisaba/port/utf8_util.h"
 #include "third_party/opengrm/sfst/sfst.h"
 #include "nisaba/port/status_macros.h"
@@ -26,6 +29,40 @@ namespace mozolm {
 namespace models {
 
 constexpr int kMaxHubStates = 10000;  // Max number of hub states to maintain.
+constexpr int kStateHandleSlotBits = 32;  // Low bits of handle hold the slot.
+
+namespace {
+
+// Number of hub states created in the previously unused slots.
+metrics::Counter *HubStatesCreated() {
+  static metrics::Counter *const counter =
+      metrics::MetricsRegistry::Global().GetCounter("hub/states_created");
+  return counter;
+}
+
+// Number of hub states that have overwritten the existing states.
+metrics::Counter *HubStatesRecycled() {
+  static metrics::Counter *const counter =
+      metrics::MetricsRegistry::Global().GetCounter("hub/states_recycled");
+  return counter;
+}
+
+// Number of hub states invalidated after adapting the models to a text.
+metrics::Counter *HubStatesInvalidated() {
+  static metrics::Counter *const counter =
+      metrics::MetricsRegistry::Global().GetCounter("hub/states_invalidated");
+  return counter;
+}
+
+// Number of hub states retired because their component model states have
+// been discarded by the models.
+metrics::Counter *HubStatesStale() {
+  static metrics::Counter *const counter =
+      metrics::MetricsRegistry::Global().GetCounter("hub/states_stale");
+  return counter;
+}
+
+}  // namespace
 
 namespace impl {
 namespace {
@@ -108,6 +145,18 @@ absl::Status LanguageModelHub::InitializeModels(const ModelHubConfig& config) {
     default:
       return absl::InternalError("Unknown mixture type");
   }
+  bayesian_lm_probs_.resize(language_models_.size());
+  bayesian_mixture_weights_.resize(mixture_weights_.size());
+  bayesian_walk_state_ = LanguageModelHubState(
+      std::vector<int>(language_models_.size()), -1, 0,
+      bayesian_history_length_);
+  if (config.component_pool_size() > 1 && language_models_.size() > 1) {
+    component_pool_ =
+        std::make_unique<nisaba::ThreadPool>(config.component_pool_size());
+  } else {
+    component_pool_ = nullptr;
+  }
+
   // Creates a start hub state, by convention index 0.
   hub_states_.clear();
   hub_states_.push_back(std::unique_ptr<LanguageModelHubState>());
@@ -122,6 +171,11 @@ absl::Status LanguageModelHub::InitializeModels(const ModelHubConfig& config) {
     max_hub_states_ = config.maximim_maintained_states();
   }
   last_created_hub_state_ = 0;
+  walked_states_.clear();
+  model_state_resets_.resize(language_models_.size());
+  for (int idx = 0; idx < language_models_.size(); ++idx) {
+    model_state_resets_[idx] = language_models_[idx]->StateResets();
+  }
   return absl::OkStatus();
 }
 
@@ -136,10 +190,8 @@ absl::Status LanguageModelHub::UpdateHubState(
     int idx, const std::vector<int>& model_states, int prev_state,
     int state_sym) {
   std::vector<int> old_next_states;
-  ASSIGN_OR_RETURN(
-      old_next_states,
-      hub_states_[idx]->UpdateHubState(LanguageModelHubState(
-          model_states, prev_state, state_sym, bayesian_history_length_)));
+  ASSIGN_OR_RETURN(old_next_states, hub_states_[idx]->UpdateHubState(
+                                        model_states, prev_state, state_sym));
   for (auto next_state : old_next_states) {
     // Removes prev_state_ values that refer to old, overwritten hub state.
     hub_states_[next_state]->ResetPrevState();
@@ -155,27 +207,43 @@ absl::Status LanguageModelHub::InitializeStartHubState() {
   return UpdateHubState(0, start_states, -1, 0);
 }
 
+absl::Status LanguageModelHub::InvalidateHubStates() {
+  for (int idx = 1; idx < hub_states_.size(); ++idx) {
+    hub_states_[idx]->IncrementGeneration();  // Invalidates old handles.
+  }
+  HubStatesInvalidated()->Increment(hub_states_.size() - 1);
+  last_created_hub_state_ = 0;  // Slots are reused from the first one.
+  walked_states_.clear();
+  return InitializeStartHubState();
+}
+
 absl::StatusOr<int> LanguageModelHub::AssignNewHubState(
     const std::vector<int>& model_states, int prev_state, int state_sym) {
-  int idx;
-  if (hub_states_.size() >= max_hub_states_) {
-    idx = last_created_hub_state_ + 1;
+  int idx = last_created_hub_state_ + 1;
+  if (idx < hub_states_.size() || hub_states_.size() >= max_hub_states_) {
+    // Overwrites either an invalidated state or, once the maximum number of
+    // states is reached, the least recently created one.
     if (idx >= max_hub_states_) {
       // Going back to overwrite earlier states, reinitializes start state.
       RETURN_IF_ERROR(InitializeStartHubState());
       idx = 1;
     }
     RETURN_IF_ERROR(UpdateHubState(idx, model_states, prev_state, state_sym));
+    hub_states_[idx]->IncrementGeneration();  // Invalidates old handles.
+    HubStatesRecycled()->Increment();
   } else {
     idx = hub_states_.size();
     hub_states_.push_back(std::unique_ptr<LanguageModelHubState>());
     hub_states_[idx] =
         std::unique_ptr<LanguageModelHubState>(new LanguageModelHubState(
             model_states, prev_state, state_sym, bayesian_history_length_));
+    HubStatesCreated()->Increment();
   }
   last_created_hub_state_ = idx;
-  hub_states_[prev_state]->AddNextState(state_sym, idx);
-  UpdateBayesianHistory(idx);  // Updates Bayesian probabilities for new state.
+  if (prev_state >= 0) {
+    hub_states_[prev_state]->AddNextState(state_sym, idx);
+    UpdateBayesianHistory(idx);  // Updates Bayesian probabilities for state.
+  }
   return idx;
 }
 
@@ -190,10 +258,11 @@ int LanguageModelHub::NextState(int state, int utf8_sym) {
     return next_state;
   }
   std::vector<int> next_states(language_models_.size());
-  for (auto idx = 0; idx < language_models_.size(); ++idx) {
+  ForEachModel(language_models_.size(), [this, state, utf8_sym,
+                                         &next_states](int idx) {
     next_states[idx] = language_models_[idx]->NextState(
         hub_states_[state]->model_state(idx), utf8_sym);
-  }
+  });
   auto new_state_status = AssignNewHubState(next_states, state, utf8_sym);
   if (new_state_status.ok()) {
     return new_state_status.value();
@@ -202,47 +271,219 @@ int LanguageModelHub::NextState(int state, int utf8_sym) {
 }
 
 int LanguageModelHub::ContextState(const std::string& context, int init_state) {
+  CheckModelStateResets();
   // Sets initial state to start state if not otherwise valid.
-  int this_state = init_state < 0 ? 0 : init_state;
-  if (!context.empty()) {
-    const std::vector<int> context_utf8 =
-        nisaba::utf8::StrSplitByCharToUnicode(context);
-    for (const auto& utf8_code : context_utf8) {
-      this_state = NextState(this_state, utf8_code);
-      if (this_state < 0) {
-        // Returns to start state if symbol not found.
-        // TODO: should it return to a null context state?
-        this_state = 0;
-      }
+  int this_state =
+      init_state < 0 || init_state >= hub_states_.size() ? 0 : init_state;
+  if (context.empty()) {
+    return this_state;
+  }
+  const std::vector<int> context_utf8 =
+      nisaba::utf8::StrSplitByCharToUnicode(context);
+  int pos = 0;
+  for (int idx = 0; idx < context_utf8.size(); ++idx) {
+    if (context_utf8[idx] < 0) {
+      // Returns to start state if symbol not found.
+      // TODO: should it return to a null context state?
+      this_state = 0;
+      pos = idx + 1;
+    }
+  }
+  // Follows already existing hub states as far as possible.
+  while (pos < context_utf8.size()) {
+    const int next_state = hub_states_[this_state]->next_state(
+        context_utf8[pos]);
+    if (next_state < 0) break;
+    if (HasStaleModelStates(next_state)) {
+      // Rebuilds the rest of the context from here.
+      RetireHubState(next_state);
+      break;
     }
+    this_state = next_state;
+    ++pos;
+  }
+  if (pos + 1 == context_utf8.size()) {
+    // Just one new state, which is created as a regular next state.
+    this_state = NextState(this_state, context_utf8[pos]);
+    return this_state < 0 ? 0 : this_state;
+  } else if (pos < context_utf8.size()) {
+    return WalkModelsToNewHubState(this_state, context_utf8, pos);
   }
   return this_state;
 }
 
-std::vector<double> LanguageModelHub::GetBayesianMixtureWeights(
-    int state) const {
+int LanguageModelHub::WalkModelsToNewHubState(
+    int state, const std::vector<int>& utf8_syms, int begin) {
+  std::pair<int, std::vector<int>> key(
+      state, std::vector<int>(utf8_syms.begin() + begin, utf8_syms.end()));
+  const int init_generation = hub_states_[state]->generation();
+  const auto walked = walked_states_.find(key);
+  if (walked != walked_states_.end()) {
+    const WalkedState& walked_state = walked->second;
+    if (walked_state.init_generation == init_generation &&
+        hub_states_[walked_state.state]->generation() ==
+            walked_state.generation &&
+        !HasStaleModelStates(walked_state.state)) {
+      return walked_state.state;
+    }
+    // Either slot has been recycled since, or the final state is stale.
+    walked_states_.erase(walked);
+  }
+  std::vector<int> model_states(language_models_.size());
+  for (int idx = 0; idx < model_states.size(); ++idx) {
+    model_states[idx] = hub_states_[state]->model_state(idx);
+  }
+  // Only the probabilities of the last bayesian_history_length_ symbols are
+  // needed for the history at the final state, the rest are just walked.
+  const int history_begin = std::max<int>(
+      begin, utf8_syms.size() - bayesian_history_length_);
+  if (bayesian_history_length_ > 0) {
+    bayesian_walk_state_.CopyBayesianHistory(*hub_states_[state]);
+  }
+  for (int pos = begin; pos < utf8_syms.size(); ++pos) {
+    const int utf8_sym = utf8_syms[pos];
+    const bool in_history = bayesian_history_length_ > 0 &&
+                            pos >= history_begin;
+    ForEachModel(language_models_.size(), [this, utf8_sym, in_history,
+                                           &model_states](int idx) {
+      if (in_history) {
+        bayesian_lm_probs_[idx] =
+            language_models_[idx]->SymLMScore(model_states[idx], utf8_sym);
+      }
+      model_states[idx] =
+          language_models_[idx]->NextState(model_states[idx], utf8_sym);
+    });
+    if (in_history) {
+      bayesian_walk_state_.AppendBayesianHistory(bayesian_lm_probs_);
+    }
+  }
+  const auto new_state_status = AssignNewHubState(
+      model_states, /*prev_state=*/-1, utf8_syms.back());
+  if (!new_state_status.ok()) {
+    return 0;  // Returns start state (0) if fails to assign new hub state.
+  }
+  const int new_state = new_state_status.value();
+  if (bayesian_history_length_ > 0) {
+    hub_states_[new_state]->CopyBayesianHistory(bayesian_walk_state_);
+  }
+  if (hub_states_[state]->generation() == init_generation) {
+    // Only remembered if the initial state has not just been recycled.
+    if (walked_states_.size() >= max_hub_states_) walked_states_.clear();
+    walked_states_[std::move(key)] = {init_generation, new_state,
+                                      hub_states_[new_state]->generation()};
+  }
+  return new_state;
+}
+
+int64_t LanguageModelHub::StateHandle(int state) const {
+  if (state < 0 || state >= hub_states_.size()) {
+    return state;
+  }
+  const int generation =
+      (hub_states_[state]->generation() + state_handle_offset_) & 0x7fffffff;
+  return (static_cast<int64_t>(generation) << kStateHandleSlotBits) | state;
+}
+
+int LanguageModelHub::ResolveStateHandle(int64_t handle,
+                                         const std::string& fallback_context) {
+  if (handle < 0) {
+    return -1;
+  }
+  CheckModelStateResets();
+  const int64_t slot = handle & ((int64_t{1} << kStateHandleSlotBits) - 1);
+  const int generation = handle >> kStateHandleSlotBits;
+  if (slot >= hub_states_.size()) {
+    // Handles issued by a hub with a different epoch are rebuilt. The others
+    // remain invalid, the slots the hub never allocates (including the ones
+    // beyond the range of int) are rejected.
+    if (generation != state_handle_offset_) {
+      return RebuildState(slot, fallback_context);
+    }
+    return slot < max_hub_states_ ? static_cast<int>(slot) : -1;
+  }
+  if (((hub_states_[slot]->generation() + state_handle_offset_) &
+       0x7fffffff) != generation) {
+    // Slot has been recycled since the handle was issued, rebuilds the state.
+    return RebuildState(slot, fallback_context);
+  }
+  if (HasStaleModelStates(slot)) {
+    // Some model has discarded the context of the state, rebuilds it.
+    RetireHubState(slot);
+    return RebuildState(slot, fallback_context);
+  }
+  return static_cast<int>(slot);
+}
+
+int LanguageModelHub::RebuildState(int64_t slot,
+                                   const std::string& fallback_context) {
+  if (fallback_context.empty() && slot != 0) {
+    // Only the start state has an empty context, any other state cannot be
+    // rebuilt without knowing its context.
+    return -1;
+  }
+  return ContextState(fallback_context);
+}
+
+void LanguageModelHub::CheckModelStateResets() {
+  bool reset = false;
+  for (int idx = 0; idx < language_models_.size(); ++idx) {
+    const int64_t state_resets = language_models_[idx]->StateResets();
+    if (state_resets != model_state_resets_[idx]) {
+      model_state_resets_[idx] = state_resets;
+      reset = true;
+    }
+  }
+  if (reset && !InvalidateHubStates().ok()) {
+    GOOGLE_LOG(ERROR) << "Failed to invalidate hub states";
+  }
+}
+
+bool LanguageModelHub::HasStaleModelStates(int state) const {
+  for (int idx = 0; idx < language_models_.size(); ++idx) {
+    if (language_models_[idx]->IsStaleState(
+            hub_states_[state]->model_state(idx))) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void LanguageModelHub::RetireHubState(int state) {
+  LanguageModelHubState& hub_state = *hub_states_[state];
+  const int prev_state = hub_state.prev_state();
+  if (prev_state >= 0 &&
+      hub_states_[prev_state]->next_state(hub_state.state_sym()) == state) {
+    hub_states_[prev_state]->RemoveNextState(hub_state.state_sym());
+  }
+  hub_state.ResetPrevState();
+  hub_state.IncrementGeneration();  // Invalidates old handles.
+  HubStatesStale()->Increment();
+}
+
+const std::vector<double>& LanguageModelHub::GetBayesianMixtureWeights(
+    int state) {
   if (bayesian_history_length_ <= 0 || state < 0 ||
       state >= hub_states_.size()) {
     return mixture_weights_;
   }
-  std::vector<double> mixture_weights = mixture_weights_;
-  const std::vector<double> bayesian_history_probs_sum =
-      hub_states_[state]->bayesian_history_probs_sum();
+  const LanguageModelHubState& hub_state = *hub_states_[state];
   double normalization;
-  for (auto idx = 0; idx < mixture_weights.size(); ++idx) {
-    mixture_weights[idx] += bayesian_history_probs_sum[idx];
-    normalization = (idx == 0)
-                        ? mixture_weights[idx]
-                        : sfst::NegLogSum(normalization, mixture_weights[idx]);
-  }
-  for (auto idx = 0; idx < mixture_weights.size(); ++idx) {
-    mixture_weights[idx] -= normalization;
-  }
-  return mixture_weights;
+  for (auto idx = 0; idx < mixture_weights_.size(); ++idx) {
+    bayesian_mixture_weights_[idx] =
+        mixture_weights_[idx] + hub_state.bayesian_history_probs_sum(idx);
+    normalization =
+        (idx == 0) ? bayesian_mixture_weights_[idx]
+                   : sfst::NegLogSum(normalization,
+                                      bayesian_mixture_weights_[idx]);
+  }
+  for (auto idx = 0; idx < bayesian_mixture_weights_.size(); ++idx) {
+    bayesian_mixture_weights_[idx] -= normalization;
+  }
+  return bayesian_mixture_weights_;
 }
 
-std::vector<double> LanguageModelHub::GetMixtureWeights(int state,
-                                                        bool result) const {
+const std::vector<double>& LanguageModelHub::GetMixtureWeights(int state,
+                                                               bool result) {
   if (!result || bayesian_history_length_ <= 0 || state < 0 ||
       state >= hub_states_.size()) {
     return mixture_weights_;
@@ -260,7 +501,25 @@ bool LanguageModelHub::ExtractLMScores(int state, LMScores* response) {
   }
   absl::flat_hash_map<std::string, double> mixed_values;
   double mixed_normalization = 0.0;
-  const auto mixture_weights = GetMixtureWeights(state, result);
+  const std::vector<double>& mixture_weights = GetMixtureWeights(state, result);
+  if (result && component_pool_ != nullptr) {
+    // Collects the scores from all models concurrently, then mixes them.
+    std::vector<LMScores> responses(mixture_weights.size());
+    std::vector<char> results(mixture_weights.size());
+    ForEachModel(mixture_weights.size(), [this, state, &responses,
+                                          &results](int idx) {
+      results[idx] = language_models_[idx]->ExtractLMScores(
+          hub_states_[state]->model_state(idx), &responses[idx]);
+    });
+    while (result && idx < mixture_weights.size()) {
+      result = results[idx];
+      if (result) {
+        mixed_normalization += impl::MixResults(
+            responses[idx], mixture_weights[idx], &mixed_values);
+      }
+      ++idx;
+    }
+  }
   while (result && idx < mixture_weights.size()) {
     LMScores this_response;
     result = language_models_[idx]->ExtractLMScores(
@@ -277,18 +536,43 @@ bool LanguageModelHub::ExtractLMScores(int state, LMScores* response) {
   return result;
 }
 
+double LanguageModelHub::SymLMScore(int state, int utf8_sym) {
+  if (state < 0 || state >= hub_states_.size()) {
+    return -std::log(0.0);
+  }
+  if (mixture_weights_.size() < 2) {
+    // Returns from first model as no mixing is required.
+    return language_models_[0]->SymLMScore(hub_states_[state]->model_state(0),
+                                           utf8_sym);
+  }
+  const std::vector<double>& mixture_weights =
+      GetMixtureWeights(state, /*result=*/true);
+  std::vector<double> scores(mixture_weights.size());
+  ForEachModel(mixture_weights.size(), [this, state, utf8_sym,
+                                        &scores](int idx) {
+    scores[idx] = language_models_[idx]->SymLMScore(
+        hub_states_[state]->model_state(idx), utf8_sym);
+  });
+  double mixed_score = scores[0] + mixture_weights[0];
+  for (int idx = 1; idx < scores.size(); ++idx) {
+    mixed_score =
+        sfst::NegLogSum(mixed_score, scores[idx] + mixture_weights[idx]);
+  }
+  return mixed_score;
+}
+
 void LanguageModelHub::UpdateBayesianHistory(int32_t state) {
   if (state >= 0 && bayesian_history_length_ > 0) {
     const int prev_state = hub_states_[state]->prev_state();
     if (prev_state >= 0) {
-      std::vector<double> lm_probs(language_models_.size());
-      for (int idx = 0; idx < language_models_.size(); ++idx) {
-        lm_probs[idx] = language_models_[idx]->SymLMScore(
-            hub_states_[prev_state]->model_state(idx),
-            hub_states_[state]->state_sym());
-      }
-      hub_states_[state]->UpdateBayesianHistory(
-          lm_probs, hub_states_[prev_state]->bayesian_history_probs());
+      const int state_sym = hub_states_[state]->state_sym();
+      ForEachModel(language_models_.size(), [this, prev_state,
+                                             state_sym](int idx) {
+        bayesian_lm_probs_[idx] = language_models_[idx]->SymLMScore(
+            hub_states_[prev_state]->model_state(idx), state_sym);
+      });
+      hub_states_[state]->UpdateBayesianHistory(bayesian_lm_probs_,
+                                                *hub_states_[prev_state]);
     }
   }
 }
@@ -306,25 +590,69 @@ bool LanguageModelHub::UpdateLMCounts(int32_t state,
     // Updates Bayesian history at next states before updating counts.
     int this_state = state;
     for (auto utf8_sym : utf8_syms) {
-      const auto next_states = hub_states_[this_state]->next_states();
-      for (auto ns : next_states) {
+      for (const auto& ns : hub_states_[this_state]->next_states()) {
         UpdateBayesianHistory(ns.second);
       }
       this_state = NextState(this_state, utf8_sym);
     }
   }
-  int idx = 0;
-  while (result && idx < mixture_weights_.size()) {
-    result = language_models_[idx]->UpdateLMCounts(
-        hub_states_[state]->model_state(idx), utf8_syms, count);
-    ++idx;
+  if (result && component_pool_ != nullptr) {
+    // Updates all models concurrently.
+    std::vector<char> results(mixture_weights_.size());
+    ForEachModel(mixture_weights_.size(), [this, state, &utf8_syms, count,
+                                           &results](int idx) {
+      results[idx] = language_models_[idx]->UpdateLMCounts(
+          hub_states_[state]->model_state(idx), utf8_syms, count);
+    });
+    result = std::all_of(results.begin(), results.end(),
+                         [](char model_result) { return model_result; });
+  } else {
+    int idx = 0;
+    while (result && idx < mixture_weights_.size()) {
+      result = language_models_[idx]->UpdateLMCounts(
+          hub_states_[state]->model_state(idx), utf8_syms, count);
+      ++idx;
+    }
   }
   if (result) {
     result = VerifyOrCorrectModelStates(state, utf8_syms);
   }
+  // The model states reached by walking the contexts may have changed.
+  if (!IsStatic()) walked_states_.clear();
   return result;
 }
 
+absl::Status LanguageModelHub::AdaptToText(const std::string& text) {
+  if (nisaba::utf8::StrSplitByChar(text).size() !=
+      nisaba::utf8::StrSplitByCharToUnicode(text).size()) {
+    return absl::InvalidArgumentError("Invalid UTF-8 text");
+  }
+  // Adapts all the dynamic models, including those beyond the first one that
+  // do not take part in the scores under the NONE mixture.
+  std::vector<absl::Status> statuses(language_models_.size());
+  ForEachModel(language_models_.size(), [this, &text, &statuses](int idx) {
+    if (!language_models_[idx]->IsStatic()) {
+      statuses[idx] = language_models_[idx]->AdaptToText(text);
+    }
+  });
+  if (!IsStatic()) RETURN_IF_ERROR(InvalidateHubStates());
+  for (const absl::Status& status : statuses) {
+    RETURN_IF_ERROR(status);
+  }
+  return absl::OkStatus();
+}
+
+absl::StatusOr<std::vector<std::unique_ptr<ModelSnapshot>>>
+LanguageModelHub::SnapshotModels() const {
+  std::vector<std::unique_ptr<ModelSnapshot>> snapshots(
+      language_models_.size());
+  for (int idx = 0; idx < language_models_.size(); ++idx) {
+    if (language_models_[idx]->IsStatic()) continue;
+    ASSIGN_OR_RETURN(snapshots[idx], language_models_[idx]->Snapshot());
+  }
+  return snapshots;
+}
+
 bool LanguageModelHub::VerifyOrCorrectModelStates(
     int32_t state, const std::vector<int>& utf8_syms) {
   for (int utf8_sym : utf8_syms) {
@@ -354,6 +682,27 @@ bool LanguageModelHub::VerifyOrCorrectModelStates(
   return true;
 }
 
+void LanguageModelHub::ForEachModel(
+    int num_models, const std::function<void(int)>& model_fn) {
+  if (component_pool_ == nullptr || num_models < 2) {
+    for (int idx = 0; idx < num_models; ++idx) {
+      model_fn(idx);
+    }
+    return;
+  }
+  // Schedules all but the first model on the pool, the first one is handled
+  // by the calling thread while waiting for the others.
+  absl::BlockingCounter models_pending(num_models - 1);
+  for (int idx = 1; idx < num_models; ++idx) {
+    component_pool_->Schedule([&model_fn, &models_pending, idx]() {
+      model_fn(idx);
+      models_pending.DecrementCount();
+    });
+  }
+  model_fn(0);
+  models_pending.Wait();
+}
+
 bool LanguageModelHubState::VerifyOrCorrectModelStates(
     int prev_state, int utf8_sym, const std::vector<int>& model_states) {
   if (prev_state_ != prev_state || state_sym_ != utf8_sym) {
@@ -365,26 +714,44 @@ bool LanguageModelHubState::VerifyOrCorrectModelStates(
   return true;
 }
 
-void LanguageModelHubState::UpdateBayesianHistory(
-    const std::vector<double>& lm_probs,
-    const std::vector<std::vector<double>>& prev_probs) {
+void LanguageModelHubState::CopyBayesianHistory(
+    const LanguageModelHubState& hub_state) {
+  std::copy(hub_state.bayesian_history_probs_.begin(),
+            hub_state.bayesian_history_probs_.end(),
+            bayesian_history_probs_.begin());
+  std::copy(hub_state.bayesian_history_probs_sum_.begin(),
+            hub_state.bayesian_history_probs_sum_.end(),
+            bayesian_history_probs_sum_.begin());
+  bayesian_history_pos_ = hub_state.bayesian_history_pos_;
+}
+
+void LanguageModelHubState::AppendBayesianHistory(
+    const std::vector<double>& lm_probs) {
+  // History probs are shared with the previous history for all but the oldest
+  // entry, which is overwritten with the latest probability.
+  const int pos = bayesian_history_pos_;
   for (int idx = 0; idx < lm_probs.size(); ++idx) {
-    // Adds latest probability to history probs.
-    bayesian_history_probs_[idx].back() = lm_probs[idx];
-    bayesian_history_probs_sum_[idx] = lm_probs[idx];
-
-    // History probs are shared with prev_state for all but hidx = 0.
-    for (int hidx = 1; hidx < prev_probs[idx].size(); ++hidx) {
-      bayesian_history_probs_[idx][hidx - 1] = prev_probs[idx][hidx];
-      bayesian_history_probs_sum_[idx] +=
-          bayesian_history_probs_[idx][hidx - 1];
+    double& oldest = bayesian_history_probs_[idx * bayesian_history_length_ +
+                                             pos];
+    bayesian_history_probs_sum_[idx] += lm_probs[idx] - oldest;
+    oldest = lm_probs[idx];
+  }
+  bayesian_history_pos_ = (pos + 1) % bayesian_history_length_;
+  if (bayesian_history_pos_ == 0) {
+    // Re-sums once per full cycle of the ring buffer, so that rounding errors
+    // from the incremental updates do not accumulate along long paths.
+    for (int idx = 0; idx < lm_probs.size(); ++idx) {
+      const auto begin =
+          bayesian_history_probs_.begin() + idx * bayesian_history_length_;
+      bayesian_history_probs_sum_[idx] =
+          std::accumulate(begin, begin + bayesian_history_length_, 0.0);
     }
   }
 }
 
 absl::StatusOr<std::vector<int>> LanguageModelHubState::UpdateHubState(
-    const LanguageModelHubState& hub_state) {
-  if (model_states_.size() != hub_state.ModelStateSize()) {
+    const std::vector<int>& model_states, int prev_state, int state_sym) {
+  if (model_states_.size() != model_states.size()) {
     return absl::InternalError("Size difference between hub state and models.");
   }
   std::vector<int> old_next_states(next_states_.size());
@@ -393,23 +760,24 @@ absl::StatusOr<std::vector<int>> LanguageModelHubState::UpdateHubState(
     old_next_states[idx++] = next_state.second;
   }
   next_states_.clear();
-  for (int i = 0; i < model_states_.size(); ++i) {
-    model_states_[i] = hub_state.model_state(i);
-  }
-  prev_state_ = hub_state.prev_state();
-  state_sym_ = hub_state.state_sym();
-  bayesian_history_probs_ = hub_state.bayesian_history_probs();
-  bayesian_history_probs_sum_ = hub_state.bayesian_history_probs_sum();
+  std::copy(model_states.begin(), model_states.end(), model_states_.begin());
+  prev_state_ = prev_state;
+  state_sym_ = state_sym;
+  std::fill(bayesian_history_probs_.begin(), bayesian_history_probs_.end(),
+            0.0);
+  std::fill(bayesian_history_probs_sum_.begin(),
+            bayesian_history_probs_sum_.end(), 0.0);
+  bayesian_history_pos_ = 0;
   return std::move(old_next_states);
 }
 
 void LanguageModelHubState::InitBayesianHistory(int bayesian_history_length) {
-  bayesian_history_probs_.resize(model_states_.size());
-  for (int idx = 0; idx < model_states_.size(); ++idx) {
-    // Initializes history negative log probabilities to zeros.
-    bayesian_history_probs_[idx].resize(bayesian_history_length);
-  }
+  // Initializes history negative log probabilities to zeros.
+  bayesian_history_length_ = bayesian_history_length;
+  bayesian_history_probs_.resize(model_states_.size() *
+                                 bayesian_history_length);
   bayesian_history_probs_sum_.resize(model_states_.size());
+  bayesian_history_pos_ = 0;
 }
 
 }  // namespace models
@@ -15,8 +15,11 @@
 #ifndef MOZOLM_MOZOLM_MODELS_LANGUAGE_MODEL_HUB_H_
 #define MOZOLM_MOZOLM_MODELS_LANGUAGE_MODEL_HUB_H_
 
+#include <algorithm>
+#include <functional>
 #include <memory>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include "absl/container/flat_hash_map.h"
@@ -25,6 +28,7 @@
 #include "mozolm/models/language_model.h"
 #include "mozolm/models/lm_scores.pb.h"
 #include "mozolm/models/model_config.pb.h"
+#include "nisaba/port/thread_pool.h"
 
 namespace mozolm {
 namespace models {
@@ -34,13 +38,15 @@ class LanguageModelHubState {
   LanguageModelHubState() = default;
 
   // Initializes given a vector of states, default values used for start state,
-  // plus allocates vectors for Bayesian mixtures if needed.
+  // plus allocates ring buffers for Bayesian mixtures if needed.
   explicit LanguageModelHubState(const std::vector<int>& model_states,
                                  int prev_state = -1, int state_sym = 0,
                                  int bayesian_history_length = 0)
       : model_states_(model_states),
         prev_state_(prev_state),
-        state_sym_(state_sym) {
+        state_sym_(state_sym),
+        bayesian_history_length_(0),
+        bayesian_history_pos_(0) {
     if (bayesian_history_length > 0) {
       InitBayesianHistory(bayesian_history_length);
     }
@@ -51,14 +57,15 @@ class LanguageModelHubState {
   int ModelStateSize() const { return model_states_.size(); }
   int state_sym() const { return state_sym_; }
   int prev_state() const { return prev_state_; }
-  absl::flat_hash_map<int, int> next_states() const {
+  int generation() const { return generation_; }
+  const absl::flat_hash_map<int, int>& next_states() const {
     return next_states_;
   }
-  std::vector<std::vector<double>> bayesian_history_probs() const {
-    return bayesian_history_probs_;
-  }
-  std::vector<double> bayesian_history_probs_sum() const {
-    return bayesian_history_probs_sum_;
+
+  // Returns the summed Bayesian history (negative log) probabilities for the
+  // model with the given index.
+  double bayesian_history_probs_sum(int idx) const {
+    return bayesian_history_probs_sum_[idx];
   }
 
   // Returns existing next state for symbol if exists; -1 otherwise.
@@ -77,25 +84,47 @@ class LanguageModelHubState {
     next_states_.insert({utf8_sym, next_state});
   }
 
-  // Resets values with those from given hub_state.
+  // Removes the next state for the symbol from next_states_.
+  void RemoveNextState(int utf8_sym) { next_states_.erase(utf8_sym); }
+
+  // Resets values with the given information, reusing already allocated
+  // storage. Returns the next states of the overwritten state.
   absl::StatusOr<std::vector<int>> UpdateHubState(
-      const LanguageModelHubState& hub_state);
+      const std::vector<int>& model_states, int prev_state, int state_sym);
 
   // For a given hub state, this verifies model state information which may have
   // changed due to count updates. Returns false if base information is wrong.
   bool VerifyOrCorrectModelStates(int prev_state, int utf8_sym,
                                   const std::vector<int>& model_states);
 
-  // Updates the Bayesian history probabilities at the state.
-  void UpdateBayesianHistory(
-      const std::vector<double>& lm_probs,
-      const std::vector<std::vector<double>>& prev_probs);
+  // Updates the Bayesian history probabilities at the state from the history
+  // at the previous state, given the probability of the state symbol in each
+  // model. Copying the history takes time linear in its length for each model,
+  // while the summed probabilities are updated in constant time per model.
+  void UpdateBayesianHistory(const std::vector<double>& lm_probs,
+                             const LanguageModelHubState& prev_state) {
+    CopyBayesianHistory(prev_state);
+    AppendBayesianHistory(lm_probs);
+  }
+
+  // Replaces the Bayesian history with the one from the given state, which
+  // must have the same number of models and history length.
+  void CopyBayesianHistory(const LanguageModelHubState& hub_state);
+
+  // Adds the latest probabilities of each model to the Bayesian history,
+  // replacing the oldest ones.
+  void AppendBayesianHistory(const std::vector<double>& lm_probs);
 
   // Resets previous state when previous state has been overwritten.
   void ResetPrevState() {
     prev_state_ = -1;
   }
 
+  // Marks the slot holding this state as reused for a different context.
+  void IncrementGeneration() {
+    generation_ = (generation_ + 1) & 0x7fffffff;
+  }
+
  private:
   // Initializes Bayesian history probabilities if needed.
   void InitBayesianHistory(int bayesian_history_length);
@@ -106,12 +135,17 @@ class LanguageModelHubState {
   int prev_state_;            // Previous state in the model hub.
   absl::flat_hash_map<int, int> next_states_;  // Set of next states.
   int state_sym_;             // Last symbol leading to this state.
+  int generation_ = 0;        // Number of times this slot has been recycled.
 
   // Holds the (negative log) probabilities of recent symbols for calculating
-  // Bayesian interpolation model mixing parameters. Empty if not using Bayesian
-  // methods.
-  std::vector<std::vector<double>> bayesian_history_probs_;
+  // Bayesian interpolation model mixing parameters, as one ring buffer of
+  // length bayesian_history_length_ per model, stored contiguously. All ring
+  // buffers share the same position, which points at the oldest entry. Empty if
+  // not using Bayesian methods.
+  std::vector<double> bayesian_history_probs_;
   std::vector<double> bayesian_history_probs_sum_;  // Holds pre-summed value.
+  int bayesian_history_length_;  // Length of each ring buffer.
+  int bayesian_history_pos_;     // Position of oldest entry in ring buffers.
 };
 
 // TODO: Initialize with a desired target alphabet.
@@ -136,18 +170,83 @@ class LanguageModelHub {
 
   // Provides the state reached from the init_state after consuming the context
   // string. If string is empty, returns the init_state.  If init_state is less
-  // than zero, the model will start at the start state of the model.
+  // than zero, the model will start at the start state of the model. Existing
+  // hub states are followed as far as possible, beyond that the component
+  // models are walked directly and only the final hub state is created. That
+  // state is reused when the same context is consumed again from the same
+  // state, for as long as neither of their slots is recycled and the models
+  // are not updated.
   int ContextState(const std::string& context = "", int init_state = -1);
 
+  // Returns an opaque handle for the state, encoding both its slot and the
+  // generation of that slot, so that it can be detected when the slot is later
+  // recycled for a different context. Invalid states are returned unchanged.
+  int64_t StateHandle(int state) const;
+
+  // Returns the state referred to by the handle. If the slot has since been
+  // recycled, or some model has discarded its state for the slot, the state is
+  // rebuilt from the start state by consuming the fallback_context string, as
+  // are the handles issued for a different epoch (see
+  // `set_state_handle_epoch`). Such expired handles resolve to -1 when the
+  // fallback_context is empty, except for those of the start state, rather
+  // than silently resolving to the start state. Other handles that refer to a
+  // slot not yet allocated are returned as is, hence remain invalid, and -1 is
+  // returned for those referring to a slot at or beyond the maximum number of
+  // hub states.
+  int ResolveStateHandle(int64_t handle,
+                         const std::string& fallback_context = "");
+
+  // Sets the epoch of the state handles issued by this hub. When a hub replaces
+  // another one (e.g., when the models are reloaded), giving it a new epoch
+  // ensures that the handles issued by the old hub are detected as expired and
+  // rebuilt from their fallback context. The epoch offsets the slot
+  // generations, hence the handles of two hubs only collide once a slot has
+  // been recycled about a million times. The 31-bit generations leave 11 bits
+  // for the epoch, which therefore wraps around every 2048 epochs: a handle
+  // kept across that many reloads may again be accepted as current.
+  void set_state_handle_epoch(int epoch) {
+    state_handle_offset_ = (epoch << 20) & 0x7fffffff;
+  }
+
   // Copies the probs and normalization from the given state into the response.
   bool ExtractLMScores(int state, LMScores* response);
 
+  // Returns the negative log probability of the utf8_sym at the state, mixing
+  // the scores of the component models for that symbol only. This gives the
+  // probability of the symbol in the scores extracted above, without building
+  // the whole distribution. Invalid states have probability zero.
+  double SymLMScore(int state, int utf8_sym);
+
   // Updates the count for the utf8_syms at the current state.
   bool UpdateLMCounts(int state, const std::vector<int>& utf8_syms,
                       int64_t count);
 
+  // Adapts the dynamic models to the text, each of which counts every line of
+  // the text from its start state in a single batch. The component models are
+  // adapted concurrently if a component pool is configured. Since the model
+  // states reached by the existing hub states may have changed, these are all
+  // discarded afterwards: their handles are rebuilt from the fallback context.
+  absl::Status AdaptToText(const std::string& text);
+
+  // Takes the snapshots of the dynamic models for checkpointing, indexed as
+  // the models of the hub. The snapshots of the static models and of the
+  // models that do not support them are null. The models must not be updated
+  // while the snapshots are taken.
+  absl::StatusOr<std::vector<std::unique_ptr<ModelSnapshot>>> SnapshotModels()
+      const;
+
+  // Returns true if none of the models can be updated.
+  bool IsStatic() const {
+    return std::all_of(language_models_.begin(), language_models_.end(),
+                       [](const std::unique_ptr<LanguageModel>& model) {
+                         return model->IsStatic();
+                       });
+  }
+
  private:
   // Determines vector index for new state, creates state and returns index.
+  // If prev_state is less than zero, the new state is not linked from any
+  // other state and its Bayesian history is left to the caller.
   absl::StatusOr<int> AssignNewHubState(const std::vector<int>& model_states,
                                         int prev_state, int state_sym);
 
@@ -158,9 +257,29 @@ class LanguageModelHub {
   // Initializes already allocated start hub state with start states.
   absl::Status InitializeStartHubState();
 
+  // Reinitializes the start hub state and invalidates all the other hub
+  // states, whose slots are then reused for the new states.
+  absl::Status InvalidateHubStates();
+
   // Updates probabilities from each model to allow Bayesian interpolation.
   void UpdateBayesianHistory(int state);
 
+  // Returns the hub state reached from state after consuming utf8_syms from
+  // the begin position. Reuses the state created by an earlier walk along the
+  // same symbols, if still valid. Otherwise creates it by walking the
+  // component models without creating intermediate hub states. Returns the
+  // start state (0) if the new hub state cannot be assigned.
+  int WalkModelsToNewHubState(int state, const std::vector<int>& utf8_syms,
+                              int begin);
+
+  // Hub state created by walking the component models from an initial hub
+  // state, valid as long as the generations of both slots are unchanged.
+  struct WalkedState {
+    int init_generation;  // Generation of the initial state's slot.
+    int state;            // Final state of the walk.
+    int generation;       // Generation of the final state's slot.
+  };
+
   // Bayesian interpolation methods are based on a generalization of methods
   // shown in Allauzen and Riley (2011) "Bayesian language model interpolation
   // for mobile speech input." Given K models, each k \in K having a normalized
@@ -186,24 +305,67 @@ class LanguageModelHub {
   // inflate the probabilities that the model has been providing for the history
   // and over-rely on that model for the next estimate.  For this reason, the
   // Bayesian histories are updated prior to model counts being updated.
-  std::vector<double> GetBayesianMixtureWeights(int state) const;
+  // The weights are computed into a buffer owned by the hub, which is reused
+  // across calls. Hence this is not reentrant: the returned weights are only
+  // valid until the next call, which must not be made concurrently.
+  const std::vector<double>& GetBayesianMixtureWeights(int state);
 
   // Calculates normalized mixture weights.  If anything other than Bayesian
   // methods, no special calculation required.
-  std::vector<double> GetMixtureWeights(int state, bool result) const;
+  const std::vector<double>& GetMixtureWeights(int state, bool result);
 
   // Verifies model states after updating counts, and corrects if they differ.
   bool VerifyOrCorrectModelStates(int state, const std::vector<int>& utf8_syms);
 
+  // Returns true if any of the component models has discarded its state for
+  // the hub state, e.g., evicted it from a bounded set of states.
+  bool HasStaleModelStates(int state) const;
+
+  // Invalidates all the hub states if any of the component models has since
+  // discarded all of its states, see LanguageModel::StateResets.
+  void CheckModelStateResets();
+
+  // Unlinks the hub state from its previous state and invalidates its handles,
+  // so that its context is rebuilt from the fallback context when requested.
+  void RetireHubState(int state);
+
+  // Rebuilds the state of an expired handle for the given slot by consuming
+  // the fallback_context string from the start state. Returns -1 if there is
+  // no fallback context, unless the slot is that of the start state.
+  int RebuildState(int64_t slot, const std::string& fallback_context);
+
+  // Calls model_fn with the index of each of the first num_models component
+  // models. If a component pool is configured, the calls are made concurrently
+  // on the pool and this returns once all of them have completed.
+  void ForEachModel(int num_models, const std::function<void(int)>& model_fn);
+
   // States in the model hub, tracking states in all component models.
   std::vector<std::unique_ptr<LanguageModelHubState>> hub_states_;
   int last_created_hub_state_;  // Tracks which hub states recently created.
   int max_hub_states_;          // Maximum number of hub states to allow.
   std::vector<double> mixture_weights_;  // Weight for each model in mixture.
+  int state_handle_offset_ = 0;  // Added to the generations in the handles.
 
   int bayesian_history_length_;  // Length of history for Bayesian mixing.
 
+  // Buffers reused when updating Bayesian histories and mixture weights.
+  std::vector<double> bayesian_lm_probs_;
+  std::vector<double> bayesian_mixture_weights_;
+  LanguageModelHubState bayesian_walk_state_;  // History while walking models.
+
+  // States created by walking the component models, keyed by the initial hub
+  // state and the symbols walked from it. These states are not linked from
+  // their initial states, hence are looked up here when the same context is
+  // consumed again. Cleared once the models are updated or it grows to
+  // max_hub_states_ entries.
+  absl::flat_hash_map<std::pair<int, std::vector<int>>, WalkedState>
+      walked_states_;
+
   std::vector<std::unique_ptr<LanguageModel>> language_models_;
+  std::vector<int64_t> model_state_resets_;  // Last seen state resets.
+
+  // Pool for querying component models concurrently, null if not configured.
+  std::unique_ptr<nisaba::ThreadPool> component_pool_;
 };
 
 }  // namespace models
@@ -0,0 +1,142 @@
+// Copyright 2026 MozoLM Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Microbenchmarks for the language model hub mixing one to four models, with
+// and without Bayesian interpolation. The first benchmark argument is the
+// number of mixed models, the second is the Bayesian history length (zero
+// disables Bayesian mixing, which is only run for two or more models). Example:
+//
+//   bazel run -c opt //mozolm/models:language_model_hub_benchmark
+
+#include <map>
+#include <memory>
+#include <utility>
+
+#include "google/protobuf/stubs/logging.h"
+#include "absl/strings/str_format.h"
+#include "benchmark/benchmark.h"
+#include "mozolm/models/language_model_hub.h"
+#include "mozolm/models/lm_scores.pb.h"
+#include "mozolm/models/model_benchmark_utils.h"
+#include "mozolm/models/model_factory.h"
+
+namespace mozolm {
+namespace models {
+namespace {
+
+// Bayesian history length used when Bayesian mixing is enabled.
+constexpr int kBayesianHistoryLength = 10;
+
+// Manufactures a new hub given the benchmark arguments.
+std::unique_ptr<LanguageModelHub> NewHub(const ::benchmark::State &state) {
+  auto hub_status = MakeModelHub(
+      BenchmarkModelHubConfig(state.range(0), state.range(1)));
+  GOOGLE_CHECK(hub_status.ok()) << "Failed to initialize hub: "
+                                << hub_status.status().ToString();
+  return std::move(hub_status.value());
+}
+
+// Returns the shared hub for the given benchmark arguments.
+LanguageModelHub *GetHub(const ::benchmark::State &state) {
+  static auto *hubs =
+      new std::map<std::pair<int, int>, std::unique_ptr<LanguageModelHub>>;
+  auto &hub = (*hubs)[{state.range(0), state.range(1)}];
+  if (hub == nullptr) hub = NewHub(state);
+  return hub.get();
+}
+
+// Performs the common bookkeeping for all the benchmarks.
+void SetCounters(::benchmark::State &state) {
+  state.SetLabel(absl::StrFormat("models:%d bayesian:%d", state.range(0),
+                                 state.range(1)));
+  state.SetItemsProcessed(state.iterations() * BenchmarkCorpusNumChars());
+}
+
+void HubArguments(::benchmark::internal::Benchmark *benchmark) {
+  benchmark->ArgNames({"models", "history"});
+  for (int num_models = 1; num_models <= 4; ++num_models) {
+    for (const int history_length : {0, kBayesianHistoryLength}) {
+      // Bayesian mixing requires at least two models.
+      if (num_models < 2 && history_length > 0) continue;
+      benchmark->Args({num_models, history_length});
+    }
+  }
+}
+
+void BM_HubNextState(::benchmark::State &state) {
+  LanguageModelHub *hub = GetHub(state);
+  for (auto _ : state) {
+    for (const auto &line : BenchmarkCorpus()) {
+      int hub_state = 0;
+      for (const int utf8_sym : line) {
+        hub_state = hub->NextState(hub_state, utf8_sym);
+      }
+      ::benchmark::DoNotOptimize(hub_state);
+    }
+  }
+  SetCounters(state);
+}
+BENCHMARK(BM_HubNextState)->Apply(HubArguments);
+
+// Hub states are recycled, so rather than precomputing the states this
+// measures the typical decoding loop: extracting the scores followed by the
+// transition to the next state.
+void BM_HubExtractLMScores(::benchmark::State &state) {
+  LanguageModelHub *hub = GetHub(state);
+  LMScores response;
+  for (auto _ : state) {
+    for (const auto &line : BenchmarkCorpus()) {
+      int hub_state = 0;
+      for (const int utf8_sym : line) {
+        response.Clear();
+        ::benchmark::DoNotOptimize(hub->ExtractLMScores(hub_state, &response));
+        hub_state = hub->NextState(hub_state, utf8_sym);
+      }
+    }
+  }
+  SetCounters(state);
+}
+BENCHMARK(BM_HubExtractLMScores)->Apply(HubArguments);
+
+// Uses a fresh hub since the dynamic component models are modified.
+void BM_HubUpdateLMCounts(::benchmark::State &state) {
+  std::unique_ptr<LanguageModelHub> hub = NewHub(state);
+  for (auto _ : state) {
+    for (const auto &line : BenchmarkCorpus()) {
+      int hub_state = 0;
+      for (const int utf8_sym : line) {
+        ::benchmark::DoNotOptimize(hub->UpdateLMCounts(
+            hub_state, {utf8_sym}, /*count=*/1));
+        hub_state = hub->NextState(hub_state, utf8_sym);
+      }
+    }
+  }
+  SetCounters(state);
+}
+BENCHMARK(BM_HubUpdateLMCounts)->Apply(HubArguments);
+
+void BM_HubContextState(::benchmark::State &state) {
+  LanguageModelHub *hub = GetHub(state);
+  for (auto _ : state) {
+    for (const auto &line : BenchmarkCorpusLines()) {
+      ::benchmark::DoNotOptimize(hub->ContextState(line));
+    }
+  }
+  SetCounters(state);
+}
+BENCHMARK(BM_HubContextState)->Apply(HubArguments);
+
+}  // namespace
+}  // namespace models
+}  // namespace mozolm
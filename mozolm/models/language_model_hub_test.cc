@@ -14,6 +14,8 @@
 
 #include "mozolm/models/language_model_hub.h"
 
+#include <algorithm>
+#include <cmath>
 #include <filesystem>
 #include <memory>
 #include <string>
@@ -226,6 +228,75 @@ TEST_F(VocabOnlyModelsTest, UpdateByNonSingletonCount) {
   EXPECT_NEAR(scores.probabilities(2), 0.3, kEpsilon);       // "b"
 }
 
+TEST_F(VocabOnlyModelsTest, AdaptToText) {
+  CheckUniform();
+  const int state = one_model_hub_->ContextState("ab");
+  const int64_t handle = one_model_hub_->StateHandle(state);
+
+  // Each line is counted from the start state, hence this is equivalent to
+  // the single-symbol observations in the NonUniformProbs test above.
+  ASSERT_OK(one_model_hub_->AdaptToText("a\na\nb\n"));
+  LMScores scores;
+  ASSERT_TRUE(one_model_hub_->ExtractLMScores(one_model_start_state_, &scores));
+  ASSERT_EQ(3, scores.probabilities_size());
+  EXPECT_NEAR(scores.probabilities(0), 0.114285, kEpsilon);  // </S>
+  EXPECT_NEAR(scores.probabilities(1), 0.585714, kEpsilon);  // "a"
+  EXPECT_NEAR(scores.probabilities(2), 0.3, kEpsilon);  // "b"
+
+  // The existing hub states are invalidated, their handles are rebuilt.
+  EXPECT_NE(handle, one_model_hub_->StateHandle(state));
+  EXPECT_EQ(-1, one_model_hub_->ResolveStateHandle(handle));
+  const int rebuilt_state = one_model_hub_->ResolveStateHandle(handle, "ab");
+  EXPECT_LE(0, rebuilt_state);
+  EXPECT_EQ(kAsciiB, one_model_hub_->StateSym(rebuilt_state));
+  EXPECT_EQ(rebuilt_state, one_model_hub_->ContextState("ab"));
+}
+
+TEST(LanguageModelHubTest, AdaptToTextAdaptsAllModelsWithoutMixture) {
+  const auto write_status = WriteTempTextFile(kVocabFileName, "ab");
+  ASSERT_OK(write_status.status());
+  ModelHubConfig hub_config;
+  hub_config.set_mixture_type(ModelHubConfig::NONE);
+  for (int idx = 0; idx < 2; ++idx) {
+    ModelConfig *model_config = hub_config.add_model_config();
+    model_config->set_type(ModelConfig::PPM_AS_FST);
+    ModelStorage *storage = model_config->mutable_storage();
+    storage->set_vocabulary_file(write_status.value());
+    storage->mutable_ppm_options()->set_max_order(2);
+    storage->mutable_ppm_options()->set_static_model(false);
+  }
+  auto hub_status = MakeModelHub(hub_config);
+  ASSERT_OK(hub_status.status());
+  std::unique_ptr<LanguageModelHub> hub = std::move(hub_status.value());
+  EXPECT_TRUE(std::filesystem::remove(write_status.value()));
+  ASSERT_OK(hub->AdaptToText("a\na\nb\n"));
+
+  // Only the first model is scored under the NONE mixture, hence the second
+  // one is checked by reading back its snapshot, which must have been adapted
+  // as in the AdaptToText test above.
+  const auto snapshots_status = hub->SnapshotModels();
+  ASSERT_OK(snapshots_status.status());
+  ASSERT_EQ(2, snapshots_status.value().size());
+  ASSERT_NE(nullptr, snapshots_status.value()[1]);
+  const std::string snapshot_path =
+      (std::filesystem::temp_directory_path() / "adapted_model.fst").string();
+  ASSERT_OK(snapshots_status.value()[1]->Write(snapshot_path));
+  hub_config.mutable_model_config()->DeleteSubrange(1, 1);
+  ModelStorage *storage = hub_config.mutable_model_config(0)->mutable_storage();
+  storage->clear_vocabulary_file();
+  storage->set_model_file(snapshot_path);
+  storage->mutable_ppm_options()->set_model_is_fst(true);
+  hub_status = MakeModelHub(hub_config);
+  ASSERT_OK(hub_status.status());
+  EXPECT_TRUE(std::filesystem::remove(snapshot_path));
+  LMScores scores;
+  ASSERT_TRUE(hub_status.value()->ExtractLMScores(0, &scores));
+  ASSERT_EQ(3, scores.probabilities_size());
+  EXPECT_NEAR(scores.probabilities(0), 0.114285, kEpsilon);  // </S>
+  EXPECT_NEAR(scores.probabilities(1), 0.585714, kEpsilon);  // "a"
+  EXPECT_NEAR(scores.probabilities(2), 0.3, kEpsilon);  // "b"
+}
+
 TEST_F(VocabOnlyModelsTest, CheckNextStateAndStateSymbol) {
   constexpr int kBadState = 100;
   int kBadSymbol = one_model_hub_->StateSym(kBadState);
@@ -332,6 +403,233 @@ TEST_F(VocabOnlyModelsTest, BayesMixtureTest) {
   EXPECT_NEAR(scores.probabilities(2), 0.1, kEpsilon);  // "b"
 }
 
+TEST_F(VocabOnlyModelsTest, SymLMScoreMatchesExtractedScores) {
+  EXPECT_TRUE(bayes_two_model_hub_->UpdateLMCounts(
+      bayes_two_model_start_state_, {kAsciiA}, 1));
+  const int next_state =
+      bayes_two_model_hub_->NextState(bayes_two_model_start_state_, kAsciiA);
+
+  // The single-symbol scores are mixed with the same Bayesian weights as the
+  // whole distribution (see BayesMixtureTest above).
+  const std::vector<std::pair<int, double>> expected_probs = {
+      {0, 0.3}, {kAsciiA, 0.6}, {kAsciiB, 0.1}};
+  for (const auto &[utf8_sym, prob] : expected_probs) {
+    EXPECT_NEAR(prob,
+                std::exp(-bayes_two_model_hub_->SymLMScore(next_state,
+                                                           utf8_sym)),
+                kEpsilon);
+  }
+  EXPECT_NEAR(1.0 / 3.0,
+              std::exp(-one_model_hub_->SymLMScore(one_model_start_state_,
+                                                   kAsciiB)),
+              kEpsilon);
+  EXPECT_EQ(0.0, std::exp(-bayes_two_model_hub_->SymLMScore(next_state, 'z')));
+  EXPECT_EQ(0.0, std::exp(-bayes_two_model_hub_->SymLMScore(-1, kAsciiA)));
+}
+
+TEST_F(VocabOnlyModelsTest, RepeatedContextReusesWalkedState) {
+  const int state = one_model_hub_->ContextState("abba");
+  const int64_t handle = one_model_hub_->StateHandle(state);
+  EXPECT_EQ(kAsciiA, one_model_hub_->StateSym(state));
+  EXPECT_EQ(state, one_model_hub_->ContextState("abba"));
+  EXPECT_EQ(handle, one_model_hub_->StateHandle(state));
+
+  // Same context consumed from a different state reaches a different state.
+  const int a_state = one_model_hub_->NextState(one_model_start_state_,
+                                                kAsciiA);
+  const int other_state = one_model_hub_->ContextState("bba", a_state);
+  EXPECT_NE(state, other_state);
+  EXPECT_EQ(other_state, one_model_hub_->ContextState("bba", a_state));
+}
+
+TEST_F(VocabOnlyModelsTest, WalkedStateMatchesPerSymbolBayesMixture) {
+  // Updates the counts, so that the history probabilities vary by symbol.
+  EXPECT_TRUE(bayes_two_model_hub_->UpdateLMCounts(
+      bayes_two_model_start_state_, {kAsciiA, kAsciiB, kAsciiA, kAsciiA}, 1));
+
+  // Walks the contexts both directly through the models and by creating a hub
+  // state for every symbol. The mixture weights, hence the mixed scores, at
+  // the final states should be the same. The second context continues from
+  // an existing state and is longer than the Bayesian history.
+  for (const std::vector<int> &symbols :
+       {std::vector<int>{kAsciiB, kAsciiB},
+        std::vector<int>{kAsciiB, kAsciiA, kAsciiA, kAsciiB}}) {
+    std::string context;
+    int state = bayes_two_model_start_state_;
+    for (const int sym : symbols) {
+      context.push_back(static_cast<char>(sym));
+    }
+    const int walked_state = bayes_two_model_hub_->ContextState(context);
+    for (const int sym : symbols) {
+      state = bayes_two_model_hub_->NextState(state, sym);
+    }
+    ASSERT_NE(walked_state, state);
+    LMScores walked_scores, scores;
+    ASSERT_TRUE(
+        bayes_two_model_hub_->ExtractLMScores(walked_state, &walked_scores));
+    ASSERT_TRUE(bayes_two_model_hub_->ExtractLMScores(state, &scores));
+    ASSERT_EQ(scores.probabilities_size(), walked_scores.probabilities_size());
+    for (int i = 0; i < scores.probabilities_size(); ++i) {
+      EXPECT_EQ(scores.symbols(i), walked_scores.symbols(i));
+      EXPECT_NEAR(scores.probabilities(i), walked_scores.probabilities(i),
+                  1E-9);
+    }
+  }
+}
+
+TEST(LanguageModelHubStateTest, BayesianHistorySumsWrapAround) {
+  // Appends more probabilities than the history holds, so that the ring
+  // buffers wrap around several times, and checks the sums of the most recent
+  // ones against brute-force sums.
+  constexpr int kHistoryLength = 3;
+  constexpr int kNumModels = 2;
+  LanguageModelHubState prev_state(std::vector<int>(kNumModels), -1, 0,
+                                   kHistoryLength);
+  LanguageModelHubState state(std::vector<int>(kNumModels), -1, 0,
+                              kHistoryLength);
+  std::vector<std::vector<double>> history;
+  for (int i = 0; i < 3 * kHistoryLength + 2; ++i) {
+    history.push_back({0.5 * i + 0.25, 1.0 / (i + 1)});
+    state.UpdateBayesianHistory(history.back(), prev_state);
+    prev_state.CopyBayesianHistory(state);
+    for (int idx = 0; idx < kNumModels; ++idx) {
+      double expected_sum = 0.0;
+      for (int j = std::max<int>(0, history.size() - kHistoryLength);
+           j < history.size(); ++j) {
+        expected_sum += history[j][idx];
+      }
+      EXPECT_NEAR(expected_sum, state.bayesian_history_probs_sum(idx), 1E-9);
+    }
+  }
+}
+
+TEST(LanguageModelHubTest, StateHandlesDetectRecycledStates) {
+  // Creates a single model hub maintaining very few states.
+  const auto write_status = WriteTempTextFile(kVocabFileName, "ab");
+  ASSERT_OK(write_status.status());
+  ModelHubConfig hub_config;
+  hub_config.set_maximim_maintained_states(10);
+  ModelConfig *model_config = hub_config.add_model_config();
+  model_config->set_type(ModelConfig::PPM_AS_FST);
+  model_config->mutable_storage()->set_vocabulary_file(write_status.value());
+  model_config->mutable_storage()->mutable_ppm_options()->set_max_order(2);
+  model_config->mutable_storage()->mutable_ppm_options()->set_static_model(
+      false);
+  auto hub_status = MakeModelHub(hub_config);
+  ASSERT_OK(hub_status.status());
+  std::unique_ptr<LanguageModelHub> hub = std::move(hub_status.value());
+  EXPECT_TRUE(std::filesystem::remove(write_status.value()));
+
+  // Handles of the start state and of newly created states resolve as is.
+  EXPECT_EQ(0, hub->StateHandle(0));
+  EXPECT_EQ(-1, hub->ResolveStateHandle(-1));
+  EXPECT_EQ(5, hub->ResolveStateHandle(5));  // Not yet allocated.
+  // Slots beyond the maximum number of states, or beyond the range of int,
+  // are rejected.
+  EXPECT_EQ(-1, hub->ResolveStateHandle(100));
+  EXPECT_EQ(-1, hub->ResolveStateHandle(int64_t{0xffffffff}));
+  const int state = hub->ContextState("ab");
+  const int64_t handle = hub->StateHandle(state);
+  EXPECT_EQ(state, hub->ResolveStateHandle(handle, "ab"));
+
+  // Creating many new states recycles all the slots, which invalidates the
+  // old handle. The state is then rebuilt from the fallback context.
+  int long_state = 0;
+  for (int i = 0; i < 20; ++i) {
+    long_state = hub->NextState(long_state, kAsciiA);
+  }
+  EXPECT_NE(handle, hub->StateHandle(state));
+  // Without a fallback context the state cannot be rebuilt, rather than being
+  // silently replaced by the start state.
+  EXPECT_EQ(-1, hub->ResolveStateHandle(handle));
+  const int rebuilt_state = hub->ResolveStateHandle(handle, "ab");
+  EXPECT_LE(0, rebuilt_state);
+  EXPECT_EQ(kAsciiB, hub->StateSym(rebuilt_state));
+  EXPECT_EQ(rebuilt_state, hub->ResolveStateHandle(
+      hub->StateHandle(rebuilt_state), "ab"));
+  EXPECT_EQ(0, hub->StateHandle(0));
+}
+
+TEST(LanguageModelHubTest, StateHandlesOfOtherEpochsAreRebuilt) {
+  const auto write_status = WriteTempTextFile(kVocabFileName, "ab");
+  ASSERT_OK(write_status.status());
+  ModelHubConfig hub_config;
+  ModelConfig *model_config = hub_config.add_model_config();
+  model_config->set_type(ModelConfig::PPM_AS_FST);
+  model_config->mutable_storage()->set_vocabulary_file(write_status.value());
+  model_config->mutable_storage()->mutable_ppm_options()->set_max_order(2);
+  auto hub_status = MakeModelHub(hub_config);
+  ASSERT_OK(hub_status.status());
+  std::unique_ptr<LanguageModelHub> old_hub = std::move(hub_status.value());
+  hub_status = MakeModelHub(hub_config);
+  ASSERT_OK(hub_status.status());
+  std::unique_ptr<LanguageModelHub> new_hub = std::move(hub_status.value());
+  EXPECT_TRUE(std::filesystem::remove(write_status.value()));
+  new_hub->set_state_handle_epoch(1);
+
+  // The handles issued by the old hub are rebuilt by the new one, including
+  // the handles of the slots not yet allocated by the new hub.
+  old_hub->ContextState("a");
+  const int64_t handle = old_hub->StateHandle(old_hub->ContextState("ab"));
+  EXPECT_EQ(-1, new_hub->ResolveStateHandle(handle));
+  const int state = new_hub->ResolveStateHandle(handle, "ab");
+  EXPECT_LE(0, state);
+  EXPECT_EQ(kAsciiB, new_hub->StateSym(state));
+  EXPECT_EQ(0, new_hub->ResolveStateHandle(old_hub->StateHandle(0)));
+  EXPECT_NE(old_hub->StateHandle(0), new_hub->StateHandle(0));
+  EXPECT_EQ(state, new_hub->ResolveStateHandle(new_hub->StateHandle(state),
+                                               "ab"));
+}
+
+TEST(LanguageModelHubTest, ConcurrentComponentsMatchSequential) {
+  // Creates Bayesian mixtures of two models, with and without component pool.
+  auto write_status = WriteTempTextFile(kVocabFileName, "ab");
+  ASSERT_OK(write_status.status());
+  const std::string vocab_path = write_status.value();
+  write_status = WriteTempTextFile(kSmallVocabFileName, "a");
+  ASSERT_OK(write_status.status());
+  const std::string small_vocab_path = write_status.value();
+  std::vector<std::unique_ptr<LanguageModelHub>> hubs;
+  for (const int pool_size : {0, 2}) {
+    ModelHubConfig hub_config;
+    hub_config.set_mixture_type(ModelHubConfig::INTERPOLATION);
+    hub_config.set_bayesian_history_length(2);
+    hub_config.set_component_pool_size(pool_size);
+    for (const auto &path : {vocab_path, small_vocab_path}) {
+      ModelConfig *model_config = hub_config.add_model_config();
+      model_config->set_type(ModelConfig::PPM_AS_FST);
+      model_config->mutable_storage()->set_vocabulary_file(path);
+      model_config->mutable_storage()->mutable_ppm_options()->set_max_order(2);
+      model_config->mutable_storage()->mutable_ppm_options()->set_static_model(
+          false);
+    }
+    auto hub_status = MakeModelHub(hub_config);
+    ASSERT_OK(hub_status.status());
+    hubs.push_back(std::move(hub_status.value()));
+  }
+  EXPECT_TRUE(std::filesystem::remove(vocab_path));
+  EXPECT_TRUE(std::filesystem::remove(small_vocab_path));
+
+  // Updates both hubs identically and compares the resulting estimates.
+  const std::vector<int> symbols = {kAsciiA, kAsciiB, kAsciiA, kAsciiA};
+  std::vector<int> states = {0, 0};
+  for (auto sym : symbols) {
+    LMScores scores, concurrent_scores;
+    for (int i = 0; i < hubs.size(); ++i) {
+      EXPECT_TRUE(hubs[i]->UpdateLMCounts(states[i], {sym}, 1));
+      states[i] = hubs[i]->NextState(states[i], sym);
+    }
+    ASSERT_TRUE(hubs[0]->ExtractLMScores(states[0], &scores));
+    ASSERT_TRUE(hubs[1]->ExtractLMScores(states[1], &concurrent_scores));
+    ASSERT_EQ(scores.symbols_size(), concurrent_scores.symbols_size());
+    for (int i = 0; i < scores.symbols_size(); ++i) {
+      EXPECT_EQ(scores.symbols(i), concurrent_scores.symbols(i));
+      EXPECT_THAT(concurrent_scores.probabilities(i),
+                  DoubleEq(scores.probabilities(i)));
+    }
+  }
+}
+
 }  // namespace
 }  // namespace models
 }  // namespace mozolm
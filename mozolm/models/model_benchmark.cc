@@ -0,0 +1,154 @@
+// Copyright 2026 MozoLM Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Microbenchmarks for the hot paths of the individual language models.
+//
+// Each benchmark is parameterized by the model type (see BenchmarkModel enum)
+// and processes the held-out evaluation text, reporting the throughput in
+// characters per second. Example:
+//
+//   bazel run -c opt //mozolm/models:model_benchmark -- --benchmark_filter=Extract
+
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "google/protobuf/stubs/logging.h"
+#include "benchmark/benchmark.h"
+#include "mozolm/models/language_model.h"
+#include "mozolm/models/lm_scores.pb.h"
+#include "mozolm/models/model_benchmark_utils.h"
+#include "mozolm/models/model_factory.h"
+
+namespace mozolm {
+namespace models {
+namespace {
+
+// Manufactures a new instance of the given model.
+std::unique_ptr<LanguageModel> NewModel(BenchmarkModel model) {
+  auto model_status = MakeModel(BenchmarkModelConfig(model));
+  GOOGLE_CHECK(model_status.ok()) << "Failed to initialize "
+                                  << BenchmarkModelName(model) << ": "
+                                  << model_status.status().ToString();
+  return std::move(model_status.value());
+}
+
+// Returns the shared instance of the given model. Models are loaded once and
+// shared between the read-only benchmarks.
+LanguageModel *GetModel(BenchmarkModel model) {
+  static auto *models =
+      new std::vector<std::unique_ptr<LanguageModel>>(kNumBenchmarkModels);
+  auto &instance = (*models)[model];
+  if (instance == nullptr) instance = NewModel(model);
+  return instance.get();
+}
+
+// Walks the model over the evaluation text and returns the (state, symbol)
+// pairs visited along the way. Every line starts from the start state.
+std::vector<std::pair<int, int>> GetStateSymPairs(LanguageModel *model) {
+  std::vector<std::pair<int, int>> pairs;
+  for (const auto &line : BenchmarkCorpus()) {
+    int state = model->start_state();
+    for (const int utf8_sym : line) {
+      pairs.emplace_back(state, utf8_sym);
+      state = model->NextState(state, utf8_sym);
+    }
+  }
+  return pairs;
+}
+
+// Performs the common bookkeeping for all the benchmarks.
+void SetCounters(int64_t items_per_iteration, ::benchmark::State &state) {
+  state.SetLabel(
+      BenchmarkModelName(static_cast<BenchmarkModel>(state.range(0))));
+  state.SetItemsProcessed(state.iterations() * items_per_iteration);
+}
+
+void BM_NextState(::benchmark::State &state) {
+  LanguageModel *model = GetModel(static_cast<BenchmarkModel>(state.range(0)));
+  for (auto _ : state) {
+    for (const auto &line : BenchmarkCorpus()) {
+      int model_state = model->start_state();
+      for (const int utf8_sym : line) {
+        model_state = model->NextState(model_state, utf8_sym);
+      }
+      ::benchmark::DoNotOptimize(model_state);
+    }
+  }
+  SetCounters(BenchmarkCorpusNumChars(), state);
+}
+BENCHMARK(BM_NextState)->DenseRange(0, kNumBenchmarkModels - 1);
+
+void BM_SymLMScore(::benchmark::State &state) {
+  LanguageModel *model = GetModel(static_cast<BenchmarkModel>(state.range(0)));
+  const auto pairs = GetStateSymPairs(model);
+  for (auto _ : state) {
+    for (const auto &[model_state, utf8_sym] : pairs) {
+      ::benchmark::DoNotOptimize(model->SymLMScore(model_state, utf8_sym));
+    }
+  }
+  SetCounters(pairs.size(), state);
+}
+BENCHMARK(BM_SymLMScore)->DenseRange(0, kNumBenchmarkModels - 1);
+
+void BM_ExtractLMScores(::benchmark::State &state) {
+  LanguageModel *model = GetModel(static_cast<BenchmarkModel>(state.range(0)));
+  const auto pairs = GetStateSymPairs(model);
+  LMScores response;
+  for (auto _ : state) {
+    for (const auto &[model_state, utf8_sym] : pairs) {
+      response.Clear();
+      ::benchmark::DoNotOptimize(model->ExtractLMScores(model_state,
+                                                        &response));
+    }
+  }
+  SetCounters(pairs.size(), state);
+}
+BENCHMARK(BM_ExtractLMScores)->DenseRange(0, kNumBenchmarkModels - 1);
+
+// Updates the counts for each character of the evaluation text before moving
+// to the next state. Uses a fresh copy of the model since dynamic models are
+// modified by the updates. Note, for static models this only measures the
+// overhead of the (no-op) update call.
+void BM_UpdateLMCounts(::benchmark::State &state) {
+  std::unique_ptr<LanguageModel> model =
+      NewModel(static_cast<BenchmarkModel>(state.range(0)));
+  for (auto _ : state) {
+    for (const auto &line : BenchmarkCorpus()) {
+      int model_state = model->start_state();
+      for (const int utf8_sym : line) {
+        ::benchmark::DoNotOptimize(model->UpdateLMCounts(
+            model_state, {utf8_sym}, /*count=*/1));
+        model_state = model->NextState(model_state, utf8_sym);
+      }
+    }
+  }
+  SetCounters(BenchmarkCorpusNumChars(), state);
+}
+BENCHMARK(BM_UpdateLMCounts)->DenseRange(0, kNumBenchmarkModels - 1);
+
+void BM_ContextState(::benchmark::State &state) {
+  LanguageModel *model = GetModel(static_cast<BenchmarkModel>(state.range(0)));
+  for (auto _ : state) {
+    for (const auto &line : BenchmarkCorpusLines()) {
+      ::benchmark::DoNotOptimize(model->ContextState(line));
+    }
+  }
+  SetCounters(BenchmarkCorpusNumChars(), state);
+}
+BENCHMARK(BM_ContextState)->DenseRange(0, kNumBenchmarkModels - 1);
+
+}  // namespace
+}  // namespace models
+}  // namespace mozolm
@@ -0,0 +1,149 @@
+// Copyright 2026 MozoLM Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "mozolm/models/model_benchmark_utils.h"
+
+#include <fstream>
+#include <iterator>
+
+#include "google/protobuf/stubs/logging.h"
+#include "nisaba/port/test_utils.h"
+#include "nisaba/port/utf8_util.h"
+
+using ::nisaba::testing::TestFilePath;
+
+namespace mozolm {
+namespace models {
+namespace {
+
+const char kModelsTestDir[] = "com_google_mozolm/mozolm/models/testdata";
+
+// Training and evaluation data.
+const char kBigramRowsFilename[] = "en_wiki_1Mline_char_bigram.rows.txt";
+const char kBigramMatrixFilename[] = "en_wiki_1Mline_char_bigram.matrix.txt";
+const char kCharFstModelFilename[] = "gutenberg_en_char_ngram_o2_kn.fst";
+const char kTrainTextFilename[] = "en_wiki_1Kline_sample.txt";
+const char kWordFstModelFilename[] = "en_wiki_1Kline_sample.katz_word3g.fst";
+const char kEvalTextFilename[] = "en_wiki_100line_dev_sample.txt";
+
+// Maximum order of the PPM models.
+constexpr int kPpmMaxOrder = 4;
+
+// Order of the models mixed in the hub benchmarks.
+constexpr BenchmarkModel kHubModels[] = {
+    kDynamicPpmAsFst, kCharNGramFst, kWordNGramFst, kSimpleCharBigram};
+
+}  // namespace
+
+std::string BenchmarkModelName(BenchmarkModel model) {
+  switch (model) {
+    case kSimpleCharBigram:
+      return "SIMPLE_CHAR_BIGRAM";
+    case kCharNGramFst:
+      return "CHAR_NGRAM_FST";
+    case kStaticPpmAsFst:
+      return "PPM_AS_FST/static";
+    case kDynamicPpmAsFst:
+      return "PPM_AS_FST/dynamic";
+    case kWordNGramFst:
+      return "WORD_NGRAM_FST";
+    default:
+      return "UNKNOWN";
+  }
+}
+
+ModelConfig BenchmarkModelConfig(BenchmarkModel model) {
+  ModelConfig config;
+  ModelStorage *storage = config.mutable_storage();
+  switch (model) {
+    case kSimpleCharBigram:
+      config.set_type(ModelConfig::SIMPLE_CHAR_BIGRAM);
+      storage->set_vocabulary_file(
+          TestFilePath(kModelsTestDir, kBigramRowsFilename));
+      storage->set_model_file(
+          TestFilePath(kModelsTestDir, kBigramMatrixFilename));
+      break;
+    case kCharNGramFst:
+      config.set_type(ModelConfig::CHAR_NGRAM_FST);
+      storage->set_model_file(
+          TestFilePath(kModelsTestDir, kCharFstModelFilename));
+      break;
+    case kStaticPpmAsFst:
+    case kDynamicPpmAsFst:
+      config.set_type(ModelConfig::PPM_AS_FST);
+      storage->set_model_file(TestFilePath(kModelsTestDir, kTrainTextFilename));
+      storage->mutable_ppm_options()->set_max_order(kPpmMaxOrder);
+      storage->mutable_ppm_options()->set_static_model(
+          model == kStaticPpmAsFst);
+      break;
+    case kWordNGramFst:
+      config.set_type(ModelConfig::WORD_NGRAM_FST);
+      storage->set_model_file(
+          TestFilePath(kModelsTestDir, kWordFstModelFilename));
+      break;
+    default:
+      GOOGLE_LOG(FATAL) << "Unknown benchmark model: " << model;
+  }
+  return config;
+}
+
+ModelHubConfig BenchmarkModelHubConfig(int num_models,
+                                       int bayesian_history_length) {
+  ModelHubConfig config;
+  config.set_mixture_type(ModelHubConfig::INTERPOLATION);
+  config.set_bayesian_history_length(bayesian_history_length);
+  const int max_models = std::size(kHubModels);
+  for (int idx = 0; idx < num_models && idx < max_models; ++idx) {
+    *config.add_model_config() = BenchmarkModelConfig(kHubModels[idx]);
+  }
+  return config;
+}
+
+const std::vector<std::string> &BenchmarkCorpusLines() {
+  static const std::vector<std::string> *lines = []() {
+    auto *lines = new std::vector<std::string>;
+    const std::string path = TestFilePath(kModelsTestDir, kEvalTextFilename);
+    std::ifstream infile(path);
+    GOOGLE_CHECK(infile.is_open()) << "Failed to open " << path;
+    std::string line;
+    while (std::getline(infile, line)) {
+      if (!line.empty()) lines->push_back(line);
+    }
+    return lines;
+  }();
+  return *lines;
+}
+
+const std::vector<std::vector<int>> &BenchmarkCorpus() {
+  static const std::vector<std::vector<int>> *corpus = []() {
+    auto *corpus = new std::vector<std::vector<int>>;
+    for (const auto &line : BenchmarkCorpusLines()) {
+      corpus->push_back(nisaba::utf8::StrSplitByCharToUnicode(line));
+    }
+    return corpus;
+  }();
+  return *corpus;
+}
+
+int64_t BenchmarkCorpusNumChars() {
+  static const int64_t num_chars = []() {
+    int64_t num_chars = 0;
+    for (const auto &line : BenchmarkCorpus()) num_chars += line.size();
+    return num_chars;
+  }();
+  return num_chars;
+}
+
+}  // namespace models
+}  // namespace mozolm
@@ -0,0 +1,65 @@
+// Copyright 2026 MozoLM Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Collection of utilities shared by the model and model hub benchmarks.
+
+#ifndef MOZOLM_MOZOLM_MODELS_MODEL_BENCHMARK_UTILS_H_
+#define MOZOLM_MOZOLM_MODELS_MODEL_BENCHMARK_UTILS_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "mozolm/models/model_config.pb.h"
+
+namespace mozolm {
+namespace models {
+
+// Models built from the bundled test data that are being benchmarked.
+enum BenchmarkModel {
+  kSimpleCharBigram = 0,  // Wikipedia character bigram counts.
+  kCharNGramFst,          // Gutenberg character bigram Kneser-Ney FST.
+  kStaticPpmAsFst,        // Static PPM trained on Wikipedia sample.
+  kDynamicPpmAsFst,       // Dynamic PPM trained on Wikipedia sample.
+  kWordNGramFst,          // Wikipedia sample word trigram Katz FST.
+  kNumBenchmarkModels
+};
+
+// Returns human-readable name of the benchmark model.
+std::string BenchmarkModelName(BenchmarkModel model);
+
+// Returns the configuration for the given benchmark model.
+ModelConfig BenchmarkModelConfig(BenchmarkModel model);
+
+// Returns the configuration for a hub mixing the first num_models models from
+// the fixed list of dynamic PPM, character n-gram, word n-gram and simple
+// character bigram models. If bayesian_history_length is positive, the models
+// are mixed using Bayesian interpolation.
+ModelHubConfig BenchmarkModelHubConfig(int num_models,
+                                       int bayesian_history_length);
+
+// Returns the evaluation text, disjoint from the training data, as a list of
+// lines, each represented as a sequence of Unicode codepoints.
+const std::vector<std::vector<int>> &BenchmarkCorpus();
+
+// Same as above, but each line is kept as a UTF-8 string.
+const std::vector<std::string> &BenchmarkCorpusLines();
+
+// Returns the total number of characters in the evaluation text.
+int64_t BenchmarkCorpusNumChars();
+
+}  // namespace models
+}  // namespace mozolm
+
+#endif  // MOZOLM_MOZOLM_MODELS_MODEL_BENCHMARK_UTILS_H_
@@ -16,13 +16,16 @@
 
 #include <string>
 #include <utility>
+#include <vector>
 
 #include "google/protobuf/stubs/logging.h"
 #include "absl/strings/str_cat.h"
+#include "absl/synchronization/blocking_counter.h"
 #include "mozolm/models/ngram_char_fst_model.h"
 #include "mozolm/models/ngram_word_fst_model.h"
 #include "mozolm/models/ppm_as_fst_model.h"
 #include "mozolm/models/simple_bigram_char_model.h"
+#include "nisaba/port/thread_pool.h"
 #include "nisaba/port/timer.h"
 #include "nisaba/port/status_macros.h"
 
@@ -61,6 +64,7 @@ absl::StatusOr<std::unique_ptr<LanguageModel>> MakeModel(
 
 absl::StatusOr<std::unique_ptr<LanguageModelHub>> MakeModelHub(
     const ModelHubConfig &config) {
+  nisaba::Timer timer;
   std::unique_ptr<LanguageModelHub> model_hub(new LanguageModelHub);
   if (config.model_config_size() == 0) {
     GOOGLE_LOG(INFO) << "No models specified, adding a single default model.";
@@ -68,14 +72,42 @@ absl::StatusOr<std::unique_ptr<LanguageModelHub>> MakeModelHub(
     if (!model_status.ok()) return model_status.status();
     model_hub->AddModel(std::move(model_status.value()));
   } else {
-    for (auto idx = 0; idx < config.model_config_size(); ++idx) {
-      auto model_status = models::MakeModel(config.model_config(idx));
+    const int num_models = config.model_config_size();
+    std::vector<absl::StatusOr<std::unique_ptr<LanguageModel>>> models(
+        num_models);
+    const auto make_model = [&config, &models](int idx) {
+      nisaba::Timer model_timer;
+      models[idx] = models::MakeModel(config.model_config(idx));
+      GOOGLE_LOG(INFO) << "[Model " << idx << "] Loaded in "
+                       << model_timer.ElapsedMillis() << " msec.";
+    };
+
+    // The models are independent, hence are loaded concurrently. All but the
+    // first model are loaded by the pool, the first one is loaded by the
+    // calling thread while waiting for the others.
+    if (num_models > 1) {
+      nisaba::ThreadPool pool(num_models - 1);
+      absl::BlockingCounter models_pending(num_models - 1);
+      for (int idx = 1; idx < num_models; ++idx) {
+        pool.Schedule([&make_model, &models_pending, idx]() {
+          make_model(idx);
+          models_pending.DecrementCount();
+        });
+      }
+      make_model(0);
+      models_pending.Wait();
+    } else {
+      make_model(0);
+    }
+    for (auto &model_status : models) {
       if (!model_status.ok()) return model_status.status();
       model_hub->AddModel(std::move(model_status.value()));
     }
   }
   const auto status = model_hub->InitializeModels(config);
   if (!status.ok()) return status;
+  GOOGLE_LOG(INFO) << "Model hub ready in " << timer.ElapsedMillis()
+                   << " msec.";
   return std::move(model_hub);
 }
 
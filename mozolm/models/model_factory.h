@@ -36,7 +36,8 @@ absl::StatusOr<std::unique_ptr<LanguageModel>> MakeModel(
 absl::StatusOr<std::unique_ptr<LanguageModel>> MakeModel(
     const ModelConfig::ModelType &model_type, const ModelStorage &storage);
 
-// Given model hub configuration, initializes all model instances.
+// Given model hub configuration, initializes all model instances. The
+// component models are loaded concurrently.
 absl::StatusOr<std::unique_ptr<LanguageModelHub>> MakeModelHub(
     const ModelHubConfig &config);
 
@@ -16,12 +16,24 @@
 
 #include <algorithm>
 #include <cmath>
+#include <functional>
+#include <limits>
 #include <memory>
+#include <string>
+#include <thread>  // NOLINT
+#include <utility>
+#include <vector>
 
 #include "google/protobuf/stubs/logging.h"
 #include "absl/memory/memory.h"
+#include "absl/strings/str_cat.h"
+#include "absl/synchronization/blocking_counter.h"
 #include "mozolm/models/model_storage.pb.h"
 #include "mozolm/models/ngram_word_fst_options.pb.h"
+#include "mozolm/utils/metrics.h"
+#include "nisaba/port/file_util.h"
+#include "nisaba/port/thread_pool.h"
+#include "nisaba/port/timer.h"
 #include "nisaba/port/utf8_util.h"
 #include "fst/fst.h"
 #include "fst/matcher.h"
@@ -29,9 +41,9 @@
 #include "third_party/opengrm/sfst/sfst.h"
 #include "nisaba/port/status_macros.h"
 
-using nisaba::utf8::DecodeSingleUnicodeChar;
 using nisaba::utf8::EncodeUnicodeChar;
 using nisaba::utf8::StrSplitByChar;
+using nisaba::utf8::StrSplitByCharToUnicode;
 
 using absl::StatusOr;
 using fst::ArcIterator;
@@ -44,6 +56,109 @@ using fst::Times;
 
 namespace mozolm {
 namespace models {
+namespace {
+
+// Number of n-gram state cache lookups that found the cached state.
+metrics::Counter *CacheHits() {
+  static metrics::Counter *const counter =
+      metrics::MetricsRegistry::Global().GetCounter("ngram/cache_hits");
+  return counter;
+}
+
+// Number of n-gram state cache lookups that (re)computed the state.
+metrics::Counter *CacheMisses() {
+  static metrics::Counter *const counter =
+      metrics::MetricsRegistry::Global().GetCounter("ngram/cache_misses");
+  return counter;
+}
+
+// Number of n-gram states evicted from the full cache.
+metrics::Counter *CacheEvictions() {
+  static metrics::Counter *const counter =
+      metrics::MetricsRegistry::Global().GetCounter("ngram/cache_evictions");
+  return counter;
+}
+
+// Number of implicit (word prefix) states created.
+metrics::Counter *ImplicitStatesCreated() {
+  static metrics::Counter *const counter =
+      metrics::MetricsRegistry::Global().GetCounter(
+          "ngram/implicit_states_created");
+  return counter;
+}
+
+// Number of times all the implicit states have been discarded, once a slot
+// has run out of generations.
+metrics::Counter *ImplicitStatesReset() {
+  static metrics::Counter *const counter =
+      metrics::MetricsRegistry::Global().GetCounter(
+          "ngram/implicit_states_reset");
+  return counter;
+}
+
+// Number of implicit states evicted to make room for the new ones.
+metrics::Counter *ImplicitStatesEvicted() {
+  static metrics::Counter *const counter =
+      metrics::MetricsRegistry::Global().GetCounter(
+          "ngram/implicit_states_evicted");
+  return counter;
+}
+
+// Minimal number of symbols sorted by a single thread when establishing the
+// lexicographic ordering of large vocabularies.
+constexpr int kMinSymbolsPerSortShard = 1 << 15;
+
+// Runs the function for each of the shards concurrently. All but the first
+// shard are run by a pool, the first one is run by the calling thread.
+void RunShards(int num_shards, const std::function<void(int)> &shard_fn) {
+  if (num_shards <= 1) {
+    shard_fn(0);
+    return;
+  }
+  nisaba::ThreadPool pool(num_shards - 1);
+  absl::BlockingCounter shards_pending(num_shards - 1);
+  for (int shard = 1; shard < num_shards; ++shard) {
+    pool.Schedule([&shard_fn, &shards_pending, shard]() {
+      shard_fn(shard);
+      shards_pending.DecrementCount();
+    });
+  }
+  shard_fn(0);
+  shards_pending.Wait();
+}
+
+// Sorts the labels by their symbols. The large vocabularies are sorted in
+// shards, which are then merged pairwise, all in parallel.
+void SortLabelsBySymbol(const std::vector<std::string> &symbols,
+                        std::vector<int> *labels) {
+  const auto symbol_less = [&symbols](int label1, int label2) {
+    return symbols[label1] < symbols[label2];
+  };
+  const int num_shards = std::max<int>(
+      1, std::min<int>(std::thread::hardware_concurrency(),
+                       labels->size() / kMinSymbolsPerSortShard));
+  std::vector<int> bounds(num_shards + 1);
+  for (int shard = 0; shard <= num_shards; ++shard) {
+    bounds[shard] = static_cast<int64_t>(labels->size()) * shard / num_shards;
+  }
+  const auto begin = labels->begin();
+  RunShards(num_shards, [&](int shard) {
+    std::sort(begin + bounds[shard], begin + bounds[shard + 1], symbol_less);
+  });
+  for (int width = 1; width < num_shards; width *= 2) {
+    const int num_merges = (num_shards + 2 * width - 1) / (2 * width);
+    RunShards(num_merges, [&](int merge) {
+      const int first = 2 * width * merge;
+      const int middle = std::min(first + width, num_shards);
+      const int last = std::min(first + 2 * width, num_shards);
+      std::inplace_merge(begin + bounds[first], begin + bounds[middle],
+                         begin + bounds[last], symbol_less);
+    });
+  }
+}
+
+}  // namespace
+
 namespace impl {
 namespace {
 
@@ -54,143 +169,206 @@ double SafeNegLogDiff(double cost1, double cost2) {
   return sfst::NegLogDiff(cost1, cost2);
 }
 
-// Returns the character at index idx in the unicode string.
-std::string GetNextChar(const std::string& sym, int idx) {
-  const std::vector<std::string> syms = StrSplitByChar(sym);
-  if (idx < 0 || syms.size() <= idx) {
-    // No symbol at that index for the input string, returns whitespace.
-    return " ";
-  }
-  return syms[idx];
-}
-
 }  // namespace
 }  // namespace impl
 
-absl::Status NGramWordFstModel::EstablishLexicographicOrdering() {
+absl::Status NGramWordFstModel::SortLexicographicOrder() {
   const SymbolTable *syms = fst().InputSymbols();
   std::vector<std::string> symbols(syms->NumSymbols());
-  for (StdArc::Label i = 0; i < symbols.size(); ++i) {
-    symbols[i] = syms->Find(i);
+  std::vector<int> labels;
+  labels.reserve(symbols.size());
+  for (const auto &sym : *syms) {
+    const StdArc::Label label = sym.Label();
+    if (label < 0 || label >= symbols.size()) {
+      return absl::InternalError("Symbol table for model is not dense");
+    }
+    symbols[label] = sym.Symbol();
+    if (label != 0 && label != oov_label()) labels.push_back(label);
   }
-  std::sort(symbols.begin(), symbols.end());
-  lexicographic_order_.resize(symbols.size());
-  lexicographic_position_.resize(symbols.size());
-  previous_common_prefix_length_.resize(symbols.size());
+  SortLabelsBySymbol(symbols, &labels);
+
   // By convention, put <epsilon> symbol initially, since we won't use that
-  // position for symbol ranges.
-  int idx = 0;
-  previous_common_prefix_length_[idx] = 0;
-  lexicographic_order_[idx] = 0;
-  lexicographic_position_[0] = idx++;
-  first_char_begin_index_ = idx;
-  std::string first_char;
-  std::vector<std::string> last_string(1);
-  for (int i = 0; i < symbols.size(); ++i) {
-    StdArc::Label sym = syms->Find(symbols[i]);
-    if (sym != 0 && sym != oov_label()) {
-      const std::vector<std::string> this_string = StrSplitByChar(symbols[i]);
-      int prefix_match = 0;
-      int min_len = std::min(last_string.size(), this_string.size());
-      while (prefix_match < min_len &&
-             last_string[prefix_match] == this_string[prefix_match]) {
-        ++prefix_match;
-      }
-      if (prefix_match == 0) {
-        // No prefix overlap, hence new first letter of a word.
-        if (idx > 1) {
-          // Records last index of previous character.
-          first_char_ends_.push_back(idx - 1);
-        }
-        const std::string first_char =
-            this_string.empty() ? "" : this_string[0];
-        first_chars_.push_back(first_char);
-      }
-      previous_common_prefix_length_[idx] = prefix_match;
-      lexicographic_order_[idx] = sym;
-      lexicographic_position_[sym] = idx++;
-      last_string = this_string;
+  // position for symbol ranges. Likewise, put oov_label() last if it exists,
+  // since we won't use that symbol in our calculations.
+  lexicographic_order_.clear();
+  lexicographic_order_.reserve(symbols.size());
+  lexicographic_order_.push_back(0);
+  lexicographic_order_.insert(lexicographic_order_.end(), labels.begin(),
+                              labels.end());
+  if (oov_label() > 0) lexicographic_order_.push_back(oov_label());
+  return absl::OkStatus();
+}
+
+absl::Status NGramWordFstModel::ReadLexicographicOrder(
+    absl::string_view order_file) {
+  std::string contents;
+  ASSIGN_OR_RETURN(contents, nisaba::file::ReadBinaryFile(order_file));
+  const int num_symbols = fst().InputSymbols()->NumSymbols();
+  if (contents.size() != num_symbols * sizeof(int32_t)) {
+    return absl::InvalidArgumentError(absl::StrCat(
+        "Lexicographic order in ", order_file, " has ",
+        contents.size() / sizeof(int32_t), " symbols, expected ",
+        num_symbols));
+  }
+  // The labels are stored as 32-bit little-endian integers.
+  const auto *bytes = reinterpret_cast<const uint8_t *>(contents.data());
+  lexicographic_order_.resize(num_symbols);
+  for (int i = 0; i < num_symbols; ++i, bytes += sizeof(int32_t)) {
+    lexicographic_order_[i] = static_cast<int32_t>(
+        bytes[0] | bytes[1] << 8 | bytes[2] << 16 |
+        static_cast<uint32_t>(bytes[3]) << 24);
+  }
+  // Checking the order of the adjacent words is much cheaper than sorting, and
+  // guards against the order files of other models.
+  const SymbolTable *syms = fst().InputSymbols();
+  const int end_index = num_symbols - (oov_label() > 0 ? 1 : 0);
+  bool sorted =
+      lexicographic_order_[0] == 0 &&
+      (oov_label() <= 0 || lexicographic_order_.back() == oov_label());
+  for (int i = 2; sorted && i < end_index; ++i) {
+    sorted = syms->Find(lexicographic_order_[i - 1]) <
+             syms->Find(lexicographic_order_[i]);
+  }
+  if (!sorted) {
+    return absl::InvalidArgumentError(absl::StrCat(
+        "Lexicographic order in ", order_file,
+        " does not match the model symbols"));
+  }
+  return absl::OkStatus();
+}
+
+absl::Status NGramWordFstModel::WriteLexicographicOrder(
+    absl::string_view order_file) const {
+  std::string contents;
+  contents.reserve(lexicographic_order_.size() * sizeof(int32_t));
+  for (const int label : lexicographic_order_) {
+    for (int shift = 0; shift < 32; shift += 8) {
+      contents.push_back(static_cast<char>((label >> shift) & 0xFF));
     }
   }
-  first_char_ends_.push_back(idx - 1);
-  if (oov_label() >= 0) {
-    // By convention, put oov_label() last if it exists, since we won't use that
-    // symbol in our calculations.
-    lexicographic_order_[idx] = oov_label();
-    previous_common_prefix_length_[idx] = 0;
-    lexicographic_order_[oov_label()] = idx++;
+  return nisaba::file::WriteBinaryFile(order_file, contents);
+}
+
+absl::Status NGramWordFstModel::EstablishLexicographicOrdering(
+    absl::string_view order_file) {
+  nisaba::Timer timer;
+  absl::Status status = absl::NotFoundError("No lexicographic order file");
+  if (!order_file.empty()) {
+    status = ReadLexicographicOrder(order_file);
+    if (!status.ok()) {
+      GOOGLE_LOG(WARNING) << "Sorting the vocabulary, failed to read the "
+                          << "lexicographic order: " << status.ToString();
+    }
   }
-  if (idx != symbols.size()) {
+  if (!status.ok()) RETURN_IF_ERROR(SortLexicographicOrder());
+
+  // Establishes the positions of the symbols, checking that the ordering is a
+  // permutation of the dense symbol table.
+  const SymbolTable *syms = fst().InputSymbols();
+  const int num_symbols = syms->NumSymbols();
+  if (lexicographic_order_.size() != num_symbols) {
     return absl::InternalError("Symbol table for model is not dense");
   }
+  lexicographic_position_.assign(num_symbols, -1);
+  for (int idx = 0; idx < num_symbols; ++idx) {
+    const int label = lexicographic_order_[idx];
+    if (label < 0 || label >= num_symbols ||
+        lexicographic_position_[label] >= 0) {
+      return absl::InternalError("Lexicographic order is not a permutation");
+    }
+    lexicographic_position_[label] = idx;
+  }
+
+  // Builds the character trie over the words, split into the characters by
+  // shards of the vocabulary in parallel.
+  first_char_begin_index_ = 1;
+  const int num_words = num_symbols - (oov_label() > 0 ? 2 : 1);
+  std::vector<std::vector<int>> words(num_words);
+  const int num_shards = std::max<int>(
+      1, std::min<int>(std::thread::hardware_concurrency(),
+                       num_words / kMinSymbolsPerSortShard));
+  RunShards(num_shards, [&](int shard) {
+    const int end = static_cast<int64_t>(num_words) * (shard + 1) / num_shards;
+    for (int i = static_cast<int64_t>(num_words) * shard / num_shards; i < end;
+         ++i) {
+      words[i] = StrSplitByCharToUnicode(
+          syms->Find(lexicographic_order_[first_char_begin_index_ + i]));
+    }
+  });
+  prefix_trie_.Build(words, first_char_begin_index_);
+  GOOGLE_LOG(INFO) << "Established lexicographic order of " << num_symbols
+                   << " symbols in " << timer.ElapsedMillis() << " msec.";
   ngram_implicit_states_ = std::make_unique<NGramImplicitStates>(
-      fst(), first_char_begin_index_, first_char_ends_.back());
+      fst(), first_char_begin_index_,
+      prefix_trie_.end_index(WordPrefixTrie::kRoot), max_implicit_states_);
 
   // Creates an implicit state for out-of-vocabulary words, which then
   // transitions to the unigram state at a word boundary.
   StatusOr<int> oov_state = ngram_implicit_states_->GetState(
       /*model_state=*/-1, /*prefix_length=*/1, /*symbol_begin_index=*/-1,
-      /*symbol_end_index=*/-1);
+      /*symbol_end_index=*/-1, /*trie_node=*/-1);
   if (!oov_state.ok()) {
     return absl::InternalError("Could not establish OOV state");
   }
   oov_state_ = *oov_state;
+  RETURN_IF_ERROR(ngram_implicit_states_->Pin(oov_state_));
   return absl::OkStatus();
 }
 
 std::vector<double> NGramWordFstModel::FillWeightVector(int state) {
-  if (cache_index_[state] >= 0) {
-    // State is already cached, returning the probabilities.
-    return state_cache_[cache_index_[state]]->cummulative_neg_log_probs();
-  }
   std::vector<double> weights(lexicographic_order_.size(),
                               StdArc::Weight::Zero().Value());
-  std::vector<bool> weights_here(weights.size(), false);
   for (ArcIterator<StdVectorFst> arc_iterator(fst(), state);
        !arc_iterator.Done(); arc_iterator.Next()) {
     const StdArc arc = arc_iterator.Value();
     if (arc.ilabel > 0) {
       weights[lexicographic_position_[arc.ilabel]] = arc.weight.Value();
-      weights_here[lexicographic_position_[arc.ilabel]] = true;
-    }
-  }
-  StdArc::Weight backoff_weight;
-  const StdArc::StateId backoff_state = GetBackoff(state, &backoff_weight);
-  std::vector<double> backoff_weights;
-  if (backoff_state != fst::kNoStateId) {
-    // Gets vector from backoff state.
-    absl::Status status = EnsureCacheIndex(backoff_state);
-    if (status == absl::OkStatus()) {
-      backoff_weights = FillWeightVector(backoff_state);
-      state_cache_[cache_index_[backoff_state]]->set_last_accessed(
-          cache_accessed_++);
     }
   }
-  if (backoff_weights.empty()) {
-    // Marks all items as having weight drawn from this state.
-    weights_here.clear();
-    weights_here.resize(weights.size(), true);
-  }
-  if (fst().Final(state) != StdArc::Weight::Zero()) {
-    // By convention, index 0 is end-of-string probability.
-    weights[0] = fst().Final(state).Value();
-  } else if (!backoff_weights.empty()) {
-    weights[0] = backoff_weights[0] + backoff_weight.Value();
-  }
+  // By convention, index 0 is end-of-string probability.
+  weights[0] = fst().Final(state).Value();
   double kahan_value = 0.0;
   for (int i = 1; i < weights.size(); ++i) {
-    if (!weights_here[i]) {
-      // Derives backoff probability by unsumming backoff cummulative weights.
-      weights[i] =
-          backoff_weight.Value() +
-          impl::SafeNegLogDiff(backoff_weights[i], backoff_weights[i - 1]);
-    }
     // Converts to cummulative weights for ease of later aggregation.
     weights[i] = sfst::NegLogSum(weights[i], weights[i - 1], &kahan_value);
   }
   return weights;
 }
 
+std::unique_ptr<NGramStateCache> NGramWordFstModel::MakeSparseCache(
+    int state, int backoff_state, StdArc::Weight backoff_weight) {
+  std::vector<std::pair<int, double>> explicit_costs;
+  explicit_costs.reserve(fst().NumArcs(state) + 1);
+  if (fst().Final(state) != StdArc::Weight::Zero()) {
+    // By convention, index 0 is end-of-string probability.
+    explicit_costs.emplace_back(0, fst().Final(state).Value());
+  }
+  for (ArcIterator<StdVectorFst> arc_iterator(fst(), state);
+       !arc_iterator.Done(); arc_iterator.Next()) {
+    const StdArc arc = arc_iterator.Value();
+    if (arc.ilabel > 0) {
+      explicit_costs.emplace_back(lexicographic_position_[arc.ilabel],
+                                  arc.weight.Value());
+    }
+  }
+  std::sort(explicit_costs.begin(), explicit_costs.end());
+  std::vector<int> indices;
+  std::vector<double> prob_deltas;
+  indices.reserve(explicit_costs.size());
+  prob_deltas.reserve(explicit_costs.size());
+  for (const auto &[index, cost] : explicit_costs) {
+    const double backoff_cost =
+        backoff_weight.Value() +
+        GetCachedRangeCost(backoff_state, index, index);
+    indices.push_back(index);
+    prob_deltas.push_back(std::exp(-cost) - std::exp(-backoff_cost));
+  }
+  return std::make_unique<NGramStateCache>(state, cache_accessed_++,
+                                           backoff_state,
+                                           backoff_weight.Value(), indices,
+                                           prob_deltas);
+}
+
 int NGramWordFstModel::FindOldestLastAccessedCache() const {
   int least_accessed_cache = 0;
   int oldest_access = state_cache_[0]->last_accessed();
@@ -204,11 +382,10 @@ int NGramWordFstModel::FindOldestLastAccessedCache() const {
 }
 
 absl::Status NGramWordFstModel::GetNewCacheIndex(
-    StdArc::StateId s, const std::vector<double> &weights) {
+    StdArc::StateId s, std::unique_ptr<NGramStateCache> cache) {
   if (state_cache_.size() < max_cache_size_) {
     cache_index_[s] = state_cache_.size();
-    state_cache_.push_back(
-        std::make_unique<NGramStateCache>(s, cache_accessed_++, weights));
+    state_cache_.push_back(std::move(cache));
   } else {
     const int index_to_update = FindOldestLastAccessedCache();
     const StdArc::StateId old_state = state_cache_[index_to_update]->state();
@@ -216,8 +393,8 @@ absl::Status NGramWordFstModel::GetNewCacheIndex(
       return absl::InternalError("Cache index not updated correctly.");
     }
     cache_index_[old_state] = -1;
-    state_cache_[index_to_update] =
-        std::make_unique<NGramStateCache>(s, cache_accessed_++, weights);
+    CacheEvictions()->Increment();
+    state_cache_[index_to_update] = std::move(cache);
     cache_index_[s] = index_to_update;
   }
   return absl::OkStatus();
@@ -225,19 +402,40 @@ absl::Status NGramWordFstModel::GetNewCacheIndex(
 
 absl::Status NGramWordFstModel::EnsureCacheIndex(int state) {
   if (cache_index_[state] >= 0) {
+    // Refreshes the access, so that the caches at the backoff states, which
+    // are visited by the lookups at all their higher order states, stay.
+    state_cache_[cache_index_[state]]->set_last_accessed(cache_accessed_++);
+    CacheHits()->Increment();
     return absl::OkStatus();
   }
-  const std::vector<double> weights = FillWeightVector(state);
-  return GetNewCacheIndex(state, weights);
+  CacheMisses()->Increment();
+  StdArc::Weight backoff_weight;
+  const StdArc::StateId backoff_state = GetBackoff(state, &backoff_weight);
+  if (backoff_state != fst::kNoStateId) {
+    return GetNewCacheIndex(
+        state, MakeSparseCache(state, backoff_state, backoff_weight));
+  }
+  return GetNewCacheIndex(
+      state, std::make_unique<NGramStateCache>(state, cache_accessed_++,
+                                               FillWeightVector(state),
+                                               cache_precision_));
 }
 
 absl::Status NGramWordFstModel::Read(const ModelStorage &storage) {
   RETURN_IF_ERROR(NGramFstModel::Read(storage));
-  RETURN_IF_ERROR(EstablishLexicographicOrdering());
+  max_implicit_states_ =
+      storage.ngram_word_fst_options().max_implicit_states() > 0
+          ? std::min<int64_t>(
+                storage.ngram_word_fst_options().max_implicit_states(),
+                std::numeric_limits<int>::max())
+          : kMaxNGramImplicitStates;
+  RETURN_IF_ERROR(EstablishLexicographicOrdering(
+      storage.ngram_word_fst_options().lexicographic_order_file()));
   max_cache_size_ =
       storage.ngram_word_fst_options().max_cache_size() > hi_order()
           ? storage.ngram_word_fst_options().max_cache_size()
           : kMaxNGramCache;
+  cache_precision_ = storage.ngram_word_fst_options().cache_precision();
   cache_accessed_ = 0;
   cache_index_.resize(fst_->NumStates(), -1);
   set_start_state(fst_->Start());
@@ -246,82 +444,30 @@ absl::Status NGramWordFstModel::Read(const ModelStorage &storage) {
   return EnsureCacheIndex(fst_->Start());
 }
 
-std::pair<int, int> NGramWordFstModel::GetBeginEndIndices(int state,
-                                                          int prefix_length,
-                                                          int utf8_sym) {
-  const std::pair<int, int> default_pair(-1, -1);  // Default pair if no range.
-  StatusOr<int> orig_begin_index =
-      ngram_implicit_states_->symbol_begin_index(state);
-  StatusOr<int> final_index = ngram_implicit_states_->symbol_end_index(state);
-  if (!orig_begin_index.ok() || !final_index.ok()) {
-    return default_pair;
-  }
-  const SymbolTable *syms = fst().InputSymbols();
-  int begin_index = *orig_begin_index;
-  int begin_char = -1;
-  while (begin_index <= *final_index && utf8_sym != begin_char) {
-    if (!DecodeSingleUnicodeChar(impl::GetNextChar(syms->Find(
-            lexicographic_order_[begin_index]), prefix_length), &begin_char)) {
-      return default_pair;
-    }
-    if (begin_char != utf8_sym) {
-      ++begin_index;
-      while (begin_index <= *final_index &&
-             previous_common_prefix_length_[begin_index] > prefix_length) {
-        // Moves past elements with the same character in the same position.
-        ++begin_index;
-      }
-    }
-  }
-  if (*final_index < begin_index) {
-    // Character not found at this position within this range.
-    return default_pair;
-  }
-  int end_index = begin_index;
-  while (end_index < *final_index &&
-         previous_common_prefix_length_[end_index + 1] > prefix_length) {
-    // Moves to next as long as next symbol has same character in same position.
-    ++end_index;
-  }
-  return std::make_pair(begin_index, end_index);
-}
-
-int NGramWordFstModel::NextCompleteState(int state, int model_state,
-                                         int prefix_length) const {
+int NGramWordFstModel::NextCompleteState(int state, int model_state) const {
   // Check for complete word, move to next state; otherwise unigram.
-  const SymbolTable *syms = fst().InputSymbols();
-  StatusOr<int> symbol_begin_index =
-      ngram_implicit_states_->symbol_begin_index(state);
-  if (symbol_begin_index.ok()) {
-    // Due to lexicographic sort, the first position should be complete.
-    const int sym = lexicographic_order_[*symbol_begin_index];
-    const std::vector<std::string> this_string = StrSplitByChar(
-        syms->Find(sym));
-    if (this_string.size() == prefix_length) {
-      // This item is complete at this prefix length.
-      return NextModelState(model_state, sym);
+  StatusOr<int> trie_node = ngram_implicit_states_->trie_node(state);
+  if (trie_node.ok() && *trie_node >= 0) {
+    const int complete_node =
+        prefix_trie_.FindChild(*trie_node, WordPrefixTrie::kWordEnd);
+    if (complete_node >= 0) {
+      // The word with this prefix is complete at this prefix length.
+      return NextModelState(
+          model_state,
+          lexicographic_order_[prefix_trie_.begin_index(complete_node)]);
     }
   }
   return unigram_state();
 }
 
 int NGramWordFstModel::NextFirstLetterState(int state, int utf8_sym) {
-  // Check for begin/end indices of first letter from pre-computed.
-  const std::string u_char = EncodeUnicodeChar(utf8_sym);
-  int begin_index = first_char_begin_index_;
-  int end_index = -1;
-  for (int i = 0; i < first_chars_.size(); ++i) {
-    if (first_chars_[i] == u_char) {
-      end_index = first_char_ends_[i];
-      break;
-    } else {
-      begin_index = first_char_ends_[i] + 1;
-    }
-  }
+  // Finds begin/end indices of first letter from the root of the trie.
   StdArc::StateId next_state = unigram_state();
-  if (end_index >= 0) {
-    StatusOr<int> new_state =
-        ngram_implicit_states_->GetState(state, 1, begin_index, end_index);
+  const int node = prefix_trie_.FindChild(WordPrefixTrie::kRoot, utf8_sym);
+  if (node >= 0) {
+    StatusOr<int> new_state = ngram_implicit_states_->GetState(
+        state, 1, prefix_trie_.begin_index(node), prefix_trie_.end_index(node),
+        node);
     if (new_state.ok()) {
       next_state = *new_state;
     }
@@ -341,18 +487,19 @@ int NGramWordFstModel::NextState(int state, int utf8_sym) {
   int next_state = oov_state_;  // Default state if OOV or error.
   StatusOr<int> model_state = ngram_implicit_states_->model_state(state);
   StatusOr<int> prefix_length = ngram_implicit_states_->prefix_length(state);
-  if (model_state.ok() && *model_state >= 0 && prefix_length.ok()) {
+  StatusOr<int> trie_node = ngram_implicit_states_->trie_node(state);
+  if (model_state.ok() && *model_state >= 0 && prefix_length.ok() &&
+      trie_node.ok() && *trie_node >= 0) {
     if (utf8_sym == 32) {
       // TODO: introduce better method for detecting word boundary.
-      return NextCompleteState(state, *model_state, *prefix_length);
+      return NextCompleteState(state, *model_state);
     }
     // Check for prefix match. extend to new implicit state.
-    auto begin_end_indices =
-        GetBeginEndIndices(state, *prefix_length, utf8_sym);
-    if (begin_end_indices.first >= 0 && begin_end_indices.second >= 0) {
+    const int node = prefix_trie_.FindChild(*trie_node, utf8_sym);
+    if (node >= 0) {
       StatusOr<int> new_state = ngram_implicit_states_->GetState(
-          *model_state, *prefix_length + 1, begin_end_indices.first,
-          begin_end_indices.second);
+          *model_state, *prefix_length + 1, prefix_trie_.begin_index(node),
+          prefix_trie_.end_index(node), node);
       if (new_state.ok()) {
         next_state = *new_state;
       }
@@ -362,70 +509,69 @@ int NGramWordFstModel::NextState(int state, int utf8_sym) {
 }
 
 const std::vector<int> NGramWordFstModel::GetNextCharEnds(
-    int state, int prefix_length, int begin_index, int end_index,
-    std::vector<std::string> *next_chars) {
-  const SymbolTable *syms = fst().InputSymbols();
-  int idx = begin_index;
-  std::vector<int> next_char_ends;
+    int state, std::vector<std::string> *next_chars) {
   next_chars->clear();
-  next_chars->push_back(impl::GetNextChar(
-      syms->Find(lexicographic_order_[idx++]), prefix_length));
-  while (idx <= end_index) {
-    while (idx <= end_index &&
-           previous_common_prefix_length_[idx] > prefix_length) {
-      // Moves past elements with the same character in the same position.
-      ++idx;
-    }
-    if (idx <= end_index) {
-      next_char_ends.push_back(idx - 1);
-      next_chars->push_back(impl::GetNextChar(
-          syms->Find(lexicographic_order_[idx++]), prefix_length));
-    }
+  std::vector<int> next_char_ends;
+  StatusOr<int> trie_node = ngram_implicit_states_->trie_node(state);
+  if (!trie_node.ok() || *trie_node < 0) {
+    // Returns empty vectors for states not successfully returning the trie
+    // node or for the node < 0, which is associated with the oov_state_.
+    return next_char_ends;
+  }
+  const int first_child = prefix_trie_.first_child(*trie_node);
+  const int end_child = first_child + prefix_trie_.num_children(*trie_node);
+  next_chars->reserve(end_child - first_child);
+  next_char_ends.reserve(end_child - first_child);
+  for (int node = first_child; node < end_child; ++node) {
+    const int utf8_code = prefix_trie_.code(node);
+    // The words complete at this prefix are followed by whitespace.
+    next_chars->push_back(utf8_code == WordPrefixTrie::kWordEnd
+                              ? " "
+                              : EncodeUnicodeChar(utf8_code));
+    next_char_ends.push_back(prefix_trie_.end_index(node));
   }
-  next_char_ends.push_back(end_index);
   return next_char_ends;
 }
 
-const std::vector<int> NGramWordFstModel::GetNextCharEnds(
-    int state, std::vector<std::string> *next_chars) {
-  if (state < fst().NumStates()) {
-    // Returns first characters and their end points for word initial positions.
-    *next_chars = first_chars_;
-    return first_char_ends_;
+double NGramWordFstModel::GetCachedRangeCost(int model_state, int begin_index,
+                                             int end_index) {
+  if (EnsureCacheIndex(model_state) != absl::OkStatus()) {
+    return StdArc::Weight::Zero().Value();
   }
-  StatusOr<int> prefix_length = ngram_implicit_states_->prefix_length(state);
-  StatusOr<int> begin_index = ngram_implicit_states_->symbol_begin_index(state);
-  StatusOr<int> end_index = ngram_implicit_states_->symbol_end_index(state);
-  if (!prefix_length.ok() || !begin_index.ok() || *begin_index < 0 ||
-      !end_index.ok()) {
-    // Returns empty vectors for states not successfully returning these values
-    // or for begin_index < 0, which is associated with the oov_state_.
-    next_chars->clear();
-    return std::vector<int>();
+  const NGramStateCache &state_cache = *state_cache_[cache_index_[model_state]];
+  if (!state_cache.sparse()) {
+    const double cost = state_cache.cummulative_neg_log_prob(end_index);
+    if (begin_index == 0) return cost;
+    return impl::SafeNegLogDiff(
+        cost, state_cache.cummulative_neg_log_prob(begin_index - 1));
   }
-  return GetNextCharEnds(state, *prefix_length, *begin_index, *end_index,
-                         next_chars);
+  // Copies the sparse cache values first, since computing the cost at the
+  // backoff state may evict this cache.
+  const int backoff_state = state_cache.backoff_state();
+  const double backoff_weight = state_cache.backoff_cost();
+  const double prob_delta = state_cache.GetProbDelta(begin_index, end_index);
+  const double backoff_cost =
+      backoff_weight +
+      GetCachedRangeCost(backoff_state, begin_index, end_index);
+  if (prob_delta == 0.0) return backoff_cost;  // No explicit words in range.
+  const double prob = std::exp(-backoff_cost) + prob_delta;
+  return prob > 0.0 ? -std::log(prob) : StdArc::Weight::Zero().Value();
 }
 
 double NGramWordFstModel::GetRangeCost(int model_state, int begin_index,
                                        int end_index) {
   if (model_state < 0 || model_state > fst().NumStates() || begin_index < 1 ||
-      begin_index > end_index || end_index >= lexicographic_order_.size() ||
-      EnsureCacheIndex(model_state) != absl::OkStatus()) {
+      begin_index > end_index || end_index >= lexicographic_order_.size()) {
     return StdArc::Weight::Zero().Value();
   }
-  const NGramStateCache &state_cache = *state_cache_[cache_index_[model_state]];
-  return impl::SafeNegLogDiff(
-      state_cache.cummulative_neg_log_prob(end_index),
-      state_cache.cummulative_neg_log_prob(begin_index - 1));
+  return GetCachedRangeCost(model_state, begin_index, end_index);
 }
 
 double NGramWordFstModel::GetFinalCost(int model_state) {
-  if (model_state < 0 || model_state > fst().NumStates() ||
-      EnsureCacheIndex(model_state) != absl::OkStatus()) {
+  if (model_state < 0 || model_state > fst().NumStates()) {
     return StdArc::Weight::Zero().Value();
   }
-  return state_cache_[cache_index_[model_state]]->cummulative_neg_log_prob(0);
+  return GetCachedRangeCost(model_state, 0, 0);
 }
 
 double NGramWordFstModel::GetBackedoffFinalCost(int state) {
@@ -453,24 +599,67 @@ double NGramWordFstModel::GetBackedoffFinalCost(int state) {
 }
 
 double NGramWordFstModel::SymLMScore(int state, int utf8_sym) {
-  // TODO: create more efficient way to query scores.
-  LMScores response;
-  if (ExtractLMScores(state, &response)) {
-    for (int i = 0; i < response.probabilities_size(); i++) {
-      int utf8_code;
-      if (response.symbols(i).empty()) {
-        utf8_code = 0;
-      } else {
-        if (!DecodeSingleUnicodeChar(response.symbols(i), &utf8_code)) {
-          utf8_code = -1;
-        }
-      }
-      if (utf8_sym == utf8_code) {
-        return -std::log(response.probabilities(i));
-      }
+  // Computes the same score as found in the distribution returned by
+  // ExtractLMScores, but only for the requested symbol. The normalization is
+  // the cost of the whole range of the state, plus the end-of-string cost
+  // where that is predicted separately.
+  const double zero_cost = StdArc::Weight::Zero().Value();
+  const StdArc::StateId current_state = CheckCurrentState(state);
+  StatusOr<int> model_state =
+      ngram_implicit_states_->model_state(current_state);
+  StatusOr<int> trie_node = ngram_implicit_states_->trie_node(current_state);
+  if (!model_state.ok() || !trie_node.ok() || *trie_node < 0 ||
+      prefix_trie_.num_children(*trie_node) == 0 ||
+      EnsureCacheIndex(*model_state) != absl::OkStatus()) {
+    // No distribution at this state, e.g., for the oov_state_.
+    return zero_cost;
+  }
+  const int begin_index = prefix_trie_.begin_index(*trie_node);
+  double total_cost = GetRangeCost(*model_state, begin_index,
+                                   prefix_trie_.end_index(*trie_node));
+
+  // At a word boundary, the probability mass of the first continuation is
+  // split between whitespace and end-of-string, see ExtractLMScores.
+  const int first_child = prefix_trie_.first_child(*trie_node);
+  const int first_code = prefix_trie_.code(first_child);
+  const bool word_boundary =
+      first_code == WordPrefixTrie::kWordEnd || first_code == ' ';
+  double final_cost = zero_cost;  // Cost of the end-of-string.
+  double space_cost = 0.0;        // Share of the whitespace at word boundary.
+  int boundary_node = -1;         // Continuation split at word boundary.
+  if (word_boundary) {
+    final_cost = GetBackedoffFinalCost(
+        NextModelState(*model_state, lexicographic_order_[begin_index]));
+    if (final_cost != zero_cost) {
+      boundary_node = first_child;
+      space_cost = impl::SafeNegLogDiff(0.0, final_cost);
+      final_cost += GetRangeCost(*model_state,
+                                 prefix_trie_.begin_index(first_child),
+                                 prefix_trie_.end_index(first_child));
+    }
+  } else if (*model_state == current_state) {
+    final_cost = GetFinalCost(*model_state);
+    if (final_cost != zero_cost) {
+      total_cost = sfst::NegLogSum(total_cost, final_cost);
     }
   }
-  return StdArc::Weight::Zero().Value();
+
+  double cost = zero_cost;
+  if (utf8_sym == 0) {
+    // End-of-string is, by convention, index 0.
+    cost = final_cost;
+  } else {
+    const int node = utf8_sym == ' ' && word_boundary
+                         ? first_child
+                         : prefix_trie_.FindChild(*trie_node, utf8_sym);
+    if (node >= 0) {
+      cost = GetRangeCost(*model_state, prefix_trie_.begin_index(node),
+                          prefix_trie_.end_index(node));
+      if (node == boundary_node) cost += space_cost;
+    }
+  }
+  if (cost == zero_cost) return zero_cost;
+  return cost - total_cost;
 }
 
 bool NGramWordFstModel::ExtractLMScores(int state, LMScores *response) {
@@ -495,8 +684,6 @@ bool NGramWordFstModel::ExtractLMScores(int state, LMScores *response) {
     // No initialized model state associated with this implicit state.
     return false;
   }
-  state_cache_[cache_index_[*model_state]]->set_last_accessed(
-      cache_accessed_++);
   std::vector<double> costs;
   int begin_index = *init_begin_index;
   int start_idx = 0;
@@ -560,18 +747,176 @@ bool NGramWordFstModel::ExtractLMScores(int state, LMScores *response) {
   return true;
 }
 
+NGramStateCache::NGramStateCache(
+    int state, int access_counter, const std::vector<double> &arc_weights,
+    NGramWordFstOptions::CachePrecision precision)
+    : state_(state),
+      last_accessed_(access_counter),
+      size_(arc_weights.size()),
+      precision_(precision) {
+  switch (precision_) {
+    case NGramWordFstOptions::CACHE_FLOAT:
+      float_neg_log_probs_.assign(arc_weights.begin(), arc_weights.end());
+      break;
+    case NGramWordFstOptions::CACHE_QUANTIZED:
+      Quantize(arc_weights);
+      break;
+    default:
+      precision_ = NGramWordFstOptions::CACHE_DOUBLE;
+      cummulative_neg_log_probs_ = arc_weights;
+      break;
+  }
+}
+
+NGramStateCache::NGramStateCache(int state, int access_counter,
+                                 int backoff_state, double backoff_cost,
+                                 const std::vector<int> &indices,
+                                 const std::vector<double> &prob_deltas)
+    : state_(state),
+      last_accessed_(access_counter),
+      precision_(NGramWordFstOptions::CACHE_DOUBLE),
+      backoff_state_(backoff_state),
+      backoff_cost_(backoff_cost),
+      sparse_indices_(indices) {
+  cummulative_prob_deltas_.reserve(prob_deltas.size() + 1);
+  cummulative_prob_deltas_.push_back(0.0);
+  for (const double prob_delta : prob_deltas) {
+    cummulative_prob_deltas_.push_back(cummulative_prob_deltas_.back() +
+                                       prob_delta);
+  }
+}
+
+void NGramStateCache::Quantize(const std::vector<double> &values) {
+  quantized_neg_log_probs_.resize(values.size());
+  quantization_blocks_.resize(
+      (values.size() + kQuantizationBlockSize - 1) / kQuantizationBlockSize);
+  for (int block = 0; block < quantization_blocks_.size(); ++block) {
+    const int begin = block * kQuantizationBlockSize;
+    const int end =
+        std::min<int>(begin + kQuantizationBlockSize, values.size());
+    // The cummulative costs are non-increasing, so the first finite value is
+    // the largest one and the last value the smallest one.
+    int first_finite = begin;
+    while (first_finite < end && std::isinf(values[first_finite])) {
+      quantized_neg_log_probs_[first_finite++] = kQuantizedInfinity;
+    }
+    if (first_finite == end) {
+      quantization_blocks_[block] = {0.0, 0.0};
+      continue;
+    }
+    const double base = values[first_finite];
+    const float step = (base - values[end - 1]) / (kQuantizedInfinity - 1);
+    quantization_blocks_[block] = {base, step};
+    for (int i = first_finite; i < end; ++i) {
+      const double steps = step > 0.0 ? std::round((base - values[i]) / step)
+                                      : 0.0;
+      quantized_neg_log_probs_[i] = static_cast<uint16_t>(
+          std::clamp(steps, 0.0, static_cast<double>(kQuantizedInfinity - 1)));
+    }
+  }
+}
+
 double NGramStateCache::cummulative_neg_log_prob(int idx) const {
-  if (idx < 0 || idx >= cummulative_neg_log_probs_.size()) {
+  if (idx < 0 || idx >= size_) {
     return StdArc::Weight::Zero().Value();
   }
-  return cummulative_neg_log_probs_[idx];
+  switch (precision_) {
+    case NGramWordFstOptions::CACHE_FLOAT:
+      return float_neg_log_probs_[idx];
+    case NGramWordFstOptions::CACHE_QUANTIZED: {
+      const uint16_t value = quantized_neg_log_probs_[idx];
+      if (value == kQuantizedInfinity) return StdArc::Weight::Zero().Value();
+      const QuantizationBlock &block =
+          quantization_blocks_[idx / kQuantizationBlockSize];
+      return block.base - value * static_cast<double>(block.step);
+    }
+    default:
+      return cummulative_neg_log_probs_[idx];
+  }
+}
+
+double NGramStateCache::GetProbDelta(int begin_index, int end_index) const {
+  const auto begin = std::lower_bound(sparse_indices_.begin(),
+                                      sparse_indices_.end(), begin_index);
+  const auto end = std::upper_bound(begin, sparse_indices_.end(), end_index);
+  if (begin == end) return 0.0;
+  return cummulative_prob_deltas_[end - sparse_indices_.begin()] -
+         cummulative_prob_deltas_[begin - sparse_indices_.begin()];
+}
+
+int64_t NGramStateCache::MemoryUsage() const {
+  return sizeof(*this) +
+         cummulative_neg_log_probs_.capacity() * sizeof(double) +
+         float_neg_log_probs_.capacity() * sizeof(float) +
+         quantized_neg_log_probs_.capacity() * sizeof(uint16_t) +
+         quantization_blocks_.capacity() * sizeof(QuantizationBlock) +
+         sparse_indices_.capacity() * sizeof(int) +
+         cummulative_prob_deltas_.capacity() * sizeof(double);
+}
+
+void WordPrefixTrie::Build(const std::vector<std::vector<int>> &words,
+                           int begin_index) {
+  nodes_.clear();
+  nodes_.push_back({begin_index,
+                    begin_index + static_cast<int>(words.size()) - 1,
+                    /*code=*/0, /*first_child=*/0, /*num_children=*/0});
+
+  // Expands the nodes breadth-first, so that the children of each node are
+  // allocated together. Since the words in the range of a node share their
+  // prefix and are sorted, the words with the same next character (or the
+  // complete words) are consecutive.
+  int depth = 0;      // Prefix length of the nodes being expanded.
+  int level_end = 1;  // End of the nodes with that prefix length.
+  for (int node = kRoot; node < nodes_.size(); ++node) {
+    if (node == level_end) {
+      ++depth;
+      level_end = nodes_.size();
+    }
+    if (nodes_[node].code == kWordEnd) continue;  // Leaf.
+    const auto next_code = [&words, begin_index, depth](int index) {
+      const std::vector<int> &word = words[index - begin_index];
+      return depth < word.size() ? word[depth] : kWordEnd;
+    };
+    const int end_index = nodes_[node].end_index;
+    const int first_child = nodes_.size();
+    int index = nodes_[node].begin_index;
+    while (index <= end_index) {
+      const int code = next_code(index);
+      int last_index = index;
+      while (last_index < end_index && next_code(last_index + 1) == code) {
+        ++last_index;
+      }
+      nodes_.push_back({index, last_index, code, /*first_child=*/0,
+                        /*num_children=*/0});
+      index = last_index + 1;
+    }
+    nodes_[node].first_child = first_child;
+    nodes_[node].num_children = nodes_.size() - first_child;
+  }
+  nodes_.shrink_to_fit();
+}
+
+int WordPrefixTrie::FindChild(int node, int utf8_code) const {
+  const auto begin = nodes_.begin() + nodes_[node].first_child;
+  const auto end = begin + nodes_[node].num_children;
+  const auto child = std::lower_bound(
+      begin, end, utf8_code,
+      [](const Node &child, int code) { return child.code < code; });
+  if (child == end || child->code != utf8_code) return -1;
+  return child - nodes_.begin();
 }
 
 NGramImplicitStates::NGramImplicitStates(const StdVectorFst &fst,
                                          int first_char_begin_index,
-                                         int first_char_end_index) {
+                                         int first_char_end_index,
+                                         int max_states, int max_generations) {
   explicit_model_states_ = fst.NumStates();
-  total_model_states_ = explicit_model_states_;
+  // The state indices of all the generations of the slots have to fit in int.
+  const int max_implicit_index =
+      std::numeric_limits<int>::max() - explicit_model_states_;
+  capacity_ = std::max(1, std::min(max_states, max_implicit_index));
+  max_generations_ =
+      std::max(1, std::min(max_generations, max_implicit_index / capacity_));
   const auto *syms = fst.InputSymbols();
   max_prefix_length_ = 0;
   for (const auto sym : *syms) {
@@ -621,31 +966,107 @@ int NGramImplicitStates::FindExistingState(int model_state, int prefix_length,
         prefix_length_implicit_state_map_[*prefix_idx].find(key_pair);
     if (state_entry != prefix_length_implicit_state_map_[*prefix_idx].end()) {
       // State was already created for this implicit state.
+      referenced_[(state_entry->second - explicit_model_states_) % capacity_] =
+          true;
       return state_entry->second;
     }
   }
   return -1;  // State not found.
 }
 
+StatusOr<int> NGramImplicitStates::GetFreeSlot() {
+  if (model_state_.size() < capacity_) return model_state_.size();
+
+  // Sweeps the slots, giving the referenced states a second chance. Two full
+  // sweeps are enough to find an unreferenced state unless all are pinned.
+  for (int i = 0; i < 2 * capacity_; ++i) {
+    const int slot = clock_hand_;
+    clock_hand_ = (clock_hand_ + 1) % capacity_;
+    if (pinned_[slot]) continue;
+    if (referenced_[slot]) {
+      referenced_[slot] = false;
+      continue;
+    }
+    if (generation_[slot] + 1 >= max_generations_) {
+      // Rather than wrapping the generation around, which would let the stale
+      // indices resolve to the new states, restarts all the generations.
+      ResetGenerations();
+    } else {
+      auto &state_map =
+          prefix_length_implicit_state_map_[prefix_length_[slot] - 1];
+      const auto state_entry = state_map.find(
+          std::make_pair(model_state_[slot], symbol_begin_index_[slot]));
+      if (state_entry != state_map.end() &&
+          state_entry->second == StateOfSlot(slot)) {
+        state_map.erase(state_entry);
+      }
+    }
+    ++generation_[slot];
+    ImplicitStatesEvicted()->Increment();
+    return slot;
+  }
+  return absl::ResourceExhaustedError("All implicit states are pinned.");
+}
+
+void NGramImplicitStates::ResetGenerations() {
+  for (auto &state_map : prefix_length_implicit_state_map_) {
+    for (auto state_entry = state_map.begin();
+         state_entry != state_map.end();) {
+      if (pinned_[(state_entry->second - explicit_model_states_) %
+                  capacity_]) {
+        ++state_entry;
+      } else {
+        state_map.erase(state_entry++);
+      }
+    }
+  }
+  for (int slot = 0; slot < generation_.size(); ++slot) {
+    if (pinned_[slot]) continue;
+    generation_[slot] = 0;
+    referenced_[slot] = false;
+  }
+  ++num_resets_;
+  ImplicitStatesReset()->Increment();
+}
+
 StatusOr<int> NGramImplicitStates::AddNewState(int model_state,
                                                int prefix_length,
                                                int symbol_begin_index,
-                                               int symbol_end_index) {
+                                               int symbol_end_index,
+                                               int trie_node) {
   int prefix_idx;
   ASSIGN_OR_RETURN(prefix_idx, GetPrefixIdx(prefix_length));
-  const int new_state = total_model_states_++;
-  model_state_.push_back(model_state);
-  prefix_length_.push_back(prefix_length);
-  symbol_begin_index_.push_back(symbol_begin_index);
-  symbol_end_index_.push_back(symbol_end_index);
+  int slot;
+  ASSIGN_OR_RETURN(slot, GetFreeSlot());
+  // New states are only marked as referenced once visited again, so that the
+  // prefixes visited once are the first to go.
+  if (slot == model_state_.size()) {
+    model_state_.push_back(model_state);
+    prefix_length_.push_back(prefix_length);
+    symbol_begin_index_.push_back(symbol_begin_index);
+    symbol_end_index_.push_back(symbol_end_index);
+    trie_node_.push_back(trie_node);
+    generation_.push_back(0);
+    pinned_.push_back(false);
+    referenced_.push_back(false);
+  } else {
+    model_state_[slot] = model_state;
+    prefix_length_[slot] = prefix_length;
+    symbol_begin_index_[slot] = symbol_begin_index;
+    symbol_end_index_[slot] = symbol_end_index;
+    trie_node_[slot] = trie_node;
+  }
+  const int new_state = StateOfSlot(slot);
   prefix_length_implicit_state_map_[prefix_idx].insert(
       {std::make_pair(model_state, symbol_begin_index), new_state});
+  ImplicitStatesCreated()->Increment();
   return new_state;
 }
 
 StatusOr<int> NGramImplicitStates::GetState(int model_state, int prefix_length,
                                             int symbol_begin_index,
-                                            int symbol_end_index) {
+                                            int symbol_end_index,
+                                            int trie_node) {
   if (prefix_length == 0) {
     // Prefix length of 0 means word initial, i.e., same state as model state.
     if (model_state < 0 || model_state >= explicit_model_states_) {
@@ -659,7 +1080,25 @@ StatusOr<int> NGramImplicitStates::GetState(int model_state, int prefix_length,
     return existing_state;
   }
   return AddNewState(model_state, prefix_length, symbol_begin_index,
-                     symbol_end_index);
+                     symbol_end_index, trie_node);
+}
+
+bool NGramImplicitStates::IsEvicted(int state) const {
+  if (state < explicit_model_states_) return false;
+  const int implicit_idx = (state - explicit_model_states_) % capacity_;
+  const int generation = (state - explicit_model_states_) / capacity_;
+  return implicit_idx < model_state_.size() &&
+         generation < generation_[implicit_idx];
+}
+
+absl::Status NGramImplicitStates::Pin(int state) {
+  int implicit_idx;
+  ASSIGN_OR_RETURN(implicit_idx, GetImplicitIdx(state));
+  if (implicit_idx < 0) {
+    return absl::InvalidArgumentError("Only implicit states can be pinned.");
+  }
+  pinned_[implicit_idx] = true;
+  return absl::OkStatus();
 }
 
 StatusOr<int> NGramImplicitStates::GetImplicitIdx(int state) const {
@@ -667,13 +1106,15 @@ StatusOr<int> NGramImplicitStates::GetImplicitIdx(int state) const {
     // State index is a state in the model.
     return -1;
   }
-  if (state >= total_model_states_) {
+  const int implicit_idx = (state - explicit_model_states_) % capacity_;
+  const int generation = (state - explicit_model_states_) / capacity_;
+  if (implicit_idx >= model_state_.size() || generation >= max_generations_) {
     return absl::InternalError("State index does not exist.");
   }
-  int implicit_idx = state - explicit_model_states_;
-  if (implicit_idx >= model_state_.size() || implicit_idx < 0) {
-    return absl::InternalError("Model states not correctly allocated.");
+  if (generation != generation_[implicit_idx]) {
+    return absl::NotFoundError("Implicit state has been evicted.");
   }
+  referenced_[implicit_idx] = true;
   return implicit_idx;
 }
 
@@ -714,5 +1155,32 @@ StatusOr<int> NGramImplicitStates::symbol_end_index(int state) const {
   return symbol_end_index_[implicit_idx];
 }
 
+StatusOr<int> NGramImplicitStates::trie_node(int state) const {
+  if (state < explicit_model_states_) {
+    return WordPrefixTrie::kRoot;
+  }
+  int implicit_idx;
+  ASSIGN_OR_RETURN(implicit_idx, GetImplicitIdx(state));
+  return trie_node_[implicit_idx];
+}
+
+int64_t NGramImplicitStates::MemoryUsage() const {
+  int64_t bytes = sizeof(*this);
+  for (const auto *values : {&model_state_, &prefix_length_,
+                             &symbol_begin_index_, &symbol_end_index_,
+                             &trie_node_, &generation_}) {
+    bytes += values->capacity() * sizeof(int);
+  }
+  for (const auto *flags : {&pinned_, &referenced_}) {
+    bytes += flags->capacity() / 8;
+  }
+  for (const auto &state_map : prefix_length_implicit_state_map_) {
+    // Flat hash maps hold the entries inline, plus a control byte per slot.
+    bytes += state_map.bucket_count() *
+             (sizeof(std::pair<const std::pair<int, int>, int>) + 1);
+  }
+  return bytes;
+}
+
 }  // namespace models
 }  // namespace mozolm
@@ -17,45 +17,123 @@
 #ifndef MOZOLM_MOZOLM_MODELS_NGRAM_WORD_FST_MODEL_H_
 #define MOZOLM_MOZOLM_MODELS_NGRAM_WORD_FST_MODEL_H_
 
+#include <limits>
 #include <memory>
 #include <string>
 #include <utility>
 #include <vector>
 
+#include "mozolm/stubs/integral_types.h"
 #include "absl/container/flat_hash_map.h"
 #include "absl/status/status.h"
 #include "absl/status/statusor.h"
+#include "absl/strings/string_view.h"
 #include "mozolm/models/ngram_fst_model.h"
+#include "mozolm/models/ngram_word_fst_options.pb.h"
 #include "fst/vector-fst.h"
 
 namespace mozolm {
 namespace models {
 
 constexpr int kMaxNGramCache = 2000;  // Maximum states to cache.
+constexpr int kMaxNGramImplicitStates = 1 << 20;  // Maximum implicit states.
+
+// Character-level trie over the vocabulary in lexicographic order. Each node
+// stands for a word prefix and holds the range of the lexicographic indices of
+// the words sharing that prefix, together with its children sorted by the code
+// point of the next character. The words that are complete at a node are
+// represented by a leaf child with the code kWordEnd, which sorts first just as
+// these words do in the lexicographic order. All the nodes are stored in one
+// array, with the children of each node in consecutive positions, so finding a
+// child is a binary search over a contiguous range.
+class WordPrefixTrie {
+ public:
+  static constexpr int kRoot = 0;      // Root node for the empty prefix.
+  static constexpr int kWordEnd = -1;  // Code of the leaves completing words.
+
+  WordPrefixTrie() = default;
+
+  // Builds the trie over the words, given as code points in lexicographic
+  // order, where the first word has the lexicographic index begin_index.
+  void Build(const std::vector<std::vector<int>>& words, int begin_index);
+
+  // Returns the child of the node for the given code point, -1 if none.
+  int FindChild(int node, int utf8_code) const;
+
+  // Returns the first and last lexicographic index of the words sharing the
+  // prefix of the node.
+  int begin_index(int node) const { return nodes_[node].begin_index; }
+  int end_index(int node) const { return nodes_[node].end_index; }
+
+  // Returns the code point of the last character of the node's prefix.
+  int code(int node) const { return nodes_[node].code; }
+
+  // Returns the children of the node, which are consecutive nodes.
+  int first_child(int node) const { return nodes_[node].first_child; }
+  int num_children(int node) const { return nodes_[node].num_children; }
+
+  int num_nodes() const { return nodes_.size(); }
+
+ private:
+  struct Node {
+    int begin_index;
+    int end_index;
+    int code;
+    int first_child;
+    int num_children;
+  };
+
+  std::vector<Node> nodes_;
+};
 
 // Class for managing implicit states of model. The word-based model has
 // explicit states for ngram contexts, but not for prefixes of possible words
 // leaving those explicit states, which we will call implicit states. Each
 // implicit state is associated with a specific explicit ngram context model
 // state, a word prefix length, a symbol index corresponding to the first symbol
-// matching the specific prefix at that state, and a symbol index corresponding
-// to the final symbol matching the specific prefix at that state.  A flat hash
-// map permits finding an existing state index from the associated tuple.
+// matching the specific prefix at that state, a symbol index corresponding
+// to the final symbol matching the specific prefix at that state, and the
+// prefix trie node for the prefix.  A flat hash map permits finding an existing
+// state index from the associated tuple.
+//
+// The number of implicit states is bounded by the capacity given at
+// construction. Once all the slots are in use, creating a new state evicts an
+// existing one, chosen by the CLOCK algorithm: every access to a state marks
+// it as referenced, and the eviction sweep spares (and unmarks) referenced
+// states, so that the frequently visited prefixes stay resident. Each slot
+// carries a generation, bumped on eviction and encoded in the state index, so
+// that indices of evicted states are detected as stale rather than silently
+// resolving to the state now occupying their slot. Since the generations are
+// bounded by the range of the state indices, once a slot runs out of them all
+// the states are discarded and the generations restarted, rather than wrapped
+// around for that slot. The indices issued before such a reset are no longer
+// reliable, which is reported by the reset count. Pinned states, such as the
+// out-of-vocabulary state, are never evicted nor discarded.
 class NGramImplicitStates {
  public:
   NGramImplicitStates() = default;
 
   NGramImplicitStates(const fst::StdVectorFst& fst, int first_char_begin_index,
-                      int first_char_end_index);
+                      int first_char_end_index,
+                      int max_states = kMaxNGramImplicitStates,
+                      int max_generations = std::numeric_limits<int>::max());
 
   // Returns the state if already exists, creates it otherwise.
   absl::StatusOr<int> GetState(int model_state, int prefix_length,
-                               int symbol_begin_index, int symbol_end_index);
+                               int symbol_begin_index, int symbol_end_index,
+                               int trie_node);
 
   // Returns the state if already exists, otherwise -1.
   int FindExistingState(int model_state, int prefix_length,
                         int symbol_begin_index);
 
+  // Returns true if the given implicit state has been evicted since it was
+  // created. Unlike the accessors below, does not mark the state as referenced.
+  bool IsEvicted(int state) const;
+
+  // Exempts the given implicit state from eviction.
+  absl::Status Pin(int state);
+
   // Returns the model state associated with given implicit state.
   absl::StatusOr<int> model_state(int state) const;
 
@@ -68,10 +146,37 @@ class NGramImplicitStates {
   // Returns the symbol end index for the given implicit state.
   absl::StatusOr<int> symbol_end_index(int state) const;
 
+  // Returns the prefix trie node for the given implicit state, the root for
+  // the explicit states.
+  absl::StatusOr<int> trie_node(int state) const;
+
+  // Number of implicit states currently resident.
+  int size() const { return model_state_.size(); }
+
+  // Maximum number of resident implicit states.
+  int capacity() const { return capacity_; }
+
+  // Approximate number of bytes used by the implicit states and their index.
+  int64_t MemoryUsage() const;
+
+  // Number of times the states have been discarded after a slot ran out of
+  // generations. The indices issued before the last reset may refer to
+  // different states.
+  int64_t num_resets() const { return num_resets_; }
+
  private:
   // Adds a new state with these indices.
   absl::StatusOr<int> AddNewState(int model_state, int prefix_length,
-                                  int symbol_begin_index, int symbol_end_index);
+                                  int symbol_begin_index, int symbol_end_index,
+                                  int trie_node);
+
+  // Returns the slot to hold a new state, evicting a resident state if all
+  // the slots are in use.
+  absl::StatusOr<int> GetFreeSlot();
+
+  // Discards all the states except the pinned ones and restarts the
+  // generations of their slots.
+  void ResetGenerations();
 
   // Returns the vector index of the implicit state.
   absl::StatusOr<int> GetImplicitIdx(int state) const;
@@ -79,13 +184,25 @@ class NGramImplicitStates {
   // Returns the index for an associated prefix length.
   absl::StatusOr<int> GetPrefixIdx(int prefix_length);
 
+  // Returns the state index for the state held in the slot.
+  int StateOfSlot(int slot) const {
+    return explicit_model_states_ + generation_[slot] * capacity_ + slot;
+  }
+
   int explicit_model_states_;  // Number of explicit states in model.
-  int total_model_states_;     // Number of implicit and explicit states.
   int max_prefix_length_;      // Maximum length in the symbol table.
+  int capacity_;               // Maximum number of implicit states.
+  int max_generations_;        // Generations representable in state indices.
+  int clock_hand_ = 0;         // Next slot considered for eviction.
+  int64_t num_resets_ = 0;     // Number of times the generations restarted.
   std::vector<int> model_state_;         // Model state for the implicit state.
   std::vector<int> prefix_length_;       // Length of symbol prefix at state.
   std::vector<int> symbol_begin_index_;  // First symbol index matching prefix.
   std::vector<int> symbol_end_index_;    // Last symbol index matching prefix.
+  std::vector<int> trie_node_;           // Prefix trie node for the prefix.
+  std::vector<int> generation_;          // Number of evictions from the slot.
+  std::vector<bool> pinned_;             // Whether the state can be evicted.
+  mutable std::vector<bool> referenced_;  // Whether accessed since the sweep.
   int explicit_state_begin_index_;  // Symbol begin index for explicit states.
   int explicit_state_end_index_;    // Symbol end index for explicit states.
 
@@ -105,15 +222,35 @@ class NGramImplicitStates {
 // the initial element.  Because this is stored densely over the whole
 // vocabulary, only some limited parameterized number of them are maintained in
 // the cache.
+//
+// The dense values are only kept for the states without a backoff, i.e., the
+// unigram state. The states that back off are cached sparsely, as the
+// differences between the probabilities of their explicit arcs (and the final
+// probability, at index 0) and the backed off probabilities of the same words.
+// The probability of a range at such state is then the backoff probability of
+// the range at the backoff state, plus the sum of the differences within the
+// range, which takes memory proportional to the number of explicit arcs.
+//
+// To save memory, the dense cummulative values can be stored with reduced
+// precision: as single precision floats, or quantized to 16 bits relative to
+// the range of values within fixed-size blocks of the vocabulary. The reduced
+// precision mostly affects the probabilities of the rare words, which are the
+// differences of very close cummulative values.
 class NGramStateCache {
  public:
   NGramStateCache() = default;
 
   NGramStateCache(int state, int access_counter,
-                  const std::vector<double>& arc_weights)
-      : state_(state),
-        last_accessed_(access_counter),
-        cummulative_neg_log_probs_(arc_weights) {}
+                  const std::vector<double>& arc_weights,
+                  NGramWordFstOptions::CachePrecision precision =
+                      NGramWordFstOptions::CACHE_DOUBLE);
+
+  // Creates the sparse cache of the state backing off to the backoff state,
+  // from the lexicographic indices (in increasing order) of the explicit words
+  // and the differences of their probabilities from the backed off ones.
+  NGramStateCache(int state, int access_counter, int backoff_state,
+                  double backoff_cost, const std::vector<int>& indices,
+                  const std::vector<double>& prob_deltas);
 
   // Returns state associated with this cache.
   int state() const { return state_; }
@@ -126,21 +263,62 @@ class NGramStateCache {
     last_accessed_ = access_counter;
   }
 
-  // Returns the value for the particular index if valid; Zero otherwise.
+  // Returns whether the state is cached sparsely, relative to its backoff.
+  bool sparse() const { return backoff_state_ >= 0; }
+
+  // Returns the backoff state and the cost of backing off to it, for the
+  // sparse caches.
+  int backoff_state() const { return backoff_state_; }
+  double backoff_cost() const { return backoff_cost_; }
+
+  // Returns the sum of the probability differences from the backed off
+  // probabilities within the inclusive index range, for the sparse caches.
+  double GetProbDelta(int begin_index, int end_index) const;
+
+  // Returns the value for the particular index if valid; Zero otherwise. Only
+  // available for the dense caches.
   double cummulative_neg_log_prob(int idx) const;
 
-  std::vector<double> cummulative_neg_log_probs() const {
-    return cummulative_neg_log_probs_;
-  }
+  // Returns the number of bytes used by the cached values.
+  int64_t MemoryUsage() const;
 
  private:
+  // Number of values quantized relative to the same range.
+  static constexpr int kQuantizationBlockSize = 64;
+
+  // Quantized value reserved for the infinite costs.
+  static constexpr uint16_t kQuantizedInfinity = 0xFFFF;
+
+  // Range of the values within a quantization block: the values are stored as
+  // the number of steps below the base.
+  struct QuantizationBlock {
+    double base;
+    float step;
+  };
+
+  // Quantizes the values to 16 bits.
+  void Quantize(const std::vector<double>& values);
+
   int state_;                   // Index of model state being cached.
   int last_accessed_;           // Stores index of last time accessed.
+  int size_ = 0;                // Number of cached values.
+  NGramWordFstOptions::CachePrecision precision_;
+  int backoff_state_ = -1;      // Backoff state of the sparse caches.
+  double backoff_cost_ = 0.0;   // Cost of backing off to backoff_state_.
+
+  // Lexicographic indices of the explicit words of the sparse caches, and the
+  // cummulative sums of their probability differences, with the leading zero.
+  std::vector<int> sparse_indices_;
+  std::vector<double> cummulative_prob_deltas_;
 
-  // This vector is the same size as the base model symbol table, and is for
+  // The values are the same size as the base model symbol table, and are for
   // lexicographically sorted symbols.  The probabilities are cummulative, so
   // that the probability for a range can be determined by taking a difference.
+  // Only the vector corresponding to the precision is populated.
   std::vector<double> cummulative_neg_log_probs_;
+  std::vector<float> float_neg_log_probs_;
+  std::vector<uint16_t> quantized_neg_log_probs_;
+  std::vector<QuantizationBlock> quantization_blocks_;
 };
 
 class NGramWordFstModel : public NGramFstModel {
@@ -151,6 +329,11 @@ class NGramWordFstModel : public NGramFstModel {
   // Reads the model from the model storage.
   absl::Status Read(const ModelStorage& storage) override;
 
+  // Writes the lexicographic order of the vocabulary to the file, which can
+  // then be supplied via `lexicographic_order_file` in NGramWordFstOptions to
+  // skip sorting the vocabulary when the model is read.
+  absl::Status WriteLexicographicOrder(absl::string_view order_file) const;
+
   // Provides the state reached from state following utf8_sym.
   int NextState(int state, int utf8_sym) override;
 
@@ -160,39 +343,61 @@ class NGramWordFstModel : public NGramFstModel {
   // Returns the negative log probability of the utf8_sym at the state.
   double SymLMScore(int state, int utf8_sym) override;
 
+  // Returns true if the implicit state has been evicted. The model treats the
+  // evicted states as out-of-vocabulary.
+  bool IsStaleState(int state) const override {
+    return ngram_implicit_states_ != nullptr &&
+           ngram_implicit_states_->IsEvicted(state);
+  }
+
+  // Returns the number of times the implicit states have been discarded once
+  // their generations ran out.
+  int64_t StateResets() const override {
+    return ngram_implicit_states_ != nullptr
+               ? ngram_implicit_states_->num_resets()
+               : 0;
+  }
+
  private:
-  // Creates lexicographic ordering of symbol table for efficient summing.
-  absl::Status EstablishLexicographicOrdering();
+  // Creates lexicographic ordering of symbol table for efficient summing. The
+  // ordering is read from the order file if given and valid, computed
+  // otherwise.
+  absl::Status EstablishLexicographicOrdering(absl::string_view order_file);
+
+  // Reads the lexicographic ordering written by WriteLexicographicOrder.
+  absl::Status ReadLexicographicOrder(absl::string_view order_file);
+
+  // Sorts the symbol table to establish the lexicographic ordering.
+  absl::Status SortLexicographicOrder();
 
   // Finds cache index to delete.
   int FindOldestLastAccessedCache() const;
 
   // Returns new cache index for given state.
   absl::Status GetNewCacheIndex(fst::StdArc::StateId s,
-                                const std::vector<double>& weights);
+                                std::unique_ptr<NGramStateCache> cache);
 
-  // Returns cache index if it exists, creates new cache entry otherwise.
+  // Returns cache index if it exists, marking it as the most recently accessed,
+  // creates new cache entry otherwise.
   absl::Status EnsureCacheIndex(int state);
 
-  // Fills vector with cummulative costs (in lexicographic order) at the state.
+  // Fills vector with cummulative costs (in lexicographic order) at the state
+  // without backoff.
   std::vector<double> FillWeightVector(int state);
 
-  // Returns begin/end index pair for words with that symbol extension from that
-  // implicit state.
-  std::pair<int, int> GetBeginEndIndices(int state, int prefix_length,
-                                         int utf8_sym);
+  // Creates the sparse cache for the state backing off to the backoff state.
+  std::unique_ptr<NGramStateCache> MakeSparseCache(
+      int state, int backoff_state, fst::StdArc::Weight backoff_weight);
+
+  // Returns sum of probabilities over word index range from given state,
+  // including the end-of-string probability (index 0).
+  double GetCachedRangeCost(int state, int begin_index, int end_index);
 
   // Returns vector of end indicies of next characters and fills vector of
   // corresponding next characters.
   const std::vector<int> GetNextCharEnds(int state,
                                          std::vector<std::string>* next_chars);
 
-  // Returns vector of end indicies of next characters and fills vector of
-  // corresponding next characters, for implicit states.
-  const std::vector<int> GetNextCharEnds(int state, int prefix_length,
-                                         int begin_index, int end_index,
-                                         std::vector<std::string>* next_chars);
-
   // Returns sum of probabilities over word index range from given state.
   double GetRangeCost(int state, int begin_index, int end_index);
 
@@ -203,7 +408,7 @@ class NGramWordFstModel : public NGramFstModel {
   double GetBackedoffFinalCost(int state);
 
   // Returns next model state for complete word.
-  int NextCompleteState(int state, int model_state, int prefix_length) const;
+  int NextCompleteState(int state, int model_state) const;
 
   // Returns next implicit state after first letter of a word.
   int NextFirstLetterState(int state, int utf8_sym);
@@ -212,19 +417,18 @@ class NGramWordFstModel : public NGramFstModel {
   std::vector<int> lexicographic_order_;     // Lexicographic order of symbols.
   std::vector<int> lexicographic_position_;  // Lexicographic index of symbol.
 
-  // Length of common prefix with previous symbol in lexicographic order.
-  std::vector<int> previous_common_prefix_length_;
-
-  // For establishing begin and end indices of prefixes after the first char.
+  // Character trie over the words in lexicographic order, for establishing
+  // begin and end indices of the word prefixes.
   int first_char_begin_index_;  // Starting index of the lexicographic order.
-  std::vector<std::string> first_chars_;  // First characters of all words.
-  std::vector<int> first_char_ends_;  // Last index for each first character.
+  WordPrefixTrie prefix_trie_;
 
   int oov_state_;  // Implicit state for out-of-vocabulary words.
+  int max_implicit_states_;  // Limit on the resident implicit states.
 
   // TODO: add locking mechanisms for updating cache and implicit states.
   // For caching word probabilities at model states for quick marginalization.
   int max_cache_size_;  // Limit on caching for garbage collection.
+  NGramWordFstOptions::CachePrecision cache_precision_;  // Of cached values.
   int cache_accessed_;  // Counter of cache accesses to determine priority.
   std::vector<int> cache_index_;  // Index of cache for state if it exists.
   std::vector<std::unique_ptr<NGramStateCache>>
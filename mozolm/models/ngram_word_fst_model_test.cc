@@ -15,8 +15,10 @@
 #include "mozolm/models/ngram_word_fst_model.h"
 
 #include <cmath>
+#include <cstdint>
 #include <cstdlib>
 #include <fstream>
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -24,8 +26,14 @@
 #include "nisaba/port/status-matchers.h"
 #include "protobuf-matchers/protocol-buffer-matchers.h"
 #include "gtest/gtest.h"
+#include "absl/status/status.h"
+#include "mozolm/models/language_model_hub.h"
+#include "mozolm/models/model_config.pb.h"
+#include "mozolm/models/model_factory.h"
 #include "mozolm/models/model_storage.pb.h"
 #include "mozolm/models/model_test_utils.h"
+#include "mozolm/models/ngram_word_fst_options.pb.h"
+#include "mozolm/utils/metrics.h"
 #include "nisaba/port/file_util.h"
 #include "nisaba/port/test_utils.h"
 #include "nisaba/port/utf8_util.h"
@@ -46,6 +54,9 @@ namespace {
 
 constexpr float kFloatDelta = 0.00001;  // Delta for float comparisons.
 
+// Delta for comparing the values cached with reduced precision.
+constexpr float kReducedPrecisionDelta = 0.0001;
+
 class NGramWordFstTest : public ::testing::Test {
  protected:
   // Creates FST trigram count file, to test FST model initialization.
@@ -329,6 +340,371 @@ TEST_F(NGramWordFstTest, ExtractLMScoresImplicitWordBoundary) {
               kFloatDelta);
 }
 
+// Walking the prefix trie finds the lexicographic ranges of the prefixes.
+TEST(WordPrefixTrieTest, FindsPrefixRanges) {
+  // Words "a", "ab", "abc", "b" and "bc", in lexicographic order from index 1.
+  const std::vector<std::vector<int>> words = {
+      {'a'}, {'a', 'b'}, {'a', 'b', 'c'}, {'b'}, {'b', 'c'}};
+  WordPrefixTrie trie;
+  trie.Build(words, /*begin_index=*/1);
+  EXPECT_EQ(1, trie.begin_index(WordPrefixTrie::kRoot));
+  EXPECT_EQ(5, trie.end_index(WordPrefixTrie::kRoot));
+  ASSERT_EQ(2, trie.num_children(WordPrefixTrie::kRoot));
+
+  const int a_node = trie.FindChild(WordPrefixTrie::kRoot, 'a');
+  ASSERT_LE(0, a_node);
+  EXPECT_EQ(1, trie.begin_index(a_node));
+  EXPECT_EQ(3, trie.end_index(a_node));
+  EXPECT_EQ(-1, trie.FindChild(WordPrefixTrie::kRoot, 'c'));
+
+  // The complete word comes first among the continuations of the prefix.
+  ASSERT_EQ(2, trie.num_children(a_node));
+  const int a_end_node = trie.first_child(a_node);
+  EXPECT_EQ(WordPrefixTrie::kWordEnd, trie.code(a_end_node));
+  EXPECT_EQ(a_end_node, trie.FindChild(a_node, WordPrefixTrie::kWordEnd));
+  EXPECT_EQ(1, trie.begin_index(a_end_node));
+  EXPECT_EQ(1, trie.end_index(a_end_node));
+  EXPECT_EQ(0, trie.num_children(a_end_node));
+
+  const int abc_node = trie.FindChild(trie.FindChild(a_node, 'b'), 'c');
+  ASSERT_LE(0, abc_node);
+  EXPECT_EQ(3, trie.begin_index(abc_node));
+  EXPECT_EQ(3, trie.end_index(abc_node));
+  const int bc_node =
+      trie.FindChild(trie.FindChild(WordPrefixTrie::kRoot, 'b'), 'c');
+  ASSERT_LE(0, bc_node);
+  EXPECT_EQ(5, trie.begin_index(bc_node));
+  EXPECT_EQ(5, trie.end_index(bc_node));
+}
+
+// Scoring single symbols matches the full distribution at the explicit and
+// implicit states, including the word boundaries and unseen continuations.
+TEST_F(NGramWordFstTest, SymLMScoreMatchesExtractLMScores) {
+  NGramWordFstModel model;
+  ASSERT_OK(model.Read(storage_));
+  for (const std::string context :
+       {"", "a", "b", "aa ", "aa b", "aa ba", "aa bb", "bbb b", "ab"}) {
+    SCOPED_TRACE(context);
+    const int state = model.ContextState(context);
+    LMScores lm_scores;
+    ASSERT_TRUE(model.ExtractLMScores(state, &lm_scores));
+    double total_prob = 0.0;
+    for (int i = 0; i < lm_scores.probabilities_size(); i++) {
+      char32 utf8_code = 0;  // End-of-string (</S>) is, by convention, 0.
+      if (!lm_scores.symbols(i).empty()) {
+        ASSERT_TRUE(nisaba::utf8::DecodeSingleUnicodeChar(
+            lm_scores.symbols(i), &utf8_code));
+      }
+      EXPECT_NEAR(exp(-model.SymLMScore(state, static_cast<int>(utf8_code))),
+                  lm_scores.probabilities(i), kFloatDelta);
+      total_prob += lm_scores.probabilities(i);
+    }
+    EXPECT_NEAR(1.0, total_prob, kFloatDelta);
+    EXPECT_NEAR(0.0, exp(-model.SymLMScore(state, 'z')), kFloatDelta);
+  }
+}
+
+// Implicit states visited in between the evictions stay resident, while the
+// indices of the evicted states are detected as stale.
+TEST_F(NGramWordFstTest, ImplicitStatesEvictColdStates) {
+  std::unique_ptr<StdVectorFst> fst(StdVectorFst::Read(trigram_model_file_));
+  ASSERT_NE(nullptr, fst);
+  NGramImplicitStates states(*fst, /*first_char_begin_index=*/1,
+                             /*first_char_end_index=*/4, /*max_states=*/3);
+  const auto hot_state = states.GetState(/*model_state=*/0, /*prefix_length=*/1,
+                                         /*symbol_begin_index=*/1,
+                                         /*symbol_end_index=*/1,
+                                         /*trie_node=*/1);
+  ASSERT_OK(hot_state);
+  std::vector<int> cold_states;
+  for (int index = 2; index <= 4; ++index) {
+    ASSERT_OK(states.model_state(*hot_state));
+    const auto cold_state = states.GetState(
+        /*model_state=*/0, /*prefix_length=*/1, index, index, /*trie_node=*/1);
+    ASSERT_OK(cold_state);
+    cold_states.push_back(*cold_state);
+  }
+  EXPECT_EQ(3, states.size());
+  EXPECT_EQ(3, states.capacity());
+  EXPECT_GT(states.MemoryUsage(), 0);
+  EXPECT_EQ(*hot_state, states.FindExistingState(0, 1, 1));
+  EXPECT_EQ(-1, states.FindExistingState(0, 1, 2));
+  EXPECT_EQ(absl::StatusCode::kNotFound,
+            states.model_state(cold_states[0]).status().code());
+  EXPECT_OK(states.symbol_begin_index(cold_states[2]));
+}
+
+// Once a slot runs out of generations, the states are discarded and the
+// generations restarted, so that the new states can still be created.
+TEST_F(NGramWordFstTest, ImplicitStatesResetExhaustedGenerations) {
+  std::unique_ptr<StdVectorFst> fst(StdVectorFst::Read(trigram_model_file_));
+  ASSERT_NE(nullptr, fst);
+  NGramImplicitStates states(*fst, /*first_char_begin_index=*/1,
+                             /*first_char_end_index=*/4, /*max_states=*/2,
+                             /*max_generations=*/3);
+  // Each of the two slots holds three generations of states, the seventh
+  // state requires a fourth one.
+  std::vector<int> created_states;
+  for (int index = 1; index <= 7; ++index) {
+    const auto state = states.GetState(/*model_state=*/0, /*prefix_length=*/1,
+                                       index, index, /*trie_node=*/1);
+    ASSERT_OK(state);
+    created_states.push_back(*state);
+    EXPECT_EQ(index < 7 ? 0 : 1, states.num_resets());
+  }
+  EXPECT_EQ(2, states.size());
+  EXPECT_EQ(created_states[6], states.FindExistingState(0, 1, 7));
+  EXPECT_EQ(7, *states.symbol_begin_index(created_states[6]));
+  // The state resident before the reset has been discarded.
+  EXPECT_EQ(-1, states.FindExistingState(0, 1, 6));
+  for (int index = 8; index <= 20; ++index) {
+    EXPECT_OK(states.GetState(/*model_state=*/0, /*prefix_length=*/1, index,
+                              index, /*trie_node=*/1));
+  }
+  EXPECT_LT(1, states.num_resets());
+}
+
+// Bounding the implicit states does not change the scores.
+TEST_F(NGramWordFstTest, BoundedImplicitStatesKeepScores) {
+  NGramWordFstModel model;
+  ASSERT_OK(model.Read(storage_));
+  storage_.mutable_ngram_word_fst_options()->set_max_implicit_states(2);
+  NGramWordFstModel bounded_model;
+  ASSERT_OK(bounded_model.Read(storage_));
+  for (const std::string context : {"a", "aa b", "aa ba", "bbb bb", "ab a"}) {
+    SCOPED_TRACE(context);
+    LMScores lm_scores, bounded_lm_scores;
+    ASSERT_TRUE(model.ExtractLMScores(model.ContextState(context), &lm_scores));
+    ASSERT_TRUE(bounded_model.ExtractLMScores(
+        bounded_model.ContextState(context), &bounded_lm_scores));
+    ASSERT_EQ(lm_scores.symbols_size(), bounded_lm_scores.symbols_size());
+    for (int i = 0; i < lm_scores.symbols_size(); ++i) {
+      EXPECT_EQ(lm_scores.symbols(i), bounded_lm_scores.symbols(i));
+      EXPECT_NEAR(lm_scores.probabilities(i),
+                  bounded_lm_scores.probabilities(i), kFloatDelta);
+    }
+  }
+}
+
+// A state reached by the model whose implicit state is later evicted is
+// reported as stale, while the states still resident are not.
+TEST_F(NGramWordFstTest, EvictedImplicitStatesAreStale) {
+  storage_.mutable_ngram_word_fst_options()->set_max_implicit_states(2);
+  NGramWordFstModel model;
+  ASSERT_OK(model.Read(storage_));
+  const int state = model.ContextState("aa b");
+  EXPECT_FALSE(model.IsStaleState(state));
+  const int other_state = model.ContextState("ab a");
+  EXPECT_TRUE(model.IsStaleState(state));
+  EXPECT_FALSE(model.IsStaleState(other_state));
+  EXPECT_FALSE(model.IsStaleState(model.ContextState("aa ")));
+}
+
+// A hub state that outlives the implicit state of the model is rebuilt from
+// its fallback context, rather than scored from the out-of-vocabulary state.
+TEST_F(NGramWordFstTest, HubRebuildsStatesWithEvictedImplicitStates) {
+  NGramWordFstModel model;
+  ASSERT_OK(model.Read(storage_));
+  LMScores expected_scores;
+  ASSERT_TRUE(
+      model.ExtractLMScores(model.ContextState("aa b"), &expected_scores));
+
+  storage_.mutable_ngram_word_fst_options()->set_max_implicit_states(2);
+  ModelHubConfig hub_config;
+  ModelConfig *model_config = hub_config.add_model_config();
+  model_config->set_type(ModelConfig::WORD_NGRAM_FST);
+  *model_config->mutable_storage() = storage_;
+  auto hub_status = MakeModelHub(hub_config);
+  ASSERT_OK(hub_status.status());
+  std::unique_ptr<LanguageModelHub> hub = std::move(hub_status.value());
+  const int64_t handle = hub->StateHandle(hub->ContextState("aa b"));
+  hub->ContextState("ab a");  // Evicts the implicit state of the context.
+
+  const int state = hub->ResolveStateHandle(handle, "aa b");
+  EXPECT_NE(handle, hub->StateHandle(state));
+  LMScores lm_scores;
+  ASSERT_TRUE(hub->ExtractLMScores(state, &lm_scores));
+  ASSERT_EQ(expected_scores.symbols_size(), lm_scores.symbols_size());
+  for (int i = 0; i < lm_scores.symbols_size(); ++i) {
+    EXPECT_EQ(expected_scores.symbols(i), lm_scores.symbols(i));
+    EXPECT_NEAR(expected_scores.probabilities(i), lm_scores.probabilities(i),
+                kFloatDelta);
+  }
+  EXPECT_EQ(state, hub->ResolveStateHandle(hub->StateHandle(state), "aa b"));
+}
+
+// The cummulative costs stored with reduced precision stay close to the
+// double precision ones, while taking less memory.
+TEST(NGramStateCacheTest, ReducedPrecisionMatchesDouble) {
+  // Cummulative costs of a vocabulary with Zipfian word probabilities.
+  constexpr int kVocabularySize = 1000;
+  std::vector<double> costs(kVocabularySize);
+  costs[0] = StdArc::Weight::Zero().Value();  // No end-of-string.
+  double total_prob = 0.0;
+  for (int i = 1; i < kVocabularySize; ++i) total_prob += 1.0 / i;
+  double cummulative_prob = 0.0;
+  for (int i = 1; i < kVocabularySize; ++i) {
+    cummulative_prob += 1.0 / i / total_prob;
+    costs[i] = -std::log(cummulative_prob);
+  }
+  const NGramStateCache double_cache(/*state=*/0, /*access_counter=*/0, costs);
+  const NGramStateCache float_cache(0, 0, costs,
+                                    NGramWordFstOptions::CACHE_FLOAT);
+  const NGramStateCache quantized_cache(0, 0, costs,
+                                        NGramWordFstOptions::CACHE_QUANTIZED);
+  EXPECT_LT(float_cache.MemoryUsage(), double_cache.MemoryUsage());
+  EXPECT_LT(quantized_cache.MemoryUsage(), float_cache.MemoryUsage());
+  for (const NGramStateCache *cache : {&float_cache, &quantized_cache}) {
+    EXPECT_TRUE(std::isinf(cache->cummulative_neg_log_prob(0)));
+    for (int i = 1; i < kVocabularySize; ++i) {
+      EXPECT_NEAR(double_cache.cummulative_neg_log_prob(i),
+                  cache->cummulative_neg_log_prob(i),
+                  kReducedPrecisionDelta);
+    }
+  }
+}
+
+// The sparse caches sum the probability differences within the ranges.
+TEST(NGramStateCacheTest, SparseCacheSumsDeltasInRange) {
+  const NGramStateCache cache(/*state=*/3, /*access_counter=*/0,
+                              /*backoff_state=*/0, /*backoff_cost=*/0.5,
+                              /*indices=*/{0, 2, 5}, {0.1, -0.2, 0.3});
+  EXPECT_TRUE(cache.sparse());
+  EXPECT_EQ(0, cache.backoff_state());
+  EXPECT_NEAR(0.5, cache.backoff_cost(), kFloatDelta);
+  EXPECT_NEAR(0.1, cache.GetProbDelta(0, 0), kFloatDelta);
+  EXPECT_NEAR(0.0, cache.GetProbDelta(3, 4), kFloatDelta);
+  EXPECT_NEAR(-0.2, cache.GetProbDelta(1, 4), kFloatDelta);
+  EXPECT_NEAR(0.1, cache.GetProbDelta(2, 9), kFloatDelta);
+  EXPECT_NEAR(0.2, cache.GetProbDelta(0, 5), kFloatDelta);
+
+  const NGramStateCache dense_cache(/*state=*/0, /*access_counter=*/0,
+                                    std::vector<double>(1000, 0.0));
+  EXPECT_FALSE(dense_cache.sparse());
+  EXPECT_LT(cache.MemoryUsage(), dense_cache.MemoryUsage());
+}
+
+// Scores of the models caching the costs with reduced precision.
+TEST_F(NGramWordFstTest, ReducedCachePrecisionKeepsScores) {
+  NGramWordFstModel model;
+  ASSERT_OK(model.Read(storage_));
+  for (const auto precision : {NGramWordFstOptions::CACHE_FLOAT,
+                               NGramWordFstOptions::CACHE_QUANTIZED}) {
+    SCOPED_TRACE(precision);
+    storage_.mutable_ngram_word_fst_options()->set_cache_precision(precision);
+    NGramWordFstModel compact_model;
+    ASSERT_OK(compact_model.Read(storage_));
+    for (const std::string context : {"", "a", "aa b", "aa ba", "bbb b"}) {
+      SCOPED_TRACE(context);
+      LMScores lm_scores, compact_lm_scores;
+      ASSERT_TRUE(
+          model.ExtractLMScores(model.ContextState(context), &lm_scores));
+      ASSERT_TRUE(compact_model.ExtractLMScores(
+          compact_model.ContextState(context), &compact_lm_scores));
+      ASSERT_EQ(lm_scores.symbols_size(), compact_lm_scores.symbols_size());
+      for (int i = 0; i < lm_scores.symbols_size(); ++i) {
+        EXPECT_EQ(lm_scores.symbols(i), compact_lm_scores.symbols(i));
+        EXPECT_NEAR(lm_scores.probabilities(i),
+                    compact_lm_scores.probabilities(i),
+                    kReducedPrecisionDelta);
+      }
+    }
+  }
+}
+
+// Scores of the models whose caches are evicted while computing the costs at
+// the backoff states of the sparse caches.
+TEST_F(NGramWordFstTest, SmallCacheKeepsScores) {
+  NGramWordFstModel model;
+  ASSERT_OK(model.Read(storage_));
+  storage_.mutable_ngram_word_fst_options()->set_max_cache_size(4);
+  NGramWordFstModel small_cache_model;
+  ASSERT_OK(small_cache_model.Read(storage_));
+  const metrics::Counter *evictions =
+      metrics::MetricsRegistry::Global().GetCounter("ngram/cache_evictions");
+  const int64_t initial_evictions = evictions->value();
+  for (int pass = 0; pass < 2; ++pass) {
+    for (const std::string context :
+         {"", "aa ", "aa ab ", "ab ba ", "ba ab ", "aa ba ", "ab bbb ",
+          "ba bbb ", "bbb ", "aa b", "ab ba b"}) {
+      SCOPED_TRACE(context);
+      LMScores lm_scores, small_cache_lm_scores;
+      ASSERT_TRUE(
+          model.ExtractLMScores(model.ContextState(context), &lm_scores));
+      ASSERT_TRUE(small_cache_model.ExtractLMScores(
+          small_cache_model.ContextState(context), &small_cache_lm_scores));
+      ASSERT_EQ(lm_scores.symbols_size(), small_cache_lm_scores.symbols_size());
+      for (int i = 0; i < lm_scores.symbols_size(); ++i) {
+        EXPECT_EQ(lm_scores.symbols(i), small_cache_lm_scores.symbols(i));
+        EXPECT_NEAR(lm_scores.probabilities(i),
+                    small_cache_lm_scores.probabilities(i), kFloatDelta);
+      }
+    }
+  }
+  EXPECT_LT(initial_evictions, evictions->value());
+}
+
+// The dense cache at the unigram state, visited by the lookups at all the
+// other states, is refreshed on every visit, hence is not the first evicted.
+TEST_F(NGramWordFstTest, CacheHitsRefreshBackoffCaches) {
+  storage_.mutable_ngram_word_fst_options()->set_max_cache_size(4);
+  NGramWordFstModel model;
+  ASSERT_OK(model.Read(storage_));
+  LMScores lm_scores;
+  // Fills the cache with the start, "ab", "aa ab" and unigram states.
+  ASSERT_TRUE(model.ExtractLMScores(model.ContextState(""), &lm_scores));
+  ASSERT_TRUE(model.ExtractLMScores(model.ContextState("aa ab "), &lm_scores));
+  const metrics::Counter *misses =
+      metrics::MetricsRegistry::Global().GetCounter("ngram/cache_misses");
+  const int64_t initial_misses = misses->value();
+  // Only the "ba" and "aa ba" states are missing, the unigram state is kept.
+  for (int i = 0; i < 2; ++i) {
+    lm_scores.Clear();
+    ASSERT_TRUE(
+        model.ExtractLMScores(model.ContextState("aa ba "), &lm_scores));
+  }
+  EXPECT_EQ(initial_misses + 2, misses->value());
+}
+
+// The lexicographic order written by the model is read back instead of
+// sorting the vocabulary, while the mismatching orders are ignored.
+TEST_F(NGramWordFstTest, ReadsLexicographicOrderFile) {
+  NGramWordFstModel model;
+  ASSERT_OK(model.Read(storage_));
+  const std::string order_file =
+      nisaba::file::TempFilePath("trigram_word_mod.order");
+  ASSERT_OK(model.WriteLexicographicOrder(order_file));
+  storage_.mutable_ngram_word_fst_options()->set_lexicographic_order_file(
+      order_file);
+  NGramWordFstModel ordered_model;
+  ASSERT_OK(ordered_model.Read(storage_));
+
+  // Reversed order of the words, keeping <epsilon> first.
+  const std::string reversed_order_file =
+      nisaba::file::TempFilePath("trigram_word_mod_reversed.order");
+  ASSERT_OK(nisaba::file::WriteBinaryFile(
+      reversed_order_file, std::string("\0\0\0\0\4\0\0\0\3\0\0\0"
+                                       "\2\0\0\0\1\0\0\0",
+                                       20)));
+  storage_.mutable_ngram_word_fst_options()->set_lexicographic_order_file(
+      reversed_order_file);
+  NGramWordFstModel fallback_model;
+  ASSERT_OK(fallback_model.Read(storage_));
+
+  for (const std::string context : {"", "a", "aa b", "bbb bb"}) {
+    SCOPED_TRACE(context);
+    LMScores lm_scores;
+    ASSERT_TRUE(model.ExtractLMScores(model.ContextState(context), &lm_scores));
+    for (NGramWordFstModel *other_model : {&ordered_model, &fallback_model}) {
+      LMScores other_lm_scores;
+      ASSERT_TRUE(other_model->ExtractLMScores(
+          other_model->ContextState(context), &other_lm_scores));
+      EXPECT_THAT(other_lm_scores,
+                  ::protobuf_matchers::EqualsProto(lm_scores));
+    }
+  }
+}
+
 // Check that we can use the FSTs converted from third-party models.
 //
 // Note: We don't run this test on Windows because we presently cannot verify
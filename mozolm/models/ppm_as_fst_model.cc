@@ -14,6 +14,7 @@
 
 #include "mozolm/models/ppm_as_fst_model.h"
 
+#include <algorithm>
 #include <cmath>
 #include <memory>
 
@@ -22,6 +23,9 @@
 #include "absl/memory/memory.h"
 #include "absl/status/statusor.h"
 #include "absl/strings/str_cat.h"
+#include "absl/strings/str_split.h"
+#include "absl/strings/string_view.h"
+#include "mozolm/utils/metrics.h"
 #include "nisaba/port/file_util.h"
 #include "nisaba/port/timer.h"
 #include "nisaba/port/utf8_util.h"
@@ -38,6 +42,7 @@ namespace models {
 using nisaba::file::ReadLines;
 using nisaba::utf8::EncodeUnicodeChar;
 using nisaba::utf8::StrSplitByChar;
+using nisaba::utf8::StrSplitByCharToUnicode;
 
 using fst::ArcIterator;
 using fst::ILabelCompare;
@@ -48,6 +53,51 @@ using fst::StdVectorFst;
 using fst::SymbolTable;
 using fst::SymbolTableIterator;
 
+namespace {
+
+// Number of PPM state cache lookups that found the cached state.
+metrics::Counter *CacheHits() {
+  static metrics::Counter *const counter =
+      metrics::MetricsRegistry::Global().GetCounter("ppm/cache_hits");
+  return counter;
+}
+
+// Number of PPM state cache lookups that (re)computed the state.
+metrics::Counter *CacheMisses() {
+  static metrics::Counter *const counter =
+      metrics::MetricsRegistry::Global().GetCounter("ppm/cache_misses");
+  return counter;
+}
+
+// Number of PPM states evicted from the full cache.
+metrics::Counter *CacheEvictions() {
+  static metrics::Counter *const counter =
+      metrics::MetricsRegistry::Global().GetCounter("ppm/cache_evictions");
+  return counter;
+}
+
+// Snapshot of the counts of the PPM model. The copy of the FST shares its
+// implementation with the model until either of them is modified.
+class PpmSnapshot : public ModelSnapshot {
+ public:
+  explicit PpmSnapshot(const StdVectorFst& fst) : fst_(fst) {}
+
+  absl::Status Write(const std::string& ofile) const override {
+    StdVectorFst fst(fst_);
+    ArcSort(&fst, ILabelCompare<StdArc>());
+    if (!fst.Write(ofile)) {
+      return absl::InternalError(
+          absl::StrCat("Failed to write FST to ", ofile));
+    }
+    return absl::OkStatus();
+  }
+
+ private:
+  const StdVectorFst fst_;
+};
+
+}  // namespace
+
 namespace impl {
 namespace {
 
@@ -66,9 +116,8 @@ int GetBackoffState(const StdVectorFst& fst, StdArc::StateId s) {
   if (s >= 0 && s < fst.NumStates()) {
     // Checks first arc leaving state. Will have label 0 if there is a backoff.
     ArcIterator<StdVectorFst> aiter(fst, s);
-    const StdArc arc = aiter.Value();
-    if (arc.ilabel == 0) {
-      backoff_state = arc.nextstate;
+    if (!aiter.Done() && aiter.Value().ilabel == 0) {
+      backoff_state = aiter.Value().nextstate;
     }
   }
   return backoff_state;
@@ -219,10 +268,10 @@ bool NoObservations(const StdVectorFst& fst, StdArc::StateId s) {
 }
 
 // Returns the backoff state for the current state if exists, otherwise -1. If
-// found, increments the count on the backoff arc by 1, unless there are no
+// found, increments the count on the backoff arc by count, unless there are no
 // prior observations from the state, in which case no need to increment.
 int IncrementBackoffArcReturnBackoffState(StdVectorFst* fst,
-                                          StdArc::StateId s) {
+                                          StdArc::StateId s, int64_t count) {
   const bool increment_count = !NoObservations(*fst, s);
   int backoff_state = -1;
   MutableArcIterator<StdVectorFst> arc_iterator(fst, s);
@@ -230,7 +279,8 @@ int IncrementBackoffArcReturnBackoffState(StdVectorFst* fst,
   if (arc.ilabel == 0) {
     backoff_state = arc.nextstate;
     if (increment_count) {
-      arc.weight = StdArc::Weight(sfst::NegLogSum(arc.weight.Value(), 0.0));
+      arc.weight = StdArc::Weight(
+          sfst::NegLogSum(arc.weight.Value(), -std::log(count)));
       arc_iterator.SetValue(arc);
     }
   }
@@ -308,7 +358,7 @@ absl::Status PpmAsFstModel::AddExtraCharacters(
 
 absl::StatusOr<int> PpmAsFstModel::CalculateStateOrder(int s) {
   if (state_orders_[s] >= 0) return state_orders_[s];
-  const int backoff_state = impl::GetBackoffState(*fst_, s);
+  const int backoff_state = backoff_states_[s];
   if (backoff_state < 0) {
     return absl::InternalError(
         "No backoff state found when computing state orders.");
@@ -321,10 +371,14 @@ absl::StatusOr<int> PpmAsFstModel::CalculateStateOrder(int s) {
   return state_orders_[s];
 }
 
-absl::Status PpmAsFstModel::CalculateStateOrders(bool save_state_orders) {
-  state_orders_.resize(fst_->NumStates(), -1);
+absl::Status PpmAsFstModel::CalculateStateOrders() {
+  backoff_states_.resize(fst_->NumStates());
+  for (int s = 0; s < backoff_states_.size(); ++s) {
+    backoff_states_[s] = impl::GetBackoffState(*fst_, s);
+  }
+  state_orders_.assign(fst_->NumStates(), -1);
   state_orders_[fst_->Start()] = 1;
-  const int unigram_state = impl::GetBackoffState(*fst_, fst_->Start());
+  const int unigram_state = backoff_states_[fst_->Start()];
   if (unigram_state < 0) {
     return absl::InternalError("Invalid unigram state: -1");
   }
@@ -339,7 +393,6 @@ absl::Status PpmAsFstModel::CalculateStateOrders(bool save_state_orders) {
       max_state_order = this_state_order_status.value();
     }
   }
-  if (!save_state_orders) state_orders_.clear();
   if (max_state_order >= max_order_) max_order_ = max_state_order + 1;
   return absl::OkStatus();
 }
@@ -452,6 +505,11 @@ absl::Status PpmAsFstModel::WriteFst(const std::string& ofile) const {
   }
 }
 
+absl::StatusOr<std::unique_ptr<ModelSnapshot>> PpmAsFstModel::Snapshot()
+    const {
+  return std::make_unique<PpmSnapshot>(*fst_);
+}
+
 absl::Status PpmAsFstModel::Read(const ModelStorage& storage) {
   const PpmAsFstOptions ppm_as_fst_config = storage.ppm_options();
   InitParameters(ppm_as_fst_config);
@@ -509,7 +567,7 @@ absl::Status PpmAsFstModel::Read(const ModelStorage& storage) {
     }
     GOOGLE_LOG(INFO) << "Added " << syms_->NumSymbols() << " symbols to vocabulary";
   }
-  RETURN_IF_ERROR(CalculateStateOrders(/*save_state_orders=*/!static_model_));
+  RETURN_IF_ERROR(CalculateStateOrders());
   if (max_cache_size_ < max_order_) {
     // To descent backoff needs at least max_order_ worth of cache.
     max_cache_size_ = max_order_ + 1;
@@ -564,6 +622,7 @@ absl::Status PpmAsFstModel::GetNewCacheIndex(StdArc::StateId s) {
       return absl::InternalError("Cache index not updated correctly.");
     }
     cache_index_[old_state] = -1;
+    CacheEvictions()->Increment();
     state_cache_[index_to_update] = PpmStateCache(s);
     cache_index_[s] = index_to_update;
   }
@@ -681,7 +740,7 @@ absl::Status PpmAsFstModel::UpdateCacheAtState(StdArc::StateId s) {
   if (s >= fst_->NumStates()) {
     return absl::InternalError("State index out of bounds");
   }
-  const int backoff_state = impl::GetBackoffState(*fst_, s);
+  const int backoff_state = BackoffState(s);
   PpmStateCache backoff_cache(-1);
   if (backoff_state >= 0) {
     ASSIGN_OR_RETURN(backoff_cache, EnsureCacheAtState(backoff_state));
@@ -721,14 +780,14 @@ absl::StatusOr<bool> PpmAsFstModel::NeedsNewState(
 bool PpmAsFstModel::LowerOrderCacheUpdated(StdArc::StateId s) const {
   if (cache_index_[s] < 0) return true;
   const int last_updated = state_cache_[cache_index_[s]].last_updated();
-  int backoff_state = impl::GetBackoffState(*fst_, s);
+  int backoff_state = BackoffState(s);
   while (backoff_state >= 0) {
     if (cache_index_[backoff_state] >= 0 &&
         state_cache_[cache_index_[backoff_state]].last_updated() >
             last_updated) {
       return true;
     }
-    backoff_state = impl::GetBackoffState(*fst_, backoff_state);
+    backoff_state = BackoffState(backoff_state);
   }
   return false;
 }
@@ -737,6 +796,7 @@ absl::StatusOr<PpmStateCache> PpmAsFstModel::EnsureCacheAtState(
     StdArc::StateId s) {
   bool update_access = true;
   if (cache_index_[s] < 0 || LowerOrderCacheUpdated(s)) {
+    CacheMisses()->Increment();
     const absl::Status update_status = UpdateCacheAtState(s);
     if (update_status != absl::OkStatus()) return update_status;
     update_access = false;
@@ -751,6 +811,7 @@ absl::StatusOr<PpmStateCache> PpmAsFstModel::EnsureCacheAtState(
     return absl::InternalError("State not stored correctly in cache index.");
   }
   if (update_access) {
+    CacheHits()->Increment();
     state_cache_[cache_index_[s]].set_last_accessed(cache_accessed_++);
   }
   return state_cache_[cache_index_[s]];
@@ -819,6 +880,7 @@ absl::StatusOr<int> PpmAsFstModel::AddNewState(
   }
   state_orders_.push_back(
       backoff_dest_state >= 0 ? state_orders_[backoff_dest_state] + 1 : 0);
+  backoff_states_.push_back(backoff_dest_state);
   cache_index_.push_back(-1);
   if (backoff_dest_state >= 0) {
     fst_->AddArc(new_state_index,
@@ -827,12 +889,15 @@ absl::StatusOr<int> PpmAsFstModel::AddNewState(
   return new_state_index;
 }
 
-absl::Status PpmAsFstModel::UpdateHighestFoundState(StdArc::StateId curr_state,
-                                                    int sym_index) {
+absl::StatusOr<StdArc::StateId> PpmAsFstModel::UpdateHighestFoundState(
+    StdArc::StateId curr_state, int sym_index, int64_t count) {
+  const double count_cost = -std::log(count);
   if (sym_index == 0) {
-    // Adds one to final cost and sets destination state to start state.
-    fst_->SetFinal(curr_state, StdArc::Weight(sfst::NegLogSum(
-                                   fst_->Final(curr_state).Value(), 0.0)));
+    // Adds count to final cost and sets destination state to start state.
+    fst_->SetFinal(curr_state,
+                   StdArc::Weight(sfst::NegLogSum(
+                       fst_->Final(curr_state).Value(), count_cost)));
+    return fst_->Start();
   } else {
     // Arc with sym_index found at current state.
     int new_next_state = -1;
@@ -853,7 +918,8 @@ absl::Status PpmAsFstModel::UpdateHighestFoundState(StdArc::StateId curr_state,
           new_next_state = state_orders_.size();
           arc.nextstate = new_next_state;
         }
-        arc.weight = StdArc::Weight(sfst::NegLogSum(arc.weight.Value(), 0.0));
+        arc.weight =
+            StdArc::Weight(sfst::NegLogSum(arc.weight.Value(), count_cost));
         arc_iterator.SetValue(arc);
         break;
       }
@@ -867,12 +933,13 @@ absl::Status PpmAsFstModel::UpdateHighestFoundState(StdArc::StateId curr_state,
       if (!add_new_state_status.ok()) {
         return add_new_state_status.status();
       }
+      return new_next_state;
     }
+    return old_next_state;
   }
-  return absl::OkStatus();
 }
 
-absl::Status PpmAsFstModel::UpdateNotFoundState(
+absl::StatusOr<StdArc::StateId> PpmAsFstModel::UpdateNotFoundState(
     StdArc::StateId curr_state, StdArc::StateId highest_found_state,
     StdArc::StateId backoff_state, int sym_index) {
   const auto update_status =
@@ -881,6 +948,7 @@ absl::Status PpmAsFstModel::UpdateNotFoundState(
   int backoff_dest_state = update_status.value();
   if (sym_index == 0) {
     fst_->SetFinal(curr_state, StdArc::Weight::One());
+    return fst_->Start();
   } else {
     // No arc with sym_index found at current state.
     const auto needs_new_state_status = NeedsNewState(curr_state,
@@ -898,29 +966,68 @@ absl::Status PpmAsFstModel::UpdateNotFoundState(
     }
     fst_->AddArc(curr_state, StdArc(sym_index, sym_index, StdArc::Weight::One(),
                                     dest_state));
+    return dest_state;
   }
-  return absl::OkStatus();
 }
 
 absl::StatusOr<StdArc::StateId> PpmAsFstModel::UpdateModel(
     StdArc::StateId curr_state, StdArc::StateId highest_found_state,
-    int sym_index) {
-  absl::Status update_status;
-  const int backoff_state =
-      impl::IncrementBackoffArcReturnBackoffState(fst_.get(), curr_state);
+    int sym_index, int64_t count) {
+  if (count > 1 && highest_found_state != curr_state) {
+    return absl::InvalidArgumentError(
+        "Multiple observations must accrue at the highest found state.");
+  }
+  const int backoff_state = impl::IncrementBackoffArcReturnBackoffState(
+      fst_.get(), curr_state, count);
+  StdArc::StateId dest_state;
   if (highest_found_state == curr_state) {
-    update_status = UpdateHighestFoundState(curr_state, sym_index);
+    ASSIGN_OR_RETURN(dest_state,
+                     UpdateHighestFoundState(curr_state, sym_index, count));
   } else {
-    update_status = UpdateNotFoundState(curr_state, highest_found_state,
-                                        backoff_state, sym_index);
+    ASSIGN_OR_RETURN(dest_state,
+                     UpdateNotFoundState(curr_state, highest_found_state,
+                                         backoff_state, sym_index));
   }
-  if (update_status == absl::OkStatus()) {
-    update_status = UpdateCacheAtState(curr_state);
-    if (update_status == absl::OkStatus()) {
-      return GetDestinationState(curr_state, sym_index);
+  if (defer_cache_updates_) {
+    stale_cache_states_.insert(curr_state);
+  } else {
+    RETURN_IF_ERROR(UpdateCacheAtState(curr_state));
+  }
+  return dest_state;
+}
+
+absl::StatusOr<int> PpmAsFstModel::FindArcOriginState(StdArc::StateId s,
+                                                      int sym_index) const {
+  for (StdArc::StateId state = s; state >= 0;
+       state = BackoffState(state)) {
+    if (sym_index == 0) {
+      if (fst_->Final(state) != StdArc::Weight::Zero()) return state;
+      continue;
+    }
+    for (ArcIterator<StdVectorFst> arc_iterator(*fst_, state);
+         !arc_iterator.Done(); arc_iterator.Next()) {
+      if (arc_iterator.Value().ilabel == sym_index) return state;
     }
   }
-  return update_status;
+  return absl::NotFoundError(
+      absl::StrCat("No arc found for symbol index ", sym_index));
+}
+
+absl::Status PpmAsFstModel::UpdateStaleCaches() {
+  // Lower order states are brought up to date first, so that the caches of
+  // the higher order states are computed from the current backoff caches.
+  std::vector<int> states(stale_cache_states_.begin(),
+                         stale_cache_states_.end());
+  stale_cache_states_.clear();
+  std::sort(states.begin(), states.end(), [this](int a, int b) {
+    return state_orders_[a] != state_orders_[b]
+               ? state_orders_[a] < state_orders_[b]
+               : a < b;
+  });
+  for (const int s : states) {
+    RETURN_IF_ERROR(UpdateCacheAtState(s));
+  }
+  return absl::OkStatus();
 }
 
 int PpmAsFstModel::NextState(int state, int utf8_sym) {
@@ -934,7 +1041,7 @@ int PpmAsFstModel::NextState(int state, int utf8_sym) {
   }
   // If symbol is epsilon or not in vocabulary, or destination state retrieval
   // fails, next state is unigram state (no context).
-  return impl::GetBackoffState(*fst_, fst_->Start());
+  return BackoffState(fst_->Start());
 }
 
 bool PpmAsFstModel::ExtractLMScores(int state, LMScores* response) {
@@ -963,14 +1070,8 @@ double PpmAsFstModel::SymLMScore(int state, int utf8_sym) {
   return StdArc::Weight::Zero().Value();
 }
 
-bool PpmAsFstModel::UpdateLMCounts(int32_t state,
-                                   const std::vector<int>& utf8_syms,
-                                   int64_t count) {
-  // TODO: needs Mutex locks for model updating.
-  if (static_model_ || count <= 0) {
-    // Returns true, nothing to update.
-    return true;
-  }
+absl::StatusOr<int> PpmAsFstModel::UpdateCounts(
+    int state, const std::vector<int>& utf8_syms, int64_t count) {
   for (auto utf8_sym : utf8_syms) {
     int sym_index = utf8_sym;
     if (utf8_sym > 0) {
@@ -981,21 +1082,54 @@ bool PpmAsFstModel::UpdateLMCounts(int32_t state,
       // Symbol not in model, ignoring and moves to start state.
       // TODO: Possible to add symbol not covered in model?
       state = start_state();
+      continue;
+    }
+    // The caches are out of date while their updates are deferred, hence the
+    // origin state is then looked up in the model itself.
+    int origin_state;
+    if (defer_cache_updates_) {
+      ASSIGN_OR_RETURN(origin_state, FindArcOriginState(state, sym_index));
     } else {
-      const auto origin_state_status = GetArcOriginState(state, sym_index);
-      if (!origin_state_status.ok()) return false;
-      auto update_status =
-          UpdateModel(state, origin_state_status.value(), sym_index);
-      if (!update_status.ok()) return false;
-      for (int c = 1; c < count; c++) {
-        // Any subsequent observations accrue only at state.
-        update_status = UpdateModel(state, state, sym_index);
-        if (!update_status.ok()) return false;
-      }
-       state = NextState(state, utf8_sym);
+      ASSIGN_OR_RETURN(origin_state, GetArcOriginState(state, sym_index));
+    }
+    StdArc::StateId dest_state;
+    ASSIGN_OR_RETURN(dest_state, UpdateModel(state, origin_state, sym_index));
+    if (count > 1) {
+      // Any subsequent observations accrue only at state, all at once.
+      ASSIGN_OR_RETURN(dest_state,
+                       UpdateModel(state, state, sym_index, count - 1));
     }
+    state = sym_index > 0 ? dest_state : NextState(state, utf8_sym);
   }
-  return true;
+  return state;
+}
+
+bool PpmAsFstModel::UpdateLMCounts(int32_t state,
+                                   const std::vector<int>& utf8_syms,
+                                   int64_t count) {
+  // TODO: needs Mutex locks for model updating.
+  if (static_model_ || count <= 0) {
+    // Returns true, nothing to update.
+    return true;
+  }
+  return UpdateCounts(state, utf8_syms, count).ok();
+}
+
+absl::Status PpmAsFstModel::AdaptToText(const std::string& text) {
+  if (static_model_) return absl::OkStatus();
+  defer_cache_updates_ = true;
+  absl::Status update_status = absl::OkStatus();
+  for (absl::string_view line : absl::StrSplit(text, '\n', absl::SkipEmpty())) {
+    update_status = UpdateCounts(start_state(), StrSplitByCharToUnicode(line),
+                                 /*count=*/1)
+                        .status();
+    if (!update_status.ok()) break;
+  }
+  // The caches are brought up to date even if an update failed midway, since
+  // the counts may have already changed.
+  defer_cache_updates_ = false;
+  RETURN_IF_ERROR(UpdateStaleCaches());
+  return update_status;
 }
 
 void PpmStateCache::UpdateCache(int access_counter,
@@ -66,6 +66,7 @@
 #include <string>
 #include <vector>
 
+#include "absl/container/flat_hash_set.h"
 #include "absl/status/statusor.h"
 #include "mozolm/models/language_model.h"
 #include "mozolm/models/model_storage.pb.h"
@@ -173,6 +174,11 @@ class PpmAsFstModel : public LanguageModel {
   // Returns fst_.
   const fst::StdVectorFst GetFst() const { return *fst_; }
 
+  // Returns a snapshot sharing the counts with the model until either of them
+  // is modified (the FSTs are copied on write), hence taking it is constant
+  // time.
+  absl::StatusOr<std::unique_ptr<ModelSnapshot>> Snapshot() const override;
+
   // Provides the state reached from state following utf8_sym.
   int NextState(int state, int utf8_sym) override;
 
@@ -186,6 +192,10 @@ class PpmAsFstModel : public LanguageModel {
   bool UpdateLMCounts(int state, const std::vector<int>& utf8_syms,
                       int64_t count) override;
 
+  // Adapts the model to the text, counting each of its lines from the start
+  // state. The caches are brought up to date once for the whole text.
+  absl::Status AdaptToText(const std::string& text) override;
+
   // Returns value of static_model_ bool.
   bool IsStatic() const override { return static_model_; }
 
@@ -218,9 +228,14 @@ class PpmAsFstModel : public LanguageModel {
   // Calculates the state order for given state, using backoffs.
   absl::StatusOr<int> CalculateStateOrder(int s);
 
-  // Calculates and stores state orders for updates to model.  Updates
-  // max_order_ of model if higher than provided parameter.
-  absl::Status CalculateStateOrders(bool save_state_orders);
+  // Calculates and stores the backoff state and order of every state, which
+  // are then maintained by AddNewState as the model grows. Updates max_order_
+  // of model if higher than provided parameter.
+  absl::Status CalculateStateOrders();
+
+  // Returns the backoff state for the state, or -1 for the unigram state.
+  // Only valid once the state orders have been calculated.
+  int BackoffState(fst::StdArc::StateId s) const { return backoff_states_[s]; }
 
   // Determines whether new state needs to be created for arc.
   absl::StatusOr<bool> NeedsNewState(fst::StdArc::StateId curr_state,
@@ -289,20 +304,37 @@ class PpmAsFstModel : public LanguageModel {
   // Returns normalization value at the current state.
   absl::StatusOr<double> GetNormalization(fst::StdArc::StateId s);
 
-  // Updates model at highest found state for given symbol.
-  absl::Status UpdateHighestFoundState(fst::StdArc::StateId curr_state,
-                                       int sym_index);
+  // Returns origin state of arc with symbol from state s, found by following
+  // the backoff arcs of the model rather than from the cache.
+  absl::StatusOr<int> FindArcOriginState(fst::StdArc::StateId s,
+                                         int sym_index) const;
 
-  // Updates model at state where given symbol is not found.
-  absl::Status UpdateNotFoundState(fst::StdArc::StateId curr_state,
-                                   fst::StdArc::StateId highest_found_state,
-                                   fst::StdArc::StateId backoff_state,
-                                   int sym_index);
+  // Updates model at highest found state for given symbol, adding count to
+  // it. Returns the destination state.
+  absl::StatusOr<fst::StdArc::StateId> UpdateHighestFoundState(
+      fst::StdArc::StateId curr_state, int sym_index, int64_t count);
 
-  // Updates model with an observation of the sym_index at curr_state.
+  // Updates model at state where given symbol is not found. Returns the
+  // destination state.
+  absl::StatusOr<fst::StdArc::StateId> UpdateNotFoundState(
+      fst::StdArc::StateId curr_state, fst::StdArc::StateId highest_found_state,
+      fst::StdArc::StateId backoff_state, int sym_index);
+
+  // Updates model with count observations of the sym_index at curr_state and
+  // returns the destination state. More than one observation can only be added
+  // at once where curr_state is the highest found state.
   absl::StatusOr<fst::StdArc::StateId> UpdateModel(
       fst::StdArc::StateId curr_state, fst::StdArc::StateId highest_found_state,
-      int sym_index);
+      int sym_index, int64_t count = 1);
+
+  // Updates the counts for the utf8_syms at the state and returns the state
+  // reached after them.
+  absl::StatusOr<int> UpdateCounts(int state, const std::vector<int>& utf8_syms,
+                                   int64_t count);
+
+  // Recomputes the caches of the states updated while the cache updates were
+  // deferred, lower order states first.
+  absl::Status UpdateStaleCaches();
 
   // Converts input string into linear FST at the character level, replacing
   // characters not in possible_characters_ set (if non-empty) with kOovSymbol.
@@ -316,6 +348,7 @@ class PpmAsFstModel : public LanguageModel {
   double beta_;        // Beta hyper-parameter for PPM.
   bool static_model_;  // Whether to use the model as static or dynamic.
   std::vector<int> state_orders_;  // Stores the order of each state.
+  std::vector<int> backoff_states_;  // Stores the backoff of each state.
   std::unique_ptr<fst::StdVectorFst> fst_;  // Model (counts) stored in FST.
   // For counting character n-grams if training from text file.
   std::unique_ptr<sfst::NGramCounter<fst::Log64Weight>> ngram_counter_;
@@ -326,6 +359,10 @@ class PpmAsFstModel : public LanguageModel {
   int cache_accessed_;  // Counter of cache accesses to determine priority.
   std::vector<int> cache_index_;  // Index of cache for state if it exists.
   std::vector<PpmStateCache> state_cache_;  // Cache for state information.
+
+  // Whether the cache updates are deferred until the end of a batch update.
+  bool defer_cache_updates_ = false;
+  absl::flat_hash_set<int> stale_cache_states_;  // States updated in batch.
 };
 
 }  // namespace models
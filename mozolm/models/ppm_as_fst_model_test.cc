@@ -18,6 +18,7 @@
 #include <cstdlib>
 #include <filesystem>
 #include <fstream>
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -421,6 +422,102 @@ TEST_F(PpmAsFstTest, UpdateLMCounts) {
   }
 }
 
+// Adding several counts at once matches adding them one by one.
+TEST_F(PpmAsFstTest, WeightedUpdateMatchesRepeatedUpdates) {
+  ModelStorage storage = storage_;
+  storage.mutable_ppm_options()->set_static_model(false);
+  PpmAsFstModel weighted_model, repeated_model;
+  ASSERT_OK(weighted_model.Read(storage));
+  ASSERT_OK(repeated_model.Read(storage));
+  const int start_state = weighted_model.ContextState("");
+  ASSERT_EQ(start_state, repeated_model.ContextState(""));
+
+  ASSERT_TRUE(weighted_model.UpdateLMCounts(start_state, {98, 0}, 3));
+  for (int c = 0; c < 3; ++c) {
+    ASSERT_TRUE(repeated_model.UpdateLMCounts(start_state, {98}, 1));
+  }
+  for (int c = 0; c < 3; ++c) {
+    // The state reached by "b" is unchanged by the subsequent updates.
+    const int b_state = repeated_model.ContextState("b");
+    ASSERT_TRUE(repeated_model.UpdateLMCounts(b_state, {0}, 1));
+  }
+  EXPECT_TRUE(
+      Isomorphic<StdArc>(weighted_model.GetFst(), repeated_model.GetFst()));
+  for (const std::string context : {"", "b"}) {
+    const int weighted_state = weighted_model.ContextState(context);
+    const int repeated_state = repeated_model.ContextState(context);
+    for (const int utf8_sym : {0, 97, 98}) {
+      EXPECT_NEAR(weighted_model.SymLMScore(weighted_state, utf8_sym),
+                  repeated_model.SymLMScore(repeated_state, utf8_sym),
+                  kFloatDelta);
+    }
+  }
+}
+
+// Adapting to text in a batch matches updating the counts symbol by symbol.
+TEST_F(PpmAsFstTest, AdaptToTextMatchesUpdateLMCounts) {
+  ModelStorage storage = storage_;
+  storage.mutable_ppm_options()->set_static_model(false);
+  PpmAsFstModel batch_model, model;
+  ASSERT_OK(batch_model.Read(storage));
+  ASSERT_OK(model.Read(storage));
+  const int start_state = model.ContextState("");
+
+  ASSERT_OK(batch_model.AdaptToText("abbab"));
+  ASSERT_TRUE(model.UpdateLMCounts(start_state, {97, 98, 98, 97, 98}, 1));
+  EXPECT_TRUE(Isomorphic<StdArc>(batch_model.GetFst(), model.GetFst()));
+  for (const std::string context : {"", "a", "ab", "bb", "abba"}) {
+    const int batch_state = batch_model.ContextState(context);
+    const int state = model.ContextState(context);
+    for (const int utf8_sym : {0, 97, 98}) {
+      EXPECT_NEAR(batch_model.SymLMScore(batch_state, utf8_sym),
+                  model.SymLMScore(state, utf8_sym), kFloatDelta);
+    }
+  }
+
+  // Static models are left as is.
+  PpmAsFstModel static_model;
+  ASSERT_OK(static_model.Read(storage_));
+  const StdVectorFst static_fst = static_model.GetFst();
+  ASSERT_OK(static_model.AdaptToText("abbab"));
+  EXPECT_TRUE(Isomorphic<StdArc>(static_fst, static_model.GetFst()));
+}
+
+// Snapshot keeps the counts at the time it was taken and reads back as the
+// model at that time.
+TEST_F(PpmAsFstTest, SnapshotRestoresCountsWhenTaken) {
+  ModelStorage storage = storage_;
+  storage.mutable_ppm_options()->set_static_model(false);
+  PpmAsFstModel model, expected_model;
+  ASSERT_OK(model.Read(storage));
+  ASSERT_OK(expected_model.Read(storage));
+  ASSERT_OK(model.AdaptToText("abbab"));
+  ASSERT_OK(expected_model.AdaptToText("abbab"));
+
+  const auto snapshot_status = model.Snapshot();
+  ASSERT_OK(snapshot_status.status());
+  const std::unique_ptr<ModelSnapshot>& snapshot = snapshot_status.value();
+  ASSERT_NE(snapshot, nullptr);
+  ASSERT_OK(model.AdaptToText("bbbbbbbb"));  // Not in the snapshot.
+  const std::string snapshot_file =
+      (std::filesystem::temp_directory_path() / "snapshot.fst").string();
+  ASSERT_OK(snapshot->Write(snapshot_file));
+
+  PpmAsFstModel restored_model;
+  ModelStorage restored_storage = storage;
+  restored_storage.set_model_file(snapshot_file);
+  ASSERT_OK(restored_model.Read(restored_storage));
+  EXPECT_TRUE(std::filesystem::remove(snapshot_file));
+  for (const std::string context : {"", "a", "ab", "bb", "abba"}) {
+    const int restored_state = restored_model.ContextState(context);
+    const int state = expected_model.ContextState(context);
+    for (const int utf8_sym : {0, 97, 98}) {
+      EXPECT_NEAR(restored_model.SymLMScore(restored_state, utf8_sym),
+                  expected_model.SymLMScore(state, utf8_sym), kFloatDelta);
+    }
+  }
+}
+
 // Checks various bad initialization conditions.
 TEST(PpmAsFstOtherTest, CheckBadInitializationConditions) {
   ModelStorage storage;
@@ -21,6 +21,7 @@
 #include "absl/status/statusor.h"
 #include "absl/strings/str_cat.h"
 #include "absl/strings/str_split.h"
+#include "absl/strings/string_view.h"
 #include "nisaba/port/utf8_util.h"
 #include "nisaba/port/status_macros.h"
 
@@ -197,9 +198,27 @@ bool SimpleBigramCharModel::UpdateLMCounts(int state,
                                            int64_t count) {
   absl::WriterMutexLock nl(normalizer_lock_);
   absl::WriterMutexLock cl(counts_lock_);
+  UpdateCounts(state, utf8_syms, count);
+  return true;
+}
+
+absl::Status SimpleBigramCharModel::AdaptToText(const std::string& text) {
+  // All the lines are counted under a single acquisition of the locks.
+  absl::WriterMutexLock nl(normalizer_lock_);
+  absl::WriterMutexLock cl(counts_lock_);
+  for (absl::string_view line : absl::StrSplit(text, '\n', absl::SkipEmpty())) {
+    UpdateCounts(start_state(), nisaba::utf8::StrSplitByCharToUnicode(line),
+                 /*count=*/1);
+  }
+  return absl::OkStatus();
+}
+
+void SimpleBigramCharModel::UpdateCounts(int state,
+                                         const std::vector<int>& utf8_syms,
+                                         int64_t count) {
   if (count <= 0) {
-    // Returns true, nothing to update.
-    return true;
+    // Nothing to update.
+    return;
   }
   if (!ValidState(state)) {
     // Invalid state, switching to start state, by convention state 0.
@@ -216,7 +235,6 @@ bool SimpleBigramCharModel::UpdateLMCounts(int state,
     }
     state = next_state;
   }
-  return true;
 }
 
 }  // namespace models
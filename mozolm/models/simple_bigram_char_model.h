@@ -15,6 +15,7 @@
 #ifndef MOZOLM_MOZOLM_MODELS_SIMPLE_BIGRAM_CHAR_MODEL_H_
 #define MOZOLM_MOZOLM_MODELS_SIMPLE_BIGRAM_CHAR_MODEL_H_
 
+#include <string>
 #include <vector>
 
 #include "absl/status/status.h"
@@ -51,6 +52,11 @@ class SimpleBigramCharModel : public LanguageModel {
                       int64_t count)
       ABSL_LOCKS_EXCLUDED(normalizer_lock_, counts_lock_) override;
 
+  // Adapts the counts to the text, counting each of its lines from the start
+  // state.
+  absl::Status AdaptToText(const std::string& text)
+      ABSL_LOCKS_EXCLUDED(normalizer_lock_, counts_lock_) override;
+
   // Returns false since these models are always dynamic.
   bool IsStatic() const override { return false; }
 
@@ -67,6 +73,11 @@ class SimpleBigramCharModel : public LanguageModel {
   // Provides the state associated with the symbol.
   int SymState(int utf8_sym);
 
+  // Updates the counts for the utf8_syms at the state.
+  void UpdateCounts(int state, const std::vector<int>& utf8_syms,
+                    int64_t count)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(normalizer_lock_, counts_lock_);
+
   std::vector<int> utf8_indices_;   // utf8 symbols in vocabulary.
   std::vector<int> vocab_indices_;  // dimension is utf8 symbol, stores index.
   // stores normalization constant for each item in vocabulary.
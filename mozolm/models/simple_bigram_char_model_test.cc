@@ -135,6 +135,28 @@ TEST_F(SimpleBigramCharModelTest, BasicCheck) {
   }
 }
 
+// Adapting to a text counts each of its lines from the start state.
+TEST_F(SimpleBigramCharModelTest, AdaptToTextMatchesUpdateLMCounts) {
+  SimpleBigramCharModel adapted_model, updated_model;
+  const ModelStorage empty_storage;
+  ASSERT_TRUE(adapted_model.Read(empty_storage).ok());
+  ASSERT_TRUE(updated_model.Read(empty_storage).ok());
+  ASSERT_TRUE(adapted_model.AdaptToText("ab c\n\nba").ok());
+  for (const std::string line : {"ab c", "ba"}) {
+    ASSERT_TRUE(updated_model.UpdateLMCounts(
+        updated_model.start_state(),
+        nisaba::utf8::StrSplitByCharToUnicode(line), /*count=*/1));
+  }
+  for (const std::string context : {"", "a", "b", " "}) {
+    const int state = adapted_model.ContextState(context);
+    ASSERT_EQ(state, updated_model.ContextState(context));
+    for (const int utf8_sym : {0, 'a', 'b', 'c', ' '}) {
+      EXPECT_DOUBLE_EQ(adapted_model.SymLMScore(state, utf8_sym),
+                       updated_model.SymLMScore(state, utf8_sym));
+    }
+  }
+}
+
 TEST_F(SimpleBigramCharModelTest, TopCandidates) {
   Init();
   constexpr int kMaxString = 15;
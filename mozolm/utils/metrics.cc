@@ -0,0 +1,139 @@
+// Copyright 2026 MozoLM Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "mozolm/utils/metrics.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include "absl/numeric/bits.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_format.h"
+
+namespace mozolm {
+namespace metrics {
+namespace {
+
+// Returns the histogram shard for the calling thread. The threads are
+// assigned to the shards in a round-robin fashion on their first access.
+int ThreadShard(int num_shards) {
+  static std::atomic<int> next_shard = 0;
+  thread_local const int shard = next_shard.fetch_add(
+      1, std::memory_order_relaxed);
+  return shard % num_shards;
+}
+
+}  // namespace
+
+int64_t HistogramSnapshot::Quantile(double q) const {
+  if (count == 0) return 0;
+  const int64_t rank = std::max<int64_t>(
+      1, static_cast<int64_t>(std::ceil(std::clamp(q, 0.0, 1.0) * count)));
+  int64_t num_values = 0;
+  for (int i = 0; i < bucket_counts.size(); ++i) {
+    num_values += bucket_counts[i];
+    if (num_values >= rank) return Histogram::BucketUpperBound(i);
+  }
+  return Histogram::BucketUpperBound(bucket_counts.size() - 1);
+}
+
+void Histogram::Record(int64_t value) {
+  if (value < 0) value = 0;
+  Shard &shard = shards_[ThreadShard(kNumShards)];
+  shard.buckets[BucketIndex(value)].fetch_add(1, std::memory_order_relaxed);
+  shard.count.fetch_add(1, std::memory_order_relaxed);
+  shard.sum.fetch_add(value, std::memory_order_relaxed);
+}
+
+HistogramSnapshot Histogram::Snapshot() const {
+  HistogramSnapshot snapshot;
+  snapshot.bucket_counts.resize(kNumBuckets, 0);
+  for (const Shard &shard : shards_) {
+    for (int i = 0; i < kNumBuckets; ++i) {
+      snapshot.bucket_counts[i] +=
+          shard.buckets[i].load(std::memory_order_relaxed);
+    }
+    snapshot.count += shard.count.load(std::memory_order_relaxed);
+    snapshot.sum += shard.sum.load(std::memory_order_relaxed);
+  }
+  return snapshot;
+}
+
+int Histogram::BucketIndex(int64_t value) {
+  if (value <= 0) return 0;
+  const int index = std::numeric_limits<uint64_t>::digits -
+                    absl::countl_zero(static_cast<uint64_t>(value));
+  return std::min(index, kNumBuckets - 1);
+}
+
+int64_t Histogram::BucketUpperBound(int bucket) {
+  if (bucket <= 0) return 0;
+  if (bucket >= kNumBuckets - 1) return std::numeric_limits<int64_t>::max();
+  return (int64_t{1} << bucket) - 1;
+}
+
+std::string MetricsSnapshot::ToString() const {
+  std::string result;
+  for (const auto &[name, value] : counters) {
+    absl::StrAppend(&result, name, ": ", value, "\n");
+  }
+  for (const auto &[name, histogram] : histograms) {
+    absl::StrAppendFormat(
+        &result, "%s: count=%d mean=%.1f p50=%d p90=%d p99=%d\n", name,
+        histogram.count, histogram.Mean(), histogram.Quantile(0.5),
+        histogram.Quantile(0.9), histogram.Quantile(0.99));
+  }
+  return result;
+}
+
+MetricsRegistry &MetricsRegistry::Global() {
+  static MetricsRegistry *const registry = new MetricsRegistry();
+  return *registry;
+}
+
+Counter *MetricsRegistry::GetCounter(absl::string_view name) {
+  absl::MutexLock lock(lock_);
+  auto pos = counters_.find(name);
+  if (pos == counters_.end()) {
+    pos = counters_.emplace(std::string(name),
+                            std::make_unique<Counter>()).first;
+  }
+  return pos->second.get();
+}
+
+Histogram *MetricsRegistry::GetHistogram(absl::string_view name) {
+  absl::MutexLock lock(lock_);
+  auto pos = histograms_.find(name);
+  if (pos == histograms_.end()) {
+    pos = histograms_.emplace(std::string(name),
+                              std::make_unique<Histogram>()).first;
+  }
+  return pos->second.get();
+}
+
+MetricsSnapshot MetricsRegistry::Snapshot() const {
+  MetricsSnapshot snapshot;
+  absl::MutexLock lock(lock_);
+  for (const auto &[name, counter] : counters_) {
+    snapshot.counters[name] = counter->value();
+  }
+  for (const auto &[name, histogram] : histograms_) {
+    snapshot.histograms[name] = histogram->Snapshot();
+  }
+  return snapshot;
+}
+
+}  // namespace metrics
+}  // namespace mozolm
@@ -0,0 +1,157 @@
+// Copyright 2026 MozoLM Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Simple in-process metrics registry: named monotonic counters and histograms
+// with exponential (power of two) buckets. Updating the metrics is lock-free,
+// the histograms are sharded across threads to avoid contention on the
+// counters. Locking only happens when the metrics are created or collected.
+//
+// Example:
+// --------
+//   static metrics::Counter *const requests =
+//       metrics::MetricsRegistry::Global().GetCounter("rpc/requests");
+//   requests->Increment();
+
+#ifndef MOZOLM_MOZOLM_UTILS_METRICS_H_
+#define MOZOLM_MOZOLM_UTILS_METRICS_H_
+
+#include <array>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "mozolm/stubs/integral_types.h"
+#include "absl/base/thread_annotations.h"
+#include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/time/time.h"
+
+namespace mozolm {
+namespace metrics {
+
+// Monotonically increasing counter.
+class Counter {
+ public:
+  Counter() = default;
+  Counter(const Counter &) = delete;
+  Counter &operator=(const Counter &) = delete;
+
+  void Increment(int64_t delta = 1) {
+    value_.fetch_add(delta, std::memory_order_relaxed);
+  }
+  int64_t value() const { return value_.load(std::memory_order_relaxed); }
+
+ private:
+  std::atomic<int64_t> value_ = 0;
+};
+
+// Merged contents of the histogram.
+struct HistogramSnapshot {
+  // Returns the mean of the recorded values.
+  double Mean() const {
+    return count > 0 ? static_cast<double>(sum) / count : 0.0;
+  }
+
+  // Returns an estimate of the given quantile (in [0, 1]) of the recorded
+  // values, which is the upper bound of the bucket the quantile falls into.
+  int64_t Quantile(double q) const;
+
+  int64_t count = 0;                   // Number of recorded values.
+  int64_t sum = 0;                     // Sum of the recorded values.
+  std::vector<int64_t> bucket_counts;  // Number of values in each bucket.
+};
+
+// Histogram of non-negative integer values, e.g., latencies in microseconds.
+// Bucket 0 holds the zero values, bucket i > 0 holds the values in the range
+// [2^(i-1), 2^i). The last bucket also holds all the larger values.
+class Histogram {
+ public:
+  static constexpr int kNumBuckets = 40;
+
+  Histogram() = default;
+  Histogram(const Histogram &) = delete;
+  Histogram &operator=(const Histogram &) = delete;
+
+  // Records the value, negative values are recorded as zero.
+  void Record(int64_t value);
+
+  // Records the duration in microseconds.
+  void RecordMicros(absl::Duration duration) {
+    Record(absl::ToInt64Microseconds(duration));
+  }
+
+  // Merges the per-thread shards.
+  HistogramSnapshot Snapshot() const;
+
+  // Returns the bucket index for the value.
+  static int BucketIndex(int64_t value);
+
+  // Returns the largest value held by the bucket.
+  static int64_t BucketUpperBound(int bucket);
+
+ private:
+  static constexpr int kNumShards = 16;
+
+  // Per-thread shard, aligned to avoid false sharing between the threads.
+  struct alignas(64) Shard {
+    std::array<std::atomic<int64_t>, kNumBuckets> buckets = {};
+    std::atomic<int64_t> count = 0;
+    std::atomic<int64_t> sum = 0;
+  };
+  std::array<Shard, kNumShards> shards_;
+};
+
+// Collected values of all the registered metrics, sorted by name.
+struct MetricsSnapshot {
+  // Returns a human-readable multi-line summary of the metrics.
+  std::string ToString() const;
+
+  std::map<std::string, int64_t> counters;
+  std::map<std::string, HistogramSnapshot> histograms;
+};
+
+// Registry of named metrics. The metrics are created on the first access and
+// live for as long as the registry, so the pointers can be cached by callers.
+class MetricsRegistry {
+ public:
+  MetricsRegistry() = default;
+  MetricsRegistry(const MetricsRegistry &) = delete;
+  MetricsRegistry &operator=(const MetricsRegistry &) = delete;
+
+  // Process-wide registry.
+  static MetricsRegistry &Global();
+
+  // Returns the counter with the given name, creating it if necessary.
+  Counter *GetCounter(absl::string_view name) ABSL_LOCKS_EXCLUDED(lock_);
+
+  // Returns the histogram with the given name, creating it if necessary.
+  Histogram *GetHistogram(absl::string_view name) ABSL_LOCKS_EXCLUDED(lock_);
+
+  // Collects the current values of all the metrics.
+  MetricsSnapshot Snapshot() const ABSL_LOCKS_EXCLUDED(lock_);
+
+ private:
+  mutable absl::Mutex lock_;
+  std::map<std::string, std::unique_ptr<Counter>, std::less<>> counters_
+      ABSL_GUARDED_BY(lock_);
+  std::map<std::string, std::unique_ptr<Histogram>, std::less<>> histograms_
+      ABSL_GUARDED_BY(lock_);
+};
+
+}  // namespace metrics
+}  // namespace mozolm
+
+#endif  // MOZOLM_MOZOLM_UTILS_METRICS_H_
@@ -0,0 +1,98 @@
+// Copyright 2026 MozoLM Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "mozolm/utils/metrics.h"
+
+#include <limits>
+#include <thread>
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+namespace mozolm {
+namespace metrics {
+namespace {
+
+TEST(MetricsTest, BucketBoundaries) {
+  EXPECT_EQ(0, Histogram::BucketIndex(-5));
+  EXPECT_EQ(0, Histogram::BucketIndex(0));
+  EXPECT_EQ(1, Histogram::BucketIndex(1));
+  EXPECT_EQ(2, Histogram::BucketIndex(2));
+  EXPECT_EQ(2, Histogram::BucketIndex(3));
+  EXPECT_EQ(3, Histogram::BucketIndex(4));
+  EXPECT_EQ(11, Histogram::BucketIndex(1024));
+  EXPECT_EQ(Histogram::kNumBuckets - 1,
+            Histogram::BucketIndex(std::numeric_limits<int64_t>::max()));
+  for (int i = 0; i < Histogram::kNumBuckets - 1; ++i) {
+    EXPECT_EQ(i, Histogram::BucketIndex(Histogram::BucketUpperBound(i)));
+    EXPECT_EQ(i + 1,
+              Histogram::BucketIndex(Histogram::BucketUpperBound(i) + 1));
+  }
+}
+
+TEST(MetricsTest, HistogramQuantiles) {
+  Histogram histogram;
+  HistogramSnapshot snapshot = histogram.Snapshot();
+  EXPECT_EQ(0, snapshot.count);
+  EXPECT_EQ(0, snapshot.Quantile(0.5));
+
+  for (int i = 1; i <= 100; ++i) histogram.Record(i);
+  snapshot = histogram.Snapshot();
+  EXPECT_EQ(100, snapshot.count);
+  EXPECT_EQ(5050, snapshot.sum);
+  EXPECT_DOUBLE_EQ(50.5, snapshot.Mean());
+  EXPECT_EQ(63, snapshot.Quantile(0.5));  // 50 is in [32, 63].
+  EXPECT_EQ(127, snapshot.Quantile(0.9));  // 90 is in [64, 127].
+  EXPECT_EQ(1, snapshot.Quantile(0.0));
+}
+
+TEST(MetricsTest, ConcurrentUpdates) {
+  constexpr int kNumThreads = 8;
+  constexpr int kNumUpdates = 10000;
+  MetricsRegistry registry;
+  std::vector<std::thread> threads;
+  for (int i = 0; i < kNumThreads; ++i) {
+    threads.emplace_back([&registry]() {
+      Counter *counter = registry.GetCounter("test/counter");
+      Histogram *histogram = registry.GetHistogram("test/histogram");
+      for (int j = 0; j < kNumUpdates; ++j) {
+        counter->Increment();
+        histogram->Record(j);
+      }
+    });
+  }
+  for (auto &thread : threads) thread.join();
+
+  const MetricsSnapshot snapshot = registry.Snapshot();
+  ASSERT_EQ(1, snapshot.counters.count("test/counter"));
+  EXPECT_EQ(kNumThreads * kNumUpdates, snapshot.counters.at("test/counter"));
+  ASSERT_EQ(1, snapshot.histograms.count("test/histogram"));
+  EXPECT_EQ(kNumThreads * kNumUpdates,
+            snapshot.histograms.at("test/histogram").count);
+  EXPECT_THAT(snapshot.ToString(),
+              ::testing::HasSubstr("test/counter: 80000"));
+}
+
+TEST(MetricsTest, MetricsAreCreatedOnce) {
+  MetricsRegistry registry;
+  EXPECT_EQ(registry.GetCounter("a"), registry.GetCounter("a"));
+  EXPECT_NE(registry.GetCounter("a"), registry.GetCounter("b"));
+  EXPECT_EQ(registry.GetHistogram("a"), registry.GetHistogram("a"));
+  EXPECT_EQ(&MetricsRegistry::Global(), &MetricsRegistry::Global());
+}
+
+}  // namespace
+}  // namespace metrics
+}  // namespace mozolm
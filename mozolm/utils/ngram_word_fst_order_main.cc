@@ -0,0 +1,82 @@
+// Copyright 2026 MozoLM Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Precomputes the lexicographic order of the vocabulary of a word n-gram FST
+// model, which is then supplied to the model using the
+// `lexicographic_order_file` field of NGramWordFstOptions.
+//
+// Example:
+// --------
+//   bazel build -c opt mozolm/utils:ngram_word_fst_order
+//   bazel-bin/mozolm/utils/ngram_word_fst_order \
+//     --input_fst_file /tmp/word_3gram.fst \
+//     --output_order_file /tmp/word_3gram.order
+
+#include <string>
+
+#include "google/protobuf/stubs/logging.h"
+#include "absl/flags/flag.h"
+#include "absl/flags/parse.h"
+#include "absl/status/status.h"
+#include "mozolm/models/model_storage.pb.h"
+#include "mozolm/models/ngram_word_fst_model.h"
+#include "nisaba/port/status_macros.h"
+
+ABSL_FLAG(std::string, input_fst_file, "",
+          "Input n-gram word model file in FST format.");
+
+ABSL_FLAG(std::string, output_order_file, "",
+          "Output file for the lexicographic order of the model vocabulary.");
+
+namespace mozolm {
+namespace {
+
+// Reads the model, establishing the lexicographic order of its vocabulary,
+// and saves the order.
+absl::Status ComputeAndSaveOrder(const std::string &input_file,
+                                 const std::string &output_file) {
+  GOOGLE_LOG(INFO) << "Reading model from " << input_file << " ...";
+  ModelStorage storage;
+  storage.set_model_file(input_file);
+  models::NGramWordFstModel model;
+  RETURN_IF_ERROR(model.Read(storage));
+  GOOGLE_LOG(INFO) << "Saving lexicographic order to " << output_file
+                   << " ...";
+  return model.WriteLexicographicOrder(output_file);
+}
+
+}  // namespace
+}  // namespace mozolm
+
+int main(int argc, char* argv[]) {
+  absl::ParseCommandLine(argc, argv);
+  const std::string &input_fst_file = absl::GetFlag(FLAGS_input_fst_file);
+  if (input_fst_file.empty()) {
+    GOOGLE_LOG(ERROR) << "Input FST file not specified!";
+    return 1;
+  }
+  const std::string &output_order_file =
+      absl::GetFlag(FLAGS_output_order_file);
+  if (output_order_file.empty()) {
+    GOOGLE_LOG(ERROR) << "Output order file not specified!";
+    return 1;
+  }
+  const auto status =
+      mozolm::ComputeAndSaveOrder(input_fst_file, output_order_file);
+  if (!status.ok()) {
+    GOOGLE_LOG(ERROR) << "Computing the order failed: " << status.ToString();
+    return 1;
+  }
+  return 0;
+}
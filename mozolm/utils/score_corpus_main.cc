@@ -0,0 +1,118 @@
+// Copyright 2026 MozoLM Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Offline scoring of a text corpus with the model hub, without the gRPC
+// client and server. Reports bits per character, OOV rate and throughput.
+//
+// Dynamic models are updated as the corpus is scored, hence the corpus is
+// streamed one line at a time. If all the models are static, the corpus is
+// sharded across `--num_threads` threads.
+//
+// Example:
+// --------
+//   DATADIR=mozolm/models/testdata
+//   bazel build -c opt mozolm/utils:score_corpus
+//   bazel-bin/mozolm/utils/score_corpus \
+//     --corpus_file "${DATADIR}"/en_wiki_100line_dev_sample.txt \
+//     --num_threads 4 \
+//     --model_hub_config="model_config { type:CHAR_NGRAM_FST storage { \
+//     model_file:\"${DATADIR}/gutenberg_en_char_ngram_o2_kn.fst\" } }"
+
+#include <string>
+
+#include "google/protobuf/stubs/logging.h"
+#include "absl/flags/flag.h"
+#include "absl/flags/parse.h"
+#include "absl/status/status.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_format.h"
+#include "mozolm/models/corpus_scorer.h"
+#include "mozolm/models/model_config.pb.h"
+#include "nisaba/port/file_util.h"
+#include "third_party/protobuf/text_format.h"
+#include "nisaba/port/status_macros.h"
+
+ABSL_FLAG(std::string, model_hub_config, "",
+          "Contents of (`mozolm.ModelHubConfig`) protocol buffer in text "
+          "format.");
+
+ABSL_FLAG(std::string, model_hub_config_file, "",
+          "File containing the model hub configuration protocol buffer in "
+          "text format. This flag overrides --model_hub_config.");
+
+ABSL_FLAG(std::string, corpus_file, "",
+          "Text corpus to score, one text per line.");
+
+ABSL_FLAG(int, num_threads, 1,
+          "Number of threads for scoring the corpus with static models. "
+          "Each thread loads its own copy of the models, hence memory use "
+          "and loading time grow with the number of threads.");
+
+namespace mozolm {
+namespace {
+
+// Initializes hub configuration from command-line flags.
+absl::Status InitConfigFromFlags(ModelHubConfig *config) {
+  std::string config_contents;
+  const std::string config_file = absl::GetFlag(FLAGS_model_hub_config_file);
+  if (!config_file.empty()) {
+    ASSIGN_OR_RETURN(config_contents, nisaba::file::ReadBinaryFile(
+        config_file));
+  } else if (!absl::GetFlag(FLAGS_model_hub_config).empty()) {
+    config_contents = absl::GetFlag(FLAGS_model_hub_config);
+  } else {
+    GOOGLE_LOG(INFO) << "Using default configuration";
+  }
+  if (!google::protobuf::TextFormat::ParseFromString(config_contents, config)) {
+    return absl::InvalidArgumentError(absl::StrCat(
+        "Failed to parse configuration from contents"));
+  }
+  return absl::OkStatus();
+}
+
+// Scores the corpus and prints the statistics.
+absl::Status ScoreCorpus(const std::string &corpus_file) {
+  ModelHubConfig config;
+  RETURN_IF_ERROR(InitConfigFromFlags(&config));
+  ASSIGN_OR_RETURN(const models::CorpusScores corpus_scores,
+                   models::ScoreCorpus(config, corpus_file,
+                                       absl::GetFlag(FLAGS_num_threads)));
+  const models::TextScores &scores = corpus_scores.scores;
+  absl::PrintF("Lines: %d\n", corpus_scores.num_lines);
+  absl::PrintF("Total characters: %d (%d OOV, %.4f%%)\n", scores.num_chars,
+               scores.num_oov_chars, 100.0 * scores.OovRate());
+  absl::PrintF("Bits per character: %.6f\n", scores.BitsPerChar());
+  absl::PrintF("Threads: %d\n", corpus_scores.num_threads);
+  absl::PrintF("Elapsed: %.3f sec (%.1f chars/sec)\n",
+               corpus_scores.elapsed_sec, corpus_scores.CharsPerSec());
+  return absl::OkStatus();
+}
+
+}  // namespace
+}  // namespace mozolm
+
+int main(int argc, char* argv[]) {
+  absl::ParseCommandLine(argc, argv);
+  const std::string &corpus_file = absl::GetFlag(FLAGS_corpus_file);
+  if (corpus_file.empty()) {
+    GOOGLE_LOG(ERROR) << "Corpus file not specified!";
+    return 1;
+  }
+  const auto status = mozolm::ScoreCorpus(corpus_file);
+  if (!status.ok()) {
+    GOOGLE_LOG(ERROR) << "Scoring failed: " << status.ToString();
+    return 1;
+  }
+  return 0;
+}